@@ -21,10 +21,24 @@ mkdir -p iso_root
 # Copy the relevant files over.
 mkdir -p iso_root/boot
 cp -v bin/kiwiOS iso_root/boot/
+# Function symbols for the profiler, loaded as a Limine module
+nm -n bin/kiwiOS > iso_root/boot/kiwiOS.sym
 mkdir -p iso_root/boot/limine
 cp -v limine.conf limine/limine-bios.sys limine/limine-bios-cd.bin \
       limine/limine-uefi-cd.bin iso_root/boot/limine/
 
+# Optional initramfs, packed from a directory (INITRAMFS_DIR=path)
+if [ -n "$INITRAMFS_DIR" ]; then
+  tar --format=ustar -cf iso_root/boot/initramfs.tar -C "$INITRAMFS_DIR" .
+  printf '    module_path: boot():/boot/initramfs.tar\n    module_string: initramfs\n' >> iso_root/boot/limine/limine.conf
+fi
+
+# Optional headless batch script, run before the shell (BATCH_SCRIPT=path)
+if [ -n "$BATCH_SCRIPT" ]; then
+  cp -v "$BATCH_SCRIPT" iso_root/boot/kiwiOS.batch
+  printf '    module_path: boot():/boot/kiwiOS.batch\n    module_string: kiwiOS.batch\n' >> iso_root/boot/limine/limine.conf
+fi
+
 # Create the EFI boot tree and copy Limine's EFI executables over.
 mkdir -p iso_root/EFI/BOOT
 cp -v limine/BOOTX64.EFI iso_root/EFI/BOOT/
@@ -7,6 +7,7 @@ cd "/mnt/c/Program Files/qemu/"
 
 ./qemu-system-x86_64.exe \
   -M q35 \
+  -smp 4 \
   -serial stdio \
   -device ich9-ahci,id=ahci0 \
   -cdrom "$WIN_IMAGE" \
@@ -0,0 +1,156 @@
+#include "arch/x86/acpi.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arch/x86/io.h"
+#include "core/boot.h"
+#include "libc/string.h"
+#include "memory/vmm.h"
+
+typedef struct {
+    char signature[8];      // "RSD PTR "
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;       // 0 for ACPI 1.0, 2 and up adds the XSDT
+    uint32_t rsdt_address;
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed)) acpi_rsdp_t;
+
+// FADT fields used for power-off; offsets from the start of the table
+#define FADT_DSDT         40   // uint32_t
+#define FADT_SMI_CMD      48   // uint32_t
+#define FADT_ACPI_ENABLE  52   // uint8_t
+#define FADT_PM1A_CNT     64   // uint32_t
+#define FADT_PM1B_CNT     68   // uint32_t
+#define FADT_X_DSDT       140  // uint64_t, ACPI 2.0 and up
+
+#define PM1_SCI_EN        (1u << 0)
+#define PM1_SLP_TYP_SHIFT 10
+#define PM1_SLP_EN        (1u << 13)
+
+#define AML_NAME_OP     0x08
+#define AML_BYTE_PREFIX 0x0A
+#define AML_PACKAGE_OP  0x12
+
+static const acpi_sdt_header_t *root = NULL;
+static bool root_is_xsdt = false;
+
+static bool checksum_ok(const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    uint8_t sum = 0;
+    for (size_t i = 0; i < len; i++) sum += p[i];
+    return sum == 0;
+}
+
+// Map the header to learn the length, then the whole table
+static const acpi_sdt_header_t *map_table(uint64_t phys) {
+    const acpi_sdt_header_t *hdr = vmm_map_phys(phys, sizeof(acpi_sdt_header_t), 0);
+    if (!hdr || hdr->length < sizeof(acpi_sdt_header_t)) return NULL;
+    if (!vmm_map_phys(phys, hdr->length, 0)) return NULL;
+    return checksum_ok(hdr, hdr->length) ? hdr : NULL;
+}
+
+bool acpi_init(void) {
+    if (root) return true;
+    struct limine_rsdp_response *resp = boot_rsdp_response();
+    if (!resp || !resp->address) return false;
+
+    const acpi_rsdp_t *rsdp = vmm_map_phys(resp->address, sizeof(acpi_rsdp_t), 0);
+    if (!rsdp || memcmp(rsdp->signature, "RSD PTR ", 8) != 0) return false;
+    if (!checksum_ok(rsdp, 20)) return false;  // The ACPI 1.0 part
+
+    if (rsdp->revision >= 2 && rsdp->xsdt_address && checksum_ok(rsdp, sizeof(*rsdp))) {
+        root = map_table(rsdp->xsdt_address);
+        root_is_xsdt = root != NULL;
+    }
+    if (!root) root = map_table(rsdp->rsdt_address);
+    return root != NULL;
+}
+
+const acpi_sdt_header_t *acpi_find_table(const char *signature) {
+    if (!root) return NULL;
+
+    size_t entry_size = root_is_xsdt ? 8 : 4;
+    size_t count = (root->length - sizeof(acpi_sdt_header_t)) / entry_size;
+    const uint8_t *entries = (const uint8_t *)root + sizeof(acpi_sdt_header_t);
+    for (size_t i = 0; i < count; i++) {
+        uint64_t phys;
+        if (root_is_xsdt) {
+            memcpy(&phys, entries + i * 8, 8);  // Only 4-byte aligned
+        } else {
+            uint32_t phys32;
+            memcpy(&phys32, entries + i * 4, 4);
+            phys = phys32;
+        }
+
+        const acpi_sdt_header_t *hdr = vmm_map_phys(phys, sizeof(acpi_sdt_header_t), 0);
+        if (!hdr || memcmp(hdr->signature, signature, 4) != 0) continue;
+        const acpi_sdt_header_t *table = map_table(phys);
+        if (table) return table;
+    }
+    return NULL;
+}
+
+static uint32_t fadt_u32(const acpi_sdt_header_t *fadt, size_t offset) {
+    uint32_t v = 0;
+    if (offset + 4 <= fadt->length) memcpy(&v, (const uint8_t *)fadt + offset, 4);
+    return v;
+}
+
+// Find the \_S5_ package in the DSDT without an AML interpreter: the name,
+// a PackageOp, its length and element count, then SLP_TYPa and SLP_TYPb as
+// byte constants (ZeroOp and OneOp double as the values 0 and 1)
+static bool find_s5(const acpi_sdt_header_t *dsdt, uint8_t *typ_a, uint8_t *typ_b) {
+    const uint8_t *aml = (const uint8_t *)dsdt;
+    size_t len = dsdt->length;
+    for (size_t i = sizeof(acpi_sdt_header_t) + 1; i + 12 < len; i++) {
+        if (memcmp(aml + i, "_S5_", 4) != 0 || aml[i + 4] != AML_PACKAGE_OP) continue;
+        if (aml[i - 1] != AML_NAME_OP && !(aml[i - 1] == '\\' && aml[i - 2] == AML_NAME_OP)) continue;
+
+        const uint8_t *p = aml + i + 5;
+        p += ((*p & 0xC0) >> 6) + 1;  // PkgLength
+        p++;                          // NumElements
+        if (*p == AML_BYTE_PREFIX) p++;
+        *typ_a = *p++;
+        if (*p == AML_BYTE_PREFIX) p++;
+        *typ_b = *p;
+        return true;
+    }
+    return false;
+}
+
+void acpi_shutdown(void) {
+    if (!acpi_init()) return;
+    const acpi_sdt_header_t *fadt = acpi_find_table("FACP");
+    if (!fadt) return;
+
+    uint64_t dsdt_phys = fadt_u32(fadt, FADT_DSDT);
+    if (fadt->length >= FADT_X_DSDT + 8) {
+        uint64_t x_dsdt;
+        memcpy(&x_dsdt, (const uint8_t *)fadt + FADT_X_DSDT, 8);
+        if (x_dsdt) dsdt_phys = x_dsdt;
+    }
+    const acpi_sdt_header_t *dsdt = dsdt_phys ? map_table(dsdt_phys) : NULL;
+    uint8_t typ_a, typ_b;
+    if (!dsdt || !find_s5(dsdt, &typ_a, &typ_b)) return;
+
+    uint16_t pm1a = (uint16_t)fadt_u32(fadt, FADT_PM1A_CNT);
+    uint16_t pm1b = (uint16_t)fadt_u32(fadt, FADT_PM1B_CNT);
+    if (!pm1a) return;
+
+    // Hand the chipset from SMM to ACPI mode if the firmware has not
+    uint32_t smi_cmd = fadt_u32(fadt, FADT_SMI_CMD);
+    uint8_t acpi_enable = fadt->length > FADT_ACPI_ENABLE ? ((const uint8_t *)fadt)[FADT_ACPI_ENABLE] : 0;
+    if (!(inw(pm1a) & PM1_SCI_EN) && smi_cmd && acpi_enable) {
+        outb((uint16_t)smi_cmd, acpi_enable);
+        for (uint32_t spin = 0; spin < 10000000 && !(inw(pm1a) & PM1_SCI_EN); spin++) {
+            asm volatile ("pause");
+        }
+    }
+
+    outw(pm1a, (uint16_t)((typ_a << PM1_SLP_TYP_SHIFT) | PM1_SLP_EN));
+    if (pm1b) outw(pm1b, (uint16_t)((typ_b << PM1_SLP_TYP_SHIFT) | PM1_SLP_EN));
+}
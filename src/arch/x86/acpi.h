@@ -0,0 +1,31 @@
+#ifndef ARCH_X86_ACPI_H
+#define ARCH_X86_ACPI_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Common header of every ACPI system description table
+typedef struct {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) acpi_sdt_header_t;
+
+// Locate the RSDT/XSDT through the RSDP Limine reports. Needs the VMM:
+// tables outside the HHDM get mapped on demand.
+bool acpi_init(void);
+
+// First table with this signature whose checksum is valid, or NULL
+const acpi_sdt_header_t *acpi_find_table(const char *signature);
+
+// Enter S5 (soft off) through the FADT's PM1 control blocks, using the
+// sleep type from the DSDT's \_S5_ object. Returns only if that failed.
+void acpi_shutdown(void);
+
+#endif // ARCH_X86_ACPI_H
@@ -0,0 +1,353 @@
+#include "arch/x86/apic.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arch/x86/acpi.h"
+#include "arch/x86/cpu.h"
+#include "arch/x86/io.h"
+#include "arch/x86/smp.h"
+#include "core/timer.h"
+#include "libc/string.h"
+#include "memory/vmm.h"
+
+#define MSR_APIC_BASE        0x1Bu
+#define MSR_TSC_DEADLINE     0x6E0u
+#define MSR_X2APIC_BASE      0x800u
+#define APIC_BASE_ENABLE     (1ull << 11)
+#define APIC_BASE_X2APIC     (1ull << 10)
+#define APIC_BASE_ADDR_MASK  0x000FFFFFFFFFF000ull
+
+#define CPUID1_X2APIC        (1u << 21)
+#define CPUID1_TSC_DEADLINE  (1u << 24)
+
+// Local APIC registers (MMIO offsets; x2APIC MSR = 0x800 + offset / 16)
+#define LAPIC_ID             0x020
+#define LAPIC_TPR            0x080
+#define LAPIC_EOI            0x0B0
+#define LAPIC_SVR            0x0F0
+#define LAPIC_ICR_LOW        0x300
+#define LAPIC_ICR_HIGH       0x310
+#define LAPIC_LVT_TIMER      0x320
+#define LAPIC_LVT_LINT0      0x350
+#define LAPIC_LVT_LINT1      0x360
+#define LAPIC_LVT_ERROR      0x370
+#define LAPIC_TIMER_INITIAL  0x380
+#define LAPIC_TIMER_CURRENT  0x390
+#define LAPIC_TIMER_DIVIDE   0x3E0
+
+#define LAPIC_SVR_ENABLE     (1u << 8)
+#define LAPIC_LVT_MASKED     (1u << 16)
+#define LAPIC_TIMER_DEADLINE (2u << 17)
+#define LAPIC_ICR_PENDING    (1u << 12)
+#define LAPIC_DIVIDE_16      0x3
+
+#define LAPIC_CALIBRATE_MS   10
+
+// IOAPIC: an index register and a data window
+#define IOAPIC_REGSEL        0x00
+#define IOAPIC_WINDOW        0x10
+#define IOAPIC_REG_VERSION   0x01
+#define IOAPIC_REG_REDIR     0x10
+#define IOAPIC_MASKED        (1u << 16)
+#define IOAPIC_ACTIVE_LOW    (1u << 13)
+#define IOAPIC_LEVEL         (1u << 15)
+#define IOAPIC_MAX           4
+
+// MADT entry types and interrupt source override flags
+#define MADT_IOAPIC          1
+#define MADT_ISO             2
+#define MADT_LAPIC_OVERRIDE  5
+#define MPS_POLARITY_MASK    0x3
+#define MPS_POLARITY_LOW     0x3
+#define MPS_TRIGGER_MASK     0xC
+#define MPS_TRIGGER_LEVEL    0xC
+
+#define ISA_IRQS             16
+
+typedef struct {
+    acpi_sdt_header_t header;
+    uint32_t lapic_address;
+    uint32_t flags;
+    uint8_t entries[];
+} __attribute__((packed)) madt_t;
+
+typedef struct {
+    volatile uint32_t *regs;
+    uint32_t gsi_base;
+    uint32_t inputs;
+} ioapic_t;
+
+typedef struct {
+    uint32_t gsi;
+    uint32_t flags;  // Redirection polarity/trigger bits
+} isa_route_t;
+
+typedef enum {
+    TIMER_DEADLINE,
+    TIMER_ONESHOT,
+} timer_mode_t;
+
+static bool enabled = false;
+static bool x2apic = false;
+static uint32_t bsp_lapic_id = 0;
+static volatile uint8_t *lapic_mmio = NULL;
+static ioapic_t ioapics[IOAPIC_MAX];
+static uint32_t ioapic_count = 0;
+static isa_route_t isa_routes[ISA_IRQS];
+
+static timer_mode_t timer_mode = TIMER_ONESHOT;
+static uint64_t tick_cycles = 0;   // TSC cycles per tick (deadline mode)
+static uint32_t tick_count = 0;    // Timer counts per tick (one-shot mode)
+static uint64_t next_deadline[SMP_MAX_CPUS];
+
+// ---------------- Local APIC ----------------
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    if (x2apic) return (uint32_t)rdmsr(MSR_X2APIC_BASE + (reg >> 4));
+    return *(volatile uint32_t *)(lapic_mmio + reg);
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    if (x2apic) {
+        wrmsr(MSR_X2APIC_BASE + (reg >> 4), value);
+    } else {
+        *(volatile uint32_t *)(lapic_mmio + reg) = value;
+    }
+}
+
+static void lapic_enable(void) {
+    uint64_t base = rdmsr(MSR_APIC_BASE) | APIC_BASE_ENABLE;
+    if (x2apic) base |= APIC_BASE_X2APIC;
+    wrmsr(MSR_APIC_BASE, base);
+
+    // Accept everything; LINT0/1 carry the 8259 and NMI on some boards,
+    // so mask them now that the IOAPIC routes the ISA lines
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+}
+
+// One-shot mode: count LAPIC timer ticks over a TSC-timed interval
+static uint32_t calibrate_lapic_timer(void) {
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | APIC_TIMER_VECTOR);
+
+    uint64_t wait = timer_tsc_hz() / 1000 * LAPIC_CALIBRATE_MS;
+    lapic_write(LAPIC_TIMER_INITIAL, UINT32_MAX);
+    uint64_t start = rdtsc();
+    while (rdtsc() - start < wait) asm volatile ("pause");
+    uint32_t elapsed = UINT32_MAX - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+
+    return (uint32_t)((uint64_t)elapsed * 1000 / LAPIC_CALIBRATE_MS / TIMER_HZ);
+}
+
+// ---------------- IOAPIC ----------------
+
+static uint32_t ioapic_read(const ioapic_t *io, uint32_t reg) {
+    io->regs[IOAPIC_REGSEL / 4] = reg;
+    return io->regs[IOAPIC_WINDOW / 4];
+}
+
+static void ioapic_write(const ioapic_t *io, uint32_t reg, uint32_t value) {
+    io->regs[IOAPIC_REGSEL / 4] = reg;
+    io->regs[IOAPIC_WINDOW / 4] = value;
+}
+
+static const ioapic_t *ioapic_for_gsi(uint32_t gsi) {
+    for (uint32_t i = 0; i < ioapic_count; i++) {
+        if (gsi >= ioapics[i].gsi_base && gsi < ioapics[i].gsi_base + ioapics[i].inputs) {
+            return &ioapics[i];
+        }
+    }
+    return NULL;
+}
+
+static void add_ioapic(uint32_t phys, uint32_t gsi_base) {
+    if (ioapic_count == IOAPIC_MAX) return;
+    volatile uint32_t *regs = vmm_map_phys(phys, PAGE_SIZE, PAGE_MMIO);
+    if (!regs) return;
+
+    ioapic_t *io = &ioapics[ioapic_count++];
+    io->regs = regs;
+    io->gsi_base = gsi_base;
+    io->inputs = ((ioapic_read(io, IOAPIC_REG_VERSION) >> 16) & 0xFF) + 1;
+    for (uint32_t i = 0; i < io->inputs; i++) {
+        ioapic_write(io, IOAPIC_REG_REDIR + 2 * i, IOAPIC_MASKED);
+    }
+}
+
+static void parse_madt(const madt_t *madt, uint64_t *lapic_phys) {
+    *lapic_phys = madt->lapic_address;
+
+    // ISA lines map 1:1 to GSIs, edge triggered and active high, unless
+    // an override says otherwise
+    for (uint32_t irq = 0; irq < ISA_IRQS; irq++) {
+        isa_routes[irq].gsi = irq;
+        isa_routes[irq].flags = 0;
+    }
+
+    const uint8_t *p = madt->entries;
+    const uint8_t *end = (const uint8_t *)madt + madt->header.length;
+    while (p + 2 <= end && p[1] >= 2 && p + p[1] <= end) {
+        uint8_t type = p[0];
+        if (type == MADT_IOAPIC && p[1] >= 12) {
+            uint32_t addr, gsi_base;
+            memcpy(&addr, p + 4, 4);
+            memcpy(&gsi_base, p + 8, 4);
+            add_ioapic(addr, gsi_base);
+        } else if (type == MADT_ISO && p[1] >= 10) {
+            uint8_t source = p[3];
+            uint32_t gsi;
+            uint16_t mps;
+            memcpy(&gsi, p + 4, 4);
+            memcpy(&mps, p + 8, 2);
+            if (source < ISA_IRQS) {
+                uint32_t flags = 0;
+                if ((mps & MPS_POLARITY_MASK) == MPS_POLARITY_LOW) flags |= IOAPIC_ACTIVE_LOW;
+                if ((mps & MPS_TRIGGER_MASK) == MPS_TRIGGER_LEVEL) flags |= IOAPIC_LEVEL;
+                isa_routes[source].gsi = gsi;
+                isa_routes[source].flags = flags;
+            }
+        } else if (type == MADT_LAPIC_OVERRIDE && p[1] >= 12) {
+            memcpy(lapic_phys, p + 4, 8);
+        }
+        p += p[1];
+    }
+}
+
+// ---------------- Setup ----------------
+
+bool apic_init(void) {
+    if (timer_tsc_hz() == 0 || !acpi_init()) return false;
+    const madt_t *madt = (const madt_t *)acpi_find_table("APIC");
+    if (!madt) return false;
+
+    uint64_t lapic_phys;
+    parse_madt(madt, &lapic_phys);
+    if (ioapic_count == 0) return false;
+
+    uint32_t ecx;
+    cpuid(1, 0, NULL, NULL, &ecx, NULL);
+    x2apic = (ecx & CPUID1_X2APIC) != 0;
+    if (!x2apic) {
+        uint64_t base = rdmsr(MSR_APIC_BASE) & APIC_BASE_ADDR_MASK;
+        if (base) lapic_phys = base;
+        lapic_mmio = vmm_map_phys(lapic_phys, PAGE_SIZE, PAGE_MMIO);
+        if (!lapic_mmio) return false;
+    }
+    lapic_enable();
+    bsp_lapic_id = x2apic ? lapic_read(LAPIC_ID) : lapic_read(LAPIC_ID) >> 24;
+
+    if (ecx & CPUID1_TSC_DEADLINE) {
+        timer_mode = TIMER_DEADLINE;
+        tick_cycles = timer_tsc_hz() / TIMER_HZ;
+    } else {
+        timer_mode = TIMER_ONESHOT;
+        tick_count = calibrate_lapic_timer();
+        if (tick_count == 0) return false;
+    }
+
+    enabled = true;
+    return true;
+}
+
+void apic_init_ap(void) {
+    lapic_enable();
+    apic_timer_start();
+}
+
+bool apic_enabled(void) {
+    return enabled;
+}
+
+bool apic_is_x2apic(void) {
+    return x2apic;
+}
+
+const char *apic_timer_mode(void) {
+    return timer_mode == TIMER_DEADLINE ? "tsc-deadline" : "one-shot";
+}
+
+uint32_t apic_ioapic_count(void) {
+    return ioapic_count;
+}
+
+bool apic_route_irq(uint8_t isa_irq, uint8_t vector) {
+    if (isa_irq >= ISA_IRQS) return false;
+    const isa_route_t *route = &isa_routes[isa_irq];
+    const ioapic_t *io = ioapic_for_gsi(route->gsi);
+    if (!io) return false;
+
+    // Physical destination mode; the IOAPIC destination field is 8 bits
+    uint32_t pin = route->gsi - io->gsi_base;
+    ioapic_write(io, IOAPIC_REG_REDIR + 2 * pin + 1, bsp_lapic_id << 24);
+    ioapic_write(io, IOAPIC_REG_REDIR + 2 * pin, vector | route->flags);
+    return true;
+}
+
+// ---------------- Timer ----------------
+
+void apic_timer_start(void) {
+    if (timer_mode == TIMER_DEADLINE) {
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_DEADLINE | APIC_TIMER_VECTOR);
+        asm volatile ("mfence" ::: "memory");  // LVT write before the first deadline
+        uint64_t deadline = rdtsc() + tick_cycles;
+        next_deadline[smp_cpu_id()] = deadline;
+        wrmsr(MSR_TSC_DEADLINE, deadline);
+    } else {
+        lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_16);
+        lapic_write(LAPIC_LVT_TIMER, APIC_TIMER_VECTOR);
+        lapic_write(LAPIC_TIMER_INITIAL, tick_count);
+    }
+}
+
+void apic_timer_tick(void) {
+    if (timer_mode == TIMER_DEADLINE) {
+        // Keep ticks on a fixed grid; after a long stall skip the missed ones
+        uint32_t cpu = smp_cpu_id();
+        uint64_t now = rdtsc();
+        uint64_t deadline = next_deadline[cpu] + tick_cycles;
+        if (deadline <= now) deadline = now + tick_cycles;
+        next_deadline[cpu] = deadline;
+        wrmsr(MSR_TSC_DEADLINE, deadline);
+    } else {
+        lapic_write(LAPIC_TIMER_INITIAL, tick_count);
+    }
+}
+
+void apic_timer_stop(void) {
+    if (timer_mode == TIMER_DEADLINE) {
+        wrmsr(MSR_TSC_DEADLINE, 0);
+    } else {
+        lapic_write(LAPIC_TIMER_INITIAL, 0);
+    }
+}
+
+// ---------------- IPIs and EOI ----------------
+
+void apic_send_ipi(uint32_t lapic_id, uint8_t vector) {
+    if (x2apic) {
+        // x2APIC ICR writes are not serializing: publish earlier stores first
+        asm volatile ("mfence; lfence" ::: "memory");
+        wrmsr(MSR_X2APIC_BASE + (LAPIC_ICR_LOW >> 4), ((uint64_t)lapic_id << 32) | vector);
+        return;
+    }
+    uint64_t flags = irq_save();
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) asm volatile ("pause");
+    lapic_write(LAPIC_ICR_HIGH, lapic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, vector);
+    irq_restore(flags);
+}
+
+void irq_eoi(uint32_t irq) {
+    if (enabled) {
+        lapic_write(LAPIC_EOI, 0);
+        return;
+    }
+    if (irq >= 8) outb(0xA0, 0x20);
+    outb(0x20, 0x20);
+}
@@ -0,0 +1,47 @@
+#ifndef ARCH_X86_APIC_H
+#define ARCH_X86_APIC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Local APIC (in x2APIC mode when the CPU has it) plus IOAPIC routing for
+// the legacy ISA lines. Without a usable MADT or a calibrated TSC the
+// kernel stays on the 8259 PIC and the PIT, and every call below except
+// apic_init() must not be made.
+
+#define APIC_TIMER_VECTOR     32    // Same vector the PIT used
+#define IPI_RESCHEDULE_VECTOR 0xF0
+#define IPI_TLB_SHOOTDOWN_VECTOR 0xF1
+#define APIC_SPURIOUS_VECTOR  0xFF
+
+// BSP: parse the MADT, enable the local APIC and mask every IOAPIC input.
+// The 8259 must already be remapped and masked. Needs the VMM (for the
+// register pages) and a calibrated TSC.
+bool apic_init(void);
+
+// AP: enable this CPU's local APIC in the mode the BSP chose and start its
+// timer. Call only if apic_enabled().
+void apic_init_ap(void);
+
+bool apic_enabled(void);
+bool apic_is_x2apic(void);
+const char *apic_timer_mode(void);
+uint32_t apic_ioapic_count(void);
+
+// Route an ISA IRQ (after MADT source overrides) to vector on the BSP
+bool apic_route_irq(uint8_t isa_irq, uint8_t vector);
+
+// Local timer at TIMER_HZ. apic_timer_tick() re-arms it from the timer
+// interrupt; apic_timer_stop() silences it for tickless idle.
+void apic_timer_start(void);
+void apic_timer_tick(void);
+void apic_timer_stop(void);
+
+// Fixed-delivery IPI to the CPU with this local APIC ID
+void apic_send_ipi(uint32_t lapic_id, uint8_t vector);
+
+// Acknowledge an interrupt from the IRQ stubs. irq is the legacy line,
+// which tells the PIC path whether the slave needs an EOI too.
+void irq_eoi(uint32_t irq);
+
+#endif // ARCH_X86_APIC_H
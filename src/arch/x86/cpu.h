@@ -0,0 +1,122 @@
+#ifndef ARCH_X86_CPU_H
+#define ARCH_X86_CPU_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf,
+                         uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    uint32_t a, b, c, d;
+    asm volatile ("cpuid"
+                  : "=a"(a), "=b"(b), "=c"(c), "=d"(d)
+                  : "a"(leaf), "c"(subleaf));
+    if (eax) *eax = a;
+    if (ebx) *ebx = b;
+    if (ecx) *ecx = c;
+    if (edx) *edx = d;
+}
+
+static inline uint32_t cpuid_max_leaf(uint32_t base) {
+    uint32_t max;
+    cpuid(base, 0, &max, NULL, NULL, NULL);
+    return max;
+}
+
+// CPUID.80000001h:EDX[26] - 1 GiB pages in the PDPT
+static inline bool cpu_has_1g_pages(void) {
+    if (cpuid_max_leaf(0x80000000u) < 0x80000001u) return false;
+    uint32_t edx;
+    cpuid(0x80000001u, 0, NULL, NULL, NULL, &edx);
+    return (edx & (1u << 26)) != 0;
+}
+
+// CPUID.01h:ECX[3] - MONITOR/MWAIT
+static inline bool cpu_has_monitor(void) {
+    uint32_t ecx;
+    cpuid(1, 0, NULL, NULL, &ecx, NULL);
+    return (ecx & (1u << 3)) != 0;
+}
+
+// CPUID.01h:ECX[17] - process-context identifiers
+static inline bool cpu_has_pcid(void) {
+    uint32_t ecx;
+    cpuid(1, 0, NULL, NULL, &ecx, NULL);
+    return (ecx & (1u << 17)) != 0;
+}
+
+// CPUID.01h:EDX[16] - page attribute table
+static inline bool cpu_has_pat(void) {
+    uint32_t edx;
+    cpuid(1, 0, NULL, NULL, NULL, &edx);
+    return (edx & (1u << 16)) != 0;
+}
+
+// Read the time-stamp counter
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// RFLAGS.IF - are maskable interrupts enabled?
+static inline bool interrupts_enabled(void) {
+    uint64_t flags;
+    asm volatile ("pushfq; popq %0" : "=r"(flags));
+    return (flags & (1ull << 9)) != 0;
+}
+
+// Disable interrupts, returning the previous RFLAGS for irq_restore()
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    asm volatile ("pushfq; popq %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint64_t flags) {
+    if (flags & (1ull << 9)) asm volatile ("sti" ::: "memory");
+}
+
+#define MSR_PAT            0x00000277u
+#define MSR_EFER           0xC0000080u
+#define MSR_STAR           0xC0000081u
+#define MSR_LSTAR          0xC0000082u
+#define MSR_SFMASK         0xC0000084u
+#define MSR_GS_BASE        0xC0000101u
+#define MSR_KERNEL_GS_BASE 0xC0000102u
+
+#define EFER_SCE (1ull << 0)  // SYSCALL/SYSRET enable
+#define EFER_NXE (1ull << 11) // No-execute page bit enable
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    asm volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    asm volatile ("wrmsr" :: "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)) : "memory");
+}
+
+// Enable x86_64 FPU/SSE for both kernel and userspace. Every CPU runs this
+// for itself: CR0 and CR4 are per processor.
+static inline void cpu_enable_sse(void) {
+    uint64_t cr0, cr4;
+    asm volatile ("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+
+    // CR0: clear EM (bit 2) to enable FPU, set MP (bit 1) for proper WAIT/FWAIT.
+    cr0 &= ~(1ULL << 2);
+    cr0 |=  (1ULL << 1);
+
+    // CR4: enable OS support for FXSAVE/FXRSTOR and SIMD exception handling.
+    cr4 |= (1ULL << 9);   // OSFXSR
+    cr4 |= (1ULL << 10);  // OSXMMEXCPT
+
+    asm volatile ("mov %0, %%cr0" : : "r"(cr0) : "memory");
+    asm volatile ("mov %0, %%cr4" : : "r"(cr4) : "memory");
+
+    // Initialize FPU state.
+    asm volatile ("fninit");
+}
+
+#endif // ARCH_X86_CPU_H
@@ -0,0 +1,239 @@
+#include "arch/x86/fpu.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arch/x86/cpu.h"
+#include "arch/x86/smp.h"
+#include "arch/x86/spinlock.h"
+#include "core/log.h"
+#include "core/sched.h"
+#include "core/stats.h"
+#include "libc/string.h"
+#include "memory/hhdm.h"
+#include "memory/pmm.h"
+#include "memory/slab.h"
+
+#define CR0_TS          (1ull << 3)
+#define CR4_OSXSAVE     (1ull << 18)
+#define CPUID1_XSAVE    (1u << 26)
+
+// XCR0 state components
+#define XSTATE_X87      (1ull << 0)
+#define XSTATE_SSE      (1ull << 1)
+#define XSTATE_AVX      (1ull << 2)
+#define XSTATE_AVX512   (7ull << 5)  // Opmask, ZMM_Hi256, Hi16_ZMM
+
+#define FXSAVE_SIZE     512
+#define FPU_AREA_ALIGN  64           // XSAVE needs 64, FXSAVE 16
+
+// Legacy-area defaults: every x87 and SSE exception masked. XRSTOR loads
+// MXCSR from the area even for components in their init state.
+#define FPU_DEFAULT_FCW   0x037F
+#define FPU_DEFAULT_MXCSR 0x1F80
+
+typedef enum {
+    FPU_FXSAVE,
+    FPU_XSAVE,
+    FPU_XSAVEOPT,
+} fpu_method_t;
+
+// Only the owning CPU touches its slot, with interrupts off
+typedef struct {
+    struct thread *owner;  // Thread whose state may be live in the registers
+    bool ts;               // Cached CR0.TS
+    bool ready;
+} __attribute__((aligned(64))) fpu_cpu_t;
+
+static fpu_cpu_t fpu_cpus[SMP_MAX_CPUS];
+static fpu_method_t method = FPU_FXSAVE;
+static uint64_t xcr0 = XSTATE_X87 | XSTATE_SSE;
+static size_t state_size = FXSAVE_SIZE;
+static kmem_cache_t *area_cache = NULL;  // NULL if areas outgrow a slab
+static bool area_cache_tried = false;
+static spinlock_t area_cache_lock;
+
+static inline void set_ts(fpu_cpu_t *fc) {
+    if (fc->ts) return;
+    uint64_t cr0;
+    asm volatile ("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile ("mov %0, %%cr0" :: "r"(cr0 | CR0_TS) : "memory");
+    fc->ts = true;
+}
+
+static inline void clear_ts(fpu_cpu_t *fc) {
+    if (!fc->ts) return;
+    asm volatile ("clts" ::: "memory");
+    fc->ts = false;
+}
+
+static void save_state(void *area) {
+    uint32_t lo = (uint32_t)xcr0, hi = (uint32_t)(xcr0 >> 32);
+    switch (method) {
+    case FPU_XSAVEOPT: asm volatile ("xsaveopt64 (%0)" :: "r"(area), "a"(lo), "d"(hi) : "memory"); break;
+    case FPU_XSAVE:    asm volatile ("xsave64 (%0)" :: "r"(area), "a"(lo), "d"(hi) : "memory"); break;
+    case FPU_FXSAVE:   asm volatile ("fxsave64 (%0)" :: "r"(area) : "memory"); break;
+    }
+    KSTAT_INC(FPU_SAVE);
+}
+
+static void restore_state(const void *area) {
+    uint32_t lo = (uint32_t)xcr0, hi = (uint32_t)(xcr0 >> 32);
+    if (method == FPU_FXSAVE) {
+        asm volatile ("fxrstor64 (%0)" :: "r"(area) : "memory");
+    } else {
+        asm volatile ("xrstor64 (%0)" :: "r"(area), "a"(lo), "d"(hi) : "memory");
+    }
+    KSTAT_INC(FPU_RESTORE);
+}
+
+static void *area_alloc(void) {
+    void *area;
+    if (area_cache) {
+        area = kmem_cache_alloc(area_cache);
+    } else {
+        void *phys = pmm_alloc_pages((state_size + PAGE_SIZE - 1) / PAGE_SIZE);
+        area = phys ? hhdm_phys_to_virt((uint64_t)phys) : NULL;
+    }
+    if (!area) return NULL;
+
+    // An all-zero XSAVE header puts every component in its init state
+    memset(area, 0, state_size);
+    *(uint16_t *)area = FPU_DEFAULT_FCW;
+    *(uint32_t *)((uint8_t *)area + 24) = FPU_DEFAULT_MXCSR;
+    return area;
+}
+
+static void area_free(void *area) {
+    if (area_cache) {
+        kmem_cache_free(area_cache, area);
+    } else {
+        pmm_free_pages((void *)hhdm_virt_to_phys(area), (state_size + PAGE_SIZE - 1) / PAGE_SIZE);
+    }
+}
+
+void fpu_init(void) {
+    cpu_enable_sse();
+
+    uint32_t ecx;
+    cpuid(1, 0, NULL, NULL, &ecx, NULL);
+    if ((ecx & CPUID1_XSAVE) && cpuid_max_leaf(0) >= 0xD) {
+        uint64_t cr4;
+        asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+        asm volatile ("mov %0, %%cr4" :: "r"(cr4 | CR4_OSXSAVE) : "memory");
+
+        uint32_t eax, edx;
+        cpuid(0xD, 0, &eax, NULL, NULL, &edx);
+        uint64_t supported = eax | ((uint64_t)edx << 32);
+        uint64_t want = XSTATE_X87 | XSTATE_SSE;
+        if (supported & XSTATE_AVX) {
+            want |= XSTATE_AVX;
+            if ((supported & XSTATE_AVX512) == XSTATE_AVX512) want |= XSTATE_AVX512;
+        }
+        asm volatile ("xsetbv" :: "c"(0), "a"((uint32_t)want), "d"((uint32_t)(want >> 32)));
+
+        // EBX: save area size for the components just enabled
+        uint32_t size, opt;
+        cpuid(0xD, 0, NULL, &size, NULL, NULL);
+        cpuid(0xD, 1, &opt, NULL, NULL, NULL);
+        if (smp_cpu_id() == 0) {
+            xcr0 = want;
+            state_size = size;
+            method = (opt & 1) ? FPU_XSAVEOPT : FPU_XSAVE;
+        }
+    }
+
+    fpu_cpu_t *fc = &fpu_cpus[smp_cpu_id()];
+    fc->owner = NULL;
+    fc->ts = false;
+    set_ts(fc);
+    fc->ready = true;
+}
+
+size_t fpu_state_size(void) {
+    return state_size;
+}
+
+const char *fpu_save_method(void) {
+    static const char *const names[] = {
+        [FPU_FXSAVE]   = "fxsave",
+        [FPU_XSAVE]    = "xsave",
+        [FPU_XSAVEOPT] = "xsaveopt",
+    };
+    return names[method];
+}
+
+void fpu_switch(thread_t *prev, thread_t *next) {
+    uint32_t cpu = smp_cpu_id();
+    fpu_cpu_t *fc = &fpu_cpus[cpu];
+    if (!fc->ready) return;
+
+    // TS clear: prev trapped in this slice and may have changed the registers
+    if (fc->owner == prev) {
+        if (prev->state == THREAD_DEAD) fc->owner = NULL;
+        else if (!fc->ts) save_state(prev->fpu_area);
+    }
+
+    // The registers still hold next's state if nothing was loaded over it
+    if (next->fpu_area && fc->owner == next && next->fpu_cpu == cpu) {
+        clear_ts(fc);
+    } else {
+        set_ts(fc);
+    }
+}
+
+void fpu_thread_free(thread_t *thread) {
+    if (thread->fpu_area) area_free(thread->fpu_area);
+    thread->fpu_area = NULL;
+}
+
+void fpu_handle_nm(void) {
+    uint32_t cpu = smp_cpu_id();
+    fpu_cpu_t *fc = &fpu_cpus[cpu];
+    clear_ts(fc);
+
+    thread_t *self = sched_current();
+    if (!self) return;  // Boot code before the scheduler: nothing to switch
+
+    if (!self->fpu_area) {
+        // One try only, so an area is always freed the way it was allocated
+        spin_lock(&area_cache_lock);
+        if (!area_cache_tried) {
+            area_cache_tried = true;
+            if (state_size <= SLAB_MAX_SIZE) {
+                area_cache = kmem_cache_create("fpu_state", state_size, FPU_AREA_ALIGN);
+            }
+        }
+        spin_unlock(&area_cache_lock);
+        self->fpu_area = area_alloc();
+        if (!self->fpu_area) {
+            log_error("fpu", "No memory for FPU state, killing thread");
+            fc->owner = NULL;
+            set_ts(fc);
+            thread_exit();
+        }
+    }
+
+    // Whatever the registers held was saved when its thread switched out
+    restore_state(self->fpu_area);
+    fc->owner = self;
+    self->fpu_cpu = cpu;
+}
+
+bool kernel_fpu_available(void) {
+    return fpu_cpus[smp_cpu_id()].ready;
+}
+
+uint64_t kernel_fpu_begin(void) {
+    uint64_t flags = irq_save();
+    fpu_cpu_t *fc = &fpu_cpus[smp_cpu_id()];
+    if (!fc->ts && fc->owner) save_state(fc->owner->fpu_area);
+    fc->owner = NULL;
+    clear_ts(fc);
+    return flags;
+}
+
+void kernel_fpu_end(uint64_t flags) {
+    // The running thread (if it had state) reloads it on its next use
+    set_ts(&fpu_cpus[smp_cpu_id()]);
+    irq_restore(flags);
+}
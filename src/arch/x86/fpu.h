@@ -0,0 +1,38 @@
+#ifndef ARCH_X86_FPU_H
+#define ARCH_X86_FPU_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct thread;
+
+// Lazy x87/SSE/AVX state switching. CR0.TS stays set while the registers
+// don't hold the running thread's state, so its first vector instruction
+// raises #NM and the state is loaded then. A thread that used the
+// registers during its slice has them saved when it is switched out;
+// one that didn't costs only the TS update.
+
+// Per CPU: enable the FPU, SSE and (when present) XSAVE with AVX and
+// AVX-512 state, then arm the #NM trap
+void fpu_init(void);
+
+// Bytes in one thread's save area, and the instruction that fills it
+size_t fpu_state_size(void);
+const char *fpu_save_method(void);
+
+// Scheduler hooks, called with interrupts off
+void fpu_switch(struct thread *prev, struct thread *next);
+void fpu_thread_free(struct thread *thread);
+
+// #NM: load the running thread's state, allocating it on first use
+void fpu_handle_nm(void);
+
+// Bracket kernel code that touches SSE registers. Interrupts stay off in
+// between, so sections must be short and must not sleep. Only valid once
+// kernel_fpu_available() is true on this CPU.
+bool kernel_fpu_available(void);
+uint64_t kernel_fpu_begin(void);
+void kernel_fpu_end(uint64_t flags);
+
+#endif // ARCH_X86_FPU_H
@@ -1,7 +1,8 @@
 #include <stddef.h>
 #include <stdint.h>
 #include "libc/string.h"
-#include "arch/x86/tss.h"
+#include "arch/x86/cpu.h"
+#include "arch/x86/gdt.h"
 #include "libc/stdio.h"
 
 typedef struct {
@@ -18,11 +19,7 @@ typedef struct {
     uint64_t base;
 } __attribute__((packed)) gdt_ptr_t;
 
-#define GDT_ENTRIES 7  // 5 regular + TSS takes 2 entries
-static uint64_t gdt[GDT_ENTRIES];
-static gdt_ptr_t gdt_ptr;
-
-static void gdt_set_gate(int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
+static void gdt_set_gate(uint64_t* gdt, int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
     gdt_entry_t* entry = (gdt_entry_t*)&gdt[num];
     entry->base_low = (base & 0xFFFF);
     entry->base_mid = (base >> 16) & 0xFF;
@@ -33,17 +30,17 @@ static void gdt_set_gate(int num, uint32_t base, uint32_t limit, uint8_t access,
     entry->access = access;
 }
 
-void gdt_init(void) {
-    memset(&gdt, 0, sizeof(gdt));
+void gdt_init(uint64_t* gdt, const tss_t* tss) {
+    memset(gdt, 0, GDT_ENTRIES * sizeof(uint64_t));
     
-    gdt_set_gate(0, 0, 0, 0, 0);                // Null
-    gdt_set_gate(1, 0, 0xFFFFFFFF, 0x9A, 0xAF); // Kernel code (0x08)
-    gdt_set_gate(2, 0, 0xFFFFFFFF, 0x92, 0xCF); // Kernel data (0x10)
-    gdt_set_gate(3, 0, 0xFFFFFFFF, 0xFA, 0xAF); // User code (0x18)
-    gdt_set_gate(4, 0, 0xFFFFFFFF, 0xF2, 0xCF); // User data (0x20)
+    gdt_set_gate(gdt, 0, 0, 0, 0, 0);                // Null
+    gdt_set_gate(gdt, 1, 0, 0xFFFFFFFF, 0x9A, 0xAF); // Kernel code (0x08)
+    gdt_set_gate(gdt, 2, 0, 0xFFFFFFFF, 0x92, 0xCF); // Kernel data (0x10)
+    gdt_set_gate(gdt, 3, 0, 0xFFFFFFFF, 0xF2, 0xCF); // User data (0x18)
+    gdt_set_gate(gdt, 4, 0, 0xFFFFFFFF, 0xFA, 0xAF); // User code (0x20)
     
     // Set up TSS descriptor at index 5 (takes 2 entries in 64-bit mode)
-    uint64_t tss_base = (uint64_t)&tss;
+    uint64_t tss_base = (uint64_t)tss;
     uint32_t tss_limit = sizeof(tss_t) - 1;
 
     // Build the TSS descriptor carefully to avoid shift warnings
@@ -62,12 +59,16 @@ void gdt_init(void) {
     gdt[5] = tss_low;
     gdt[6] = tss_high;
     
-    gdt_ptr.limit = sizeof(gdt) - 1;
-    gdt_ptr.base = (uint64_t)&gdt;
+    gdt_ptr_t gdt_ptr;
+    gdt_ptr.limit = GDT_ENTRIES * sizeof(uint64_t) - 1;
+    gdt_ptr.base = (uint64_t)gdt;
     
     // Load GDT
     asm volatile ("lgdt %0" : : "m"(gdt_ptr) : "memory");
     
+    // Reloading %gs zeroes its base, which holds the per-CPU pointer
+    uint64_t gs_base = rdmsr(MSR_GS_BASE);
+
     // Reload segments
     asm volatile (
         "pushq $0x08\n"
@@ -82,6 +83,7 @@ void gdt_init(void) {
         "mov %%ax, %%ss\n"
         ::: "rax", "memory"
     );
+    wrmsr(MSR_GS_BASE, gs_base);
     
     // Load TSS
     uint16_t tss_selector = 0x28;
@@ -1,6 +1,20 @@
 #ifndef ARCH_X86_GDT_H
 #define ARCH_X86_GDT_H
 
-void gdt_init(void);
+#include <stdint.h>
+#include "arch/x86/tss.h"
+
+#define GDT_ENTRIES 7  // 5 regular + TSS takes 2 entries
+
+// Selectors. SYSRET loads SS and CS from consecutive slots after the kernel
+// ones, so user data must come before user code.
+#define GDT_KERNEL_CODE 0x08
+#define GDT_KERNEL_DATA 0x10
+#define GDT_USER_DATA   0x18
+#define GDT_USER_CODE   0x20
+
+// Build a GDT for the calling CPU in gdt, pointing its TSS descriptor at
+// tss, then load it, reload the segments and load the task register
+void gdt_init(uint64_t* gdt, const tss_t* tss);
 
 #endif // ARCH_X86_GDT_H
@@ -1,8 +1,17 @@
 #include <stdint.h>
 #include <stddef.h>
+#include "arch/x86/apic.h"
 #include "arch/x86/idt.h"
+#include "arch/x86/syscall.h"
+#include "arch/x86/tss.h"
 #include "core/console.h"
+#include "core/log.h"
+#include "core/sched.h"
+#include "core/stats.h"
+#include "core/trace.h"
+#include "libc/stdio.h"
 #include "libc/string.h"
+#include "memory/vma.h"
 
 // ================= IDT (Interrupt Descriptor Table) =================
 struct idt_entry {
@@ -75,6 +84,13 @@ __attribute__((noinline)) void kernel_panic(struct exception_frame *frame) {
     uint32_t old_fg, old_bg;
     console_get_colors(&old_fg, &old_bg);
 
+    // Draw the panic screen immediately, not on the next timer tick
+    console_set_deferred(false, 0);
+
+    // Get the reason out on COM1 as well; nothing will drain the log later
+    log_error("panic", frame->int_no < 32 ? exception_messages[frame->int_no] : "Unknown Exception");
+    log_flush();
+
     // Set panic colors, then reset scrollback so the buffer uses panic colors
     console_set_colors(0x00FFFFFF, 0x00913030);
     console_reset_scrollback();
@@ -120,6 +136,28 @@ __attribute__((noinline)) void kernel_panic(struct exception_frame *frame) {
     panic_halt_forever();
 }
 
+// Page faults inside a VMA are resolved and return; a user thread that
+// faults for real is killed. Anything else from the kernel panics.
+void exception_dispatch(struct exception_frame *frame) {
+    uint64_t cr2 = 0;
+    if (frame->int_no == 14) {
+        asm volatile ("mov %%cr2, %0" : "=r"(cr2));
+        if (vma_handle_fault(cr2, frame->error_code)) return;
+    }
+
+    thread_t *thread = sched_current();
+    if ((frame->cs & 3) && thread) {
+        char msg[112];
+        ksnprintf(msg, sizeof(msg), "%s (thread %u) killed: %s at %#llx, cr2 %#llx",
+                  thread->name, thread->id,
+                  frame->int_no < 32 ? exception_messages[frame->int_no] : "Unknown Exception",
+                  (unsigned long long)frame->rip, (unsigned long long)cr2);
+        log_error("user", msg);
+        thread_exit();
+    }
+    kernel_panic(frame);
+}
+
 // Common exception handler
 extern void exception_handler_common(void);
 
@@ -151,7 +189,6 @@ EXCEPTION_HANDLER(3)
 EXCEPTION_HANDLER(4)
 EXCEPTION_HANDLER(5)
 EXCEPTION_HANDLER(6)
-EXCEPTION_HANDLER(7)
 EXCEPTION_HANDLER_ERR(8)
 EXCEPTION_HANDLER(9)
 EXCEPTION_HANDLER_ERR(10)
@@ -170,6 +207,8 @@ EXCEPTION_HANDLER_ERR(21)
 // Common handler that saves all registers
 __attribute__((naked)) void exception_handler_common(void) {
     asm volatile (
+        SWAPGS_IF_USER(24)  // Above int_no and error_code
+        "cld\n"             // C code wants DF clear; interrupt gates don't clear it
         "push %rax\n"
         "push %rbx\n"
         "push %rcx\n"
@@ -186,15 +225,18 @@ __attribute__((naked)) void exception_handler_common(void) {
         "push %r14\n"
         "push %r15\n"
         "mov %rsp, %rdi\n"  // Pass frame pointer as first argument
-        "call kernel_panic\n"
+        "call exception_dispatch\n"
         "add $120, %rsp\n"   // pop 15 regs
         "add $16, %rsp\n"    // pop int_no + error_code
+        SWAPGS_IF_USER(8)
         "iretq\n"
     );
 }
 
 __attribute__((naked)) void irq0_handler(void) {
     asm volatile (
+        SWAPGS_IF_USER(8)
+        "cld\n"
         "push %rax\n"
         "push %rbx\n"
         "push %rcx\n"
@@ -210,13 +252,19 @@ __attribute__((naked)) void irq0_handler(void) {
         "push %r13\n"
         "push %r14\n"
         "push %r15\n"
-        
+
+        KSTAT_VECTOR_ASM(32)
+        TRACE_IRQ_ENTER_ASM(32)
         "mov %rsp, %rdi\n"  // Pass pointer to interrupt frame
+        "call timer_interrupt_handler\n"
         
-        // Send EOI to PIC (AT&T: use DX as the port register)
-        "mov $0x20, %al\n"
-        "mov $0x20, %dx\n"
-        "out %al, (%dx)\n"
+        // Local APIC or PIC timer, whichever is running
+        "xor %edi, %edi\n"
+        "call irq_eoi\n"
+        TRACE_IRQ_EXIT_ASM(32)
+
+        // Preempt here, after EOI: the next thread may run for a while
+        "call sched_irq_exit\n"
         
         "pop %r15\n"
         "pop %r14\n"
@@ -233,13 +281,105 @@ __attribute__((naked)) void irq0_handler(void) {
         "pop %rcx\n"
         "pop %rbx\n"
         "pop %rax\n"
+        SWAPGS_IF_USER(8)
+        "iretq\n"
+    );
+}
+
+// Stub for an IRQ whose C handler takes no arguments; irq is the legacy
+// line irq_eoi() needs on the PIC path
+#define IRQ_HANDLER(name, vector, irq, handler) \
+    __attribute__((naked)) void name(void) { \
+        asm volatile ( \
+            SWAPGS_IF_USER(8) \
+            "cld\n" \
+            "push %rax\n" \
+            "push %rbx\n" \
+            "push %rcx\n" \
+            "push %rdx\n" \
+            "push %rsi\n" \
+            "push %rdi\n" \
+            "push %rbp\n" \
+            "push %r8\n" \
+            "push %r9\n" \
+            "push %r10\n" \
+            "push %r11\n" \
+            "push %r12\n" \
+            "push %r13\n" \
+            "push %r14\n" \
+            "push %r15\n" \
+            KSTAT_VECTOR_ASM(vector) \
+            TRACE_IRQ_ENTER_ASM(vector) \
+            "call " #handler "\n" \
+            "mov $" #irq ", %edi\n" \
+            "call irq_eoi\n" \
+            TRACE_IRQ_EXIT_ASM(vector) \
+            "call sched_irq_exit\n" \
+            "pop %r15\n" \
+            "pop %r14\n" \
+            "pop %r13\n" \
+            "pop %r12\n" \
+            "pop %r11\n" \
+            "pop %r10\n" \
+            "pop %r9\n" \
+            "pop %r8\n" \
+            "pop %rbp\n" \
+            "pop %rdi\n" \
+            "pop %rsi\n" \
+            "pop %rdx\n" \
+            "pop %rcx\n" \
+            "pop %rbx\n" \
+            "pop %rax\n" \
+            SWAPGS_IF_USER(8) \
+            "iretq\n" \
+        ); \
+    }
+
+// #NM: a thread touched the FPU while CR0.TS was set (see arch/x86/fpu.h)
+__attribute__((naked)) void nm_handler(void) {
+    asm volatile (
+        SWAPGS_IF_USER(8)
+        "cld\n"
+        "push %rax\n"
+        "push %rcx\n"
+        "push %rdx\n"
+        "push %rsi\n"
+        "push %rdi\n"
+        "push %r8\n"
+        "push %r9\n"
+        "push %r10\n"
+        "push %r11\n"      // Nine pushes on the CPU's frame keep the call aligned
+        "call fpu_handle_nm\n"
+        "pop %r11\n"
+        "pop %r10\n"
+        "pop %r9\n"
+        "pop %r8\n"
+        "pop %rdi\n"
+        "pop %rsi\n"
+        "pop %rdx\n"
+        "pop %rcx\n"
+        "pop %rax\n"
+        SWAPGS_IF_USER(8)
         "iretq\n"
     );
 }
 
+IRQ_HANDLER(irq1_handler, 33, 1, keyboard_interrupt_handler)  // PS/2 keyboard
+IRQ_HANDLER(irq4_handler, 36, 4, serial_interrupt_handler)    // COM1 TX FIFO refill
+IRQ_HANDLER(ipi_resched_handler, 0xF0, 0, sched_resched_ipi)  // IPI_RESCHEDULE_VECTOR
+IRQ_HANDLER(ipi_tlb_handler, 0xF1, 0, vmm_tlb_shootdown_ipi)  // IPI_TLB_SHOOTDOWN_VECTOR
+
+// The local APIC raises this when an interrupt vanishes before delivery;
+// it must not be acknowledged
+__attribute__((naked)) void apic_spurious_handler(void) {
+    asm volatile ("iretq\n");
+}
+
 // PCI HDA interrupt handler (wired via legacy PIC / Interrupt Line)
 __attribute__((naked)) void irq_hda_handler() {
     __asm__ volatile (
+        SWAPGS_IF_USER(8)
+        "cld\n"
         "push %rax\n"
         "push %rbx\n"
         "push %rcx\n"
@@ -259,10 +399,9 @@ __attribute__((naked)) void irq_hda_handler() {
         // hda_interrupt_handler(void) doesn't take arguments
         "call hda_interrupt_handler\n"
 
-        // Send EOI: slave then master (safe even if on master only)
-        "mov $0x20, %al\n"
-        "out %al, $0xA0\n"
-        "out %al, $0x20\n"
+        // A slave-PIC line: on the PIC path both chips get an EOI
+        "mov $8, %edi\n"
+        "call irq_eoi\n"
 
         "pop %r15\n"
         "pop %r14\n"
@@ -279,6 +418,7 @@ __attribute__((naked)) void irq_hda_handler() {
         "pop %rcx\n"
         "pop %rbx\n"
         "pop %rax\n"
+        SWAPGS_IF_USER(8)
         "iretq\n"
     );
 }
@@ -309,7 +449,7 @@ void init_idt(void) {
     idt_set_gate(4, (uint64_t)exception_4);
     idt_set_gate(5, (uint64_t)exception_5);
     idt_set_gate(6, (uint64_t)exception_6);
-    idt_set_gate(7, (uint64_t)exception_7);
+    idt_set_gate(7, (uint64_t)nm_handler);  // Lazy FPU switching, not a panic
     idt_set_gate(8, (uint64_t)exception_8);
     idt_set_gate(9, (uint64_t)exception_9);
     idt_set_gate(10, (uint64_t)exception_10);
@@ -324,16 +464,34 @@ void init_idt(void) {
     idt_set_gate(19, (uint64_t)exception_19);
     idt_set_gate(20, (uint64_t)exception_20);
     idt_set_gate(21, (uint64_t)exception_21);
+
+    // These can hit on a user-controlled or overflowed stack
+    idt[2].ist = TSS_IST_NMI;
+    idt[8].ist = TSS_IST_DF;
+    idt[18].ist = TSS_IST_MC;
     
-    // Timer IRQ (IRQ 0 = interrupt 32)
-    idt_set_gate(32, (uint64_t)irq0_handler);
+    // Timer: PIT on IRQ 0 or the local APIC timer, both on vector 32
+    idt_set_gate(APIC_TIMER_VECTOR, (uint64_t)irq0_handler);
+
+    // Keyboard (IRQ 1 = interrupt 33) and COM1 (IRQ 4 = interrupt 36)
+    idt_set_gate(33, (uint64_t)irq1_handler);
+    idt_set_gate(36, (uint64_t)irq4_handler);
+
+    idt_set_gate(IPI_RESCHEDULE_VECTOR, (uint64_t)ipi_resched_handler);
+    idt_set_gate(IPI_TLB_SHOOTDOWN_VECTOR, (uint64_t)ipi_tlb_handler);
+    idt_set_gate(APIC_SPURIOUS_VECTOR, (uint64_t)apic_spurious_handler);
 
-    // After setting up all exception handlers, set syscall differently:
-    idt[0x80].type_attr = 0xEE; // Change to DPL=3 (ring 3 can call)
+    // int 0x80: the slow path next to SYSCALL, callable from ring 3 (DPL=3)
+    idt_set_gate(0x80, (uint64_t)syscall_int80_entry);
+    idt[0x80].type_attr = 0xEE;
 
     // Load IDT
     idtr.limit = sizeof(idt) - 1;
     idtr.base = (uint64_t)&idt;
     
+    idt_load();
+}
+
+void idt_load(void) {
     asm volatile ("lidt %0" : : "m"(idtr));
 }
@@ -3,6 +3,26 @@
 
 #include <stdint.h>
 
+// Registers saved by the IRQ stubs (in stack order), then the CPU's frame
+struct irq_frame {
+    uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
+    uint64_t rbp, rdi, rsi, rdx, rcx, rbx, rax;
+    uint64_t rip, cs, rflags, rsp, ss;
+};
+
+// For the entry and exit stubs: switch between the user and kernel GS base
+// if the interrupted code ran in ring 3. off is the offset of the saved CS
+// from %rsp.
+#define SWAPGS_IF_USER(off) \
+    "testb $3, " #off "(%rsp)\n" \
+    "jz 1f\n" \
+    "swapgs\n" \
+    "1:\n"
+
 void init_idt(void);
 
+// Load the table built by init_idt() on the calling CPU. Every CPU shares
+// it: the gates are the same everywhere, only the stacks differ (via TSS).
+void idt_load(void);
+
 #endif // ARCH_X86_IDT_H
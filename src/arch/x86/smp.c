@@ -0,0 +1,121 @@
+#include "arch/x86/smp.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arch/x86/apic.h"
+#include "arch/x86/cpu.h"
+#include "arch/x86/fpu.h"
+#include "arch/x86/idt.h"
+#include "arch/x86/syscall.h"
+#include "core/boot.h"
+#include "core/sched.h"
+#include "core/timer.h"
+#include "memory/hhdm.h"
+#include "memory/pmm.h"
+#include "memory/vmm.h"
+
+_Static_assert(offsetof(cpu_t, self) == CPU_SELF_OFFSET, "this_cpu() reads %gs:0");
+_Static_assert(offsetof(cpu_t, id) == CPU_ID_OFFSET, "smp_cpu_id() reads %gs:8");
+_Static_assert(offsetof(cpu_t, thread) == CPU_THREAD_OFFSET, "sched_current() reads %gs:16");
+_Static_assert(offsetof(cpu_t, kernel_rsp) == CPU_KERNEL_RSP_OFFSET, "syscall_entry reads %gs:24");
+_Static_assert(offsetof(cpu_t, user_rsp) == CPU_USER_RSP_OFFSET, "syscall_entry writes %gs:32");
+
+// How long the BSP waits for the APs to report in
+#define SMP_START_TIMEOUT_MS 1000
+
+static cpu_t cpus[SMP_MAX_CPUS];
+static volatile uint32_t cpus_online = 0;
+
+static void set_gs_base(cpu_t *cpu) {
+    // User code starts out with a zero GS base
+    wrmsr(MSR_GS_BASE, (uint64_t)cpu);
+    wrmsr(MSR_KERNEL_GS_BASE, 0);
+}
+
+void smp_init_bsp(void) {
+    cpu_t *bsp = &cpus[0];
+    bsp->self = bsp;
+    bsp->id = 0;
+    struct limine_mp_response *mp = boot_mp_response();
+    bsp->lapic_id = mp ? mp->bsp_lapic_id : 0;
+    bsp->online = true;
+    set_gs_base(bsp);
+    cpus_online = 1;
+}
+
+// Runs on the AP's own stack with interrupts disabled
+static void ap_main(cpu_t *cpu) {
+    set_gs_base(cpu);
+
+    // Limine starts APs on its own tables; use the kernel's
+    vmm_init_cpu();
+
+    tss_init(&cpu->tss);
+    tss_set_kernel_stack(cpu->stack_top);
+    gdt_init(cpu->gdt, &cpu->tss);
+    idt_load();
+    syscall_init();
+    fpu_init();
+    if (apic_enabled()) apic_init_ap();
+
+    cpu->online = true;
+    __atomic_fetch_add(&cpus_online, 1, __ATOMIC_RELEASE);
+
+    // Become this CPU's idle thread and wait for work to steal
+    sched_ap_enter();
+}
+
+// Limine jumps here on a bootloader stack; move to our own first
+static void ap_entry(struct limine_mp_info *info) {
+    cpu_t *cpu = (cpu_t *)info->extra_argument;
+    asm volatile (
+        "mov %0, %%rsp\n"
+        "xor %%ebp, %%ebp\n"
+        "call *%%rax\n"
+        :: "r"(cpu->stack_top), "a"(ap_main), "D"(cpu) : "memory"
+    );
+    __builtin_unreachable();
+}
+
+uint32_t smp_start_aps(void) {
+    struct limine_mp_response *mp = boot_mp_response();
+    if (!mp) return cpus_online;
+
+    uint32_t started = 1;
+    for (uint64_t i = 0; i < mp->cpu_count && started < SMP_MAX_CPUS; i++) {
+        struct limine_mp_info *info = mp->cpus[i];
+        if (info->lapic_id == mp->bsp_lapic_id) continue;
+
+        void *stack = pmm_alloc_pages(SMP_AP_STACK_PAGES);
+        if (!stack) break;
+
+        cpu_t *cpu = &cpus[started];
+        cpu->self = cpu;
+        cpu->id = started;
+        cpu->lapic_id = info->lapic_id;
+        cpu->stack_top = (uint64_t)hhdm_phys_to_virt((uint64_t)stack) + SMP_AP_STACK_PAGES * PAGE_SIZE;
+        cpu->online = false;
+        started++;
+
+        // The AP polls goto_address, so the argument must be visible first
+        info->extra_argument = (uint64_t)cpu;
+        __atomic_store_n(&info->goto_address, ap_entry, __ATOMIC_RELEASE);
+    }
+
+    uint64_t hz = timer_tsc_hz();
+    if (hz == 0) hz = 1000000000ull;
+    uint64_t deadline = rdtsc() + hz / 1000 * SMP_START_TIMEOUT_MS;
+    while (__atomic_load_n(&cpus_online, __ATOMIC_ACQUIRE) < started && rdtsc() < deadline) {
+        asm volatile ("pause");
+    }
+    return __atomic_load_n(&cpus_online, __ATOMIC_ACQUIRE);
+}
+
+uint32_t smp_cpu_count(void) {
+    return __atomic_load_n(&cpus_online, __ATOMIC_ACQUIRE);
+}
+
+cpu_t *smp_cpu(uint32_t id) {
+    if (id >= SMP_MAX_CPUS || !cpus[id].self) return NULL;
+    return &cpus[id];
+}
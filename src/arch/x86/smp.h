@@ -0,0 +1,70 @@
+#ifndef ARCH_X86_SMP_H
+#define ARCH_X86_SMP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arch/x86/gdt.h"
+#include "arch/x86/tss.h"
+
+#define SMP_MAX_CPUS 16
+#define SMP_NO_CPU UINT32_MAX
+#define SMP_AP_STACK_PAGES 4  // 16 KiB kernel stack per application processor
+
+struct thread;
+struct page_table;
+
+// Per-CPU block, reached through the GS base. The first fields sit at
+// fixed offsets so that assembly can address them as %gs:offset.
+typedef struct cpu {
+    struct cpu *self;        // %gs:0 - lets this_cpu() turn GS into a pointer
+    uint32_t id;             // %gs:8 - dense index, the BSP is 0
+    uint32_t lapic_id;
+    struct thread *thread;   // %gs:16 - running thread, NULL before the scheduler
+    uint64_t kernel_rsp;     // %gs:24 - stack SYSCALL switches to (mirrors TSS.rsp0)
+    uint64_t user_rsp;       // %gs:32 - SYSCALL entry's scratch slot for the user RSP
+    uint64_t stack_top;      // Kernel stack the CPU was started on
+    struct page_table *page_table;  // Address space loaded in CR3
+    uint32_t pcid_gen;       // PCID generation this CPU's TLB was last flushed for
+    volatile bool online;
+    uint64_t gdt[GDT_ENTRIES];
+    tss_t tss;
+} cpu_t;
+
+#define CPU_SELF_OFFSET   0
+#define CPU_ID_OFFSET     8
+#define CPU_THREAD_OFFSET 16
+#define CPU_KERNEL_RSP_OFFSET 24
+#define CPU_USER_RSP_OFFSET   32
+
+static inline cpu_t *this_cpu(void) {
+    cpu_t *cpu;
+    asm volatile ("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+static inline uint32_t smp_cpu_id(void) {
+    uint32_t id;
+    asm volatile ("movl %%gs:8, %0" : "=r"(id));
+    return id;
+}
+
+// In the kernel GS_BASE holds the CPU's block and KERNEL_GS_BASE the user
+// GS base; entry stubs coming from ring 3 swap them with SWAPGS.
+
+// Point GS at the BSP's block. Must run before anything takes a lock or
+// touches per-CPU data.
+void smp_init_bsp(void);
+
+// Start every application processor Limine reported and wait for them to
+// come up. Needs the PMM (for AP stacks) and the IDT. Returns the number
+// of CPUs online, the BSP included.
+uint32_t smp_start_aps(void);
+
+// CPUs online, the BSP included
+uint32_t smp_cpu_count(void);
+
+// Block of CPU id, or NULL
+cpu_t *smp_cpu(uint32_t id);
+
+#endif // ARCH_X86_SMP_H
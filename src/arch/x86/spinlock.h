@@ -0,0 +1,55 @@
+#ifndef ARCH_X86_SPINLOCK_H
+#define ARCH_X86_SPINLOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "arch/x86/cpu.h"
+
+// Ticket lock: waiters take a number and are served in order, so no CPU
+// can starve under contention. All zeroes is unlocked, so static locks
+// need no initialiser.
+typedef struct {
+    volatile uint16_t next;   // Next ticket to hand out
+    volatile uint16_t owner;  // Ticket currently being served
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0, 0 }
+
+static inline void spin_lock(spinlock_t *lock) {
+    uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+        asm volatile ("pause");
+    }
+}
+
+// Take the lock only if nobody holds or waits for it
+static inline bool spin_trylock(spinlock_t *lock) {
+    uint16_t owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE);
+    uint16_t expected = owner;
+    return __atomic_compare_exchange_n(&lock->next, &expected, (uint16_t)(owner + 1), false,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void spin_unlock(spinlock_t *lock) {
+    __atomic_store_n(&lock->owner, (uint16_t)(lock->owner + 1), __ATOMIC_RELEASE);
+}
+
+static inline bool spin_is_locked(const spinlock_t *lock) {
+    return __atomic_load_n(&lock->next, __ATOMIC_RELAXED) !=
+           __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+}
+
+// For locks that interrupt handlers also take: an IRQ on the holder's own
+// CPU would otherwise spin on a ticket that can never be served
+static inline uint64_t spin_lock_irqsave(spinlock_t *lock) {
+    uint64_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, uint64_t flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+#endif // ARCH_X86_SPINLOCK_H
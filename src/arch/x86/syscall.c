@@ -0,0 +1,142 @@
+#include "arch/x86/syscall.h"
+#include <stddef.h>
+#include <stdint.h>
+#include "arch/x86/cpu.h"
+#include "arch/x86/gdt.h"
+#include "arch/x86/idt.h"
+#include "arch/x86/smp.h"
+#include "core/stats.h"
+#include "core/syscall.h"
+
+_Static_assert(offsetof(syscall_frame_t, nr) == 6 * 8, "entry stubs push nr after six arguments");
+_Static_assert(sizeof(syscall_frame_t) == 10 * 8, "entry stubs push ten registers");
+
+// Cleared on entry: no interrupts until the stack is switched, and a clean
+// direction, trap and alignment-check state for C code
+#define SYSCALL_RFLAGS_MASK ((1u << 8) | (1u << 9) | (1u << 10) | (1u << 18))  // TF IF DF AC
+
+// SYSCALL leaves the user RSP in place and the user GS loaded. Swap GS,
+// park the user RSP in the per-CPU block just long enough to switch to
+// this thread's kernel stack, then save only what C code may clobber.
+__attribute__((naked)) static void syscall_entry(void) {
+    asm volatile (
+        "swapgs\n"
+        "mov %rsp, %gs:32\n"          // CPU_USER_RSP_OFFSET
+        "mov %gs:24, %rsp\n"          // CPU_KERNEL_RSP_OFFSET
+        "push %gs:32\n"
+        "push %r11\n"
+        "push %rcx\n"
+        "push %rax\n"
+        "push %rdi\n"
+        "push %rsi\n"
+        "push %rdx\n"
+        "push %r10\n"
+        "push %r8\n"
+        "push %r9\n"
+        "sti\n"
+        "mov %rsp, %rdi\n"
+        "call syscall_dispatch\n"
+        "cli\n"
+        "pop %r9\n"
+        "pop %r8\n"
+        "pop %r10\n"
+        "pop %rdx\n"
+        "pop %rsi\n"
+        "pop %rdi\n"
+        "add $8, %rsp\n"              // nr; the result is in %rax
+        "pop %rcx\n"
+        "pop %r11\n"
+        "pop %rsp\n"
+        "swapgs\n"
+        "sysretq\n"
+    );
+}
+
+// Same frame built under an interrupt gate, plus one slot to keep the
+// stack 16-byte aligned for the call
+__attribute__((naked)) void syscall_int80_entry(void) {
+    asm volatile (
+        SWAPGS_IF_USER(8)
+        "cld\n"                       // Unlike SYSCALL, the gate leaves DF as ring 3 set it
+        "push $0\n"                   // Alignment
+        "push $0\n"                   // frame->rsp: iretq restores the user RSP
+        "push %r11\n"
+        "push %rcx\n"
+        "push %rax\n"
+        "push %rdi\n"
+        "push %rsi\n"
+        "push %rdx\n"
+        "push %r10\n"
+        "push %r8\n"
+        "push %r9\n"
+        KSTAT_VECTOR_ASM(128)
+        "sti\n"
+        "mov %rsp, %rdi\n"
+        "call syscall_dispatch\n"
+        "cli\n"
+        "pop %r9\n"
+        "pop %r8\n"
+        "pop %r10\n"
+        "pop %rdx\n"
+        "pop %rsi\n"
+        "pop %rdi\n"
+        "add $8, %rsp\n"              // nr
+        "pop %rcx\n"
+        "pop %r11\n"
+        "add $16, %rsp\n"             // frame->rsp and the alignment slot
+        SWAPGS_IF_USER(8)
+        "iretq\n"
+    );
+}
+
+void syscall_init(void) {
+    wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_SCE);
+
+    // SYSCALL loads CS = STAR[47:32] and SS = +8. SYSRET to 64-bit code
+    // loads CS = STAR[63:48] + 16 and SS = STAR[63:48] + 8, both with RPL 3.
+    uint64_t star = ((uint64_t)(GDT_USER_DATA - 8) << 48) | ((uint64_t)GDT_KERNEL_CODE << 32);
+    wrmsr(MSR_STAR, star);
+    wrmsr(MSR_LSTAR, (uint64_t)syscall_entry);
+    wrmsr(MSR_SFMASK, SYSCALL_RFLAGS_MASK);
+}
+
+void syscall_enter_user(uint64_t rip, uint64_t rsp) {
+    // Build the frame iretq pops, swap to the user GS base, and clear every
+    // register so no kernel value leaks into ring 3
+    asm volatile (
+        "cli\n"
+        "push %[ss]\n"
+        "push %[rsp]\n"
+        "push %[rflags]\n"
+        "push %[cs]\n"
+        "push %[rip]\n"
+        "swapgs\n"
+        "xor %%eax, %%eax\n"
+        "xor %%ebx, %%ebx\n"
+        "xor %%ecx, %%ecx\n"
+        "xor %%edx, %%edx\n"
+        "xor %%esi, %%esi\n"
+        "xor %%edi, %%edi\n"
+        "xor %%ebp, %%ebp\n"
+        "xor %%r8d, %%r8d\n"
+        "xor %%r9d, %%r9d\n"
+        "xor %%r10d, %%r10d\n"
+        "xor %%r11d, %%r11d\n"
+        "xor %%r12d, %%r12d\n"
+        "xor %%r13d, %%r13d\n"
+        "xor %%r14d, %%r14d\n"
+        "xor %%r15d, %%r15d\n"
+        "iretq\n"
+        :: [ss]"i"(GDT_USER_DATA | 3), [cs]"i"(GDT_USER_CODE | 3), [rflags]"i"(1 << 9),
+           [rip]"r"(rip), [rsp]"r"(rsp)
+        : "memory"
+    );
+    __builtin_unreachable();
+}
+
+int64_t syscall_dispatch(syscall_frame_t *frame) {
+    KSTAT_INC(SYSCALL);
+    if (frame->nr >= SYS_COUNT || !syscall_table[frame->nr]) return SYSCALL_ENOSYS;
+    return syscall_table[frame->nr](frame->rdi, frame->rsi, frame->rdx,
+                                    frame->r10, frame->r8, frame->r9);
+}
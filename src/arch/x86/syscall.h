@@ -0,0 +1,36 @@
+#ifndef ARCH_X86_SYSCALL_H
+#define ARCH_X86_SYSCALL_H
+
+#include <stdint.h>
+
+// System call entry. SYSCALL is the fast path; int 0x80 stays for
+// compatibility. Both take the number in %rax and up to six arguments in
+// %rdi, %rsi, %rdx, %r10, %r8 and %r9, and return in %rax. SYSCALL
+// clobbers %rcx and %r11 as the instruction itself does; int 0x80
+// preserves everything but %rax.
+
+// Registers saved by both entry stubs, in stack order
+typedef struct {
+    uint64_t r9, r8, r10, rdx, rsi, rdi;
+    uint64_t nr;
+    uint64_t rcx;   // User RIP for SYSCALL
+    uint64_t r11;   // User RFLAGS for SYSCALL
+    uint64_t rsp;   // User RSP for SYSCALL, unused for int 0x80
+} syscall_frame_t;
+
+// Program EFER.SCE, STAR, LSTAR and SFMASK on the calling CPU. Needs the
+// GDT layout from gdt_init().
+void syscall_init(void);
+
+// IDT gate for int 0x80 (installed by init_idt())
+void syscall_int80_entry(void);
+
+// Drop the calling thread to ring 3 at rip with stack rsp and IF set. The
+// thread's address space must be loaded. Syscalls and interrupts come back
+// in on its kernel stack.
+void syscall_enter_user(uint64_t rip, uint64_t rsp) __attribute__((noreturn));
+
+// Called by both stubs with interrupts enabled; returns the result for %rax
+int64_t syscall_dispatch(syscall_frame_t *frame);
+
+#endif // ARCH_X86_SYSCALL_H
@@ -1,15 +1,24 @@
 #include "arch/x86/tss.h"
 #include <stddef.h>
 #include <stdint.h>
+#include "arch/x86/smp.h"
 #include "libc/string.h"
 
-tss_t tss;
+static uint8_t ist_stacks[SMP_MAX_CPUS][TSS_IST_COUNT][TSS_IST_STACK_SIZE]
+    __attribute__((aligned(16)));
 
-void tss_init(void) {
-    memset(&tss, 0, sizeof(tss_t));
-    tss.iopb_offset = sizeof(tss_t);
+void tss_init(tss_t* tss) {
+    memset(tss, 0, sizeof(tss_t));
+    tss->iopb_offset = sizeof(tss_t);
+
+    uint32_t cpu = smp_cpu_id();
+    for (int i = 0; i < TSS_IST_COUNT; i++) {
+        tss->ist[i] = (uint64_t)&ist_stacks[cpu][i][TSS_IST_STACK_SIZE];
+    }
 }
 
 void tss_set_kernel_stack(uint64_t stack) {
-    tss.rsp0 = stack;
-}
\ No newline at end of file
+    cpu_t *cpu = this_cpu();
+    cpu->tss.rsp0 = stack;
+    cpu->kernel_rsp = stack;  // SYSCALL doesn't consult the TSS
+}
@@ -15,9 +15,21 @@ typedef struct {
     uint16_t iopb_offset;
 } __attribute__((packed)) tss_t;
 
-extern tss_t tss;
+// Interrupt stack table slots (1-based; 0 in a gate means "no switch").
+// NMI, #DF and #MC may arrive while RSP is not a usable kernel stack - in
+// the SYSCALL entry/exit windows, or after a kernel stack overflow - so
+// they always switch to a known-good stack of their own.
+#define TSS_IST_NMI 1
+#define TSS_IST_DF  2
+#define TSS_IST_MC  3
+#define TSS_IST_COUNT 3
+#define TSS_IST_STACK_SIZE 8192
 
-void tss_init(void);
+// Each CPU has its own TSS in its per-CPU block (arch/x86/smp.h). Must run
+// on that CPU: it also points the IST slots at the CPU's own stacks.
+void tss_init(tss_t* tss);
+
+// Set the ring 0 stack of the calling CPU, for interrupts and SYSCALL
 void tss_set_kernel_stack(uint64_t stack);
 
 #endif // ARCH_X86_TSS_H
@@ -0,0 +1,89 @@
+#include "core/batch.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "core/boot.h"
+#include "core/console.h"
+#include "core/log.h"
+#include "core/serial.h"
+#include "core/shell.h"
+#include "core/timer.h"
+#include "libc/stdio.h"
+#include "libc/string.h"
+#include "memory/heap.h"
+
+#define BATCH_LINE_MAX 256
+
+static char *capture = NULL;
+static size_t capture_len = 0;
+static size_t capture_cap = 0;
+static size_t capture_dropped = 0;
+
+static void capture_sink(const char *buf, size_t len) {
+    // Wait for the UART rather than lose output
+    serial_write_all(buf, len);
+
+    if (capture_len + len > capture_cap && capture_cap < BATCH_CAPTURE_MAX) {
+        size_t cap = capture_cap ? capture_cap : 4096;
+        while (cap < capture_len + len && cap < BATCH_CAPTURE_MAX) cap *= 2;
+        if (cap > BATCH_CAPTURE_MAX) cap = BATCH_CAPTURE_MAX;
+        char *grown = krealloc(capture, cap);
+        if (grown) {
+            capture = grown;
+            capture_cap = cap;
+        }
+    }
+    size_t take = capture_cap - capture_len;
+    if (take > len) take = len;
+    memcpy(capture + capture_len, buf, take);
+    capture_len += take;
+    capture_dropped += len - take;
+}
+
+bool batch_run(struct limine_framebuffer *fb) {
+    struct limine_file *file = boot_find_module(BATCH_MODULE);
+    if (!file) return false;
+
+    log_info("batch", "running " BATCH_MODULE ", output captured and sent to COM1");
+    capture_len = 0;
+    capture_dropped = 0;
+
+    uint64_t start = ktime_ns();
+    uint32_t commands = 0;
+    const char *p = (const char *)file->address;
+    const char *end = p + file->size;
+    char line[BATCH_LINE_MAX];
+
+    console_capture(capture_sink);
+    while (p < end) {
+        const char *eol = p;
+        while (eol < end && *eol != '\n') eol++;
+        size_t len = (size_t)(eol - p);
+        if (len > 0 && p[len - 1] == '\r') len--;
+        if (len >= sizeof(line)) len = sizeof(line) - 1;
+        memcpy(line, p, len);
+        line[len] = '\0';
+        p = eol + 1;
+
+        const char *cmd = line;
+        while (*cmd == ' ' || *cmd == '\t') cmd++;
+        if (*cmd == '\0' || *cmd == '#') continue;
+
+        kprintf("$ %s\n", cmd);
+        shell_execute(fb, line);
+        commands++;
+    }
+    console_capture(NULL);
+
+    char msg[96];
+    ksnprintf(msg, sizeof(msg), "%u commands in %llu ms, %zu bytes captured (%zu dropped)",
+              commands, (unsigned long long)((ktime_ns() - start) / 1000000),
+              capture_len, capture_dropped);
+    log_ok("batch", msg);
+    return true;
+}
+
+const char *batch_output(size_t *len) {
+    *len = capture_len;
+    return capture;
+}
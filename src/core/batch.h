@@ -0,0 +1,22 @@
+#ifndef CORE_BATCH_H
+#define CORE_BATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "limine.h"
+
+// Headless batch mode: if Limine loaded a "kiwiOS.batch" module, run it as
+// a shell script before the interactive prompt. One command per line;
+// blank lines and lines starting with '#' are skipped. Command output is
+// not drawn: it goes to an in-memory capture buffer and is mirrored to
+// COM1. End the script with "shutdown" to power off when it is done.
+#define BATCH_MODULE      "kiwiOS.batch"
+#define BATCH_CAPTURE_MAX (1024 * 1024)
+
+// Run the script from the shell thread. Returns false if there is none.
+bool batch_run(struct limine_framebuffer *fb);
+
+// Output captured by the last run (not NUL-terminated)
+const char *batch_output(size_t *len);
+
+#endif // CORE_BATCH_H
@@ -0,0 +1,439 @@
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arch/x86/cpu.h"
+#include "core/bench.h"
+#include "core/console.h"
+#include "core/serial.h"
+#include "core/timer.h"
+#include "libc/stdio.h"
+#include "libc/string.h"
+#include "memory/heap.h"
+#include "memory/pmm.h"
+#include "memory/vmm.h"
+
+// Every case runs a few untimed warmup samples and then BENCH_DEFAULT_SAMPLES
+// timed ones. A sample is one call of the case body doing `ops` operations;
+// per-op cycle counts are the sample cycles divided by ops. Setup and
+// teardown run outside the timed region. Results are printed as one
+// key=value line per case on the console and COM1, e.g.
+//
+//   bench suite=pmm case=alloc ops=64 samples=200 min=41 median=44 p99=97 ns=14
+//
+// so two builds can be compared with a text diff.
+
+#define BENCH_WARMUP          8
+#define BENCH_DEFAULT_SAMPLES 200
+#define BENCH_MAX_SAMPLES     1000
+#define BENCH_BATCH           64      // Operations per sample for tiny ops
+#define BENCH_COPY_BYTES      (64 * 1024)
+#define BENCH_FRAG_PAGES      1024    // Singles held to fragment the PMM
+#define BENCH_VMM_BASE        0x400000ULL
+#define BENCH_LINE_MAX        192
+
+typedef void (*bench_fn_t)(void *ctx);
+
+typedef struct {
+    const char *suite;
+    const char *name;
+    bench_fn_t setup;      // Untimed, before each sample (may be NULL)
+    bench_fn_t body;       // Timed
+    bench_fn_t teardown;   // Untimed, after each sample (may be NULL)
+    uint32_t ops;          // Operations per body call
+    uint64_t bytes;        // Bytes moved per operation, 0 if not bandwidth
+} bench_case_t;
+
+static uint64_t samples[BENCH_MAX_SAMPLES];
+static uint32_t sample_count = BENCH_DEFAULT_SAMPLES;
+
+// ---------------- Output ----------------
+
+static void bench_emit(const char *line, size_t len) {
+    console_write(line, len);
+    // A capture sink (batch mode) already mirrors everything to COM1
+    if (console_is_captured()) return;
+
+    // Results matter more than latency here: wait for room in the UART ring
+    serial_write_all(line, len);
+}
+
+static void bench_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void bench_printf(const char *fmt, ...) {
+    char line[BENCH_LINE_MAX];
+    va_list args;
+    va_start(args, fmt);
+    int n = kvsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (n < 0) return;
+    size_t len = (size_t)n < sizeof(line) ? (size_t)n : sizeof(line) - 1;
+    bench_emit(line, len);
+}
+
+// ---------------- Harness ----------------
+
+static void sort_samples(uint64_t *v, uint32_t n) {
+    // Insertion sort: n is small and this runs outside the timed region
+    for (uint32_t i = 1; i < n; i++) {
+        uint64_t key = v[i];
+        uint32_t j = i;
+        while (j > 0 && v[j - 1] > key) {
+            v[j] = v[j - 1];
+            j--;
+        }
+        v[j] = key;
+    }
+}
+
+static void bench_run_case(const bench_case_t *bc, void *ctx) {
+    for (uint32_t i = 0; i < BENCH_WARMUP + sample_count; i++) {
+        if (bc->setup) bc->setup(ctx);
+        uint64_t start = rdtsc();
+        bc->body(ctx);
+        uint64_t cycles = rdtsc() - start;
+        if (bc->teardown) bc->teardown(ctx);
+        if (i >= BENCH_WARMUP) samples[i - BENCH_WARMUP] = cycles;
+    }
+    sort_samples(samples, sample_count);
+
+    uint64_t ops = bc->ops ? bc->ops : 1;
+    uint64_t min = samples[0] / ops;
+    uint64_t median = samples[sample_count / 2] / ops;
+    uint64_t p99 = samples[(uint64_t)sample_count * 99 / 100] / ops;
+
+    char extra[48] = "";
+    if (bc->bytes && median) {
+        // MB/s at the median: bytes per cycle times cycles per microsecond
+        uint64_t mbps = bc->bytes * (timer_tsc_hz() / 1000000) / median;
+        ksnprintf(extra, sizeof(extra), " bytes=%llu mbps=%llu",
+                  (unsigned long long)bc->bytes, (unsigned long long)mbps);
+    }
+
+    bench_printf("bench suite=%s case=%s ops=%llu samples=%u min=%llu median=%llu p99=%llu ns=%llu%s\n",
+                 bc->suite, bc->name, (unsigned long long)ops, sample_count,
+                 (unsigned long long)min, (unsigned long long)median,
+                 (unsigned long long)p99, (unsigned long long)timer_cycles_to_ns(median), extra);
+}
+
+// ---------------- pmm ----------------
+
+typedef struct {
+    void *pages[BENCH_BATCH];
+    size_t run;            // Pages per pmm_alloc_pages() call
+} pmm_ctx_t;
+
+static void pmm_alloc_body(void *p) {
+    pmm_ctx_t *c = p;
+    for (int i = 0; i < BENCH_BATCH; i++) c->pages[i] = pmm_alloc();
+}
+
+static void pmm_free_body(void *p) {
+    pmm_ctx_t *c = p;
+    for (int i = 0; i < BENCH_BATCH; i++) {
+        if (c->pages[i]) pmm_free(c->pages[i]);
+    }
+}
+
+static void pmm_alloc_run_body(void *p) {
+    pmm_ctx_t *c = p;
+    for (int i = 0; i < BENCH_BATCH; i++) c->pages[i] = pmm_alloc_pages(c->run);
+}
+
+static void pmm_free_run(void *p) {
+    pmm_ctx_t *c = p;
+    for (int i = 0; i < BENCH_BATCH; i++) {
+        if (c->pages[i]) pmm_free_pages(c->pages[i], c->run);
+    }
+}
+
+static void bench_pmm(void) {
+    static pmm_ctx_t ctx;
+    bench_case_t alloc = { "pmm", "alloc", NULL, pmm_alloc_body, pmm_free_body, BENCH_BATCH, 0 };
+    bench_case_t release = { "pmm", "free", pmm_alloc_body, pmm_free_body, NULL, BENCH_BATCH, 0 };
+    bench_run_case(&alloc, &ctx);
+    bench_run_case(&release, &ctx);
+
+    // Fragment the allocator: take a run of single pages and give back
+    // every other one, so small blocks are plentiful but do not coalesce
+    static void *held[BENCH_FRAG_PAGES];
+    for (int i = 0; i < BENCH_FRAG_PAGES; i++) held[i] = pmm_alloc();
+    for (int i = 0; i < BENCH_FRAG_PAGES; i += 2) {
+        if (held[i]) pmm_free(held[i]);
+        held[i] = NULL;
+    }
+
+    static const size_t runs[] = { 1, 4, 16, 64 };
+    static const char *const names[] = { "alloc_pages_1", "alloc_pages_4",
+                                         "alloc_pages_16", "alloc_pages_64" };
+    for (size_t r = 0; r < sizeof(runs) / sizeof(runs[0]); r++) {
+        ctx.run = runs[r];
+        bench_case_t bc = { "pmm", names[r], NULL, pmm_alloc_run_body, pmm_free_run, BENCH_BATCH, 0 };
+        bench_run_case(&bc, &ctx);
+    }
+
+    for (int i = 1; i < BENCH_FRAG_PAGES; i += 2) {
+        if (held[i]) pmm_free(held[i]);
+    }
+}
+
+// ---------------- heap ----------------
+
+typedef struct {
+    void *ptrs[BENCH_BATCH];
+    size_t sizes[BENCH_BATCH];
+    size_t size;
+} heap_ctx_t;
+
+static void heap_alloc_body(void *p) {
+    heap_ctx_t *c = p;
+    for (int i = 0; i < BENCH_BATCH; i++) c->ptrs[i] = kmalloc(c->size);
+}
+
+static void heap_free_body(void *p) {
+    heap_ctx_t *c = p;
+    for (int i = 0; i < BENCH_BATCH; i++) kfree(c->ptrs[i]);
+}
+
+static void heap_pair_body(void *p) {
+    heap_ctx_t *c = p;
+    for (int i = 0; i < BENCH_BATCH; i++) kfree(kmalloc(c->size));
+}
+
+// Allocate a spread of sizes, then free them in a scrambled order
+static void heap_mix_body(void *p) {
+    heap_ctx_t *c = p;
+    for (int i = 0; i < BENCH_BATCH; i++) c->ptrs[i] = kmalloc(c->sizes[i]);
+    for (int i = 0; i < BENCH_BATCH; i++) kfree(c->ptrs[(i * 37) & (BENCH_BATCH - 1)]);
+}
+
+static void bench_heap(void) {
+    static heap_ctx_t ctx;
+    static const size_t sizes[] = { 32, 256, 8192 };
+    static const char *const alloc_names[] = { "kmalloc_32", "kmalloc_256", "kmalloc_8k" };
+    static const char *const pair_names[] = { "pair_32", "pair_256", "pair_8k" };
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        ctx.size = sizes[s];
+        bench_case_t alloc = { "heap", alloc_names[s], NULL, heap_alloc_body, heap_free_body, BENCH_BATCH, 0 };
+        bench_case_t pair = { "heap", pair_names[s], NULL, heap_pair_body, NULL, BENCH_BATCH, 0 };
+        bench_run_case(&alloc, &ctx);
+        bench_run_case(&pair, &ctx);
+    }
+
+    // Fixed pseudo-random sizes from 16 bytes to 4 KiB so runs are comparable
+    uint32_t seed = 12345;
+    for (int i = 0; i < BENCH_BATCH; i++) {
+        seed = seed * 1103515245u + 12345u;
+        ctx.sizes[i] = 16u << ((seed >> 16) % 9);
+    }
+    bench_case_t mix = { "heap", "mix", NULL, heap_mix_body, NULL, BENCH_BATCH * 2, 0 };
+    bench_run_case(&mix, &ctx);
+}
+
+// ---------------- vmm ----------------
+
+typedef struct {
+    page_table_t *pt;
+    uint64_t phys;
+} vmm_ctx_t;
+
+static void vmm_map_body(void *p) {
+    vmm_ctx_t *c = p;
+    for (int i = 0; i < BENCH_BATCH; i++) {
+        vmm_map_page(c->pt, BENCH_VMM_BASE + (uint64_t)i * PAGE_SIZE, c->phys, PAGE_WRITE);
+    }
+}
+
+static void vmm_unmap_body(void *p) {
+    vmm_ctx_t *c = p;
+    for (int i = 0; i < BENCH_BATCH; i++) {
+        vmm_unmap_page(c->pt, BENCH_VMM_BASE + (uint64_t)i * PAGE_SIZE);
+    }
+}
+
+static void vmm_lookup_body(void *p) {
+    vmm_ctx_t *c = p;
+    uint64_t sum = 0;
+    for (int i = 0; i < BENCH_BATCH; i++) {
+        sum += vmm_get_physical(c->pt, BENCH_VMM_BASE + (uint64_t)i * PAGE_SIZE);
+    }
+    asm volatile ("" :: "r"(sum));
+}
+
+static void bench_vmm(void) {
+    static vmm_ctx_t ctx;
+    ctx.pt = vmm_create_page_table();
+    ctx.phys = (uint64_t)pmm_alloc();
+    if (!ctx.pt || !ctx.phys) {
+        bench_printf("bench suite=vmm error=nomem\n");
+        if (ctx.phys) pmm_free((void *)ctx.phys);
+        if (ctx.pt) vmm_destroy_page_table(ctx.pt);
+        return;
+    }
+
+    // The first map pulls in the intermediate tables; time steady state
+    vmm_map_body(&ctx);
+    vmm_unmap_body(&ctx);
+
+    bench_case_t map = { "vmm", "map_page", NULL, vmm_map_body, vmm_unmap_body, BENCH_BATCH, 0 };
+    bench_case_t unmap = { "vmm", "unmap_page", vmm_map_body, vmm_unmap_body, NULL, BENCH_BATCH, 0 };
+    bench_case_t lookup = { "vmm", "get_physical", vmm_map_body, vmm_lookup_body, vmm_unmap_body, BENCH_BATCH, 0 };
+    bench_run_case(&map, &ctx);
+    bench_run_case(&unmap, &ctx);
+    bench_run_case(&lookup, &ctx);
+
+    vmm_destroy_page_table(ctx.pt);
+    pmm_free((void *)ctx.phys);
+}
+
+// ---------------- string ----------------
+
+typedef struct {
+    uint8_t *src;
+    uint8_t *dst;
+    void *(*copy)(void *dst, const void *src, size_t n);
+    void *(*set)(void *dst, int c, size_t n);
+} string_ctx_t;
+
+static void string_copy_body(void *p) {
+    string_ctx_t *c = p;
+    c->copy(c->dst, c->src, BENCH_COPY_BYTES);
+}
+
+static void string_move_body(void *p) {
+    string_ctx_t *c = p;
+    c->copy(c->src + 64, c->src, BENCH_COPY_BYTES);
+}
+
+static void string_set_body(void *p) {
+    string_ctx_t *c = p;
+    c->set(c->dst, 0x5A, BENCH_COPY_BYTES);
+}
+
+static void bench_string(void) {
+    size_t pages = 2 * BENCH_COPY_BYTES / PAGE_SIZE + 1;
+    uint64_t phys = (uint64_t)pmm_alloc_pages(pages);
+    if (!phys) {
+        bench_printf("bench suite=string error=nomem\n");
+        return;
+    }
+
+    static string_ctx_t ctx;
+    ctx.src = (uint8_t *)phys_to_virt(phys);
+    ctx.dst = ctx.src + BENCH_COPY_BYTES + PAGE_SIZE;
+
+    static const struct {
+        const char *name;
+        bench_fn_t body;
+        void *(*copy)(void *dst, const void *src, size_t n);
+        void *(*set)(void *dst, int c, size_t n);
+    } cases[] = {
+        { "memcpy",           string_copy_body, memcpy,           NULL },
+        { "memcpy_words",     string_copy_body, memcpy_words,     NULL },
+        { "memcpy_erms",      string_copy_body, memcpy_erms,      NULL },
+        { "memcpy_sse2",      string_copy_body, memcpy_sse2,      NULL },
+        { "memmove_backward", string_move_body, memmove_backward, NULL },
+        { "memset",           string_set_body,  NULL,             memset },
+        { "memset_words",     string_set_body,  NULL,             memset_words },
+        { "memset_erms",      string_set_body,  NULL,             memset_erms },
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        ctx.copy = cases[i].copy;
+        ctx.set = cases[i].set;
+        bench_case_t bc = { "string", cases[i].name, NULL, cases[i].body, NULL, 1, BENCH_COPY_BYTES };
+        bench_run_case(&bc, &ctx);
+    }
+
+    pmm_free_pages((void *)phys, pages);
+}
+
+// ---------------- console ----------------
+
+#define BENCH_CONSOLE_LINES 16
+
+static const char console_line[] =
+    "The quick brown fox jumps over the lazy dog 0123456789 ABCDEFGH\n";
+
+static void console_write_body(void *p) {
+    (void)p;
+    for (int i = 0; i < BENCH_CONSOLE_LINES; i++) {
+        console_write(console_line, sizeof(console_line) - 1);
+    }
+}
+
+static void console_render_body(void *p) {
+    (void)p;
+    console_flush();
+}
+
+static void bench_console(void) {
+    // Start from a screen with nothing left to draw
+    console_flush();
+
+    // write_line times scrollback updates (and drawing, outside deferred
+    // mode); render times the scroll and glyph work a flush does afterwards
+    bench_case_t write = { "console", "write_line", NULL, console_write_body, console_render_body,
+                           BENCH_CONSOLE_LINES, sizeof(console_line) - 1 };
+    bench_case_t render = { "console", "render_lines", console_write_body, console_render_body, NULL,
+                            BENCH_CONSOLE_LINES, sizeof(console_line) - 1 };
+    bench_run_case(&write, NULL);
+    bench_run_case(&render, NULL);
+}
+
+// ---------------- Command ----------------
+
+typedef struct {
+    const char *name;
+    void (*run)(void);
+} bench_suite_t;
+
+// "all" runs these in order; console goes last since it floods the screen
+static const bench_suite_t suites[] = {
+    { "pmm",     bench_pmm },
+    { "heap",    bench_heap },
+    { "vmm",     bench_vmm },
+    { "string",  bench_string },
+    { "console", bench_console },
+};
+
+#define SUITE_COUNT (sizeof(suites) / sizeof(suites[0]))
+
+static void bench_usage(void) {
+    kprintf("usage: bench <suite|all|list> [samples]\n  suites:");
+    for (size_t i = 0; i < SUITE_COUNT; i++) kprintf(" %s", suites[i].name);
+    kprintf("\n  samples: 1-%u (default %u)\n", BENCH_MAX_SAMPLES, BENCH_DEFAULT_SAMPLES);
+}
+
+void bench_command(const char *args) {
+    char name[16];
+    size_t len = 0;
+    while (args && *args == ' ') args++;
+    while (args && *args && *args != ' ' && len < sizeof(name) - 1) name[len++] = *args++;
+    name[len] = '\0';
+
+    uint32_t count = 0;
+    while (args && *args == ' ') args++;
+    while (args && *args >= '0' && *args <= '9') count = count * 10 + (uint32_t)(*args++ - '0');
+    if (count == 0) count = BENCH_DEFAULT_SAMPLES;
+    if (count > BENCH_MAX_SAMPLES) count = BENCH_MAX_SAMPLES;
+
+    if (len == 0 || strcmp(name, "list") == 0) {
+        bench_usage();
+        return;
+    }
+
+    bool all = strcmp(name, "all") == 0;
+    bool found = false;
+    sample_count = count;
+    bench_printf("bench begin tsc_hz=%llu samples=%u warmup=%u\n",
+                 (unsigned long long)timer_tsc_hz(), sample_count, BENCH_WARMUP);
+    for (size_t i = 0; i < SUITE_COUNT; i++) {
+        if (all || strcmp(name, suites[i].name) == 0) {
+            suites[i].run();
+            found = true;
+        }
+    }
+    if (!found) bench_printf("bench error=unknown_suite suite=%s\n", name);
+    bench_printf("bench end\n");
+}
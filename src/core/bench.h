@@ -0,0 +1,7 @@
+#ifndef CORE_BENCH_H
+#define CORE_BENCH_H
+
+// Shell entry point: "bench <suite|all|list> [samples]"
+void bench_command(const char *args);
+
+#endif // CORE_BENCH_H
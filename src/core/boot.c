@@ -1,4 +1,5 @@
 #include "core/boot.h"
+#include "libc/string.h"
 
 // ================= Limine boilerplate =================
 __attribute__((used, section(".limine_requests")))
@@ -33,6 +34,19 @@ static volatile struct limine_module_request module_request = {
     .revision = 0
 };
 
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_mp_request mp_request = {
+    .id = LIMINE_MP_REQUEST,
+    .revision = 0,
+    .flags = 0
+};
+
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_rsdp_request rsdp_request = {
+    .id = LIMINE_RSDP_REQUEST,
+    .revision = 0
+};
+
 bool boot_limine_supported(void) {
     return LIMINE_BASE_REVISION_SUPPORTED;
 }
@@ -53,6 +67,33 @@ struct limine_module_response *boot_module_response(void) {
     return module_request.response;
 }
 
+struct limine_mp_response *boot_mp_response(void) {
+    return mp_request.response;
+}
+
+struct limine_rsdp_response *boot_rsdp_response(void) {
+    return rsdp_request.response;
+}
+
+struct limine_file *boot_find_module(const char *name) {
+    struct limine_module_response *resp = module_request.response;
+    if (!resp || !name) return NULL;
+
+    size_t name_len = strlen(name);
+    for (uint64_t i = 0; i < resp->module_count; i++) {
+        struct limine_file *file = resp->modules[i];
+        if (file->string && strcmp(file->string, name) == 0) return file;
+
+        if (!file->path) continue;
+        size_t path_len = strlen(file->path);
+        if (path_len > name_len && file->path[path_len - name_len - 1] == '/' &&
+            strcmp(file->path + path_len - name_len, name) == 0) {
+            return file;
+        }
+    }
+    return NULL;
+}
+
 void boot_hcf(void) {
     for (;;) asm volatile ("hlt");
 }
@@ -12,5 +12,11 @@ struct limine_framebuffer_response *boot_framebuffer_response(void);
 struct limine_memmap_response *boot_memmap_response(void);
 struct limine_hhdm_response *boot_hhdm_response(void);
 struct limine_module_response *boot_module_response(void);
+struct limine_mp_response *boot_mp_response(void);
+struct limine_rsdp_response *boot_rsdp_response(void);  // address is physical
+
+// Module whose string (module_string in limine.conf) equals name, or whose
+// path ends in "/name"; NULL if there is none
+struct limine_file *boot_find_module(const char *name);
 
 #endif // CORE_BOOT_H
@@ -1,10 +1,18 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include "arch/x86/smp.h"
+#include "arch/x86/spinlock.h"
 #include "core/boot.h"
 #include "core/console.h"
+#include "core/sched.h"
+#include "core/stats.h"
 #include "font8x16_tandy2k.h"
 #include "libc/string.h"
+#include "memory/heap.h"
+#include "memory/hhdm.h"
+#include "memory/pmm.h"
+#include "memory/vmm.h"
 
 // ================= Framebuffer helpers =================
 struct limine_framebuffer *console_primary_framebuffer(void) {
@@ -26,12 +34,30 @@ static uint32_t g_fb_count = 0;
 // Text layout bounds shared by all outputs (min width/height across displays)
 static uint32_t g_text_w_px = 0;  // usable width in pixels (min across outputs)
 static uint32_t g_text_h_px = 0;  // usable height in pixels (min across outputs)
+static uint32_t g_bounds_w_px = 0; // shared glyph-grid bounds before scaling
+static uint32_t g_bounds_h_px = 0;
+
+// RAM back buffer, enabled once the PMM is up. Everything is rasterized into
+// it once and dirty spans are streamed to every output. Screen pixel row y is
+// stored in shadow row (g_shadow_top + y) % g_text_h_px, so scrolling rotates
+// the rows instead of moving pixels through video memory.
+#define MAX_DIRTY_ROWS 512
+
+static uint32_t *g_shadow = NULL;
+static uint32_t g_shadow_stride = 0;          // pixels per shadow row
+static uint32_t g_shadow_top = 0;             // shadow row holding screen row 0
+static uint32_t g_dirty_x0[MAX_DIRTY_ROWS];   // per text row: first dirty pixel column
+static uint32_t g_dirty_x1[MAX_DIRTY_ROWS];   // per text row: end of dirty span (0 = clean)
+static bool g_dirty = false;
 
 // Forward declarations for helpers used during display initialization.
 static void update_layout_from_bounds(void);
 static void reset_scrollback(void);
 static void clear_outputs(void);
 static void render_visible(void);
+static void glyph_cache_reset(void);
+static void console_lock(void);
+static void console_unlock(void);
 
 // Call this once early in kmain(), after Limine is ready.
 static void display_init(void) {
@@ -72,8 +98,11 @@ static void display_init(void) {
     // Round down to glyph grid so wrapping/scrolling is identical on all displays.
     g_text_w_px = (g_text_w_px / GLYPH_W) * GLYPH_W;
     g_text_h_px = (g_text_h_px / GLYPH_H) * GLYPH_H;
+    g_bounds_w_px = g_text_w_px;
+    g_bounds_h_px = g_text_h_px;
 
     update_layout_from_bounds();
+    glyph_cache_reset();
     reset_scrollback();
     clear_outputs();
     render_visible();
@@ -137,30 +166,241 @@ static void ansi_reset_state(void);
 
 // Scrollback buffer ------------------------------------------------------
 
-#define MAX_COLS          512
-#define SCROLLBACK_LINES 1024
+// Each line is a small header followed by one 2-byte cell per column. A cell
+// is a glyph byte plus an index into the attribute table of (fg, bg) pairs.
+// Once the table is full, new color pairs go into a run table of LINE_RUNS
+// pairs in the line header instead, and the cell holds ATTR_RUN_BASE plus
+// the slot. Once a line's slots are full, further pairs are drawn with the
+// closest pair already in the table or the line's runs.
+//
+// Until the heap is up the console runs on a small static scrollback; kmain
+// then calls console_set_scrollback_lines() to move to a heap buffer sized to
+// the real column count.
+
+#define MAX_COLS              512
+#define BOOT_SCROLLBACK_LINES 64
+#define LINE_RUNS             8
+#define ATTR_RUN_BASE         (256 - LINE_RUNS)
+#define ATTR_COUNT            ATTR_RUN_BASE
+#define ATTR_TRUECOLOR        0xFF  // from current_attr(): use a line run slot
+
+struct cell { uint8_t ch; uint8_t attr; };
+struct attr_colors { uint32_t fg; uint32_t bg; };
+struct line_header {
+    uint32_t runs;                          // run slots in use
+    struct attr_colors run[LINE_RUNS];      // colors of ATTR_RUN_BASE + slot cells
+};
+
+static struct attr_colors g_attrs[ATTR_COUNT];
+static uint32_t g_attr_count = 0;
+static uint32_t g_last_fg = 0, g_last_bg = 0;  // colors of g_last_attr
+static uint8_t g_last_attr = ATTR_TRUECOLOR;
+static bool g_last_valid = false;
 
-struct cell { char ch; uint32_t fg; uint32_t bg; };
-static struct cell g_buffer[SCROLLBACK_LINES][MAX_COLS];
+#define LINE_BYTES(cols) (sizeof(struct line_header) + (size_t)(cols) * sizeof(struct cell))
+
+static uint8_t g_boot_lines[BOOT_SCROLLBACK_LINES * LINE_BYTES(MAX_COLS)];
+static uint8_t *g_lines = g_boot_lines;
+static size_t g_line_stride = LINE_BYTES(MAX_COLS);
+static uint32_t g_line_cols = MAX_COLS;                   // cells each line has room for
+static uint32_t g_scrollback_lines = BOOT_SCROLLBACK_LINES;
+static uint32_t g_requested_lines = 0;                    // heap scrollback size (0 = boot buffer)
 
 static uint32_t g_cols = 0;               // columns in the visible area
 static uint32_t g_rows = 0;               // rows in the visible area
-static uint32_t g_head = 0;               // logical line 0 -> g_buffer[g_head]
+static uint32_t g_head = 0;               // logical line 0 -> line g_head
 static uint32_t g_line_count = 0;         // number of valid lines in buffer
 static uint32_t g_view_offset = 0;        // how many lines up from the newest view is
 static uint32_t g_cursor_col = 0;         // cursor column within the newest line
 
+// Deferred rendering -----------------------------------------------------
+// In deferred mode text only goes into the scrollback and the changed lines
+// are noted. render_pending() brings the screen up to date; it runs from the
+// timer tick (at most CONSOLE_MAX_FPS times a second) and whenever input is
+// read, so output-heavy commands run at memory speed. Lines are tracked by
+// absolute number because logical numbers shift when the scrollback wraps.
+#define LINE_NONE UINT64_MAX
+
+static bool g_deferred = false;
+static bool g_full_redraw = false;         // layout changed, redraw everything
+static uint64_t g_line_base = 0;           // lines dropped off the top of the scrollback
+static uint64_t g_rendered_start = 0;      // absolute first line on screen at the last render
+static uint64_t g_dirty_from = LINE_NONE;  // lowest absolute line changed since then
+static uint32_t g_frame_ticks = 1;         // timer ticks per frame
+static uint32_t g_tick_count = 0;
+static spinlock_t g_lock;                  // held by the thread inside the console
+static volatile uintptr_t g_owner = 0;     // owner_token() of the holder, 0 if none
+static volatile uint32_t g_busy = 0;       // nesting depth of the owner's calls
+static volatile bool g_frame_due = false;  // a tick found the console busy, or woke kconsole
+static wait_queue_t g_render_wq;           // kconsole waits here for g_frame_due
+static volatile bool g_render_thread = false;
+static console_sink_t g_capture_sink = NULL;   // takes g_capture_thread's output
+static thread_t *volatile g_capture_thread = NULL;
+
+static inline void note_line_dirty(uint32_t logical) {
+    uint64_t line = g_line_base + logical;
+    if (line < g_dirty_from) g_dirty_from = line;
+}
+
 static inline uint32_t wrap_line(uint32_t logical) {
-    return (g_head + logical) % SCROLLBACK_LINES;
+    return (g_head + logical) % g_scrollback_lines;
+}
+
+static inline struct line_header *line_header(uint32_t idx) {
+    return (struct line_header *)(g_lines + (size_t)idx * g_line_stride);
+}
+
+static inline struct cell *line_cells(uint32_t idx) {
+    return (struct cell *)(line_header(idx) + 1);
+}
+
+// Attribute index for the current colors, interning new pairs
+static uint8_t current_attr(void) {
+    if (g_last_valid && g_last_fg == fg_color && g_last_bg == bg_color) {
+        return g_last_attr;
+    }
+
+    uint8_t attr = ATTR_TRUECOLOR;
+    for (uint32_t i = 0; i < g_attr_count; i++) {
+        if (g_attrs[i].fg == fg_color && g_attrs[i].bg == bg_color) {
+            attr = (uint8_t)i;
+            break;
+        }
+    }
+    if (attr == ATTR_TRUECOLOR && g_attr_count < ATTR_COUNT) {
+        attr = (uint8_t)g_attr_count++;
+        g_attrs[attr].fg = fg_color;
+        g_attrs[attr].bg = bg_color;
+    }
+
+    g_last_fg = fg_color;
+    g_last_bg = bg_color;
+    g_last_attr = attr;
+    g_last_valid = true;
+    return attr;
+}
+
+static uint32_t color_distance(uint32_t a, uint32_t b) {
+    uint32_t d = 0;
+    for (int shift = 0; shift < 24; shift += 8) {
+        int c = (int)((a >> shift) & 0xFF) - (int)((b >> shift) & 0xFF);
+        d += (uint32_t)(c * c);
+    }
+    return d;
+}
+
+static inline uint32_t pair_distance(const struct attr_colors *pair) {
+    return color_distance(pair->fg, fg_color) + color_distance(pair->bg, bg_color);
+}
+
+// Run slot attribute for the current colors on a line, adding a slot if
+// needed. With every slot taken the closest existing pair stands in: a
+// slot other cells already use must keep its colors.
+static uint8_t line_run_attr(struct line_header *header) {
+    for (uint32_t i = 0; i < header->runs; i++) {
+        if (header->run[i].fg == fg_color && header->run[i].bg == bg_color) {
+            return (uint8_t)(ATTR_RUN_BASE + i);
+        }
+    }
+    if (header->runs < LINE_RUNS) {
+        uint32_t slot = header->runs++;
+        header->run[slot].fg = fg_color;
+        header->run[slot].bg = bg_color;
+        return (uint8_t)(ATTR_RUN_BASE + slot);
+    }
+
+    uint8_t best = ATTR_RUN_BASE;
+    uint32_t best_distance = UINT32_MAX;
+    for (uint32_t i = 0; i < LINE_RUNS; i++) {
+        uint32_t d = pair_distance(&header->run[i]);
+        if (d < best_distance) {
+            best = (uint8_t)(ATTR_RUN_BASE + i);
+            best_distance = d;
+        }
+    }
+    for (uint32_t i = 0; i < g_attr_count; i++) {
+        uint32_t d = pair_distance(&g_attrs[i]);
+        if (d < best_distance) {
+            best = (uint8_t)i;
+            best_distance = d;
+        }
+    }
+    return best;
+}
+
+// Store a glyph with the current colors
+static inline void set_cell(uint32_t idx, uint32_t col, char ch, uint8_t attr) {
+    struct cell *cell = &line_cells(idx)[col];
+    cell->ch = (uint8_t)ch;
+    cell->attr = attr == ATTR_TRUECOLOR ? line_run_attr(line_header(idx)) : attr;
+}
+
+static inline void cell_colors(uint32_t idx, const struct cell *cell, uint32_t *fg, uint32_t *bg) {
+    if (cell->attr >= ATTR_RUN_BASE) {
+        *fg = line_header(idx)->run[cell->attr - ATTR_RUN_BASE].fg;
+        *bg = line_header(idx)->run[cell->attr - ATTR_RUN_BASE].bg;
+    } else {
+        *fg = g_attrs[cell->attr].fg;
+        *bg = g_attrs[cell->attr].bg;
+    }
 }
 
 static void clear_line(uint32_t logical_line) {
     uint32_t idx = wrap_line(logical_line);
-    for (uint32_t x = 0; x < g_cols && x < MAX_COLS; x++) {
-        g_buffer[idx][x].ch = ' ';
-        g_buffer[idx][x].fg = fg_color;
-        g_buffer[idx][x].bg = bg_color;
+    uint8_t attr = current_attr();
+    line_header(idx)->runs = 0;
+    for (uint32_t x = 0; x < g_cols && x < g_line_cols; x++) set_cell(idx, x, ' ', attr);
+}
+
+// Move the scrollback to a heap buffer of lines x g_cols, keeping the newest
+// lines. Lines wider than the old buffer come out blank past its width.
+static bool scrollback_realloc(uint32_t lines) {
+    size_t stride = LINE_BYTES(g_cols);
+    uint8_t *buf = (uint8_t *)kmalloc((size_t)lines * stride);
+    if (!buf) return false;
+
+    uint32_t keep = (g_line_count < lines) ? g_line_count : lines;
+    uint32_t first = g_line_count - keep;
+    uint32_t copy_cols = (g_cols < g_line_cols) ? g_cols : g_line_cols;
+    uint8_t attr = current_attr();
+    for (uint32_t i = 0; i < keep; i++) {
+        uint8_t *dst = buf + (size_t)i * stride;
+        memcpy(dst, line_header(wrap_line(first + i)), LINE_BYTES(copy_cols));
+        struct line_header *header = (struct line_header *)dst;
+        struct cell blank = { ' ', attr == ATTR_TRUECOLOR ? line_run_attr(header) : attr };
+        struct cell *cells = (struct cell *)(header + 1);
+        for (uint32_t x = copy_cols; x < g_cols; x++) cells[x] = blank;
     }
+
+    if (g_lines != g_boot_lines) kfree(g_lines);
+    g_lines = buf;
+    g_line_stride = stride;
+    g_line_cols = g_cols;
+    g_scrollback_lines = lines;
+    g_head = 0;
+    g_line_count = keep;
+    g_line_base += first;
+    g_full_redraw = true;
+    return true;
+}
+
+// Fall back to the static buffer, which fits any column count
+static void scrollback_use_boot(void) {
+    if (g_lines != g_boot_lines) kfree(g_lines);
+    g_lines = g_boot_lines;
+    g_line_stride = LINE_BYTES(MAX_COLS);
+    g_line_cols = MAX_COLS;
+    g_scrollback_lines = BOOT_SCROLLBACK_LINES;
+    g_requested_lines = 0;
+}
+
+bool console_set_scrollback_lines(uint32_t lines) {
+    if (lines < g_rows) lines = g_rows;
+    console_lock();
+    bool ok = scrollback_realloc(lines);
+    if (ok) g_requested_lines = lines;
+    console_unlock();
+    return ok;
 }
 
 static void reset_scrollback(void) {
@@ -170,6 +410,8 @@ static void reset_scrollback(void) {
     g_line_count = 1;
     g_view_offset = 0;
     g_cursor_col = 0;
+    g_line_base = 0;
+    g_full_redraw = true;
     clear_line(0);
 }
 
@@ -198,7 +440,117 @@ static uint32_t view_start_line(void) {
     return g_line_count - g_rows - g_view_offset;
 }
 
+// Back buffer ------------------------------------------------------------
+static inline uint32_t *shadow_row(uint32_t y) {
+    uint32_t row = g_shadow_top + y;
+    if (row >= g_text_h_px) row -= g_text_h_px;
+    return g_shadow + (size_t)row * g_shadow_stride;
+}
+
+// Mark pixels [x0, x1) of the text row containing pixel row y as dirty
+static void mark_dirty(uint32_t y, uint32_t x0, uint32_t x1) {
+    uint32_t row = y / CELL_H();
+    if (row >= MAX_DIRTY_ROWS) return;
+    if (g_dirty_x1[row] == 0) {
+        g_dirty_x0[row] = x0;
+        g_dirty_x1[row] = x1;
+    } else {
+        if (x0 < g_dirty_x0[row]) g_dirty_x0[row] = x0;
+        if (x1 > g_dirty_x1[row]) g_dirty_x1[row] = x1;
+    }
+    g_dirty = true;
+}
+
+static void mark_all_dirty(void) {
+    for (uint32_t row = 0; row < g_rows && row < MAX_DIRTY_ROWS; row++) {
+        g_dirty_x0[row] = 0;
+        g_dirty_x1[row] = g_text_w_px;
+    }
+    g_dirty = true;
+}
+
+// Copy to video memory with non-temporal stores: the CPU never reads the
+// framebuffer back and the pixels don't evict useful cache lines
+static inline void stream_copy(void *dst, const void *src, size_t bytes) {
+    uint64_t *d = (uint64_t *)dst;
+    const uint64_t *s = (const uint64_t *)src;
+    for (size_t n = bytes / 8; n; n--) {
+        asm volatile ("movnti %1, %0" : "=m"(*d) : "r"(*s));
+        d++; s++;
+    }
+    if (bytes & 4) {
+        asm volatile ("movnti %1, %0" : "=m"(*(uint32_t *)d) : "r"(*(const uint32_t *)s));
+    }
+}
+
+// Push every dirty span of the back buffer to all outputs
+static void flush_dirty(void) {
+    if (!g_shadow || !g_dirty) return;
+
+    uint32_t cell_h = CELL_H();
+    for (uint32_t row = 0; row < g_rows && row < MAX_DIRTY_ROWS; row++) {
+        uint32_t x0 = g_dirty_x0[row];
+        uint32_t x1 = g_dirty_x1[row];
+        if (x1 == 0) continue;
+        g_dirty_x1[row] = 0;
+
+        size_t bytes = (size_t)(x1 - x0) * 4;
+        for (uint32_t y = row * cell_h; y < (row + 1) * cell_h; y++) {
+            const uint32_t *src = shadow_row(y) + x0;
+            for (uint32_t i = 0; i < g_fb_count; i++) {
+                struct limine_framebuffer *out = g_fbs[i];
+                uint8_t *dst = (uint8_t *)(uintptr_t)out->address + (size_t)y * out->pitch + (size_t)x0 * 4;
+                stream_copy(dst, src, bytes);
+                KSTAT_ADD(CONSOLE_FLUSH_BYTES, bytes);
+            }
+        }
+    }
+    asm volatile ("sfence" ::: "memory");
+    g_dirty = false;
+}
+
+bool console_enable_backbuffer(void) {
+    if (g_shadow) return true;
+    if (g_deferred) return false; // Only switched on during early boot
+    if (g_bounds_h_px / GLYPH_H > MAX_DIRTY_ROWS) return false;
+
+    size_t bytes = (size_t)g_bounds_w_px * g_bounds_h_px * 4;
+    size_t pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+    void *phys = pmm_alloc_pages(pages);
+    if (!phys) return false;
+
+    g_shadow = (uint32_t *)hhdm_phys_to_virt((uint64_t)phys);
+    g_shadow_stride = g_bounds_w_px;
+    g_shadow_top = 0;
+
+    // Rebuild the screen in the back buffer; the outputs already show it
+    for (uint32_t y = 0; y < g_text_h_px; y++) fill_row_span((uint8_t *)shadow_row(y), g_text_w_px, bg_color);
+    render_visible();
+    flush_dirty();
+    return true;
+}
+
+uint32_t console_map_write_combining(void) {
+    // Don't depend on the type the bootloader picked: pixel stores should
+    // merge into bursts instead of going out one uncached write at a time
+    page_table_t *pt = vmm_get_kernel_page_table();
+    uint32_t mapped = 0;
+    for (uint32_t i = 0; i < g_fb_count; i++) {
+        struct limine_framebuffer *out = g_fbs[i];
+        size_t bytes = (size_t)out->pitch * out->height;
+        if (vmm_set_memory_type(pt, (uint64_t)(uintptr_t)out->address, bytes, PAGE_WRITE_COMBINING)) mapped++;
+    }
+    return mapped;
+}
+
 static void clear_outputs(void) {
+    if (g_shadow) {
+        g_shadow_top = 0;
+        for (uint32_t y = 0; y < g_text_h_px; y++) fill_row_span((uint8_t *)shadow_row(y), g_text_w_px, bg_color);
+        for (uint32_t row = 0; row < MAX_DIRTY_ROWS; row++) g_dirty_x1[row] = 0;
+        g_dirty = false;
+    }
+
     for (uint32_t i = 0; i < g_fb_count; i++) {
         struct limine_framebuffer *out = g_fbs[i];
         uint8_t *base = (uint8_t *)(uintptr_t)out->address;
@@ -210,20 +562,181 @@ static void clear_outputs(void) {
     }
 }
 
+// Glyph cache ------------------------------------------------------------
+// Fully rendered 32-bpp cells keyed by (glyph, fg, bg, scale). Drawing a cached
+// cell is one row copy per pixel row. Slots are carved out of a fixed pixel
+// budget, so larger scales get fewer of them; least recently used cells are
+// evicted first.
+
+#define GLYPH_CACHE_BYTES   (256 * 1024)
+#define GLYPH_CACHE_ENTRIES 512
+#define GLYPH_CACHE_BUCKETS 256 // power of two
+#define GLYPH_NONE          0xFFFF
+
+struct glyph_entry {
+    uint32_t fg;
+    uint32_t bg;
+    uint8_t  glyph;
+    uint8_t  scale;
+    uint16_t hash_next;  // next entry in the same bucket
+    uint16_t lru_prev;   // towards more recently used
+    uint16_t lru_next;   // towards less recently used
+};
+
+static struct glyph_entry g_glyphs[GLYPH_CACHE_ENTRIES];
+static uint16_t g_glyph_buckets[GLYPH_CACHE_BUCKETS];
+static uint16_t g_lru_head = GLYPH_NONE;  // most recently used
+static uint16_t g_lru_tail = GLYPH_NONE;  // next to evict
+static uint32_t g_glyph_slots = 0;        // entries that fit the budget at this scale
+static uint32_t g_glyph_used = 0;         // entries handed out so far
+static uint32_t g_glyph_pixels[GLYPH_CACHE_BYTES / 4];
+
+// Drop every cached cell and size the slots for the current scale
+static void glyph_cache_reset(void) {
+    for (uint32_t i = 0; i < GLYPH_CACHE_BUCKETS; i++) g_glyph_buckets[i] = GLYPH_NONE;
+    g_lru_head = GLYPH_NONE;
+    g_lru_tail = GLYPH_NONE;
+    g_glyph_used = 0;
+
+    uint32_t cell_bytes = CELL_W() * CELL_H() * 4;
+    g_glyph_slots = GLYPH_CACHE_BYTES / cell_bytes;
+    if (g_glyph_slots > GLYPH_CACHE_ENTRIES) g_glyph_slots = GLYPH_CACHE_ENTRIES;
+}
+
+static inline uint32_t glyph_hash(uint8_t glyph, uint32_t fg, uint32_t bg) {
+    uint32_t h = glyph * 0x9E3779B1u;
+    h ^= fg * 0x85EBCA6Bu;
+    h ^= bg * 0xC2B2AE35u;
+    h ^= h >> 15;
+    return h & (GLYPH_CACHE_BUCKETS - 1);
+}
+
+static inline uint32_t *glyph_slot_pixels(uint16_t idx) {
+    return g_glyph_pixels + (size_t)idx * CELL_W() * CELL_H();
+}
+
+static void lru_unlink(uint16_t idx) {
+    struct glyph_entry *e = &g_glyphs[idx];
+    if (e->lru_prev != GLYPH_NONE) g_glyphs[e->lru_prev].lru_next = e->lru_next;
+    else g_lru_head = e->lru_next;
+    if (e->lru_next != GLYPH_NONE) g_glyphs[e->lru_next].lru_prev = e->lru_prev;
+    else g_lru_tail = e->lru_prev;
+}
+
+static void lru_push_front(uint16_t idx) {
+    struct glyph_entry *e = &g_glyphs[idx];
+    e->lru_prev = GLYPH_NONE;
+    e->lru_next = g_lru_head;
+    if (g_lru_head != GLYPH_NONE) g_glyphs[g_lru_head].lru_prev = idx;
+    g_lru_head = idx;
+    if (g_lru_tail == GLYPH_NONE) g_lru_tail = idx;
+}
+
+// Take the least recently used entry out of its bucket and the LRU list
+static uint16_t glyph_evict(void) {
+    uint16_t idx = g_lru_tail;
+    struct glyph_entry *e = &g_glyphs[idx];
+
+    uint16_t *link = &g_glyph_buckets[glyph_hash(e->glyph, e->fg, e->bg)];
+    while (*link != idx) link = &g_glyphs[*link].hash_next;
+    *link = e->hash_next;
+
+    lru_unlink(idx);
+    return idx;
+}
+
+// Expand a font glyph into a full cell of fg/bg pixels
+static void glyph_render(uint32_t *pixels, uint8_t glyph, uint32_t fg, uint32_t bg) {
+    const uint8_t *bitmap = font8x16_tandy2k[glyph];
+    uint32_t cell_w = CELL_W();
+
+    for (uint32_t src_row = 0; src_row < GLYPH_H; src_row++) {
+        uint32_t *row = pixels + (size_t)src_row * g_scale * cell_w;
+        uint8_t bits = bitmap[src_row];
+        for (uint32_t src_col = 0; src_col < GLYPH_W; src_col++) {
+            uint32_t color = (bits & 1) ? fg : bg;
+            for (uint32_t dx = 0; dx < g_scale; dx++) row[src_col * g_scale + dx] = color;
+            bits >>= 1;
+        }
+        // Vertical scaling repeats the first pixel row
+        for (uint32_t dy = 1; dy < g_scale; dy++) {
+            memcpy(row + (size_t)dy * cell_w, row, (size_t)cell_w * 4);
+        }
+    }
+}
+
+// Rendered pixels for a cell, or NULL if a cell doesn't fit the budget
+static const uint32_t *glyph_cache_get(uint8_t glyph, uint32_t fg, uint32_t bg) {
+    if (g_glyph_slots == 0) return NULL;
+
+    uint32_t bucket = glyph_hash(glyph, fg, bg);
+    for (uint16_t idx = g_glyph_buckets[bucket]; idx != GLYPH_NONE; idx = g_glyphs[idx].hash_next) {
+        struct glyph_entry *e = &g_glyphs[idx];
+        if (e->glyph == glyph && e->fg == fg && e->bg == bg && e->scale == g_scale) {
+            if (g_lru_head != idx) {
+                lru_unlink(idx);
+                lru_push_front(idx);
+            }
+            return glyph_slot_pixels(idx);
+        }
+    }
+
+    uint16_t idx = (g_glyph_used < g_glyph_slots) ? (uint16_t)g_glyph_used++ : glyph_evict();
+    struct glyph_entry *e = &g_glyphs[idx];
+    e->glyph = glyph;
+    e->fg = fg;
+    e->bg = bg;
+    e->scale = (uint8_t)g_scale;
+    e->hash_next = g_glyph_buckets[bucket];
+    g_glyph_buckets[bucket] = idx;
+    lru_push_front(idx);
+
+    uint32_t *pixels = glyph_slot_pixels(idx);
+    glyph_render(pixels, glyph, fg, bg);
+    return pixels;
+}
+
 // Font blitting ----------------------------------------------------------
-static void draw_char_scaled(uint32_t x, uint32_t y, char c, uint32_t fg, uint32_t bg) {
-    const uint8_t *glyph = font8x16_tandy2k[(uint8_t)c];
+// A cell is drawn once into the back buffer, or into every output that can
+// hold it when there is no back buffer. Cells never straddle the point where
+// the back buffer rows wrap, so each target is a plain base + pitch.
+struct draw_target {
+    uint8_t *base;
+    size_t pitch;
+};
+
+static uint32_t cell_targets(uint32_t x, uint32_t y, struct draw_target *targets) {
+    if (g_shadow) {
+        targets[0].base = (uint8_t *)(shadow_row(y) + x);
+        targets[0].pitch = (size_t)g_shadow_stride * 4;
+        mark_dirty(y, x, x + CELL_W());
+        return 1;
+    }
 
+    uint32_t count = 0;
     for (uint32_t i = 0; i < g_fb_count; i++) {
         struct limine_framebuffer *out = g_fbs[i];
         if (x + CELL_W() > out->width || y + CELL_H() > out->height) continue;
 
-        uint8_t  *base   = (uint8_t *)(uintptr_t)out->address;
-        size_t    pitch  = (size_t)out->pitch;
+        targets[count].base = (uint8_t *)(uintptr_t)out->address + (size_t)y * out->pitch + (size_t)x * 4;
+        targets[count].pitch = (size_t)out->pitch;
+        count++;
+    }
+    return count;
+}
+
+static void draw_char_uncached(uint32_t x, uint32_t y, char c, uint32_t fg, uint32_t bg) {
+    const uint8_t *glyph = font8x16_tandy2k[(uint8_t)c];
+    struct draw_target targets[MAX_OUTPUTS];
+    uint32_t count = cell_targets(x, y, targets);
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t  *base   = targets[i].base;
+        size_t    pitch  = targets[i].pitch;
 
         // Fill glyph background box
         for (uint32_t ry = 0; ry < CELL_H(); ry++) {
-            uint8_t *row = base + (size_t)(y + ry) * pitch + (size_t)x * 4;
+            uint8_t *row = base + (size_t)ry * pitch;
             fill_row_span(row, CELL_W(), bg);
         }
 
@@ -234,8 +747,8 @@ static void draw_char_scaled(uint32_t x, uint32_t y, char c, uint32_t fg, uint32
                 if (bits & 1) {
                     for (uint32_t dy = 0; dy < g_scale; dy++) {
                         uint8_t *row = base
-                                     + (size_t)(y + (uint32_t)src_row * g_scale + dy) * pitch
-                                     + (size_t)(x + (uint32_t)src_col * g_scale) * 4;
+                                     + (size_t)((uint32_t)src_row * g_scale + dy) * pitch
+                                     + (size_t)((uint32_t)src_col * g_scale) * 4;
                         uint32_t *p = (uint32_t *)row;
                         for (uint32_t dx = 0; dx < g_scale; dx++) p[dx] = fg;
                     }
@@ -246,20 +759,48 @@ static void draw_char_scaled(uint32_t x, uint32_t y, char c, uint32_t fg, uint32
     }
 }
 
-static void draw_cell(uint32_t view_row, uint32_t col, const struct cell *c) {
-    draw_char_scaled(col * CELL_W(), view_row * CELL_H(), c->ch, c->fg, c->bg);
+static void draw_char_scaled(uint32_t x, uint32_t y, char c, uint32_t fg, uint32_t bg) {
+    KSTAT_INC(CONSOLE_CELLS);
+    const uint32_t *pixels = glyph_cache_get((uint8_t)c, fg, bg);
+    if (!pixels) {
+        KSTAT_INC(CONSOLE_GLYPH_MISS);
+        draw_char_uncached(x, y, c, fg, bg);
+        return;
+    }
+
+    uint32_t cell_w = CELL_W();
+    uint32_t cell_h = CELL_H();
+    size_t row_bytes = (size_t)cell_w * 4;
+    struct draw_target targets[MAX_OUTPUTS];
+    uint32_t count = cell_targets(x, y, targets);
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t *dst = targets[i].base;
+        const uint32_t *src = pixels;
+        for (uint32_t ry = 0; ry < cell_h; ry++) {
+            memcpy(dst, src, row_bytes);
+            dst += targets[i].pitch;
+            src += cell_w;
+        }
+    }
+}
+
+// Draw the cell stored at column col of line idx
+static void draw_cell(uint32_t view_row, uint32_t col, uint32_t idx) {
+    const struct cell *cell = &line_cells(idx)[col];
+    uint32_t fg, bg;
+    cell_colors(idx, cell, &fg, &bg);
+    draw_char_scaled(col * CELL_W(), view_row * CELL_H(), (char)cell->ch, fg, bg);
 }
 
 static void draw_blank_cell(uint32_t view_row, uint32_t col) {
-    struct cell blank = { ' ', fg_color, bg_color };
-    draw_cell(view_row, col, &blank);
+    draw_char_scaled(col * CELL_W(), view_row * CELL_H(), ' ', fg_color, bg_color);
 }
 
 static void render_line_to_row(uint32_t logical_line, uint32_t view_row) {
     uint32_t idx = wrap_line(logical_line);
-    const struct cell *line = g_buffer[idx];
     for (uint32_t col = 0; col < g_cols; col++) {
-        draw_cell(view_row, col, &line[col]);
+        draw_cell(view_row, col, idx);
     }
 }
 
@@ -273,11 +814,27 @@ static void render_visible(void) {
             for (uint32_t col = 0; col < g_cols; col++) draw_blank_cell(row, col);
         }
     }
+
+    g_rendered_start = g_line_base + start;
+    g_dirty_from = LINE_NONE;
+    g_full_redraw = false;
 }
 
 static void scroll_view_up_one(void) {
     const uint32_t step = CELL_H();
     if (step == 0 || g_text_h_px < step) return;
+    KSTAT_INC(CONSOLE_SCROLLS);
+
+    if (g_shadow) {
+        // The old top text row becomes the new bottom one
+        g_shadow_top += step;
+        if (g_shadow_top >= g_text_h_px) g_shadow_top -= g_text_h_px;
+        for (uint32_t y = g_text_h_px - step; y < g_text_h_px; y++) {
+            fill_row_span((uint8_t *)shadow_row(y), g_text_w_px, bg_color);
+        }
+        mark_all_dirty();
+        return;
+    }
 
     for (uint32_t i = 0; i < g_fb_count; i++) {
         struct limine_framebuffer *out = g_fbs[i];
@@ -288,6 +845,7 @@ static void scroll_view_up_one(void) {
             uint8_t *dest = base + (size_t)y * pitch;
             uint8_t *src  = dest + (size_t)step * pitch;
             memmove(dest, src, (size_t)g_text_w_px * 4);
+            KSTAT_ADD(CONSOLE_SCROLL_BYTES, (size_t)g_text_w_px * 4);
         }
 
         for (uint32_t y = g_text_h_px - step; y < g_text_h_px; y++) {
@@ -298,16 +856,25 @@ static void scroll_view_up_one(void) {
 }
 
 static void new_line(void) {
-    if (g_line_count < SCROLLBACK_LINES) {
+    if (g_line_count < g_scrollback_lines) {
         clear_line(g_line_count);
         g_line_count++;
     } else {
-        g_head = (g_head + 1) % SCROLLBACK_LINES;
+        g_head = (g_head + 1) % g_scrollback_lines;
+        g_line_base++;
         clear_line(g_line_count - 1);
     }
 
     g_cursor_col = 0;
 
+    if (g_deferred) {
+        // Keep a scrolled-back view on the same lines while output arrives
+        if (g_view_offset > 0 && g_line_count > g_rows) g_view_offset++;
+        note_line_dirty(g_line_count - 1);
+        (void)view_start_line();
+        return;
+    }
+
     if (g_view_offset == 0) {
         if (g_line_count > g_rows) {
             scroll_view_up_one();
@@ -320,23 +887,193 @@ static void new_line(void) {
     }
 }
 
+// Bring the screen up to date with the scrollback after deferred updates
+static void render_pending(void) {
+    uint32_t start = view_start_line();
+    uint64_t start_abs = g_line_base + start;
+    if (!g_full_redraw && start_abs == g_rendered_start && g_dirty_from == LINE_NONE) return;
+
+    // Without a back buffer, or after a jump, just redraw the whole view
+    if (g_full_redraw || start_abs < g_rendered_start || start_abs - g_rendered_start >= g_rows ||
+        (!g_shadow && start_abs != g_rendered_start)) {
+        render_visible();
+        return;
+    }
+
+    // Scrolled forward by less than a screen: rotate the back buffer rows
+    uint32_t delta = (uint32_t)(start_abs - g_rendered_start);
+    if (delta > 0) {
+        g_shadow_top = (g_shadow_top + delta * CELL_H()) % g_text_h_px;
+        mark_all_dirty();
+    }
+
+    // Redraw lines that changed or weren't on screen before
+    uint64_t redraw_from = g_rendered_start + g_rows;
+    if (g_dirty_from < redraw_from) redraw_from = g_dirty_from;
+    if (redraw_from < start_abs) redraw_from = start_abs;
+
+    for (uint32_t row = (uint32_t)(redraw_from - start_abs); row < g_rows; row++) {
+        uint32_t logical = start + row;
+        if (logical < g_line_count) {
+            render_line_to_row(logical, row);
+        } else {
+            for (uint32_t col = 0; col < g_cols; col++) draw_blank_cell(row, col);
+        }
+    }
+
+    g_rendered_start = start_abs;
+    g_dirty_from = LINE_NONE;
+}
+
+// Public entry points hold the console so other CPUs wait and a timer tick
+// never renders in the middle of an update; a frame that came due meanwhile
+// is drawn on exit. Entry points call each other, so the owner may re-enter.
+// Interrupts stay enabled: IRQ-time callers use console_trylock() instead.
+//
+// The owner is the running thread, or the CPU before it has a scheduler: a
+// preempted holder must not let the next thread on its CPU in, and a thread
+// that moved to another CPU must still be let back in.
+static inline uintptr_t owner_token(void) {
+    thread_t *thread = sched_current();
+    return thread ? (uintptr_t)thread : (uintptr_t)this_cpu();
+}
+
+static void console_lock(void) {
+    uintptr_t token = owner_token();
+    if (g_owner != token) {
+        spin_lock(&g_lock);
+        g_owner = token;
+    }
+    g_busy++;
+}
+
+static void console_unlock(void) {
+    if (g_busy == 1 && g_frame_due) {
+        g_frame_due = false;
+        render_pending();
+        flush_dirty();
+    }
+    if (--g_busy == 0) {
+        g_owner = 0;
+        spin_unlock(&g_lock);
+    }
+}
+
+// Never waits and never nests, so it is safe from an interrupt handler
+static bool console_trylock(void) {
+    uintptr_t token = owner_token();
+    if (g_owner == token || !spin_trylock(&g_lock)) return false;
+    g_owner = token;
+    g_busy = 1;
+    return true;
+}
+
+// Only the capturing thread is redirected; log records and other threads
+// keep drawing
+static inline bool captured(void) {
+    return g_capture_thread && g_capture_thread == sched_current();
+}
+
+void console_capture(console_sink_t sink) {
+    g_capture_sink = sink;
+    g_capture_thread = sink ? sched_current() : NULL;
+}
+
+bool console_is_captured(void) {
+    return captured();
+}
+
+bool console_is_busy(void) {
+    return spin_is_locked(&g_lock);
+}
+
+void console_flush(void) {
+    if (!g_deferred) return;
+    console_lock();
+    render_pending();
+    flush_dirty();
+    console_unlock();
+}
+
+void console_set_deferred(bool enable, uint32_t tick_hz) {
+    console_lock();
+    if (tick_hz == 0) tick_hz = CONSOLE_MAX_FPS;
+    g_frame_ticks = (tick_hz + CONSOLE_MAX_FPS - 1) / CONSOLE_MAX_FPS;
+    g_tick_count = 0;
+    g_frame_due = false;
+
+    // Either way the screen starts out matching the scrollback
+    g_deferred = enable;
+    render_visible();
+    flush_dirty();
+    console_unlock();
+}
+
+void console_timer_tick(void) {
+    if (!g_deferred) return;
+    if (++g_tick_count < g_frame_ticks) return;
+    g_tick_count = 0;
+
+    if (g_render_thread) {
+        g_frame_due = true;
+        wait_queue_wake_all(&g_render_wq);
+        return;
+    }
+    if (!console_trylock()) {
+        g_frame_due = true;
+        return;
+    }
+    render_pending();
+    flush_dirty();
+    g_busy = 0;
+    g_owner = 0;
+    spin_unlock(&g_lock);
+}
+
+static bool frame_due(void *arg) {
+    (void)arg;
+    return g_frame_due;
+}
+
+// Draws frames in thread context, so a long redraw never stretches an IRQ
+void console_render_thread(void *arg) {
+    (void)arg;
+    g_render_thread = true;
+    for (;;) {
+        wait_queue_wait(&g_render_wq, frame_due, NULL);
+        console_lock();
+        if (g_frame_due) {
+            g_frame_due = false;
+            render_pending();
+            flush_dirty();
+        }
+        console_unlock();
+    }
+}
+
 void console_page_up(void) {
     uint32_t max_off = max_view_offset();
     if (max_off == 0) return;
 
+    console_lock();
     uint32_t step = (g_rows > 1) ? (g_rows - 1) : 1;
     if (g_view_offset + step > max_off) step = max_off - g_view_offset;
     g_view_offset += step;
     render_visible();
+    flush_dirty();
+    console_unlock();
 }
 
 void console_page_down(void) {
     if (g_view_offset == 0) return;
 
+    console_lock();
     uint32_t step = (g_rows > 1) ? (g_rows - 1) : 1;
     if (step > g_view_offset) step = g_view_offset;
     g_view_offset -= step;
     render_visible();
+    flush_dirty();
+    console_unlock();
 }
 
 // Public: allow shell to change scale
@@ -345,38 +1082,69 @@ void console_set_scale(uint32_t new_scale) {
     if (new_scale > 16) new_scale = 9;
     if (new_scale == g_scale) return;
 
+    console_lock();
     g_scale = new_scale;
 
     update_layout_from_bounds();
+    // The scrollback is cleared below; resize it for the new column count
+    if (g_requested_lines != 0 && !scrollback_realloc(g_requested_lines) && g_cols > g_line_cols) {
+        scrollback_use_boot();
+    }
+    glyph_cache_reset();
     clear_outputs();
     reset_scrollback();
     render_visible();
+    flush_dirty();
+    console_unlock();
 }
 
-void console_reset_scrollback(void) { reset_scrollback(); }
+void console_reset_scrollback(void) {
+    console_lock();
+    reset_scrollback();
+    console_unlock();
+}
 
-void console_clear_outputs(void) { clear_outputs(); }
+void console_clear_outputs(void) {
+    console_lock();
+    clear_outputs();
+    console_unlock();
+}
 
-void console_render_visible(void) { render_visible(); }
+void console_render_visible(void) {
+    console_lock();
+    render_visible();
+    flush_dirty();
+    console_unlock();
+}
 
 void console_clear(void) {
+    if (captured()) return;
+    console_lock();
     reset_scrollback();
     clear_outputs();
     render_visible();
+    flush_dirty();
+    console_unlock();
 }
 
 // --- Required exports (same names as your existing code) ---
 
 void scroll_up(struct limine_framebuffer *fb /*unused*/) {
     (void)fb;
+    console_lock();
     new_line();
+    flush_dirty();
+    console_unlock();
 }
 
 void draw_char(struct limine_framebuffer *fb /*unused*/,
                uint32_t x, uint32_t y,
                char c, uint32_t fg, uint32_t bg) {
     (void)fb;
+    console_lock();
     draw_char_scaled(x, y, c, fg, bg);
+    flush_dirty();
+    console_unlock();
 }
 
 // ANSI escape parsing state for simple color control
@@ -418,10 +1186,8 @@ static void apply_sgr_params(void) {
     }
 }
 
-// Draw char at cursor (advances cursor) — mirrored to all outputs
-void putc_fb(struct limine_framebuffer *fb /*unused*/, char c) {
-    (void)fb;
-
+// Put a char at the cursor (advances cursor) without flushing
+static void put_char(char c) {
     if (ansi_state == ANSI_ESC) {
         if (c == '[') {
             ansi_state = ANSI_CSI;
@@ -456,12 +1222,12 @@ void putc_fb(struct limine_framebuffer *fb /*unused*/, char c) {
         if (g_cursor_col > 0) {
             g_cursor_col--;
             uint32_t logical_line = g_line_count - 1;
-            g_buffer[wrap_line(logical_line)][g_cursor_col].ch = ' ';
-            g_buffer[wrap_line(logical_line)][g_cursor_col].fg = fg_color;
-            g_buffer[wrap_line(logical_line)][g_cursor_col].bg = bg_color;
+            set_cell(wrap_line(logical_line), g_cursor_col, ' ', current_attr());
 
             uint32_t start = view_start_line();
-            if (g_view_offset <= max_view_offset() && logical_line >= start && logical_line < start + g_rows) {
+            if (g_deferred) {
+                note_line_dirty(logical_line);
+            } else if (g_view_offset <= max_view_offset() && logical_line >= start && logical_line < start + g_rows) {
                 render_line_to_row(logical_line, logical_line - start);
             }
         }
@@ -472,39 +1238,108 @@ void putc_fb(struct limine_framebuffer *fb /*unused*/, char c) {
 
     uint32_t logical_line = g_line_count - 1;
     uint32_t idx = wrap_line(logical_line);
-    g_buffer[idx][g_cursor_col].ch = c;
-    g_buffer[idx][g_cursor_col].fg = fg_color;
-    g_buffer[idx][g_cursor_col].bg = bg_color;
+    set_cell(idx, g_cursor_col, c, current_attr());
 
     uint32_t start = view_start_line();
-    if (logical_line >= start && logical_line < start + g_rows && g_cursor_col < g_cols) {
-        draw_cell(logical_line - start, g_cursor_col, &g_buffer[idx][g_cursor_col]);
+    if (g_deferred) {
+        note_line_dirty(logical_line);
+    } else if (logical_line >= start && logical_line < start + g_rows && g_cursor_col < g_cols) {
+        draw_cell(logical_line - start, g_cursor_col, idx);
     }
 
     g_cursor_col++;
 }
 
+// Plain text never goes through the ANSI state machine
+static inline bool is_plain_char(char c) {
+    return c != '\x1B' && c != '\n' && c != '\b';
+}
+
+// Put a run of plain chars at the cursor, one line segment at a time
+static void put_run(const char *s, size_t len) {
+    while (len > 0) {
+        if (g_cursor_col >= g_cols) new_line();
+
+        uint32_t take = g_cols - g_cursor_col;
+        if (take > len) take = (uint32_t)len;
+
+        uint32_t logical_line = g_line_count - 1;
+        uint32_t idx = wrap_line(logical_line);
+        uint32_t first_col = g_cursor_col;
+        uint8_t attr = current_attr();
+        for (uint32_t i = 0; i < take; i++) set_cell(idx, first_col + i, s[i], attr);
+
+        uint32_t start = view_start_line();
+        if (g_deferred) {
+            note_line_dirty(logical_line);
+        } else if (logical_line >= start && logical_line < start + g_rows) {
+            uint32_t view_row = logical_line - start;
+            for (uint32_t i = 0; i < take; i++) draw_cell(view_row, first_col + i, idx);
+        }
+
+        g_cursor_col += take;
+        s += take;
+        len -= take;
+    }
+}
+
+// Write a buffer: runs of plain text are stored and drawn in bulk, control
+// bytes and escape sequences go through put_char
+void console_write(const char *buf, size_t len) {
+    if (captured()) {
+        g_capture_sink(buf, len);
+        return;
+    }
+    console_lock();
+    size_t i = 0;
+    while (i < len) {
+        if (ansi_state == ANSI_NORMAL && is_plain_char(buf[i])) {
+            size_t end = i + 1;
+            while (end < len && is_plain_char(buf[end])) end++;
+            put_run(buf + i, end - i);
+            i = end;
+            continue;
+        }
+        put_char(buf[i++]);
+    }
+    flush_dirty();
+    console_unlock();
+}
+
+// Draw char at cursor (advances cursor) — mirrored to all outputs
+void putc_fb(struct limine_framebuffer *fb /*unused*/, char c) {
+    (void)fb;
+    if (captured()) {
+        g_capture_sink(&c, 1);
+        return;
+    }
+    console_lock();
+    put_char(c);
+    flush_dirty();
+    console_unlock();
+}
+
 // Draw string at cursor
 void print(struct limine_framebuffer *fb /*unused*/, const char *s) {
     (void)fb;
-    while (*s) putc_fb(NULL, *s++);
+    console_write(s, strlen(s));
 }
 
 // Print a 64-bit hex number (unchanged)
 void print_hex(struct limine_framebuffer *fb, uint64_t num) {
-    print(fb, "0x");
+    (void)fb;
     static const char hex[] = "0123456789ABCDEF";
-    char buf[17]; buf[16] = '\0';
-    for (int i = 15; i >= 0; i--) { buf[i] = hex[num & 0xF]; num >>= 4; }
-    print(fb, buf);
+    char buf[18]; buf[0] = '0'; buf[1] = 'x';
+    for (int i = 17; i >= 2; i--) { buf[i] = hex[num & 0xF]; num >>= 4; }
+    console_write(buf, sizeof(buf));
 }
 
 void print_u64(struct limine_framebuffer *fb, uint64_t v) {
-    char buf[32];
-    int i = 0;
-    if (v == 0) { putc_fb(fb, '0'); return; }
-    while (v > 0) { buf[i++] = '0' + (char)(v % 10); v /= 10; }
-    while (i--) putc_fb(fb, buf[i]);
+    (void)fb;
+    char buf[20];
+    int i = (int)sizeof(buf);
+    do { buf[--i] = '0' + (char)(v % 10); v /= 10; } while (v > 0);
+    console_write(buf + i, sizeof(buf) - (size_t)i);
 }
 
 void print_u32(struct limine_framebuffer *fb, uint32_t v) {
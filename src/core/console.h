@@ -1,10 +1,37 @@
 #ifndef CORE_CONSOLE_H
 #define CORE_CONSOLE_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include "limine.h"
 
 void console_init(void);
+// Switch to a RAM back buffer once physical memory is available
+bool console_enable_backbuffer(void);
+
+// Map every output write-combining once the VMM is up, before the APs start.
+// Returns how many outputs were remapped.
+uint32_t console_map_write_combining(void);
+
+// Scrollback length used once the heap is up
+#define CONSOLE_SCROLLBACK_LINES 1024
+
+// Move the scrollback to the heap with room for this many lines
+bool console_set_scrollback_lines(uint32_t lines);
+
+// Deferred rendering: output only updates the scrollback and the screen is
+// redrawn at most CONSOLE_MAX_FPS times a second from console_timer_tick(),
+// or right away by console_flush() (called when input is read). Once the
+// kconsole thread runs console_render_thread(), the tick only wakes it.
+#define CONSOLE_MAX_FPS 30
+void console_set_deferred(bool enable, uint32_t tick_hz);
+void console_timer_tick(void);
+void console_flush(void);
+void console_render_thread(void *arg);
+
+// True while some thread or CPU is inside a console call (an interrupt must not print)
+bool console_is_busy(void);
 struct limine_framebuffer *console_primary_framebuffer(void);
 
 void console_clear(void);
@@ -19,6 +46,15 @@ void console_page_up(void);
 void console_page_down(void);
 void console_set_scale(uint32_t scale);
 
+// Send everything the calling thread prints to sink instead of the screen
+// (batch mode); NULL restores normal output. Needs a running thread.
+typedef void (*console_sink_t)(const char *buf, size_t len);
+void console_capture(console_sink_t sink);
+
+// Is the calling thread's output going to a capture sink?
+bool console_is_captured(void);
+
+void console_write(const char *buf, size_t len);
 void putc_fb(struct limine_framebuffer *fb, char c);
 void print(struct limine_framebuffer *fb, const char *s);
 void print_hex(struct limine_framebuffer *fb, uint64_t num);
@@ -0,0 +1,129 @@
+#include "core/elf.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arch/x86/syscall.h"
+#include "core/sched.h"
+#include "fs/initramfs.h"
+#include "libc/string.h"
+#include "memory/vma.h"
+#include "memory/vmm.h"
+
+#define ELF_MAGIC       0x464C457Fu  // "\x7f" "ELF", little endian
+#define ELF_CLASS_64    2
+#define ELF_DATA_LSB    1
+#define ELF_TYPE_EXEC   2
+#define ELF_MACHINE_X64 62
+#define ELF_PT_LOAD     1
+#define ELF_PF_X        (1u << 0)
+#define ELF_PF_W        (1u << 1)
+#define ELF_PF_R        (1u << 2)
+
+typedef struct {
+    uint32_t magic;
+    uint8_t class;
+    uint8_t data;
+    uint8_t version;
+    uint8_t abi;
+    uint8_t pad[8];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t version2;
+    uint64_t entry;
+    uint64_t phoff;
+    uint64_t shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+} __attribute__((packed)) elf64_ehdr_t;
+
+typedef struct {
+    uint32_t type;
+    uint32_t flags;
+    uint64_t offset;
+    uint64_t vaddr;
+    uint64_t paddr;
+    uint64_t filesz;
+    uint64_t memsz;
+    uint64_t align;
+} __attribute__((packed)) elf64_phdr_t;
+
+static bool header_ok(const elf64_ehdr_t *eh, size_t size) {
+    if (size < sizeof(*eh) || eh->magic != ELF_MAGIC) return false;
+    if (eh->class != ELF_CLASS_64 || eh->data != ELF_DATA_LSB) return false;
+    if (eh->type != ELF_TYPE_EXEC || eh->machine != ELF_MACHINE_X64) return false;
+    if (eh->phentsize != sizeof(elf64_phdr_t) || eh->phnum == 0) return false;
+    return eh->phoff <= size && (uint64_t)eh->phnum * sizeof(elf64_phdr_t) <= size - eh->phoff;
+}
+
+// One VMA per segment, starting at the page that holds p_vaddr. The file
+// bytes in front of p_vaddr on that page ride along, as with mmap().
+static bool map_segment(page_table_t *pt, const uint8_t *image, size_t size, const elf64_phdr_t *ph) {
+    if (ph->memsz == 0) return true;
+    if (ph->filesz > ph->memsz || ph->offset > size || ph->filesz > size - ph->offset) return false;
+    if (ph->vaddr + ph->memsz < ph->vaddr || ph->vaddr + ph->memsz > VMM_USER_END) return false;
+    if ((ph->vaddr & (PAGE_SIZE - 1)) != (ph->offset & (PAGE_SIZE - 1))) return false;
+
+    uint64_t skew = ph->vaddr & (PAGE_SIZE - 1);
+    uint32_t prot = VMA_USER;
+    if (ph->flags & ELF_PF_R) prot |= VMA_READ;
+    if (ph->flags & ELF_PF_W) prot |= VMA_WRITE;
+    if (ph->flags & ELF_PF_X) prot |= VMA_EXEC;
+    return vma_map(pt, ph->vaddr - skew, ph->memsz + skew, prot,
+                   image + ph->offset - skew, ph->filesz + skew);
+}
+
+bool elf_load(const void *data, size_t size, elf_image_t *image) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    const elf64_ehdr_t *eh = (const elf64_ehdr_t *)data;
+    if (!data || !header_ok(eh, size) || eh->entry >= VMM_USER_END) return false;
+
+    page_table_t *pt = vmm_create_page_table();
+    if (!pt) return false;
+
+    bool ok = true;
+    uint64_t image_end = 0;
+    for (uint16_t i = 0; i < eh->phnum && ok; i++) {
+        elf64_phdr_t ph;
+        memcpy(&ph, bytes + eh->phoff + (uint64_t)i * sizeof(ph), sizeof(ph));
+        if (ph.type != ELF_PT_LOAD) continue;
+        ok = map_segment(pt, bytes, size, &ph);
+        if (ok && ph.vaddr + ph.memsz > image_end) image_end = ph.vaddr + ph.memsz;
+    }
+
+    // The heap starts empty right after the image and grows with brk;
+    // the stack is zero-filled on demand below ELF_STACK_TOP
+    pt->brk_start = PAGE_ALIGN_UP(image_end);
+    pt->brk = pt->brk_start;
+    ok = ok && vma_map(pt, pt->brk_start, 0, VMA_USER | VMA_READ | VMA_WRITE, NULL, 0);
+    ok = ok && vma_map(pt, ELF_STACK_TOP - ELF_STACK_SIZE, ELF_STACK_SIZE,
+                       VMA_USER | VMA_READ | VMA_WRITE, NULL, 0);
+    if (!ok) {
+        vma_destroy_all(pt);
+        vmm_destroy_page_table(pt);
+        return false;
+    }
+
+    image->pt = pt;
+    image->entry = eh->entry;
+    return true;
+}
+
+// The stack's first page is zero when faulted in, which is all the SysV
+// start-up block needs for argc = 0 and empty argv, envp and auxv
+static void user_thread(void *arg) {
+    syscall_enter_user((uint64_t)arg, ELF_STACK_TOP - 64);
+}
+
+thread_t *elf_spawn(const char *path) {
+    const initramfs_file_t *file = initramfs_open(path);
+    if (!file || file->dir) return NULL;
+
+    elf_image_t image;
+    if (!elf_load(initramfs_map(file, 0, file->size), file->size, &image)) return NULL;
+    return thread_create_in(file->path, image.pt, user_thread, (void *)image.entry);
+}
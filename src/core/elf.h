@@ -0,0 +1,32 @@
+#ifndef CORE_ELF_H
+#define CORE_ELF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "core/sched.h"
+#include "memory/vmm.h"
+
+// Static x86-64 ELF executables, loaded lazily: elf_load() only records a
+// VMA per PT_LOAD segment (backed by the image in place) plus a stack and
+// an empty heap, so start-up cost does not grow with the program's size.
+// Pages are faulted in as the program touches them.
+
+// Top of the main thread's stack; the page above stays unmapped as a guard
+#define ELF_STACK_TOP  (VMM_USER_END - PAGE_SIZE)
+#define ELF_STACK_SIZE (8ull * 1024 * 1024)
+
+typedef struct {
+    page_table_t *pt;
+    uint64_t entry;
+} elf_image_t;
+
+// Build a new address space for the image at data. The image must stay
+// in memory (an initramfs file does) while the address space lives.
+bool elf_load(const void *data, size_t size, elf_image_t *image);
+
+// Load path from the initramfs and start it in a new thread; NULL if the
+// file is missing, not a loadable executable or out of memory
+thread_t *elf_spawn(const char *path);
+
+#endif // CORE_ELF_H
@@ -1,13 +1,21 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
+#include "arch/x86/cpu.h"
 #include "arch/x86/io.h"
 #include "core/console.h"
 #include "core/keyboard.h"
+#include "core/sched.h"
 
 #define PS2_DATA_PORT 0x60
 #define PS2_STATUS_PORT 0x64
 
+#define PS2_STATUS_OUTPUT_FULL 0x01
+#define PS2_STATUS_INPUT_FULL  0x02
+#define PS2_CMD_READ_CONFIG    0x20
+#define PS2_CMD_WRITE_CONFIG   0x60
+#define PS2_CONFIG_PORT1_IRQ   0x01
+
 // US QWERTY scancode set 1 -> ASCII mapping
 static const char scancode_to_ascii[] = {
     0,  27, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b',
@@ -38,7 +46,23 @@ static const char scancode_to_ascii_shift[] = {
 static bool shift_pressed = false;
 static bool ctrl_pressed  = false;
 static bool e0_prefix     = false;
-static int  pending_special = -1;
+
+// Keys only the reader acts on; they never reach callers
+enum {
+    KEY_PAGE_UP   = -18,
+    KEY_PAGE_DOWN = -19,
+};
+
+// Decoded keys, filled by the IRQ1 handler and drained by the getchar
+// functions. One producer and one consumer, so head and tail each have a
+// single writer and no lock is needed.
+#define KEY_RING_SIZE 256  // Power of two
+static int16_t key_ring[KEY_RING_SIZE];
+static volatile uint32_t key_head = 0;
+static volatile uint32_t key_tail = 0;
+
+// Threads blocked in keyboard_getchar()
+static wait_queue_t key_wq;
 
 // Helpers for scancode press/release
 static inline bool is_shift_press(uint8_t s)   { return s == 0x2A || s == 0x36; }
@@ -55,89 +79,26 @@ static inline char maybe_ctrlify(char c) {
     return c;
 }
 
-static bool handle_extended_scancode(uint8_t scancode) {
-    if (scancode & 0x80) return true; // ignore extended releases
+static int decode_extended_scancode(uint8_t scancode) {
+    if (scancode & 0x80) return -1; // ignore extended releases
 
     switch (scancode) {
-        case 0x49: console_page_up();   return true;
-        case 0x51: console_page_down(); return true;
-        case 0x48: pending_special = KEY_ARROW_UP;   return true; // Up arrow
-        case 0x50: pending_special = KEY_ARROW_DOWN; return true; // Down arrow
-        default:   return false;
-    }
-}
-
-char keyboard_getchar(void) {
-    if (pending_special != -1) {
-        char k = (char)pending_special;
-        pending_special = -1;
-        return k;
-    }
-
-    for (;;) {
-        // Data available?
-        uint8_t status = inb(PS2_STATUS_PORT);
-        if (!(status & 0x01)) continue;
-
-        uint8_t scancode = inb(PS2_DATA_PORT);
-
-        if (scancode == 0xE0) { e0_prefix = true; continue; }
-        if (e0_prefix) {
-            bool consumed = handle_extended_scancode(scancode);
-            e0_prefix = false;
-            if (consumed) {
-                if (pending_special != -1) {
-                    char k = (char)pending_special;
-                    pending_special = -1;
-                    return k;
-                }
-                continue;
-            }
-        }
-
-        // Track modifiers
-        if (is_shift_press(scancode))   { shift_pressed = true;  continue; }
-        if (is_shift_release(scancode)) { shift_pressed = false; continue; }
-        if (is_ctrl_press(scancode))    { ctrl_pressed  = true;  continue; }
-        if (is_ctrl_release(scancode))  { ctrl_pressed  = false; continue; }
-
-        // Ignore generic key releases
-        if (scancode & 0x80) continue;
-
-        // Map to ASCII and optionally ctrlify
-        if (scancode < sizeof(scancode_to_ascii)) {
-            char c = shift_pressed ? scancode_to_ascii_shift[scancode]
-                                   : scancode_to_ascii[scancode];
-            if (c != 0) return maybe_ctrlify(c);
-        }
+        case 0x49: return KEY_PAGE_UP;
+        case 0x51: return KEY_PAGE_DOWN;
+        case 0x48: return KEY_ARROW_UP;
+        case 0x50: return KEY_ARROW_DOWN;
+        default:   return -1;
     }
 }
 
-int keyboard_getchar_nonblocking(void) {
-    if (pending_special != -1) {
-        char k = (char)pending_special;
-        pending_special = -1;
-        return (int)k;
-    }
-
-    // Any data?
-    uint8_t status = inb(PS2_STATUS_PORT);
-    if (!(status & 0x01)) return -1;
-
-    uint8_t scancode = inb(PS2_DATA_PORT);
-
+// Feed one scancode through the decoder; returns a key or -1
+static int decode_scancode(uint8_t scancode) {
     if (scancode == 0xE0) { e0_prefix = true; return -1; }
     if (e0_prefix) {
-        bool consumed = handle_extended_scancode(scancode);
         e0_prefix = false;
-        if (consumed) {
-            if (pending_special != -1) {
-                char k = (char)pending_special;
-                pending_special = -1;
-                return (int)k;
-            }
-            return -1;
-        }
+        int key = decode_extended_scancode(scancode);
+        if (key != -1) return key;
+        if (scancode & 0x80) return -1;
     }
 
     // Track modifiers
@@ -158,6 +119,99 @@ int keyboard_getchar_nonblocking(void) {
     return -1;
 }
 
+static void key_ring_push(int key) {
+    uint32_t head = key_head;
+    uint32_t next = (head + 1) & (KEY_RING_SIZE - 1);
+    if (next == key_tail) return;  // Full: drop the key
+    key_ring[head] = (int16_t)key;
+    __atomic_store_n(&key_head, next, __ATOMIC_RELEASE);
+}
+
+// Pull everything the controller holds into the ring
+static void drain_controller(void) {
+    while (inb(PS2_STATUS_PORT) & PS2_STATUS_OUTPUT_FULL) {
+        uint8_t scancode = inb(PS2_DATA_PORT);
+        int key = decode_scancode(scancode);
+        if (key != -1) key_ring_push(key);
+    }
+}
+
+void keyboard_init(void) {
+    // Drop bytes left over from the firmware, then make sure the
+    // controller raises IRQ1 for the first port
+    while (inb(PS2_STATUS_PORT) & PS2_STATUS_OUTPUT_FULL) (void)inb(PS2_DATA_PORT);
+
+    outb(PS2_STATUS_PORT, PS2_CMD_READ_CONFIG);
+    while (!(inb(PS2_STATUS_PORT) & PS2_STATUS_OUTPUT_FULL)) asm volatile ("pause");
+    uint8_t config = inb(PS2_DATA_PORT);
+
+    outb(PS2_STATUS_PORT, PS2_CMD_WRITE_CONFIG);
+    while (inb(PS2_STATUS_PORT) & PS2_STATUS_INPUT_FULL) asm volatile ("pause");
+    outb(PS2_DATA_PORT, config | PS2_CONFIG_PORT1_IRQ);
+}
+
+void keyboard_interrupt_handler(void) {
+    drain_controller();
+    if (key_tail != key_head) wait_queue_wake_all(&key_wq);
+}
+
+static bool key_available(void *arg) {
+    (void)arg;
+    return key_tail != __atomic_load_n(&key_head, __ATOMIC_ACQUIRE);
+}
+
+// Next key from the ring, acting on scroll keys along the way; -1 if empty
+static int next_key(void) {
+    for (;;) {
+        uint32_t tail = key_tail;
+        if (tail == __atomic_load_n(&key_head, __ATOMIC_ACQUIRE)) return -1;
+        int key = key_ring[tail];
+        __atomic_store_n(&key_tail, (tail + 1) & (KEY_RING_SIZE - 1), __ATOMIC_RELEASE);
+
+        if (key == KEY_PAGE_UP)   { console_page_up();   continue; }
+        if (key == KEY_PAGE_DOWN) { console_page_down(); continue; }
+        return key;
+    }
+}
+
+char keyboard_getchar(void) {
+    // Reading input: make sure everything printed so far is on screen
+    console_flush();
+
+    for (;;) {
+        int key = next_key();
+        if (key != -1) return (char)key;
+
+        if (!interrupts_enabled()) {
+            // Too early for IRQ1; poll the controller instead
+            drain_controller();
+            continue;
+        }
+
+        // A thread may be running on a CPU that takes no interrupts; let
+        // IRQ1 wake it instead of halting
+        if (sched_current()) {
+            wait_queue_wait(&key_wq, key_available, NULL);
+            continue;
+        }
+
+        // Sleep until the next interrupt. STI only takes effect after the
+        // following instruction, so a key arriving after the check still
+        // wakes the HLT.
+        asm volatile ("cli");
+        if (key_tail == key_head) {
+            asm volatile ("sti; hlt" ::: "memory");
+        } else {
+            asm volatile ("sti");
+        }
+    }
+}
+
+int keyboard_getchar_nonblocking(void) {
+    console_flush();
+    return next_key();
+}
+
 void wait_for_key(void) {
     print(NULL, "[Press any key to continue]");
     keyboard_getchar();
@@ -1,7 +1,15 @@
 #ifndef CORE_KEYBOARD_H
 #define CORE_KEYBOARD_H
 
+// Enable IRQ1 in the PS/2 controller and discard stale bytes
+void keyboard_init(void);
+
+// Called from the IRQ1 stub: decode scancodes into the key ring
+void keyboard_interrupt_handler(void);
+
+// Blocks (halting the CPU) until a key is available
 char keyboard_getchar(void);
+// Returns -1 if no key is queued
 int keyboard_getchar_nonblocking(void);
 void wait_for_key(void);
 
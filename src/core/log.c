@@ -1,18 +1,211 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arch/x86/cpu.h"
+#include "core/console.h"
 #include "core/log.h"
+#include "core/sched.h"
+#include "core/serial.h"
+#include "core/timer.h"
 #include "libc/stdio.h"
 
-static void log_with_level(const char *level, const char *component, const char *message) {
-    kprintf("[%s] [%s] %s\n", level, component, message);
+// Writers claim a slot with one atomic increment of the head and publish it
+// by storing its sequence number last, so nothing ever waits on a lock and an
+// interrupt may log on top of a half-written record. Each sink keeps its own
+// read position; when writers lap a sink the oldest records are dropped.
+
+#define LOG_RING_SLOTS     256  // Power of two
+#define LOG_COMPONENT_MAX  16
+#define LOG_MESSAGE_MAX    104
+#define LOG_LINE_MAX       (LOG_COMPONENT_MAX + LOG_MESSAGE_MAX + 48)
+
+typedef struct {
+    volatile uint64_t seq;  // Position + 1 once published, 0 while written
+    uint64_t tsc;
+    uint8_t level;
+    char component[LOG_COMPONENT_MAX];
+    char message[LOG_MESSAGE_MAX];
+} log_record_t;
+
+typedef struct {
+    uint64_t pos;            // Next ring position to emit
+    volatile bool busy;      // Held while a drain is running
+    bool (*emit)(const log_record_t *rec);
+} log_sink_t;
+
+// Once the klogd thread is up, writers only wake it instead of draining
+// inline; the thread does the formatting and the sink I/O.
+static wait_queue_t log_wq;
+static volatile bool klogd_running = false;
+
+static log_record_t ring[LOG_RING_SLOTS];
+static volatile uint64_t ring_head = 0;
+static volatile uint64_t dropped = 0;
+
+static const char *const level_names[] = {
+    [LOG_LEVEL_INFO]  = "INFO",
+    [LOG_LEVEL_OK]    = " OK ",
+    [LOG_LEVEL_ERROR] = "ERR ",
+};
+
+static void copy_field(char *dst, const char *src, size_t cap) {
+    size_t i = 0;
+    if (src) {
+        for (; i + 1 < cap && src[i]; i++) dst[i] = src[i];
+    }
+    dst[i] = '\0';
+}
+
+// ksnprintf() reports the untruncated length; clamp to what was stored
+static size_t clamp_line(int n) {
+    if (n < 0) return 0;
+    return (size_t)n < LOG_LINE_MAX ? (size_t)n : LOG_LINE_MAX - 1;
+}
+
+static bool emit_serial(const log_record_t *rec) {
+    char line[LOG_LINE_MAX];
+    uint64_t ns = timer_tsc_to_ns(rec->tsc);
+    size_t len = clamp_line(ksnprintf(line, sizeof(line), "[%5llu.%06llu] [%s] [%s] %s\r\n",
+                                      (unsigned long long)(ns / NS_PER_SEC),
+                                      (unsigned long long)(ns % NS_PER_SEC / 1000),
+                                      level_names[rec->level], rec->component, rec->message));
+
+    // Leave the record queued until the whole line fits
+    if (serial_tx_space() < len) return false;
+    serial_write(line, len);
+    return true;
+}
+
+static bool emit_console(const log_record_t *rec) {
+    // An interrupt landed inside a console call; try again later
+    if (console_is_busy()) return false;
+
+    char line[LOG_LINE_MAX];
+    size_t len = clamp_line(ksnprintf(line, sizeof(line), "[%s] [%s] %s\n",
+                                      level_names[rec->level], rec->component, rec->message));
+    console_write(line, len);
+    return true;
+}
+
+static log_sink_t sinks[] = {
+    { .emit = emit_serial },
+    { .emit = emit_console },
+};
+
+// Copy out the record at sink->pos. Returns false if it is not published yet.
+static bool ring_read(log_sink_t *sink, log_record_t *out) {
+    for (;;) {
+        uint64_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+        if (head - sink->pos > LOG_RING_SLOTS) {
+            uint64_t oldest = head - LOG_RING_SLOTS;
+            __atomic_fetch_add(&dropped, oldest - sink->pos, __ATOMIC_RELAXED);
+            sink->pos = oldest;
+        }
+        if (sink->pos == head) return false;
+
+        log_record_t *slot = &ring[sink->pos & (LOG_RING_SLOTS - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != sink->pos + 1) {
+            return false;
+        }
+        *out = *slot;
+
+        // A writer that lapped us mid-copy changed seq first; go again
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == sink->pos + 1) {
+            return true;
+        }
+    }
+}
+
+static bool ring_ready(const log_sink_t *sink) {
+    const log_record_t *slot = &ring[sink->pos & (LOG_RING_SLOTS - 1)];
+    return sink->pos != __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) &&
+           __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == sink->pos + 1;
+}
+
+static void drain_sink(log_sink_t *sink) {
+    // Whoever is already draining this sink will pick our records up
+    while (!__atomic_exchange_n(&sink->busy, true, __ATOMIC_ACQUIRE)) {
+        log_record_t rec;
+        bool stalled = false;
+        while (ring_read(sink, &rec)) {
+            if (!sink->emit(&rec)) {
+                stalled = true;
+                break;
+            }
+            sink->pos++;
+        }
+        __atomic_store_n(&sink->busy, false, __ATOMIC_RELEASE);
+
+        // Records published while we held the sink found it busy and were
+        // left to us. An unpublished slot belongs to a writer we interrupted;
+        // it drains again once that writer finishes.
+        if (stalled || !ring_ready(sink)) return;
+    }
+}
+
+void log_drain(void) {
+    for (size_t i = 0; i < sizeof(sinks) / sizeof(sinks[0]); i++) {
+        drain_sink(&sinks[i]);
+    }
+}
+
+static bool log_pending(void *arg) {
+    (void)arg;
+    for (size_t i = 0; i < sizeof(sinks) / sizeof(sinks[0]); i++) {
+        if (ring_ready(&sinks[i])) return true;
+    }
+    return false;
+}
+
+void log_kick(void) {
+    if (klogd_running) wait_queue_wake_all(&log_wq);
+    else log_drain();
+}
+
+void log_thread(void *arg) {
+    (void)arg;
+    klogd_running = true;
+    for (;;) {
+        wait_queue_wait(&log_wq, log_pending, NULL);
+        log_drain();
+        // A sink refused a record (UART full, console busy): retry next tick
+        if (log_pending(NULL)) thread_sleep_ns(TIMER_TICK_NS);
+    }
+}
+
+void log_flush(void) {
+    log_drain();
+    serial_flush();
+}
+
+uint64_t log_dropped(void) {
+    return dropped;
+}
+
+void log_write(log_level_t level, const char *component, const char *message) {
+    uint64_t pos = __atomic_fetch_add(&ring_head, 1, __ATOMIC_ACQ_REL);
+    log_record_t *slot = &ring[pos & (LOG_RING_SLOTS - 1)];
+
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->tsc = rdtsc();
+    slot->level = (uint8_t)level;
+    copy_field(slot->component, component, LOG_COMPONENT_MAX);
+    copy_field(slot->message, message, LOG_MESSAGE_MAX);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    log_kick();
 }
 
 void log_info(const char *component, const char *message) {
-    log_with_level("INFO", component, message);
+    log_write(LOG_LEVEL_INFO, component, message);
 }
 
 void log_ok(const char *component, const char *message) {
-    log_with_level(" OK ", component, message);
+    log_write(LOG_LEVEL_OK, component, message);
 }
 
 void log_error(const char *component, const char *message) {
-    log_with_level("ERR ", component, message);
+    log_write(LOG_LEVEL_ERROR, component, message);
 }
@@ -1,8 +1,35 @@
 #ifndef CORE_LOG_H
 #define CORE_LOG_H
 
+#include <stdint.h>
+
+typedef enum {
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_OK,
+    LOG_LEVEL_ERROR,
+} log_level_t;
+
+// Records go into a lock-free ring and are drained to COM1 and the console
+// afterwards (by the klogd thread once the scheduler runs), so these are
+// safe to call from interrupt handlers.
+void log_write(log_level_t level, const char *component, const char *message);
 void log_info(const char *component, const char *message);
 void log_ok(const char *component, const char *message);
 void log_error(const char *component, const char *message);
 
+// Move pending records to the sinks that can take them right now
+void log_drain(void);
+
+// Drain now, or wake the klogd thread to do it once that is running
+void log_kick(void);
+
+// Body of the klogd thread: drains the ring whenever records arrive
+void log_thread(void *arg);
+
+// Drain everything and wait for the UART to finish (panic paths)
+void log_flush(void);
+
+// Records overwritten before a sink got to them
+uint64_t log_dropped(void);
+
 #endif // CORE_LOG_H
@@ -1,16 +1,29 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include "arch/x86/apic.h"
+#include "arch/x86/cpu.h"
+#include "arch/x86/fpu.h"
 #include "arch/x86/gdt.h"
 #include "arch/x86/idt.h"
 #include "arch/x86/io.h"
+#include "arch/x86/smp.h"
+#include "arch/x86/syscall.h"
 #include "arch/x86/tss.h"
+#include "core/batch.h"
 #include "core/boot.h"
 #include "core/console.h"
 #include "core/keyboard.h"
 #include "core/log.h"
+#include "core/sched.h"
+#include "core/serial.h"
 #include "core/shell.h"
+#include "core/timer.h"
+#include "core/trace.h"
+#include "fs/initramfs.h"
+#include "libc/stdio.h"
 #include "libc/string.h"
+#include "memory/dma.h"
 #include "memory/heap.h"
 #include "memory/hhdm.h"
 #include "memory/pmm.h"
@@ -27,33 +40,31 @@ static void init_pic(void) {
     outb(0x21, 0x01);
     outb(0xA1, 0x01);
 
-    // Mask all interrupts initially
+    // Mask all interrupts; the local APIC may replace the PIC entirely
     outb(0x21, 0xFF);
     outb(0xA1, 0xFF);
-
-    // Unmask only IRQ0 (timer)
-    outb(0x21, 0xFE);
 }
 
-// Enable x86_64 FPU/SSE for both kernel and userspace.
-static void x86_enable_sse(void) {
-    uint64_t cr0, cr4;
-    asm volatile ("mov %%cr0, %0" : "=r"(cr0));
-    asm volatile ("mov %%cr4, %0" : "=r"(cr4));
-
-    // CR0: clear EM (bit 2) to enable FPU, set MP (bit 1) for proper WAIT/FWAIT.
-    cr0 &= ~(1ULL << 2);
-    cr0 |=  (1ULL << 1);
+static void pic_unmask_legacy(void) {
+    // Unmask IRQ0 (timer), IRQ1 (keyboard) and IRQ4 (COM1)
+    outb(0x21, 0xEC);
+}
 
-    // CR4: enable OS support for FXSAVE/FXRSTOR and SIMD exception handling.
-    cr4 |= (1ULL << 9);   // OSFXSR
-    cr4 |= (1ULL << 10);  // OSXMMEXCPT
+// Idle-time page zeroing, off the shell's input path
+#define SCRUB_IDLE_NS (10 * NS_PER_SEC / 1000)
 
-    asm volatile ("mov %0, %%cr0" : : "r"(cr0) : "memory");
-    asm volatile ("mov %0, %%cr4" : : "r"(cr4) : "memory");
+static void scrub_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        if (pmm_idle_scrub()) sched_yield();
+        else thread_sleep_ns(SCRUB_IDLE_NS);
+    }
+}
 
-    // Initialize FPU state.
-    asm volatile ("fninit");
+static void shell_thread(void *arg) {
+    struct limine_framebuffer *fb = (struct limine_framebuffer *)arg;
+    batch_run(fb);
+    shell_loop(fb);
 }
 
 void kmain(void) {
@@ -67,44 +78,197 @@ void kmain(void) {
     }
     hhdm_set_offset(hhdm->offset);
 
+    // Per-CPU data (and with it every lock) works from here on, and so
+    // does tracing. Each stage below is a slice in the boot timeline.
+    smp_init_bsp();
+    trace_begin("kmain");
+
+    // Pick memcpy/memset variants before anything copies in bulk
+    trace_begin("boot.string");
+    string_init();
+    trace_end("boot.string");
+
+    // Calibrate before the first log record so every timestamp is usable
+    trace_begin("boot.timer");
+    bool have_tsc = timer_calibrate();
+    trace_end("boot.timer");
+    trace_begin("boot.serial");
+    bool have_serial = serial_init();
+    trace_end("boot.serial");
+
+    trace_begin("boot.console");
     console_init();
+    trace_end("boot.console");
     log_ok("console", "Framebuffer console initialized");
+    if (have_serial) {
+        log_ok("serial", "COM1 ready, logs mirrored at 115200 baud");
+    } else {
+        log_info("serial", "No UART on COM1");
+    }
+    if (have_tsc) {
+        char msg[48];
+        ksnprintf(msg, sizeof(msg), "TSC calibrated at %llu MHz",
+                  (unsigned long long)(timer_tsc_hz() / 1000000));
+        log_ok("timer", msg);
+    } else {
+        log_error("timer", "TSC calibration failed, using tick resolution");
+    }
 
     // Disable interrupts during initialization
     asm volatile ("cli");
 
+    trace_begin("boot.idt");
     init_idt();
+    trace_end("boot.idt");
     log_ok("interrupts", "IDT installed");
 
-    tss_init();
-    gdt_init();
+    trace_begin("boot.gdt_tss");
+    cpu_t *bsp = this_cpu();
+    tss_init(&bsp->tss);
+    gdt_init(bsp->gdt, &bsp->tss);
+    trace_end("boot.gdt_tss");
     log_ok("cpu", "GDT/TSS configured");
 
-    x86_enable_sse();
-    log_ok("cpu", "SSE enabled");
+    trace_begin("boot.syscall");
+    syscall_init();
+    trace_end("boot.syscall");
+    log_ok("cpu", "SYSCALL/SYSRET enabled");
+
+    trace_begin("boot.fpu");
+    fpu_init();
+    trace_end("boot.fpu");
+    char fpu_msg[48];
+    ksnprintf(fpu_msg, sizeof(fpu_msg), "FPU enabled, %zu-byte %s state", fpu_state_size(), fpu_save_method());
+    log_ok("cpu", fpu_msg);
 
     struct limine_memmap_response *memmap = boot_memmap_response();
     if (memmap) {
+        trace_begin("boot.pmm");
         pmm_init(memmap);
+        dma_init();
+        trace_end("boot.pmm");
         log_ok("memory", "Physical memory manager ready");
+        size_t dropped_ranges;
+        size_t dropped_pages = pmm_dropped_pages(&dropped_ranges);
+        if (dropped_pages > 0) {
+            char pmm_msg[96];
+            ksnprintf(pmm_msg, sizeof(pmm_msg), "%zu usable ranges (%zu KB) ignored: too many regions",
+                      dropped_ranges, dropped_pages * (PAGE_SIZE / 1024));
+            log_error("memory", pmm_msg);
+        }
     } else {
         log_error("memory", "No Limine memory map provided");
         boot_hcf();
     }
 
+    trace_begin("boot.vmm");
     vmm_init();
+    trace_end("boot.vmm");
+    trace_begin("boot.heap");
     heap_init();
+    trace_end("boot.heap");
     log_ok("memory", "Virtual memory and heap initialized");
 
+    // Before the APs start, so no other TLB holds the old memory type
+    trace_begin("boot.fb_wc");
+    uint32_t wc_outputs = console_map_write_combining();
+    trace_end("boot.fb_wc");
+    if (wc_outputs > 0) {
+        char wc_msg[48];
+        ksnprintf(wc_msg, sizeof(wc_msg), "%u framebuffer%s mapped write-combining",
+                  wc_outputs, wc_outputs == 1 ? "" : "s");
+        log_ok("console", wc_msg);
+    } else {
+        log_info("console", "Framebuffers keep their boot memory type");
+    }
+
+    trace_begin("boot.initramfs");
+    bool have_initramfs = initramfs_init();
+    trace_end("boot.initramfs");
+    if (have_initramfs) {
+        char fs_msg[48];
+        ksnprintf(fs_msg, sizeof(fs_msg), "%zu entries indexed in place", initramfs_count());
+        log_ok("initramfs", fs_msg);
+    }
+
+    // APs bring up their local APIC only if the BSP managed to
+    trace_begin("boot.pic_apic");
     init_pic();
-    log_info("interrupts", "PIC initialized and timer unmasked");
+    bool have_apic = apic_init();
+    trace_end("boot.pic_apic");
+    if (have_apic) {
+        char apic_msg[64];
+        uint32_t ioapics = apic_ioapic_count();
+        ksnprintf(apic_msg, sizeof(apic_msg), "Local %s, %u IOAPIC%s, %s timer",
+                  apic_is_x2apic() ? "x2APIC" : "xAPIC", ioapics, ioapics == 1 ? "" : "s",
+                  apic_timer_mode());
+        log_ok("interrupts", apic_msg);
+    } else {
+        log_info("interrupts", "No usable local APIC, staying on the 8259 PIC");
+    }
+
+    struct limine_mp_response *mp = boot_mp_response();
+    trace_begin("boot.smp");
+    uint32_t online = smp_start_aps();
+    trace_end("boot.smp");
+    char cpu_msg[48];
+    ksnprintf(cpu_msg, sizeof(cpu_msg), "%u of %llu CPUs online", online,
+              (unsigned long long)(mp ? mp->cpu_count : 1));
+    if (mp && online < mp->cpu_count) {
+        log_error("smp", cpu_msg);
+    } else {
+        log_ok("smp", cpu_msg);
+    }
+
+    trace_begin("boot.backbuffer");
+    bool have_backbuffer = console_enable_backbuffer();
+    bool have_scrollback = console_set_scrollback_lines(CONSOLE_SCROLLBACK_LINES);
+    trace_end("boot.backbuffer");
+    if (have_backbuffer) {
+        log_ok("console", "Back buffer enabled");
+    } else {
+        log_error("console", "No memory for back buffer, drawing directly");
+    }
+    if (!have_scrollback) {
+        log_error("console", "No memory for scrollback, keeping boot buffer");
+    }
+
+    trace_begin("boot.irq_routing");
+    if (apic_enabled()) {
+        apic_route_irq(1, 33);
+        apic_route_irq(4, 36);
+        apic_timer_start();
+    } else {
+        pic_unmask_legacy();
+        timer_init();
+    }
+    keyboard_init();
+    serial_enable_irq();
+    trace_end("boot.irq_routing");
+    log_info("interrupts", apic_enabled() ? "Local APIC timer running, keyboard and COM1 routed"
+                                          : "PIC initialized, timer, keyboard and COM1 unmasked");
+
+    // kmain becomes the BSP's idle thread; the shell and background work
+    // run as threads from here on
+    trace_begin("boot.sched");
+    sched_init();
+    if (!thread_create("klogd", log_thread, NULL) ||
+        !thread_create("kconsole", console_render_thread, NULL) ||
+        !thread_create("kscrubd", scrub_thread, NULL) ||
+        !thread_create("shell", shell_thread, console_primary_framebuffer())) {
+        log_error("sched", "Out of memory creating kernel threads");
+        boot_hcf();
+    }
+    trace_end("boot.sched");
+    log_ok("sched", "Kernel threads created");
+
+    // Timer is running: let output-heavy code skip per-line redraws
+    console_set_deferred(true, TIMER_HZ);
 
     // Enable interrupts
     asm volatile ("sti");
     log_info("kernel", "Interrupts enabled");
 
-    shell_loop(console_primary_framebuffer());
-    
-    // We should never return here; halt if we do.
-    while (1) { asm volatile ("hlt"); }
+    trace_end("kmain");
+    sched_idle();
 }
@@ -0,0 +1,324 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arch/x86/idt.h"
+#include "arch/x86/smp.h"
+#include "core/boot.h"
+#include "core/prof.h"
+#include "core/timer.h"
+#include "libc/stdio.h"
+#include "libc/string.h"
+#include "memory/heap.h"
+#include "memory/vmm.h"
+
+#ifndef PROF_CALLERS
+#define PROF_CALLERS 0
+#endif
+
+#define PROF_MAX_SAMPLES  16384
+#define PROF_CALLER_DEPTH 4
+#define PROF_DEFAULT_TOP  20
+#define PROF_SYMBOL_FILE  "kiwiOS.sym"
+
+// Samples go into a flat per-CPU array that simply stops filling when full.
+// Only the owning CPU's timer interrupt writes it, so there is no locking;
+// readers stop the profiler first.
+typedef struct {
+    uint64_t rips[PROF_MAX_SAMPLES];
+#if PROF_CALLERS
+    uint64_t callers[PROF_MAX_SAMPLES][PROF_CALLER_DEPTH];
+#endif
+    volatile uint32_t count;
+    volatile uint32_t dropped;   // Ticks after the buffer filled up
+    volatile uint32_t user;      // Ticks that interrupted ring 3
+} prof_buffer_t;
+
+static prof_buffer_t prof_cpus[SMP_MAX_CPUS];
+static volatile bool prof_active = false;
+static uint64_t prof_start_ns = 0;
+static uint64_t prof_elapsed_ns = 0;
+
+// ---------------- Sampling ----------------
+
+#if PROF_CALLERS
+static void record_callers(uint64_t *out, uint64_t rbp) {
+    for (int i = 0; i < PROF_CALLER_DEPTH; i++) {
+        // Stop at anything that does not look like a kernel stack frame
+        if (rbp < VMM_KERNEL_HALF || (rbp & 7)) {
+            out[i] = 0;
+            continue;
+        }
+        const uint64_t *frame = (const uint64_t *)rbp;
+        out[i] = frame[1];
+        uint64_t next = frame[0];
+        rbp = next > rbp ? next : 0;
+    }
+}
+#endif
+
+void prof_tick(struct irq_frame *frame) {
+    if (!prof_active) return;
+    prof_buffer_t *buf = &prof_cpus[smp_cpu_id()];
+
+    if (frame->cs & 3) {
+        buf->user++;
+        return;
+    }
+    uint32_t n = buf->count;
+    if (n >= PROF_MAX_SAMPLES) {
+        buf->dropped++;
+        return;
+    }
+    buf->rips[n] = frame->rip;
+#if PROF_CALLERS
+    record_callers(buf->callers[n], frame->rbp);
+#endif
+    buf->count = n + 1;
+}
+
+void prof_start(void) {
+    prof_active = false;
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        prof_cpus[cpu].count = 0;
+        prof_cpus[cpu].dropped = 0;
+        prof_cpus[cpu].user = 0;
+    }
+    prof_elapsed_ns = 0;
+    prof_start_ns = ktime_ns();
+    __atomic_store_n(&prof_active, true, __ATOMIC_RELEASE);
+}
+
+void prof_stop(void) {
+    if (!prof_active) return;
+    __atomic_store_n(&prof_active, false, __ATOMIC_RELEASE);
+    prof_elapsed_ns = ktime_ns() - prof_start_ns;
+}
+
+bool prof_running(void) {
+    return prof_active;
+}
+
+// ---------------- Symbols ----------------
+
+typedef struct {
+    uint64_t addr;
+    const char *name;
+} prof_symbol_t;
+
+static prof_symbol_t *symbols = NULL;
+static size_t symbol_count = 0;
+static bool symbols_loaded = false;
+
+static bool parse_hex(const char **p, const char *end, uint64_t *out) {
+    uint64_t v = 0;
+    const char *s = *p;
+    int digits = 0;
+    for (; s < end; s++, digits++) {
+        char c = *s;
+        if (c >= '0' && c <= '9') v = (v << 4) | (uint64_t)(c - '0');
+        else if (c >= 'a' && c <= 'f') v = (v << 4) | (uint64_t)(c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F') v = (v << 4) | (uint64_t)(c - 'A' + 10);
+        else break;
+    }
+    *p = s;
+    *out = v;
+    return digits > 0;
+}
+
+// Parse "addr [size] type name" lines of `nm -n` output. Names are
+// terminated in place, so the module memory doubles as the string table.
+static void load_symbols(void) {
+    symbols_loaded = true;
+    struct limine_file *file = boot_find_module(PROF_SYMBOL_FILE);
+    if (!file || !file->size) return;
+
+    char *text = (char *)file->address;
+    char *end = text + file->size;
+
+    size_t lines = 0;
+    for (char *p = text; p < end; p++) {
+        if (*p == '\n') lines++;
+    }
+    symbols = kmalloc((lines + 1) * sizeof(prof_symbol_t));
+    if (!symbols) return;
+
+    char *line = text;
+    while (line < end) {
+        char *eol = line;
+        while (eol < end && *eol != '\n') eol++;
+
+        const char *p = line;
+        uint64_t addr, size;
+        if (parse_hex(&p, eol, &addr) && p < eol && *p == ' ') {
+            p++;
+            // With nm -S a size column comes before the type
+            const char *q = p;
+            if (parse_hex(&q, eol, &size) && q < eol && *q == ' ' && q - p > 1) p = q + 1;
+
+            char type = p < eol ? *p : 0;
+            if ((type == 't' || type == 'T' || type == 'w' || type == 'W') &&
+                p + 2 < eol && p[1] == ' ') {
+                *eol = '\0';
+                symbols[symbol_count].addr = addr;
+                symbols[symbol_count].name = p + 2;
+                symbol_count++;
+            }
+        }
+        line = eol + 1;
+    }
+
+    // nm -n is already sorted; fix up anything that is not
+    for (size_t i = 1; i < symbol_count; i++) {
+        prof_symbol_t key = symbols[i];
+        size_t j = i;
+        while (j > 0 && symbols[j - 1].addr > key.addr) {
+            symbols[j] = symbols[j - 1];
+            j--;
+        }
+        symbols[j] = key;
+    }
+}
+
+// Index of the symbol containing addr, or -1
+static long find_symbol(uint64_t addr) {
+    if (symbol_count == 0 || addr < symbols[0].addr) return -1;
+    size_t lo = 0, hi = symbol_count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (symbols[mid].addr <= addr) lo = mid;
+        else hi = mid;
+    }
+    return (long)lo;
+}
+
+// ---------------- Report ----------------
+
+static void sort_u64(uint64_t *v, size_t n) {
+    // Shell sort with Ciura's gaps: plenty for a few thousand samples
+    static const size_t gaps[] = { 701, 301, 132, 57, 23, 10, 4, 1 };
+    for (size_t g = 0; g < sizeof(gaps) / sizeof(gaps[0]); g++) {
+        size_t gap = gaps[g];
+        for (size_t i = gap; i < n; i++) {
+            uint64_t key = v[i];
+            size_t j = i;
+            while (j >= gap && v[j - gap] > key) {
+                v[j] = v[j - gap];
+                j -= gap;
+            }
+            v[j] = key;
+        }
+    }
+}
+
+typedef struct {
+    uint64_t addr;     // Symbol start, or the raw RIP without symbols
+    long sym;          // Symbol index, -1 if unresolved
+    uint32_t samples;
+} prof_entry_t;
+
+#if PROF_CALLERS
+// Add the samples of one CPU in which each symbol is on the recorded part
+// of the stack
+static void count_inclusive(const prof_buffer_t *buf, uint32_t *inclusive) {
+    for (uint32_t i = 0; i < buf->count; i++) {
+        long seen[PROF_CALLER_DEPTH + 1];
+        int nseen = 0;
+        for (int d = -1; d < PROF_CALLER_DEPTH; d++) {
+            uint64_t addr = d < 0 ? buf->rips[i] : buf->callers[i][d];
+            long sym = addr ? find_symbol(addr) : -1;
+            if (sym < 0) continue;
+
+            // Recursion must not count a sample twice
+            bool dup = false;
+            for (int k = 0; k < nseen; k++) dup |= seen[k] == sym;
+            if (dup) continue;
+            seen[nseen++] = sym;
+            inclusive[sym]++;
+        }
+    }
+}
+#endif
+
+void prof_report(uint32_t top_n) {
+    if (prof_active) prof_stop();
+    if (!symbols_loaded) load_symbols();
+    if (top_n == 0) top_n = PROF_DEFAULT_TOP;
+
+    uint32_t total = 0, user = 0, dropped = 0, cpus = 0;
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        const prof_buffer_t *buf = &prof_cpus[cpu];
+        total += buf->count;
+        user += buf->user;
+        dropped += buf->dropped;
+        if (buf->count || buf->user) cpus++;
+    }
+    kprintf("prof: %u samples on %u CPUs over %llu ms at %u Hz (%u user, %u dropped), %zu symbols\n",
+            total, cpus, (unsigned long long)(prof_elapsed_ns / 1000000), TIMER_HZ,
+            user, dropped, symbol_count);
+    if (total == 0) return;
+
+    uint32_t *inclusive = NULL;
+#if PROF_CALLERS
+    // Needs the RIPs still paired with their callers, so before merging
+    if (symbol_count) inclusive = kcalloc(symbol_count, sizeof(uint32_t));
+    if (inclusive) {
+        for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) count_inclusive(&prof_cpus[cpu], inclusive);
+    }
+#endif
+
+    // Merge every CPU's samples; sorting groups equal RIPs and keeps each
+    // function's samples together
+    uint64_t *rips = kmalloc(sizeof(uint64_t) * total);
+    prof_entry_t *entries = kmalloc(sizeof(prof_entry_t) * total);
+    if (!rips || !entries) {
+        kprintf("prof: out of memory\n");
+        kfree(rips);
+        kfree(entries);
+        kfree(inclusive);
+        return;
+    }
+    uint32_t merged = 0;
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        memcpy(&rips[merged], prof_cpus[cpu].rips, prof_cpus[cpu].count * sizeof(uint64_t));
+        merged += prof_cpus[cpu].count;
+    }
+    sort_u64(rips, total);
+
+    size_t count = 0;
+    for (uint32_t i = 0; i < total; i++) {
+        long sym = find_symbol(rips[i]);
+        uint64_t key = sym >= 0 ? symbols[sym].addr : rips[i];
+        if (count && entries[count - 1].addr == key) {
+            entries[count - 1].samples++;
+            continue;
+        }
+        entries[count].addr = key;
+        entries[count].sym = sym;
+        entries[count].samples = 1;
+        count++;
+    }
+
+    // Selection of the top N; N is small
+    if (top_n > count) top_n = (uint32_t)count;
+    kprintf("  %7s %6s %7s  %-18s %s\n", "samples", "pct", "incl", "address", "function");
+    for (uint32_t rank = 0; rank < top_n; rank++) {
+        size_t best = rank;
+        for (size_t i = rank + 1; i < count; i++) {
+            if (entries[i].samples > entries[best].samples) best = i;
+        }
+        prof_entry_t tmp = entries[rank];
+        entries[rank] = entries[best];
+        entries[best] = tmp;
+
+        prof_entry_t *e = &entries[rank];
+        uint32_t tenths = (uint32_t)((uint64_t)e->samples * 1000 / total);
+        char incl[12] = "-";
+        if (inclusive && e->sym >= 0) ksnprintf(incl, sizeof(incl), "%u", inclusive[e->sym]);
+        kprintf("  %7u %3u.%u%% %7s  0x%016llX %s\n", e->samples, tenths / 10, tenths % 10,
+                incl, (unsigned long long)e->addr, e->sym >= 0 ? symbols[e->sym].name : "?");
+    }
+
+    kfree(rips);
+    kfree(entries);
+    kfree(inclusive);
+}
@@ -0,0 +1,23 @@
+#ifndef CORE_PROF_H
+#define CORE_PROF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct irq_frame;
+
+// Sampling profiler: every timer tick records the interrupted RIP while
+// running. Build with -DPROF_CALLERS=1 -fno-omit-frame-pointer to also
+// record a few return addresses from the frame-pointer chain.
+
+void prof_start(void);
+void prof_stop(void);
+bool prof_running(void);
+
+// Top-N flat profile, symbolized from the "kiwiOS.sym" module (nm -n output)
+void prof_report(uint32_t top_n);
+
+// Called from the timer interrupt
+void prof_tick(struct irq_frame *frame);
+
+#endif // CORE_PROF_H
@@ -0,0 +1,503 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arch/x86/apic.h"
+#include "arch/x86/cpu.h"
+#include "arch/x86/fpu.h"
+#include "arch/x86/smp.h"
+#include "arch/x86/tss.h"
+#include "core/sched.h"
+#include "core/stats.h"
+#include "libc/stdio.h"
+#include "memory/heap.h"
+#include "memory/hhdm.h"
+#include "memory/pmm.h"
+#include "memory/vma.h"
+#include "memory/vmm.h"
+
+// Every switch happens with interrupts off and the run queue lock of the
+// CPU doing it held; the thread that resumes releases that lock (see
+// finish_switch()). A thread that was just switched out is therefore never
+// visible to a stealing CPU before its registers are saved.
+//
+// Lock order: wait queue, then run queue, then the timer wheel. Run queue
+// locks of two CPUs are only nested through spin_trylock().
+
+typedef struct {
+    spinlock_t lock;
+    thread_t *head;
+    thread_t *tail;
+    volatile uint32_t count;   // Queued threads, read unlocked by stealers
+    uint32_t cpu;
+    thread_t *idle;
+    thread_t *dead;            // Exited thread to free once we're off its stack
+    uint32_t slice;            // Ticks left for the running thread
+    volatile bool need_resched;
+    volatile bool online;
+    bool has_monitor;
+} __attribute__((aligned(64))) run_queue_t;
+
+static run_queue_t run_queues[SMP_MAX_CPUS];
+static thread_t idle_threads[SMP_MAX_CPUS];
+static char idle_names[SMP_MAX_CPUS][8];
+
+// Bumped on every enqueue; idle APs MWAIT on it
+static volatile uint64_t work_seq = 0;
+
+// Idle CPUs halted without MONITOR/MWAIT; an enqueue wakes one with an IPI
+static volatile uint32_t halted_cpus = 0;
+
+static spinlock_t all_lock;
+static thread_t *all_threads = NULL;
+static volatile uint32_t next_thread_id = 0;
+
+static inline run_queue_t *this_rq(void) {
+    return &run_queues[smp_cpu_id()];
+}
+
+// Save callee-saved registers on the old stack, switch stacks, restore
+// them from the new one. New threads start with a frame that returns
+// into thread_start(). The arguments arrive in %rdi and %rsi.
+__attribute__((naked)) static void context_switch(uint64_t *save_rsp __attribute__((unused)),
+                                                  uint64_t new_rsp __attribute__((unused))) {
+    asm volatile (
+        "push %rbp\n"
+        "push %rbx\n"
+        "push %r12\n"
+        "push %r13\n"
+        "push %r14\n"
+        "push %r15\n"
+        "mov %rsp, (%rdi)\n"
+        "mov %rsi, %rsp\n"
+        "pop %r15\n"
+        "pop %r14\n"
+        "pop %r13\n"
+        "pop %r12\n"
+        "pop %rbx\n"
+        "pop %rbp\n"
+        "ret\n"
+    );
+}
+
+static void rq_push(run_queue_t *rq, thread_t *thread) {
+    thread->next = NULL;
+    if (rq->tail) rq->tail->next = thread;
+    else rq->head = thread;
+    rq->tail = thread;
+    rq->count++;
+
+    // Pairs with the idle loop: it publishes its bit, then rechecks work_seq
+    __atomic_fetch_add(&work_seq, 1, __ATOMIC_SEQ_CST);
+    uint32_t halted = __atomic_load_n(&halted_cpus, __ATOMIC_SEQ_CST) & ~(1u << smp_cpu_id());
+    if (halted) {
+        uint32_t target = (halted & (1u << rq->cpu)) ? rq->cpu : (uint32_t)__builtin_ctz(halted);
+        cpu_t *cpu = smp_cpu(target);
+        if (cpu) apic_send_ipi(cpu->lapic_id, IPI_RESCHEDULE_VECTOR);
+    }
+}
+
+static thread_t *rq_pop(run_queue_t *rq) {
+    thread_t *thread = rq->head;
+    if (!thread) return NULL;
+    rq->head = thread->next;
+    if (!rq->head) rq->tail = NULL;
+    rq->count--;
+    thread->next = NULL;
+    return thread;
+}
+
+// Unlink the last unpinned thread: the one that would have waited longest
+static thread_t *rq_take_last(run_queue_t *rq) {
+    thread_t *victim = NULL, *victim_prev = NULL, *prev = NULL;
+    for (thread_t *t = rq->head; t; prev = t, t = t->next) {
+        if (!t->pinned) {
+            victim = t;
+            victim_prev = prev;
+        }
+    }
+    if (!victim) return NULL;
+
+    if (victim_prev) victim_prev->next = victim->next;
+    else rq->head = victim->next;
+    if (rq->tail == victim) rq->tail = victim_prev;
+    rq->count--;
+    victim->next = NULL;
+    return victim;
+}
+
+// Take a thread from the busiest other queue; self->lock is held
+static thread_t *steal(run_queue_t *self) {
+    run_queue_t *busiest = NULL;
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+        run_queue_t *rq = &run_queues[i];
+        if (rq == self || !rq->online || rq->count == 0) continue;
+        if (!busiest || rq->count > busiest->count) busiest = rq;
+    }
+    if (!busiest || !spin_trylock(&busiest->lock)) return NULL;
+
+    thread_t *thread = rq_take_last(busiest);
+    if (thread) {
+        // Changed under the old queue's lock, which is what sched_wake() relies on
+        thread->cpu = self->cpu;
+        KSTAT_INC(SCHED_STEAL);
+    }
+    spin_unlock(&busiest->lock);
+    return thread;
+}
+
+static void thread_free(thread_t *thread) {
+    uint64_t flags = spin_lock_irqsave(&all_lock);
+    for (thread_t **link = &all_threads; *link; link = &(*link)->all_next) {
+        if (*link == thread) {
+            *link = thread->all_next;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&all_lock, flags);
+
+    // Every CPU switched CR3 away when the thread last ran, so nothing
+    // still walks these tables
+    if (thread->page_table) {
+        vma_destroy_all(thread->page_table);
+        vmm_destroy_page_table(thread->page_table);
+    }
+    fpu_thread_free(thread);
+    pmm_free_pages(thread->stack, THREAD_STACK_PAGES);
+    kfree(thread);
+}
+
+// First thing a thread does after being switched in
+static void finish_switch(void) {
+    run_queue_t *rq = this_rq();
+    thread_t *dead = rq->dead;
+    rq->dead = NULL;
+    spin_unlock(&rq->lock);
+    if (dead) thread_free(dead);
+}
+
+// Requeue the current thread if it is still runnable and switch to the
+// next one. Interrupts are off and rq->lock is held; both stay that way
+// until the thread that resumes calls finish_switch().
+static void schedule_locked(run_queue_t *rq) {
+    thread_t *prev = sched_current();
+    if (prev->state == THREAD_RUNNING) {
+        prev->state = THREAD_READY;
+        if (prev != rq->idle) rq_push(rq, prev);
+    }
+
+    thread_t *next = rq_pop(rq);
+    if (!next) next = steal(rq);
+    if (!next) next = rq->idle;
+
+    next->state = THREAD_RUNNING;
+    rq->slice = SCHED_SLICE_TICKS;
+    rq->need_resched = false;
+    if (next != prev) {
+        if (prev->state == THREAD_DEAD) rq->dead = prev;
+        if (next->stack_top) tss_set_kernel_stack(next->stack_top);
+        page_table_t *pt = next->page_table ? next->page_table : vmm_get_kernel_page_table();
+        if (this_cpu()->page_table != pt) vmm_switch_page_table(pt);
+        fpu_switch(prev, next);
+        this_cpu()->thread = next;
+        KSTAT_INC(SCHED_SWITCH);
+        context_switch(&prev->rsp, next->rsp);
+    }
+    finish_switch();
+}
+
+__attribute__((noreturn))
+static void thread_start(void) {
+    finish_switch();
+    asm volatile ("sti");
+
+    thread_t *self = sched_current();
+    self->fn(self->arg);
+    thread_exit();
+}
+
+static void track_thread(thread_t *thread) {
+    thread->id = __atomic_fetch_add(&next_thread_id, 1, __ATOMIC_RELAXED);
+    uint64_t flags = spin_lock_irqsave(&all_lock);
+    thread->all_next = all_threads;
+    all_threads = thread;
+    spin_unlock_irqrestore(&all_lock, flags);
+}
+
+// Adopt the running flow as the idle thread of the calling CPU
+static void become_idle(void) {
+    cpu_t *cpu = this_cpu();
+    run_queue_t *rq = &run_queues[cpu->id];
+    thread_t *idle = &idle_threads[cpu->id];
+
+    ksnprintf(idle_names[cpu->id], sizeof(idle_names[cpu->id]), "idle/%u", cpu->id);
+    idle->name = idle_names[cpu->id];
+    idle->state = THREAD_RUNNING;
+    idle->cpu = cpu->id;
+    idle->pinned = true;
+    idle->stack_top = cpu->stack_top;
+    idle->fpu_cpu = SMP_NO_CPU;
+    track_thread(idle);
+
+    rq->cpu = cpu->id;
+    rq->idle = idle;
+    rq->slice = SCHED_SLICE_TICKS;
+    rq->has_monitor = cpu_has_monitor();
+    cpu->thread = idle;
+    __atomic_store_n(&rq->online, true, __ATOMIC_RELEASE);
+}
+
+static bool work_available(void) {
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+        if (run_queues[i].online && run_queues[i].count) return true;
+    }
+    return false;
+}
+
+__attribute__((noreturn))
+static void idle_loop(void) {
+    run_queue_t *rq = this_rq();  // Idle threads are pinned
+    for (;;) {
+        sched_yield();
+
+        uint64_t seq = __atomic_load_n(&work_seq, __ATOMIC_ACQUIRE);
+        asm volatile ("cli");
+        if (work_available()) {
+            asm volatile ("sti");
+            continue;
+        }
+
+        if (rq->cpu == 0) {
+            // Woken by the next tick at the latest; STI holds interrupts
+            // off until HLT
+            asm volatile ("sti; hlt" ::: "memory");
+            continue;
+        }
+
+        // APs go tickless while idle: an enqueue wakes them through the
+        // MONITORed work_seq, or with an IPI if they halted
+        bool apic = apic_enabled();
+        if (apic) apic_timer_stop();
+        if (rq->has_monitor) {
+            asm volatile ("monitor" :: "a"(&work_seq), "c"(0), "d"(0));
+            if (__atomic_load_n(&work_seq, __ATOMIC_ACQUIRE) != seq) {
+                // Raced with an enqueue
+            } else if (apic) {
+                asm volatile ("sti; mwait" :: "a"(0), "c"(0) : "memory");
+            } else {
+                asm volatile ("mwait" :: "a"(0), "c"(0) : "memory");
+            }
+        } else if (apic) {
+            __atomic_fetch_or(&halted_cpus, 1u << rq->cpu, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&work_seq, __ATOMIC_SEQ_CST) == seq) asm volatile ("sti; hlt" ::: "memory");
+            asm volatile ("cli");
+            __atomic_fetch_and(&halted_cpus, ~(1u << rq->cpu), __ATOMIC_SEQ_CST);
+        } else {
+            while (__atomic_load_n(&work_seq, __ATOMIC_ACQUIRE) == seq) asm volatile ("pause");
+        }
+        if (apic) {
+            asm volatile ("cli");
+            apic_timer_start();
+        }
+        asm volatile ("sti");
+    }
+}
+
+void sched_init(void) {
+    become_idle();
+}
+
+void sched_idle(void) {
+    idle_loop();
+}
+
+void sched_ap_enter(void) {
+    become_idle();
+    idle_loop();
+}
+
+thread_t *thread_create(const char *name, thread_fn_t fn, void *arg) {
+    return thread_create_in(name, NULL, fn, arg);
+}
+
+thread_t *thread_create_in(const char *name, page_table_t *pt, thread_fn_t fn, void *arg) {
+    thread_t *thread = (thread_t *)kcalloc(1, sizeof(thread_t));
+    void *stack = thread ? pmm_alloc_pages(THREAD_STACK_PAGES) : NULL;
+    if (!stack) {
+        kfree(thread);
+        if (pt) {
+            vma_destroy_all(pt);
+            vmm_destroy_page_table(pt);
+        }
+        return NULL;
+    }
+
+    thread->name = name;
+    thread->fn = fn;
+    thread->arg = arg;
+    thread->stack = stack;
+    thread->fpu_cpu = SMP_NO_CPU;
+    thread->page_table = pt;
+    thread->stack_top = (uint64_t)hhdm_phys_to_virt((uint64_t)stack) + THREAD_STACK_PAGES * PAGE_SIZE;
+
+    // What context_switch() pops: six callee-saved registers, then the
+    // return into thread_start(), which itself sees a zero return address
+    uint64_t *sp = (uint64_t *)thread->stack_top;
+    *--sp = 0;
+    *--sp = (uint64_t)thread_start;
+    for (int i = 0; i < 6; i++) *--sp = 0;
+    thread->rsp = (uint64_t)sp;
+    track_thread(thread);
+
+    uint64_t flags = irq_save();
+    run_queue_t *rq = this_rq();
+    spin_lock(&rq->lock);
+    thread->cpu = rq->cpu;
+    thread->state = THREAD_READY;
+    rq_push(rq, thread);
+    spin_unlock(&rq->lock);
+    irq_restore(flags);
+    return thread;
+}
+
+void thread_exit(void) {
+    asm volatile ("cli");
+    run_queue_t *rq = this_rq();
+    spin_lock(&rq->lock);
+    sched_current()->state = THREAD_DEAD;
+    schedule_locked(rq);
+    __builtin_unreachable();
+}
+
+void sched_yield(void) {
+    uint64_t flags = irq_save();
+    run_queue_t *rq = this_rq();
+    spin_lock(&rq->lock);
+    schedule_locked(rq);
+    irq_restore(flags);
+}
+
+void sched_wake(thread_t *thread) {
+    for (;;) {
+        uint32_t cpu = thread->cpu;
+        run_queue_t *rq = &run_queues[cpu];
+        uint64_t flags = spin_lock_irqsave(&rq->lock);
+
+        // Stolen since we looked: thread->cpu only changes under this lock
+        if (thread->cpu != cpu) {
+            spin_unlock_irqrestore(&rq->lock, flags);
+            continue;
+        }
+
+        if (thread->state == THREAD_BLOCKED) {
+            thread->state = THREAD_READY;
+            rq_push(rq, thread);
+            KSTAT_INC(SCHED_WAKEUP);
+            if (cpu == smp_cpu_id()) rq->need_resched = true;
+        }
+        spin_unlock_irqrestore(&rq->lock, flags);
+        return;
+    }
+}
+
+static void sleep_timer_fired(void *arg) {
+    sched_wake((thread_t *)arg);
+}
+
+void thread_sleep_ns(uint64_t ns) {
+    thread_t *self = sched_current();
+    ktimer_init(&self->sleep_timer, sleep_timer_fired, self);
+
+    uint64_t flags = irq_save();
+    run_queue_t *rq = this_rq();
+    spin_lock(&rq->lock);
+    self->state = THREAD_BLOCKED;
+    ktimer_arm(&self->sleep_timer, ns, 0);
+    schedule_locked(rq);
+    irq_restore(flags);
+}
+
+void wait_queue_wait(wait_queue_t *wq, bool (*cond)(void *), void *arg) {
+    thread_t *self = sched_current();
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    while (!cond(arg)) {
+        self->next = wq->head;
+        wq->head = self;
+
+        // Blocked before the queue lock drops, so a waker can't miss us
+        run_queue_t *rq = this_rq();
+        spin_lock(&rq->lock);
+        self->state = THREAD_BLOCKED;
+        spin_unlock(&wq->lock);
+        schedule_locked(rq);
+
+        spin_lock(&wq->lock);
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+void wait_queue_wake_all(wait_queue_t *wq) {
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    thread_t *thread = wq->head;
+    wq->head = NULL;
+    spin_unlock_irqrestore(&wq->lock, flags);
+
+    while (thread) {
+        // Read the link first: once awake the thread may wait again
+        thread_t *next = thread->next;
+        sched_wake(thread);
+        thread = next;
+    }
+}
+
+void sched_tick(void) {
+    run_queue_t *rq = this_rq();
+    if (!rq->online || sched_current() == rq->idle) return;
+    if (--rq->slice > 0) return;
+
+    rq->slice = SCHED_SLICE_TICKS;
+    if (rq->count) rq->need_resched = true;
+}
+
+void sched_resched_ipi(void) {
+    // Waking HLT is all it takes: the idle loop restarts the timer before
+    // switching, so it must not be preempted from here
+}
+
+void sched_irq_exit(void) {
+    run_queue_t *rq = this_rq();
+    if (!rq->need_resched) return;
+
+    KSTAT_INC(SCHED_PREEMPT);
+    spin_lock(&rq->lock);
+    schedule_locked(rq);
+}
+
+void sched_dump(void) {
+    static const char *const state_names[] = {
+        [THREAD_READY]   = "ready",
+        [THREAD_RUNNING] = "running",
+        [THREAD_BLOCKED] = "blocked",
+        [THREAD_DEAD]    = "dead",
+    };
+
+    // Copy out under the lock, print without it
+    struct { uint32_t id, cpu; thread_state_t state; const char *name; } rows[64];
+    size_t count = 0, total = 0;
+    uint64_t flags = spin_lock_irqsave(&all_lock);
+    for (thread_t *t = all_threads; t; t = t->all_next, total++) {
+        if (count == sizeof(rows) / sizeof(rows[0])) continue;
+        rows[count].id = t->id;
+        rows[count].cpu = t->cpu;
+        rows[count].state = t->state;
+        rows[count].name = t->name;
+        count++;
+    }
+    spin_unlock_irqrestore(&all_lock, flags);
+
+    kprintf("  %4s %4s %-8s %s\n", "id", "cpu", "state", "name");
+    for (size_t i = count; i-- > 0;) {
+        kprintf("  %4u %4u %-8s %s\n", rows[i].id, rows[i].cpu,
+                state_names[rows[i].state], rows[i].name ? rows[i].name : "?");
+    }
+    if (total > count) kprintf("  ... and %llu more\n", (unsigned long long)(total - count));
+}
@@ -0,0 +1,102 @@
+#ifndef CORE_SCHED_H
+#define CORE_SCHED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arch/x86/smp.h"
+#include "arch/x86/spinlock.h"
+#include "core/timer.h"
+#include "memory/vmm.h"
+
+// Kernel threads on per-CPU run queues. The timer tick preempts threads
+// after SCHED_SLICE_TICKS (on the BSP only when there is no local APIC);
+// a CPU whose queue runs dry steals from the busiest other queue.
+
+#define THREAD_STACK_PAGES 4  // 16 KiB
+#define SCHED_SLICE_TICKS  2
+
+typedef void (*thread_fn_t)(void *arg);
+
+typedef enum {
+    THREAD_READY,
+    THREAD_RUNNING,
+    THREAD_BLOCKED,
+    THREAD_DEAD,
+} thread_state_t;
+
+typedef struct thread {
+    uint64_t rsp;              // Saved stack pointer while switched out
+    uint64_t stack_top;        // Loaded into TSS.rsp0 when switched in
+    void *stack;               // Physical stack pages, NULL for idle threads
+    struct thread *next;       // Run queue or wait queue link
+    struct thread *all_next;   // Every live thread, for sched_dump()
+    volatile thread_state_t state;
+    uint32_t id;
+    uint32_t cpu;              // Run queue the thread belongs to
+    bool pinned;               // Never stolen by another CPU
+    const char *name;
+    thread_fn_t fn;
+    void *arg;
+    ktimer_t sleep_timer;
+    void *fpu_area;            // Saved FPU/SSE/AVX state, allocated on first use
+    uint32_t fpu_cpu;          // CPU whose registers last loaded fpu_area
+    page_table_t *page_table;  // Own address space, NULL for kernel threads
+} thread_t;
+
+// Threads blocked until some condition holds. Wakers may run in IRQ context.
+typedef struct {
+    spinlock_t lock;
+    thread_t *head;
+} wait_queue_t;
+
+// Thread running on this CPU; NULL until the scheduler is up. One load via
+// GS, so the answer stays right even if the thread migrates right after.
+static inline thread_t *sched_current(void) {
+    thread_t *thread;
+    asm volatile ("mov %%gs:16, %0" : "=r"(thread));
+    return thread;
+}
+
+// BSP: turn the running flow into this CPU's idle thread. Threads may be
+// created from here on; they run once sched_idle() is entered.
+void sched_init(void);
+
+// BSP: run threads forever; the caller's flow idles when there are none
+void sched_idle(void) __attribute__((noreturn));
+
+// AP: become this CPU's idle thread and start stealing work
+void sched_ap_enter(void) __attribute__((noreturn));
+
+// Create a thread and queue it on the calling CPU; NULL if out of memory
+thread_t *thread_create(const char *name, thread_fn_t fn, void *arg);
+
+// Same, but the thread runs in address space pt. The thread owns pt
+// from then on (even if this fails) and destroys it with its VMAs on exit.
+thread_t *thread_create_in(const char *name, page_table_t *pt, thread_fn_t fn, void *arg);
+
+void thread_exit(void) __attribute__((noreturn));
+void thread_sleep_ns(uint64_t ns);
+void sched_yield(void);
+
+// Make a blocked thread runnable again (no-op for any other state)
+void sched_wake(thread_t *thread);
+
+// Block the current thread until cond(arg) is true. cond is evaluated with
+// the queue lock held and interrupts off, so it must be short.
+void wait_queue_wait(wait_queue_t *wq, bool (*cond)(void *), void *arg);
+void wait_queue_wake_all(wait_queue_t *wq);
+
+// Timer IRQ: charge the running thread a tick
+void sched_tick(void);
+
+// IPI_RESCHEDULE_VECTOR handler: new work was queued while this CPU halted
+void sched_resched_ipi(void);
+
+// IRQ stubs, after EOI: switch away if a reschedule was requested
+void sched_irq_exit(void);
+
+// Print every thread with its state and CPU
+void sched_dump(void);
+
+#endif // CORE_SCHED_H
@@ -0,0 +1,162 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arch/x86/cpu.h"
+#include "arch/x86/io.h"
+#include "arch/x86/spinlock.h"
+#include "core/sched.h"
+#include "core/serial.h"
+#include "core/timer.h"
+
+// 16550 UART on COM1. Output goes through a byte ring: writers append to it
+// and arm the TX-empty interrupt, the IRQ4 handler refills the 16-byte FIFO
+// until the ring runs dry and then disarms it again.
+
+#define COM1_BASE    0x3F8
+#define UART_DATA    (COM1_BASE + 0)  // THR/RBR, divisor low with DLAB
+#define UART_IER     (COM1_BASE + 1)  // Interrupt enable, divisor high with DLAB
+#define UART_IIR     (COM1_BASE + 2)  // Interrupt identification / FIFO control
+#define UART_LCR     (COM1_BASE + 3)
+#define UART_MCR     (COM1_BASE + 4)
+#define UART_LSR     (COM1_BASE + 5)
+
+#define UART_IER_THRE   0x02
+#define UART_LCR_8N1    0x03
+#define UART_LCR_DLAB   0x80
+#define UART_FCR_ENABLE 0xC7  // Enable + clear both FIFOs, 14-byte RX trigger
+#define UART_MCR_IRQ    0x0B  // DTR, RTS and OUT2 (routes the IRQ line)
+#define UART_MCR_LOOP   0x1E  // Loopback for the presence test
+#define UART_LSR_THRE   0x20
+#define UART_LSR_TEMT   0x40
+#define UART_FIFO_SIZE  16
+#define UART_DIVISOR    1     // 115200 baud
+
+#define SERIAL_TX_RING  4096  // Power of two
+
+static char tx_ring[SERIAL_TX_RING];
+static volatile uint32_t tx_head = 0;  // Written by serial_write()
+static volatile uint32_t tx_tail = 0;  // Written by the interrupt handler
+static volatile bool tx_armed = false;
+static spinlock_t tx_lock;  // Serialises writers against each other and the handler
+static bool present = false;
+static bool irq_enabled = false;  // IRQ4 routed and unmasked
+
+bool serial_init(void) {
+    outb(UART_IER, 0x00);
+    outb(UART_LCR, UART_LCR_DLAB);
+    outb(UART_DATA, UART_DIVISOR & 0xFF);
+    outb(UART_IER, UART_DIVISOR >> 8);
+    outb(UART_LCR, UART_LCR_8N1);
+    outb(UART_IIR, UART_FCR_ENABLE);
+
+    // Echo a byte through loopback to make sure a UART is actually there
+    outb(UART_MCR, UART_MCR_LOOP);
+    outb(UART_DATA, 0xAE);
+    if (inb(UART_DATA) != 0xAE) {
+        present = false;
+        return false;
+    }
+
+    outb(UART_MCR, UART_MCR_IRQ);
+    present = true;
+    return true;
+}
+
+void serial_enable_irq(void) {
+    if (!present) return;
+    irq_enabled = true;
+
+    // Anything queued during early boot raised THRE before the PIC was
+    // programmed; re-arming produces a fresh edge for it
+    tx_armed = tx_head != tx_tail;
+    outb(UART_IER, 0x00);
+    if (tx_armed) outb(UART_IER, UART_IER_THRE);
+}
+
+size_t serial_tx_space(void) {
+    return SERIAL_TX_RING - 1 - ((tx_head - tx_tail) & (SERIAL_TX_RING - 1));
+}
+
+size_t serial_write(const char* buf, size_t len) {
+    if (!present) return len;
+
+    uint64_t flags = spin_lock_irqsave(&tx_lock);
+    size_t space = serial_tx_space();
+    if (len > space) len = space;
+
+    uint32_t head = tx_head;
+    for (size_t i = 0; i < len; i++) {
+        tx_ring[head] = buf[i];
+        head = (head + 1) & (SERIAL_TX_RING - 1);
+    }
+    // Publish the bytes before the handler can look at the new head
+    __atomic_store_n(&tx_head, head, __ATOMIC_RELEASE);
+
+    // Arming THRE with the holding register already empty raises the
+    // interrupt right away, which starts the transfer
+    if (len && irq_enabled && !tx_armed) {
+        tx_armed = true;
+        outb(UART_IER, UART_IER_THRE);
+    }
+    spin_unlock_irqrestore(&tx_lock, flags);
+    return len;
+}
+
+void serial_write_all(const char* buf, size_t len) {
+    for (size_t sent = 0; sent < len; ) {
+        sent += serial_write(buf + sent, len - sent);
+        if (sent == len) break;
+        if (!interrupts_enabled()) serial_flush();
+        else if (sched_current()) thread_sleep_ns(TIMER_TICK_NS);
+        else asm volatile ("hlt");
+    }
+}
+
+void serial_flush(void) {
+    if (!present) return;
+
+    // Drain by polling; used when interrupts may be off for good. The
+    // handler may be draining on another CPU, so each FIFO load goes out
+    // under tx_lock the way it does there.
+    for (;;) {
+        while (!(inb(UART_LSR) & UART_LSR_THRE)) asm volatile ("pause");
+
+        uint64_t flags = spin_lock_irqsave(&tx_lock);
+        uint32_t tail = tx_tail;
+        uint32_t head = __atomic_load_n(&tx_head, __ATOMIC_ACQUIRE);
+        bool empty = tail == head;
+        if (!empty && (inb(UART_LSR) & UART_LSR_THRE)) {
+            for (int i = 0; i < UART_FIFO_SIZE && tail != head; i++) {
+                outb(UART_DATA, (uint8_t)tx_ring[tail]);
+                tail = (tail + 1) & (SERIAL_TX_RING - 1);
+            }
+            tx_tail = tail;
+        }
+        spin_unlock_irqrestore(&tx_lock, flags);
+        if (empty) break;
+    }
+    while (!(inb(UART_LSR) & UART_LSR_TEMT)) asm volatile ("pause");
+}
+
+void serial_interrupt_handler(void) {
+    // Reading IIR acknowledges a pending THRE interrupt
+    (void)inb(UART_IIR);
+    if (!present) return;
+
+    spin_lock(&tx_lock);
+    if (inb(UART_LSR) & UART_LSR_THRE) {
+        uint32_t tail = tx_tail;
+        uint32_t head = __atomic_load_n(&tx_head, __ATOMIC_ACQUIRE);
+        for (int i = 0; i < UART_FIFO_SIZE && tail != head; i++) {
+            outb(UART_DATA, (uint8_t)tx_ring[tail]);
+            tail = (tail + 1) & (SERIAL_TX_RING - 1);
+        }
+        tx_tail = tail;
+    }
+
+    if (tx_tail == tx_head) {
+        tx_armed = false;
+        outb(UART_IER, 0x00);
+    }
+    spin_unlock(&tx_lock);
+}
@@ -0,0 +1,32 @@
+#ifndef CORE_SERIAL_H
+#define CORE_SERIAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Bring up COM1 (115200 8N1, FIFO on). Returns false if no UART answers.
+bool serial_init(void);
+
+// Start interrupt-driven transmission once IRQ4 is unmasked. Until then
+// bytes only accumulate in the transmit ring.
+void serial_enable_irq(void);
+
+// Queue bytes for transmission; the TX-empty interrupt moves them into the
+// UART FIFO. Returns how many bytes fit in the transmit ring.
+size_t serial_write(const char* buf, size_t len);
+
+// Queue all of buf, waiting for room in the transmit ring instead of
+// dropping bytes: the calling thread sleeps while the TX interrupt drains
+// the ring, and with interrupts off the ring is drained by polling.
+void serial_write_all(const char* buf, size_t len);
+
+// Free space in the transmit ring
+size_t serial_tx_space(void);
+
+// Busy-wait until everything queued has left the UART (panic paths)
+void serial_flush(void);
+
+// Called from the IRQ4 stub
+void serial_interrupt_handler(void);
+
+#endif // CORE_SERIAL_H
@@ -1,13 +1,29 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include "arch/x86/acpi.h"
+#include "arch/x86/cpu.h"
+#include "arch/x86/io.h"
+#include "core/batch.h"
+#include "core/bench.h"
 #include "core/boot.h"
+#include "core/elf.h"
 #include "core/console.h"
 #include "core/keyboard.h"
 #include "core/log.h"
+#include "core/prof.h"
+#include "core/sched.h"
+#include "core/shell.h"
+#include "core/stats.h"
+#include "core/timer.h"
+#include "core/trace.h"
+#include "fs/initramfs.h"
+#include "libc/stdio.h"
 #include "libc/string.h"
+#include "memory/dma.h"
 #include "memory/heap.h"
 #include "memory/pmm.h"
+#include "memory/vma.h"
 #include "memory/vmm.h"
 
 // ================= Command functions =================
@@ -23,6 +39,17 @@ static void cmd_help(struct limine_framebuffer *fb) {
     print(fb, "  vmtest     - Run a VMM test\n");
     print(fb, "  heaptest   - Run a heap allocation test\n");
     print(fb, "  fbinfo     - Show framebuffer details\n");
+    print(fb, "  bench [suite] - Run microbenchmarks ('bench list' for suites)\n");
+    print(fb, "  uptime     - Show time since boot and the clock source\n");
+    print(fb, "  stats      - Dump and reset the hot-path event counters\n");
+    print(fb, "  ps         - List kernel threads and the CPU each runs on\n");
+    print(fb, "  ls         - List the files in the initramfs\n");
+    print(fb, "  cat [path] - Print an initramfs file\n");
+    print(fb, "  exec [path] - Run an ELF executable from the initramfs\n");
+    print(fb, "  batchlog   - Show the output captured from the boot batch script\n");
+    print(fb, "  shutdown   - Power off the machine\n");
+    print(fb, "  prof start|stop|report [n] - Sampling profiler, top-n functions\n");
+    print(fb, "  trace start|stop|dump - Boot/command/IRQ timeline as Chrome JSON on COM1\n");
     print(fb, "  scale [factor] - Set framebuffer scaling factor\n");
 }
 
@@ -163,27 +190,32 @@ static void cmd_crash(struct limine_framebuffer *fb, const char *args) {
 }
 
 static void cmd_meminfo(struct limine_framebuffer *fb) {
+    (void)fb;
     size_t total, used, free;
     pmm_get_stats(&total, &used, &free);
-    
-    print(fb, "Memory Information:\n");
-    print(fb, "  Total pages: ");
-    print_hex(fb, total);
-    print(fb, " (");
-    print_hex(fb, total * 4); // KB
-    print(fb, " KB)\n");
-    
-    print(fb, "  Used pages:  ");
-    print_hex(fb, used);
-    print(fb, " (");
-    print_hex(fb, used * 4);
-    print(fb, " KB)\n");
-    
-    print(fb, "  Free pages:  ");
-    print_hex(fb, free);
-    print(fb, " (");
-    print_hex(fb, free * 4);
-    print(fb, " KB)\n");
+
+    kprintf("Memory Information:\n"
+            "  Total pages: 0x%016zX (0x%016zX KB)\n"
+            "  Used pages:  0x%016zX (0x%016zX KB)\n"
+            "  Free pages:  0x%016zX (0x%016zX KB)\n",
+            total, total * 4, used, used * 4, free, free * 4);
+
+    size_t blocks[PMM_ORDER_COUNT];
+    pmm_get_order_stats(blocks);
+
+    size_t dma_total, dma_free_pages;
+    dma_get_stats(&dma_total, &dma_free_pages);
+
+    kprintf("  Regions: %zu\n"
+            "  Pre-zeroed pages: %zu\n"
+            "  DMA zone: %zu KB free of %zu KB\n"
+            "  Free blocks per order:\n",
+            pmm_region_count(), pmm_zeroed_pages(), dma_free_pages * 4, dma_total * 4);
+    for (int order = 0; order < PMM_ORDER_COUNT; order++) {
+        if (blocks[order] == 0) continue;
+        kprintf("    order %2d (%7llu KB): %zu\n",
+                order, (unsigned long long)4 << order, blocks[order]);
+    }
 }
 
 static void cmd_memtest(struct limine_framebuffer *fb) {
@@ -220,6 +252,56 @@ static void cmd_memtest(struct limine_framebuffer *fb) {
     print(fb, "Memory test complete!\n");
 }
 
+// Demand paging and copy-on-write, with the test address spaces loaded
+// by hand; interrupts stay off so the scheduler can't switch CR3 back
+static void vmtest_cow(struct limine_framebuffer *fb) {
+    const uint64_t base = 0x400000;
+    page_table_t* parent = vmm_create_page_table();
+    if (!parent || !vma_map(parent, base, 4 * PAGE_SIZE, VMA_USER | VMA_READ | VMA_WRITE, NULL, 0)) {
+        print(fb, "Failed to set up a VMA!\n");
+        if (parent) vmm_destroy_page_table(parent);
+        return;
+    }
+
+    uint64_t flags = irq_save();
+    page_table_t* kernel_pt = vmm_get_kernel_page_table();
+    volatile uint64_t* word = (volatile uint64_t*)base;
+
+    vmm_switch_page_table(parent);
+    bool zero_filled = *word == 0;
+    *word = 0x1111;
+    page_table_t* child = vmm_clone_address_space(parent);
+    *word = 0x2222;  // Parent breaks the sharing with a copy
+    uint64_t parent_phys = vmm_get_physical(parent, base);
+
+    bool child_ok = false;
+    bool split = false;
+    if (child) {
+        vmm_switch_page_table(child);
+        child_ok = *word == 0x1111;
+        *word = 0x3333;  // Last mapping: reused in place
+        split = vmm_get_physical(child, base) != parent_phys;
+    }
+    vmm_switch_page_table(kernel_pt);
+    irq_restore(flags);
+
+    print(fb, zero_filled ? "Demand zero-fill verified!\n" : "Demand zero-fill FAILED!\n");
+    if (!child) {
+        print(fb, "Failed to clone address space!\n");
+    } else if (child_ok && split) {
+        print(fb, "Copy-on-write clone verified!\n");
+    } else {
+        print(fb, "Copy-on-write clone FAILED!\n");
+    }
+
+    if (child) {
+        vma_destroy_all(child);
+        vmm_destroy_page_table(child);
+    }
+    vma_destroy_all(parent);
+    vmm_destroy_page_table(parent);
+}
+
 static void cmd_vmtest(struct limine_framebuffer *fb) {
     print(fb, "Testing Virtual Memory Manager...\n");
     
@@ -237,6 +319,7 @@ static void cmd_vmtest(struct limine_framebuffer *fb) {
     uint64_t phys_page = (uint64_t)pmm_alloc();
     if (!phys_page) {
         print(fb, "Failed to allocate physical page!\n");
+        vmm_destroy_page_table(test_pt);
         return;
     }
     print(fb, "Allocated physical page: ");
@@ -249,6 +332,7 @@ static void cmd_vmtest(struct limine_framebuffer *fb) {
     if (!mapped) {
         print(fb, "Failed to map page!\n");
         pmm_free((void*)phys_page);
+        vmm_destroy_page_table(test_pt);
         return;
     }
     print(fb, "Mapped virtual ");
@@ -281,7 +365,47 @@ static void cmd_vmtest(struct limine_framebuffer *fb) {
     
     // Clean up
     pmm_free((void*)phys_page);
-    
+
+    // Test a 2MB huge page and splitting it with a 4KB unmap
+    uint64_t huge_phys = (uint64_t)pmm_alloc_pages(512);
+    uint64_t huge_virt = 0x40000000;
+    if (!huge_phys) {
+        print(fb, "Failed to allocate 2MB of physical memory!\n");
+    } else if (!vmm_map_page_2m(test_pt, huge_virt, huge_phys, PAGE_WRITE | PAGE_USER)) {
+        print(fb, "Failed to map 2MB page!\n");
+        pmm_free_pages((void*)huge_phys, 512);
+    } else {
+        print(fb, "Mapped 2MB page at ");
+        print_hex(fb, huge_virt);
+        print(fb, " -> ");
+        print_hex(fb, huge_phys);
+        print(fb, "\n");
+
+        uint64_t probe = huge_virt + 0x123000;
+        if (vmm_get_page_size(test_pt, probe) == PAGE_SIZE_2M
+            && vmm_get_physical(test_pt, probe) == huge_phys + 0x123000) {
+            print(fb, "Huge page lookup verified!\n");
+        } else {
+            print(fb, "Huge page lookup FAILED!\n");
+        }
+
+        vmm_unmap_page(test_pt, probe);
+        if (vmm_get_physical(test_pt, probe) == 0
+            && vmm_get_page_size(test_pt, probe + PAGE_SIZE) == PAGE_SIZE
+            && vmm_get_physical(test_pt, probe + PAGE_SIZE) == huge_phys + 0x124000) {
+            print(fb, "Huge page split on 4KB unmap verified!\n");
+        } else {
+            print(fb, "Huge page split FAILED!\n");
+        }
+
+        pmm_free_pages((void*)huge_phys, 512);
+    }
+
+    vmm_destroy_page_table(test_pt);
+    print(fb, "Destroyed test page table\n");
+
+    vmtest_cow(fb);
+
     print(fb, "VMM test complete!\n");
 }
 
@@ -415,6 +539,129 @@ static void cmd_fbinfo(struct limine_framebuffer *fb_unused) {
         print(NULL, "\n");
     }
 }
+static void cmd_uptime(struct limine_framebuffer *fb) {
+    (void)fb;
+    uint64_t ns = ktime_ns();
+    kprintf("Up %llu.%03llu s, %llu ticks at %u Hz\n",
+            (unsigned long long)(ns / NS_PER_SEC),
+            (unsigned long long)(ns % NS_PER_SEC / 1000000),
+            (unsigned long long)timer_ticks(), TIMER_HZ);
+    if (timer_tsc_hz()) {
+        kprintf("Clock: TSC at %llu kHz\n", (unsigned long long)(timer_tsc_hz() / 1000));
+    } else {
+        kprintf("Clock: PIT ticks (TSC uncalibrated)\n");
+    }
+}
+
+static void cmd_stats(struct limine_framebuffer *fb) {
+    (void)fb;
+    kprintf("Counters since last reset:\n");
+    kstats_dump_and_reset();
+}
+
+static void cmd_ps(struct limine_framebuffer *fb) {
+    (void)fb;
+    sched_dump();
+}
+
+static void cmd_ls(struct limine_framebuffer *fb) {
+    size_t count = initramfs_count();
+    if (count == 0) {
+        print(fb, "No initramfs loaded\n");
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        const initramfs_file_t *file = initramfs_at(i);
+        if (!file->path[0]) continue;
+        kprintf("  %04o %10zu  %s%s\n", file->mode, file->size, file->path, file->dir ? "/" : "");
+    }
+}
+
+static void cmd_cat(struct limine_framebuffer *fb, const char *args) {
+    const initramfs_file_t *file = initramfs_open(args);
+    if (!file || file->dir) {
+        print(fb, "cat: no such file: ");
+        print(fb, args);
+        print(fb, "\n");
+        return;
+    }
+    // Straight out of the module, no copy
+    console_write(initramfs_map(file, 0, file->size), file->size);
+    if (file->size && file->data[file->size - 1] != '\n') print(fb, "\n");
+}
+
+static void cmd_exec(struct limine_framebuffer *fb, const char *args) {
+    (void)fb;
+    // The thread may be gone by the time this prints: don't touch it
+    if (!elf_spawn(args)) {
+        kprintf("exec: cannot run %s\n", args);
+        return;
+    }
+    kprintf("Started %s\n", args);
+}
+
+static void cmd_batchlog(struct limine_framebuffer *fb) {
+    size_t len;
+    const char *out = batch_output(&len);
+    if (!out || len == 0) {
+        print(fb, "No batch output captured\n");
+        return;
+    }
+    console_write(out, len);
+}
+
+static void cmd_shutdown(struct limine_framebuffer *fb) {
+    print(fb, "Powering off\n");
+    log_info("shell", "shutdown requested");
+    log_flush();
+
+    asm volatile ("cli");
+    acpi_shutdown();
+    // QEMU (q35, then i440fx/Bochs) power-off ports, for tables without \_S5_
+    outw(0x604, 0x2000);
+    outw(0xB004, 0x2000);
+
+    print(fb, "Shutdown failed, halting\n");
+    boot_hcf();
+}
+
+static void cmd_prof(struct limine_framebuffer *fb, const char *args) {
+    (void)fb;
+    if (strncmp(args, "start", 5) == 0) {
+        prof_start();
+        kprintf("prof: sampling at %u Hz\n", TIMER_HZ);
+    } else if (strncmp(args, "stop", 4) == 0) {
+        prof_stop();
+        kprintf("prof: stopped\n");
+    } else if (strncmp(args, "report", 6) == 0) {
+        const char *p = args + 6;
+        uint32_t top = 0;
+        while (*p == ' ') p++;
+        while (*p >= '0' && *p <= '9') top = top * 10 + (uint32_t)(*p++ - '0');
+        prof_report(top);
+    } else {
+        kprintf("usage: prof start|stop|report [n]\n");
+    }
+}
+
+static void cmd_trace(struct limine_framebuffer *fb, const char *args) {
+    (void)fb;
+    if (strncmp(args, "start", 5) == 0) {
+        trace_start();
+        kprintf("trace: recording (buffer cleared)\n");
+    } else if (strncmp(args, "stop", 4) == 0) {
+        trace_stop();
+        kprintf("trace: stopped\n");
+    } else if (strncmp(args, "dump", 4) == 0) {
+        kprintf("trace: writing JSON to COM1...\n");
+        size_t dropped = 0;
+        size_t written = trace_dump(&dropped);
+        kprintf("trace: %zu events written, %zu dropped (buffer holds %u)\n",
+                written, dropped, TRACE_MAX_EVENTS);
+    } else {
+        kprintf("usage: trace start|stop|dump\n");
+    }
+}
 
 static void cmd_scale(struct limine_framebuffer *fb, const char *args) {
     (void)fb;
@@ -469,16 +716,16 @@ static struct command commands[] = {
     {"vmtest", cmd_vmtest, COMMAND_NO_ARGS},
     {"heaptest", cmd_heaptest, COMMAND_NO_ARGS},
     {"fbinfo", cmd_fbinfo, COMMAND_NO_ARGS},
+    {"uptime", cmd_uptime, COMMAND_NO_ARGS},
+    {"stats", cmd_stats, COMMAND_NO_ARGS},
+    {"ps", cmd_ps, COMMAND_NO_ARGS},
+    {"ls", cmd_ls, COMMAND_NO_ARGS},
+    {"batchlog", cmd_batchlog, COMMAND_NO_ARGS},
+    {"shutdown", cmd_shutdown, COMMAND_NO_ARGS},
     {NULL, NULL, COMMAND_NO_ARGS} // Sentinel
 };
 
 static void execute_command(struct limine_framebuffer *fb, char *input) {
-    // Skip leading spaces
-    while (*input == ' ') input++;
-    
-    // Empty command
-    if (*input == '\0') return;
-    
     // Find end of command word
     char *args = input;
     while (*args && *args != ' ') args++;
@@ -505,6 +752,31 @@ static void execute_command(struct limine_framebuffer *fb, char *input) {
         return;
     }
 
+    if (strcmp(input, "prof") == 0) {
+        cmd_prof(fb, args);
+        return;
+    }
+
+    if (strcmp(input, "trace") == 0) {
+        cmd_trace(fb, args);
+        return;
+    }
+
+    if (strcmp(input, "cat") == 0) {
+        cmd_cat(fb, args);
+        return;
+    }
+
+    if (strcmp(input, "exec") == 0) {
+        cmd_exec(fb, args);
+        return;
+    }
+
+    if (strcmp(input, "bench") == 0) {
+        bench_command(args);
+        return;
+    }
+
     for (int i = 0; commands[i].name != NULL; i++) {
         if (strcmp(input, commands[i].name) == 0) {
             commands[i].func(fb);
@@ -516,6 +788,19 @@ static void execute_command(struct limine_framebuffer *fb, char *input) {
     cmd_unknown(fb, input);
 }
 
+void shell_execute(struct limine_framebuffer *fb, char *input) {
+    // Skip leading spaces
+    while (*input == ' ') input++;
+    
+    // Empty command
+    if (*input == '\0') return;
+
+    // One slice per command, labelled with the line as typed
+    trace_begin_arg("shell", input);
+    execute_command(fb, input);
+    trace_end("shell");
+}
+
 // ================= Input handling =================
 #define INPUT_BUFFER_SIZE 256
 
@@ -619,7 +904,7 @@ void shell_loop(struct limine_framebuffer *fb) {
             
             if (input_pos > 0) {
                 history_record(input_buffer);
-                execute_command(fb, input_buffer);
+                shell_execute(fb, input_buffer);
             }
             
             // Reset for next command
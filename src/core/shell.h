@@ -5,4 +5,7 @@
 
 void shell_loop(struct limine_framebuffer *fb);
 
+// Run one command line as if typed at the prompt; the line is modified
+void shell_execute(struct limine_framebuffer *fb, char *input);
+
 #endif // CORE_SHELL_H
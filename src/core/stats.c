@@ -0,0 +1,41 @@
+#include <stdint.h>
+#include "core/stats.h"
+#include "libc/stdio.h"
+#include "libc/string.h"
+
+kstat_block_t kstat_cpus[KSTAT_MAX_CPUS];
+uint64_t kstat_vectors[KSTAT_MAX_CPUS][KSTAT_VECTORS];
+
+_Static_assert(sizeof(kstat_vectors[0]) == 1 << 11, "KSTAT_VECTOR_ASM scales the CPU id by 2^11");
+_Static_assert(CPU_ID_OFFSET == 8, "KSTAT_VECTOR_ASM reads the CPU id at %gs:8");
+
+#if KSTATS_ENABLED
+static const char *const kstat_names[KSTAT_COUNT] = {
+#define KSTAT_NAME(id, name) [KSTAT_##id] = name,
+    KSTAT_LIST(KSTAT_NAME)
+#undef KSTAT_NAME
+};
+#endif
+
+void kstats_dump_and_reset(void) {
+#if KSTATS_ENABLED
+    // Snapshot first so the printing below does not count itself
+    uint64_t totals[KSTAT_COUNT] = {0};
+    uint64_t vectors[KSTAT_VECTORS] = {0};
+    for (int cpu = 0; cpu < KSTAT_MAX_CPUS; cpu++) {
+        for (int i = 0; i < KSTAT_COUNT; i++) totals[i] += kstat_cpus[cpu].counters[i];
+        for (int v = 0; v < KSTAT_VECTORS; v++) vectors[v] += kstat_vectors[cpu][v];
+    }
+    memset(kstat_cpus, 0, sizeof(kstat_cpus));
+    memset(kstat_vectors, 0, sizeof(kstat_vectors));
+
+    for (int i = 0; i < KSTAT_COUNT; i++) {
+        if (totals[i]) kprintf("  %-28s %llu\n", kstat_names[i], (unsigned long long)totals[i]);
+    }
+    for (int v = 0; v < KSTAT_VECTORS; v++) {
+        if (vectors[v]) kprintf("  irq.vector_%-17d %llu\n", v, (unsigned long long)vectors[v]);
+    }
+#else
+    kprintf("  counters compiled out (KSTATS_ENABLED=0)\n");
+#endif
+}
@@ -0,0 +1,96 @@
+#ifndef CORE_STATS_H
+#define CORE_STATS_H
+
+#include <stdint.h>
+#include "arch/x86/smp.h"
+
+// Hot-path event counters. Build with -DKSTATS_ENABLED=0 (for example
+// `make CPPFLAGS=-DKSTATS_ENABLED=0`) and every KSTAT_* use compiles away.
+#ifndef KSTATS_ENABLED
+#define KSTATS_ENABLED 1
+#endif
+
+// X(id, name)
+#define KSTAT_LIST(X) \
+    X(PMM_ALLOC,           "pmm.alloc")                \
+    X(PMM_ALLOC_CACHED,    "pmm.alloc_from_cache")     \
+    X(PMM_SCAN_WORDS,      "pmm.summary_words_scanned") \
+    X(PMM_MAG_HIT,         "pmm.magazine_hit")         \
+    X(PMM_MAG_REFILL,      "pmm.magazine_refill")      \
+    X(PMM_MAG_SPILL,       "pmm.magazine_spill")       \
+    X(HEAP_KMALLOC,        "heap.kmalloc")             \
+    X(HEAP_SLAB_HIT,       "heap.slab_hit")            \
+    X(HEAP_NODES_WALKED,   "heap.nodes_walked")        \
+    X(SLAB_MAG_HIT,        "slab.magazine_hit")        \
+    X(SLAB_MAG_REFILL,     "slab.magazine_refill")     \
+    X(SLAB_MAG_SPILL,      "slab.magazine_spill")      \
+    X(SCHED_SWITCH,        "sched.context_switches")   \
+    X(SCHED_PREEMPT,       "sched.preemptions")        \
+    X(SCHED_STEAL,         "sched.steals")             \
+    X(SCHED_WAKEUP,        "sched.wakeups")            \
+    X(SYSCALL,             "syscall.calls")            \
+    X(FPU_SAVE,            "fpu.saves")                \
+    X(FPU_RESTORE,         "fpu.restores")             \
+    X(VMM_TABLES_CREATED,  "vmm.tables_created")       \
+    X(VMM_INVLPG,          "vmm.invlpg")               \
+    X(VMM_CR3_RELOAD,      "vmm.cr3_reload")           \
+    X(VMM_FLUSH_EVERYTHING,"vmm.flush_all_pcids")      \
+    X(VMM_PCID_KEPT,       "vmm.switch_kept_tlb")      \
+    X(VMM_PCID_ROLLOVER,   "vmm.pcid_generations")     \
+    X(VMM_SHOOTDOWN,       "vmm.shootdowns")           \
+    X(VMM_SHOOTDOWN_IPI,   "vmm.shootdown_ipis")       \
+    X(VMA_FAULT_ANON,      "vma.fault_zero_fill")      \
+    X(VMA_FAULT_FILE,      "vma.fault_file_copy")      \
+    X(VMA_FAULT_DIRECT,    "vma.fault_file_direct")    \
+    X(VMA_COW_COPY,        "vma.cow_copy")             \
+    X(VMA_COW_REUSE,       "vma.cow_reuse_last")       \
+    X(CONSOLE_CELLS,       "console.cells_drawn")      \
+    X(CONSOLE_GLYPH_MISS,  "console.glyph_cache_miss") \
+    X(CONSOLE_SCROLLS,     "console.scrolls")          \
+    X(CONSOLE_SCROLL_BYTES,"console.scroll_bytes")     \
+    X(CONSOLE_FLUSH_BYTES, "console.flush_bytes")
+
+typedef enum {
+#define KSTAT_ENUM(id, name) KSTAT_##id,
+    KSTAT_LIST(KSTAT_ENUM)
+#undef KSTAT_ENUM
+    KSTAT_COUNT
+} kstat_id_t;
+
+#define KSTAT_VECTORS 256
+
+// Counters are kept per CPU and only summed when read
+#define KSTAT_MAX_CPUS SMP_MAX_CPUS
+
+typedef struct {
+    uint64_t counters[KSTAT_COUNT];
+} kstat_block_t;
+
+extern kstat_block_t kstat_cpus[KSTAT_MAX_CPUS];
+extern uint64_t kstat_vectors[KSTAT_MAX_CPUS][KSTAT_VECTORS];
+
+static inline kstat_block_t *kstat_local(void) {
+    return &kstat_cpus[smp_cpu_id()];
+}
+
+#if KSTATS_ENABLED
+// A plain add to this CPU's block: no other CPU writes it, and the add is
+// one instruction, so an interrupt cannot split it
+#define KSTAT_ADD(id, n) ((void)(kstat_local()->counters[KSTAT_##id] += (uint64_t)(n)))
+// For the IRQ stubs (after %rax is saved): bump kstat_vectors[cpu][vec].
+// A row is 256 * 8 = 2^11 bytes.
+#define KSTAT_VECTOR_ASM(vec) \
+    "movl %gs:8, %eax\n" \
+    "shl $11, %rax\n" \
+    "incq kstat_vectors + 8 * " #vec "(%rax)\n"
+#else
+#define KSTAT_ADD(id, n) ((void)0)
+#define KSTAT_VECTOR_ASM(vec) ""
+#endif
+
+#define KSTAT_INC(id) KSTAT_ADD(id, 1)
+
+// Print every non-zero counter, then zero them all
+void kstats_dump_and_reset(void);
+
+#endif // CORE_STATS_H
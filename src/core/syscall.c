@@ -0,0 +1,77 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "core/console.h"
+#include "core/sched.h"
+#include "core/syscall.h"
+#include "core/timer.h"
+#include "memory/vma.h"
+#include "memory/vmm.h"
+
+// True if [addr, addr + len) lies entirely in the user half
+static bool user_range_ok(uint64_t addr, uint64_t len) {
+    return addr + len >= addr && addr + len <= VMM_USER_END;
+}
+
+static int64_t sys_exit(uint64_t code, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5) {
+    (void)code; (void)a1; (void)a2; (void)a3; (void)a4; (void)a5;
+    thread_exit();
+}
+
+// write(fd, buf, len): fds 1 and 2 both go to the console
+static int64_t sys_write(uint64_t fd, uint64_t buf, uint64_t len, uint64_t a3, uint64_t a4, uint64_t a5) {
+    (void)a3; (void)a4; (void)a5;
+    if (fd != 1 && fd != 2) return SYSCALL_EINVAL;
+    if (!user_range_ok(buf, len)) return SYSCALL_EFAULT;
+    page_table_t *pt = sched_current()->page_table;
+    if (!pt) return SYSCALL_ENOSYS;
+
+    // Bounce through a kernel buffer so the console never touches user memory
+    char chunk[256];
+    uint64_t done = 0;
+    while (done < len) {
+        uint64_t n = len - done < sizeof(chunk) ? len - done : sizeof(chunk);
+        if (!vma_copy_from_user(pt, chunk, buf + done, n)) {
+            return done ? (int64_t)done : SYSCALL_EFAULT;
+        }
+        console_write(chunk, (size_t)n);
+        done += n;
+    }
+    return (int64_t)len;
+}
+
+static int64_t sys_yield(uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5) {
+    (void)a0; (void)a1; (void)a2; (void)a3; (void)a4; (void)a5;
+    sched_yield();
+    return 0;
+}
+
+static int64_t sys_sleep_ns(uint64_t ns, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5) {
+    (void)a1; (void)a2; (void)a3; (void)a4; (void)a5;
+    thread_sleep_ns(ns);
+    return 0;
+}
+
+static int64_t sys_clock_ns(uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5) {
+    (void)a0; (void)a1; (void)a2; (void)a3; (void)a4; (void)a5;
+    return (int64_t)ktime_ns();
+}
+
+// brk(addr): move the program break and return the new one; on failure, or
+// for 0, return the current break unchanged
+static int64_t sys_brk(uint64_t addr, uint64_t a1, uint64_t a2, uint64_t a3, uint64_t a4, uint64_t a5) {
+    (void)a1; (void)a2; (void)a3; (void)a4; (void)a5;
+    page_table_t *pt = sched_current()->page_table;
+    if (!pt) return SYSCALL_ENOSYS;
+    if (addr >= pt->brk_start && vma_set_end(pt, pt->brk_start, addr)) pt->brk = addr;
+    return (int64_t)pt->brk;
+}
+
+const syscall_fn_t syscall_table[SYS_COUNT] = {
+    [SYS_EXIT]     = sys_exit,
+    [SYS_WRITE]    = sys_write,
+    [SYS_YIELD]    = sys_yield,
+    [SYS_SLEEP_NS] = sys_sleep_ns,
+    [SYS_CLOCK_NS] = sys_clock_ns,
+    [SYS_BRK]      = sys_brk,
+};
@@ -0,0 +1,28 @@
+#ifndef CORE_SYSCALL_H
+#define CORE_SYSCALL_H
+
+#include <stdint.h>
+
+// System call numbers. The entry paths live in arch/x86/syscall.c.
+enum {
+    SYS_EXIT,
+    SYS_WRITE,
+    SYS_YIELD,
+    SYS_SLEEP_NS,
+    SYS_CLOCK_NS,
+    SYS_BRK,
+    SYS_COUNT
+};
+
+// Errors come back as small negative numbers
+#define SYSCALL_EFAULT (-14)
+#define SYSCALL_EINVAL (-22)
+#define SYSCALL_ENOSYS (-38)
+
+typedef int64_t (*syscall_fn_t)(uint64_t a0, uint64_t a1, uint64_t a2,
+                                uint64_t a3, uint64_t a4, uint64_t a5);
+
+// Indexed by number; NULL entries fail with SYSCALL_ENOSYS
+extern const syscall_fn_t syscall_table[SYS_COUNT];
+
+#endif // CORE_SYSCALL_H
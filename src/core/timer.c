@@ -0,0 +1,194 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arch/x86/apic.h"
+#include "arch/x86/cpu.h"
+#include "arch/x86/io.h"
+#include "arch/x86/smp.h"
+#include "arch/x86/spinlock.h"
+#include "core/console.h"
+#include "core/log.h"
+#include "core/prof.h"
+#include "core/sched.h"
+#include "core/timer.h"
+
+#define PIT_BASE_HZ      1193182
+#define PIT_CHANNEL0     0x40
+#define PIT_CHANNEL2     0x42
+#define PIT_COMMAND      0x43
+#define PIT_MODE_RATE    0x36  // Channel 0, lobyte/hibyte, mode 3 (square wave)
+#define PIT_MODE_ONESHOT 0xB0  // Channel 2, lobyte/hibyte, mode 0 (count down)
+#define PIT_GATE_PORT    0x61  // Bit 0 gates channel 2, bit 1 the speaker
+#define PIT_GATE_OUT2    0x20  // Channel 2 output, high at terminal count
+
+#define CALIBRATE_MS     10
+#define CALIBRATE_RUNS   3
+#define CALIBRATE_SPINS  100000000u  // Give up if the PIT never fires
+
+// Timers hash into slots by expiry tick; a slot is scanned every
+// WHEEL_SLOTS ticks and only the entries that are due run
+#define WHEEL_SLOTS      256  // Power of two
+
+static volatile uint64_t ticks = 0;
+
+// ns = ((tsc - tsc_base) * tsc_mult) >> 32
+static uint64_t tsc_hz = 0;
+static uint64_t tsc_base = 0;
+static uint64_t tsc_mult = 0;
+
+static ktimer_t *wheel[WHEEL_SLOTS];
+
+// Time one PIT channel 2 countdown in TSC cycles; 0 on timeout
+static uint64_t calibrate_once(uint16_t count) {
+    // Channel 2 gate on, speaker off
+    outb(PIT_GATE_PORT, (inb(PIT_GATE_PORT) & ~0x02) | 0x01);
+    outb(PIT_COMMAND, PIT_MODE_ONESHOT);
+    outb(PIT_CHANNEL2, (uint8_t)(count & 0xFF));
+    outb(PIT_CHANNEL2, (uint8_t)(count >> 8));
+
+    // Counting starts with the high byte written
+    uint64_t start = rdtsc();
+    for (uint32_t spins = 0; !(inb(PIT_GATE_PORT) & PIT_GATE_OUT2); spins++) {
+        if (spins == CALIBRATE_SPINS) return 0;
+    }
+    return rdtsc() - start;
+}
+
+bool timer_calibrate(void) {
+    uint16_t count = (uint16_t)(PIT_BASE_HZ * CALIBRATE_MS / 1000);
+
+    // Interruptions only ever make a run longer, so keep the shortest
+    uint64_t best = 0;
+    for (int run = 0; run < CALIBRATE_RUNS; run++) {
+        uint64_t cycles = calibrate_once(count);
+        if (cycles && (best == 0 || cycles < best)) best = cycles;
+    }
+    if (best == 0) return false;
+
+    tsc_hz = best * PIT_BASE_HZ / count;
+    tsc_mult = (NS_PER_SEC << 32) / tsc_hz;  // 1e9 << 32 still fits in 64 bits
+    tsc_base = rdtsc();
+    return true;
+}
+
+uint64_t timer_tsc_hz(void) {
+    return tsc_hz;
+}
+
+void timer_init(void) {
+    uint32_t divisor = PIT_BASE_HZ / TIMER_HZ;
+    outb(PIT_COMMAND, PIT_MODE_RATE);
+    outb(PIT_CHANNEL0, (uint8_t)(divisor & 0xFF));
+    outb(PIT_CHANNEL0, (uint8_t)(divisor >> 8));
+}
+
+uint64_t timer_ticks(void) {
+    return ticks;
+}
+
+uint64_t timer_cycles_to_ns(uint64_t cycles) {
+    return (uint64_t)(((unsigned __int128)cycles * tsc_mult) >> 32);
+}
+
+uint64_t timer_tsc_to_ns(uint64_t tsc) {
+    if (tsc_mult == 0 || tsc < tsc_base) return 0;
+    return timer_cycles_to_ns(tsc - tsc_base);
+}
+
+uint64_t ktime_ns(void) {
+    if (tsc_mult == 0) return ticks * TIMER_TICK_NS;
+    return timer_tsc_to_ns(rdtsc());
+}
+
+// ---------------- Timer wheel ----------------
+
+// Guards the wheel; callbacks run without it so they may re-arm or cancel
+static spinlock_t wheel_lock;
+
+static void wheel_insert(ktimer_t *timer) {
+    ktimer_t **slot = &wheel[timer->expires & (WHEEL_SLOTS - 1)];
+    timer->next = *slot;
+    if (timer->next) timer->next->pprev = &timer->next;
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+static void wheel_remove(ktimer_t *timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+static uint64_t ns_to_ticks(uint64_t ns) {
+    uint64_t t = (ns + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+    return t ? t : 1;
+}
+
+void ktimer_init(ktimer_t *timer, ktimer_fn_t fn, void *arg) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->period = 0;
+    timer->fn = fn;
+    timer->arg = arg;
+}
+
+void ktimer_arm(ktimer_t *timer, uint64_t delay_ns, uint64_t period_ns) {
+    uint64_t flags = spin_lock_irqsave(&wheel_lock);
+    if (timer->pprev) wheel_remove(timer);
+    timer->expires = ticks + ns_to_ticks(delay_ns);
+    timer->period = period_ns ? ns_to_ticks(period_ns) : 0;
+    wheel_insert(timer);
+    spin_unlock_irqrestore(&wheel_lock, flags);
+}
+
+bool ktimer_cancel(ktimer_t *timer) {
+    uint64_t flags = spin_lock_irqsave(&wheel_lock);
+    bool pending = timer->pprev != NULL;
+    if (pending) wheel_remove(timer);
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    return pending;
+}
+
+// Unlink one due timer from the slot of tick now (re-queuing it if
+// periodic), or return NULL when none is left
+static ktimer_t *take_due(uint64_t now) {
+    spin_lock(&wheel_lock);
+    ktimer_t *timer = wheel[now & (WHEEL_SLOTS - 1)];
+    while (timer && timer->expires > now) timer = timer->next;
+    if (timer) {
+        wheel_remove(timer);
+        if (timer->period) {
+            timer->expires = now + timer->period;
+            wheel_insert(timer);
+        }
+    }
+    spin_unlock(&wheel_lock);
+    return timer;
+}
+
+static void run_timers(uint64_t now) {
+    // One at a time: while a callback runs, any CPU may re-arm or cancel
+    // any timer, including the ones still due. Re-armed timers expire at
+    // now + 1 or later, so this ends.
+    ktimer_t *timer;
+    while ((timer = take_due(now)) != NULL) {
+        timer->fn(timer->arg);
+    }
+}
+
+void timer_interrupt_handler(struct irq_frame *frame) {
+    // Every CPU with a local APIC timer gets here and samples itself; the
+    // tick count, the wheel and the deferred output run on the BSP alone
+    if (apic_enabled()) apic_timer_tick();
+    sched_tick();
+    prof_tick(frame);
+    if (smp_cpu_id() != 0) return;
+
+    uint64_t now = ++ticks;
+    run_timers(now);
+    // Pick up records logged from interrupt context or left by a full UART
+    log_kick();
+    console_timer_tick();
+}
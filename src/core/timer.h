@@ -0,0 +1,64 @@
+#ifndef CORE_TIMER_H
+#define CORE_TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Rate of the periodic timer interrupt (IRQ0)
+#define TIMER_HZ 100
+#define NS_PER_SEC 1000000000ull
+#define TIMER_TICK_NS (NS_PER_SEC / TIMER_HZ)
+
+// Measure the TSC frequency against PIT channel 2. Returns false if the
+// measurement failed; ktime_ns() then falls back to tick resolution.
+bool timer_calibrate(void);
+
+// TSC frequency in Hz, 0 if uncalibrated
+uint64_t timer_tsc_hz(void);
+
+// Program PIT channel 0 for TIMER_HZ periodic interrupts (without a local APIC)
+void timer_init(void);
+
+// Number of BSP timer interrupts since interrupts were enabled
+uint64_t timer_ticks(void);
+
+// Monotonic nanoseconds since timer_calibrate()
+uint64_t ktime_ns(void);
+
+// Length of a TSC interval in nanoseconds (0 if uncalibrated)
+uint64_t timer_cycles_to_ns(uint64_t cycles);
+
+// Convert a raw rdtsc() value to the ktime_ns() timeline
+uint64_t timer_tsc_to_ns(uint64_t tsc);
+
+// Called from the vector 32 stub with the interrupted context, on every
+// CPU whose timer is running (the PIT only ever interrupts the BSP)
+struct irq_frame;
+void timer_interrupt_handler(struct irq_frame *frame);
+
+// Timer callbacks run from the tick interrupt, at tick granularity. The
+// caller owns the ktimer_t; it must stay valid while armed.
+typedef void (*ktimer_fn_t)(void *arg);
+
+typedef struct ktimer {
+    struct ktimer *next;
+    struct ktimer **pprev;   // Link pointing at us while armed, else NULL
+    uint64_t expires;        // Tick number the callback is due
+    uint64_t period;         // Ticks between runs, 0 for one-shot
+    ktimer_fn_t fn;
+    void *arg;
+} ktimer_t;
+
+void ktimer_init(ktimer_t *timer, ktimer_fn_t fn, void *arg);
+
+// (Re)arm to fire after delay_ns and then every period_ns (0 = once)
+void ktimer_arm(ktimer_t *timer, uint64_t delay_ns, uint64_t period_ns);
+
+// Disarm; returns true if the timer was pending
+bool ktimer_cancel(ktimer_t *timer);
+
+static inline bool ktimer_pending(const ktimer_t *timer) {
+    return timer->pprev != 0;
+}
+
+#endif // CORE_TIMER_H
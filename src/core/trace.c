@@ -0,0 +1,209 @@
+#include "core/trace.h"
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arch/x86/apic.h"
+#include "arch/x86/cpu.h"
+#include "arch/x86/smp.h"
+#include "core/sched.h"
+#include "core/serial.h"
+#include "core/timer.h"
+#include "libc/stdio.h"
+#include "libc/string.h"
+
+#define TRACE_LINE_MAX 192
+
+typedef struct {
+    volatile uint64_t tsc;     // Stored last; 0 while the slot is being filled
+    const char *name;
+    char arg[TRACE_ARG_MAX];   // "" unless recorded by trace_begin_arg()
+    uint32_t tid;
+    uint16_t cpu;
+    char phase;                // 'B' or 'E', as in the Chrome format
+} trace_event_t;
+
+static volatile bool trace_active = true;
+static volatile uint32_t trace_dropped = 0;
+
+#if TRACE_ENABLED
+// Writers claim slots with one atomic add and never wait for each other.
+// The count may run past the end; those events are only counted.
+static trace_event_t trace_events[TRACE_MAX_EVENTS];
+static volatile uint32_t trace_next = 0;
+
+static void record(char phase, const char *name, const char *arg, uint32_t tid) {
+    if (!trace_active) return;
+    uint64_t tsc = rdtsc();
+
+    uint32_t slot = TRACE_MAX_EVENTS;
+    if (__atomic_load_n(&trace_next, __ATOMIC_RELAXED) < TRACE_MAX_EVENTS) {
+        slot = __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED);
+    }
+    if (slot >= TRACE_MAX_EVENTS) {
+        __atomic_fetch_add(&trace_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    trace_event_t *ev = &trace_events[slot];
+    ev->name = name;
+    ev->phase = phase;
+    ev->tid = tid;
+    ev->cpu = (uint16_t)smp_cpu_id();
+    size_t len = 0;
+    if (arg) {
+        while (arg[len] && len < TRACE_ARG_MAX - 1) {
+            ev->arg[len] = arg[len];
+            len++;
+        }
+    }
+    ev->arg[len] = '\0';
+    __atomic_store_n(&ev->tsc, tsc, __ATOMIC_RELEASE);
+}
+
+// Thread 0 is kmain, which turns into the BSP's idle thread
+static uint32_t current_tid(void) {
+    thread_t *thread = sched_current();
+    return thread ? thread->id : 0;
+}
+
+void trace_begin(const char *name) {
+    record('B', name, NULL, current_tid());
+}
+
+void trace_end(const char *name) {
+    record('E', name, NULL, current_tid());
+}
+
+void trace_begin_arg(const char *name, const char *arg) {
+    record('B', name, arg, current_tid());
+}
+
+static const char *irq_name(uint32_t vector) {
+    switch (vector) {
+        case APIC_TIMER_VECTOR:        return "irq.timer";
+        case 33:                       return "irq.keyboard";
+        case 36:                       return "irq.com1";
+        case IPI_RESCHEDULE_VECTOR:    return "ipi.resched";
+        case IPI_TLB_SHOOTDOWN_VECTOR: return "ipi.tlb_shootdown";
+        default:                       return "irq";
+    }
+}
+
+void trace_irq_enter(uint32_t vector) {
+    record('B', irq_name(vector), NULL, TRACE_IRQ_TID + smp_cpu_id());
+}
+
+void trace_irq_exit(uint32_t vector) {
+    record('E', irq_name(vector), NULL, TRACE_IRQ_TID + smp_cpu_id());
+}
+#endif
+
+void trace_start(void) {
+    trace_active = false;
+#if TRACE_ENABLED
+    // A writer that claimed a slot just before may still fill it in
+    memset(trace_events, 0, sizeof(trace_events));
+    __atomic_store_n(&trace_next, 0, __ATOMIC_RELAXED);
+#endif
+    trace_dropped = 0;
+    trace_active = true;
+}
+
+void trace_stop(void) {
+    trace_active = false;
+}
+
+bool trace_running(void) {
+    return trace_active;
+}
+
+// ---------------- Export ----------------
+
+// Wait for the UART rather than cut the JSON short
+static void emit(const char *buf, size_t len) {
+    serial_write_all(buf, len);
+}
+
+static void emitf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void emitf(const char *fmt, ...) {
+    char line[TRACE_LINE_MAX];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = kvsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (len < 0) return;
+    if ((size_t)len >= sizeof(line)) len = (int)sizeof(line) - 1;
+    emit(line, (size_t)len);
+}
+
+#if TRACE_ENABLED
+// Copy src into a JSON string body, escaping what JSON requires
+static void json_escape(char *dst, size_t cap, const char *src) {
+    size_t n = 0;
+    for (; *src && n + 2 < cap; src++) {
+        char c = *src;
+        if (c == '"' || c == '\\') {
+            dst[n++] = '\\';
+            dst[n++] = c;
+        } else {
+            dst[n++] = ((unsigned char)c < 0x20) ? ' ' : c;
+        }
+    }
+    dst[n] = '\0';
+}
+
+size_t trace_dump(size_t *dropped) {
+    bool was_active = trace_active;
+    trace_active = false;
+
+    uint32_t count = __atomic_load_n(&trace_next, __ATOMIC_ACQUIRE);
+    if (count > TRACE_MAX_EVENTS) count = TRACE_MAX_EVENTS;
+
+    // Chrome wants non-negative microseconds; start at the earliest event
+    uint64_t base = UINT64_MAX;
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t tsc = trace_events[i].tsc;
+        if (tsc && tsc < base) base = tsc;
+    }
+
+    emitf("\n{\"traceEvents\":[\n");
+    emitf("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"tid\":0,\"args\":{\"name\":\"kiwiOS\"}}");
+    for (uint32_t cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (!smp_cpu(cpu)) continue;
+        emitf(",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"irq/%u\"}}",
+              TRACE_IRQ_TID + cpu, cpu);
+    }
+
+    size_t written = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const trace_event_t *ev = &trace_events[i];
+        if (!ev->tsc) continue;
+
+        uint64_t ns = timer_cycles_to_ns(ev->tsc - base);
+        unsigned long long us = (unsigned long long)(ns / 1000);
+        unsigned frac = (unsigned)(ns % 1000);
+        if (ev->arg[0]) {
+            char label[TRACE_ARG_MAX * 2];
+            json_escape(label, sizeof(label), ev->arg);
+            emitf(",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":0,\"tid\":%u,\"args\":{\"cpu\":%u}}",
+                  label, ev->name, ev->phase, us, frac, ev->tid, ev->cpu);
+        } else {
+            emitf(",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":0,\"tid\":%u,\"args\":{\"cpu\":%u}}",
+                  ev->name, ev->phase, us, frac, ev->tid, ev->cpu);
+        }
+        written++;
+    }
+    emitf("\n]}\n");
+
+    if (dropped) *dropped = trace_dropped;
+    trace_active = was_active;
+    return written;
+}
+#else
+size_t trace_dump(size_t *dropped) {
+    emitf("\n{\"traceEvents\":[\n]}\n");
+    if (dropped) *dropped = 0;
+    return 0;
+}
+#endif
@@ -0,0 +1,56 @@
+#ifndef CORE_TRACE_H
+#define CORE_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Tracepoints: begin/end pairs stamped with the TSC into one fixed buffer
+// that simply stops filling when full. Recording is on from boot so that
+// kmain's stages are caught; trace_dump() writes the buffer to COM1 as
+// Chrome trace JSON, from a line starting {"traceEvents": to a line "]}",
+// for chrome://tracing or ui.perfetto.dev. Build with -DTRACE_ENABLED=0
+// and every tracepoint compiles away.
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 1
+#endif
+
+#define TRACE_MAX_EVENTS 16384
+#define TRACE_ARG_MAX    24    // Bytes kept of a copied argument, NUL included
+
+// Threads show up under their id; interrupts get a track per CPU
+#define TRACE_IRQ_TID 1000     // + CPU id
+
+#if TRACE_ENABLED
+// name must outlive the trace (a string literal). Needs per-CPU data, so
+// nothing may be traced before smp_init_bsp().
+void trace_begin(const char *name);
+void trace_end(const char *name);
+
+// As trace_begin(), with arg (a command line, say) copied into the event;
+// the slice is labelled with arg and name becomes its category
+void trace_begin_arg(const char *name, const char *arg);
+
+// For the IRQ stubs, around the handler and its EOI
+void trace_irq_enter(uint32_t vector);
+void trace_irq_exit(uint32_t vector);
+#define TRACE_IRQ_ENTER_ASM(vec) "mov $" #vec ", %edi\n" "call trace_irq_enter\n"
+#define TRACE_IRQ_EXIT_ASM(vec)  "mov $" #vec ", %edi\n" "call trace_irq_exit\n"
+#else
+static inline void trace_begin(const char *name) { (void)name; }
+static inline void trace_end(const char *name) { (void)name; }
+static inline void trace_begin_arg(const char *name, const char *arg) { (void)name; (void)arg; }
+#define TRACE_IRQ_ENTER_ASM(vec) ""
+#define TRACE_IRQ_EXIT_ASM(vec)  ""
+#endif
+
+// Empty the buffer and record from now on
+void trace_start(void);
+void trace_stop(void);
+bool trace_running(void);
+
+// Write the buffer to COM1 as JSON, pausing recording meanwhile. Returns
+// the events written; *dropped (if given) gets the ones that did not fit.
+size_t trace_dump(size_t *dropped);
+
+#endif // CORE_TRACE_H
@@ -0,0 +1,247 @@
+#include "fs/initramfs.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "core/boot.h"
+#include "libc/string.h"
+#include "memory/heap.h"
+#include "memory/hhdm.h"
+
+#define TAR_BLOCK       512
+#define TAR_NAME        0
+#define TAR_NAME_LEN    100
+#define TAR_MODE        100
+#define TAR_SIZE        124
+#define TAR_TYPE        156
+#define TAR_MAGIC       257
+#define TAR_PREFIX      345
+#define TAR_PREFIX_LEN  155
+
+#define CPIO_HEADER     110
+#define CPIO_MODE       14
+#define CPIO_FILESIZE   54
+#define CPIO_NAMESIZE   94
+#define CPIO_TYPE_MASK  0170000
+#define CPIO_TYPE_FILE  0100000
+#define CPIO_TYPE_DIR   0040000
+
+static initramfs_file_t *files = NULL;
+static size_t file_count = 0;
+
+// Open-addressed path index, sized to at most half full
+static const initramfs_file_t **slots = NULL;
+static size_t slot_mask = 0;
+
+static uint64_t hash_path(const char *path) {
+    uint64_t h = 0xcbf29ce484222325ull;  // FNV-1a
+    while (*path) {
+        h ^= (uint8_t)*path++;
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+static uint64_t parse_octal(const uint8_t *s, size_t len) {
+    uint64_t v = 0;
+    for (size_t i = 0; i < len && s[i] >= '0' && s[i] <= '7'; i++) v = (v << 3) | (uint64_t)(s[i] - '0');
+    return v;
+}
+
+static uint32_t parse_hex8(const uint8_t *s) {
+    uint32_t v = 0;
+    for (int i = 0; i < 8; i++) {
+        uint8_t c = s[i];
+        if (c >= '0' && c <= '9') v = (v << 4) | (uint32_t)(c - '0');
+        else if (c >= 'a' && c <= 'f') v = (v << 4) | (uint32_t)(c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F') v = (v << 4) | (uint32_t)(c - 'A' + 10);
+        else return 0;
+    }
+    return v;
+}
+
+static size_t strnlen_bounded(const uint8_t *s, size_t max) {
+    size_t n = 0;
+    while (n < max && s[n]) n++;
+    return n;
+}
+
+// Drop "./" and "/" in front and "/" behind. Trailing slashes are cut in
+// place, so the module memory doubles as the string table.
+static char *normalize(char *path) {
+    for (;;) {
+        if (path[0] == '/') path++;
+        else if (path[0] == '.' && path[1] == '/') path += 2;
+        else break;
+    }
+    size_t len = strlen(path);
+    while (len > 0 && path[len - 1] == '/') path[--len] = '\0';
+    if (len == 1 && path[0] == '.') path[0] = '\0';
+    return path;
+}
+
+// Path of a tar header: "prefix/name" for ustar, else the name field. Only
+// names that are not already NUL-terminated in the header get copied.
+static char *tar_path(uint8_t *hdr) {
+    size_t name_len = strnlen_bounded(hdr + TAR_NAME, TAR_NAME_LEN);
+    size_t prefix_len = 0;
+    if (memcmp(hdr + TAR_MAGIC, "ustar", 5) == 0) {
+        prefix_len = strnlen_bounded(hdr + TAR_PREFIX, TAR_PREFIX_LEN);
+    }
+    if (prefix_len == 0 && name_len < TAR_NAME_LEN) return (char *)hdr + TAR_NAME;
+
+    char *path = kmalloc(prefix_len + 1 + name_len + 1);
+    if (!path) return NULL;
+    size_t at = 0;
+    if (prefix_len) {
+        memcpy(path, hdr + TAR_PREFIX, prefix_len);
+        path[prefix_len] = '/';
+        at = prefix_len + 1;
+    }
+    memcpy(path + at, hdr + TAR_NAME, name_len);
+    path[at + name_len] = '\0';
+    return path;
+}
+
+// Both walkers count entries when out is NULL and fill out otherwise
+static size_t walk_tar(uint8_t *base, size_t size, initramfs_file_t *out) {
+    size_t count = 0;
+    size_t off = 0;
+    while (off + TAR_BLOCK <= size) {
+        uint8_t *hdr = base + off;
+        if (hdr[TAR_NAME] == '\0') break;  // End-of-archive blocks
+
+        size_t data_off = off + TAR_BLOCK;
+        size_t file_size = (size_t)parse_octal(hdr + TAR_SIZE, 12);
+        if (file_size > size - data_off) break;  // Truncated
+        off = data_off + ((file_size + TAR_BLOCK - 1) & ~(size_t)(TAR_BLOCK - 1));
+
+        // Regular files and directories; links and pax headers are skipped
+        char type = (char)hdr[TAR_TYPE];
+        if (type != '0' && type != '\0' && type != '5') continue;
+
+        if (out) {
+            char *path = tar_path(hdr);
+            if (!path) continue;
+            initramfs_file_t *file = &out[count];
+            file->path = normalize(path);
+            file->data = base + data_off;
+            file->size = type == '5' ? 0 : file_size;
+            file->mode = (uint32_t)parse_octal(hdr + TAR_MODE, 8) & 07777;
+            file->dir = type == '5';
+        }
+        count++;
+    }
+    return count;
+}
+
+static size_t walk_cpio(uint8_t *base, size_t size, initramfs_file_t *out) {
+    size_t count = 0;
+    size_t off = 0;
+    while (off + CPIO_HEADER <= size) {
+        uint8_t *hdr = base + off;
+        if (memcmp(hdr, "070701", 6) != 0 && memcmp(hdr, "070702", 6) != 0) break;
+
+        uint32_t mode = parse_hex8(hdr + CPIO_MODE);
+        size_t file_size = parse_hex8(hdr + CPIO_FILESIZE);
+        size_t name_size = parse_hex8(hdr + CPIO_NAMESIZE);
+        size_t name_off = off + CPIO_HEADER;
+        if (name_size == 0 || name_size > size - name_off) break;
+        char *name = (char *)base + name_off;
+        if (name[name_size - 1] != '\0') break;
+        if (strcmp(name, "TRAILER!!!") == 0) break;
+
+        // Name and data are each padded to 4 bytes from the archive start
+        size_t data_off = (name_off + name_size + 3) & ~(size_t)3;
+        if (data_off > size || file_size > size - data_off) break;
+        off = (data_off + file_size + 3) & ~(size_t)3;
+
+        uint32_t type = mode & CPIO_TYPE_MASK;
+        if (type != CPIO_TYPE_FILE && type != CPIO_TYPE_DIR) continue;
+
+        if (out) {
+            initramfs_file_t *file = &out[count];
+            file->path = normalize(name);
+            file->data = base + data_off;
+            file->size = type == CPIO_TYPE_DIR ? 0 : file_size;
+            file->mode = mode & 07777;
+            file->dir = type == CPIO_TYPE_DIR;
+        }
+        count++;
+    }
+    return count;
+}
+
+// Later entries for the same path replace earlier ones, as when extracting
+static void index_insert(const initramfs_file_t *file) {
+    size_t i = (size_t)hash_path(file->path) & slot_mask;
+    while (slots[i] && strcmp(slots[i]->path, file->path) != 0) i = (i + 1) & slot_mask;
+    slots[i] = file;
+}
+
+bool initramfs_init(void) {
+    struct limine_file *module = boot_find_module(INITRAMFS_MODULE);
+    if (!module || module->size == 0) return false;
+
+    uint8_t *base = (uint8_t *)module->address;
+    size_t size = (size_t)module->size;
+    bool cpio = size >= 6 && (memcmp(base, "070701", 6) == 0 || memcmp(base, "070702", 6) == 0);
+    bool tar = !cpio && size >= TAR_BLOCK && memcmp(base + TAR_MAGIC, "ustar", 5) == 0;
+    if (!cpio && !tar) return false;
+
+    size_t max = cpio ? walk_cpio(base, size, NULL) : walk_tar(base, size, NULL);
+    if (max == 0) return false;
+    files = kcalloc(max, sizeof(initramfs_file_t));
+    if (!files) return false;
+    file_count = cpio ? walk_cpio(base, size, files) : walk_tar(base, size, files);
+
+    size_t slot_count = 16;
+    while (slot_count < file_count * 2) slot_count <<= 1;
+    slots = kcalloc(slot_count, sizeof(*slots));
+    if (!slots) {
+        kfree(files);
+        files = NULL;
+        file_count = 0;
+        return false;
+    }
+    slot_mask = slot_count - 1;
+    for (size_t i = 0; i < file_count; i++) {
+        if (files[i].path[0]) index_insert(&files[i]);
+    }
+    return true;
+}
+
+const initramfs_file_t *initramfs_open(const char *path) {
+    if (!slots || !path) return NULL;
+    while (path[0] == '/' || (path[0] == '.' && path[1] == '/')) path += path[0] == '/' ? 1 : 2;
+
+    size_t i = (size_t)hash_path(path) & slot_mask;
+    while (slots[i]) {
+        if (strcmp(slots[i]->path, path) == 0) return slots[i];
+        i = (i + 1) & slot_mask;
+    }
+    return NULL;
+}
+
+size_t initramfs_read(const initramfs_file_t *file, size_t offset, void *buf, size_t len) {
+    if (!file || offset >= file->size) return 0;
+    if (len > file->size - offset) len = file->size - offset;
+    memcpy(buf, file->data + offset, len);
+    return len;
+}
+
+const void *initramfs_map(const initramfs_file_t *file, size_t offset, size_t len) {
+    if (!file || offset > file->size || len > file->size - offset) return NULL;
+    return file->data + offset;
+}
+
+uint64_t initramfs_phys(const initramfs_file_t *file) {
+    return hhdm_virt_to_phys(file->data);
+}
+
+size_t initramfs_count(void) {
+    return file_count;
+}
+
+const initramfs_file_t *initramfs_at(size_t index) {
+    return index < file_count ? &files[index] : NULL;
+}
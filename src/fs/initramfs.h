@@ -0,0 +1,44 @@
+#ifndef FS_INITRAMFS_H
+#define FS_INITRAMFS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Read-only filesystem served in place from the "initramfs" Limine module
+// (a ustar tar or a cpio "newc" archive). File data is never copied: the
+// API hands out pointers into the module through the HHDM. Paths are
+// relative to the archive root; a leading "/" or "./" is ignored.
+#define INITRAMFS_MODULE "initramfs"
+
+typedef struct {
+    const char *path;      // NUL-terminated, usually inside the module
+    const uint8_t *data;   // size bytes, inside the module
+    size_t size;
+    uint32_t mode;         // Permission bits from the archive
+    bool dir;
+} initramfs_file_t;
+
+// Find the module and build the path index. Needs the heap (for the index
+// only). Returns false if there is no module or it is not an archive.
+bool initramfs_init(void);
+
+// Entry for path, or NULL. One hash lookup.
+const initramfs_file_t *initramfs_open(const char *path);
+
+// Copy up to len bytes from offset; returns the number copied
+size_t initramfs_read(const initramfs_file_t *file, size_t offset, void *buf, size_t len);
+
+// Direct pointer to [offset, offset + len) of the file, or NULL if the
+// range is out of bounds. The memory is the module itself: do not write.
+const void *initramfs_map(const initramfs_file_t *file, size_t offset, size_t len);
+
+// Physical address of the file's first byte, for mapping it into an
+// address space (tar data is 512-byte aligned, cpio data 4-byte aligned)
+uint64_t initramfs_phys(const initramfs_file_t *file);
+
+// Entries in archive order, for listing
+size_t initramfs_count(void);
+const initramfs_file_t *initramfs_at(size_t index);
+
+#endif // FS_INITRAMFS_H
@@ -5,93 +5,324 @@
 #include "core/console.h"
 #include "libc/stdio.h"
 
-static void print_unsigned(unsigned long long value, int base, bool uppercase) {
-    char buf[32];
-    const char *digits = uppercase ? "0123456789ABCDEF" : "0123456789abcdef";
-    int pos = 0;
-
-    if (value == 0) {
-        putc_fb(NULL, '0');
-        return;
-    }
+// Formatted output goes through a small buffer target. ksnprintf() stops
+// storing at the caller's capacity; kprintf() hands the buffer to the console
+// whenever it fills up and once more at the end, so a typical line reaches
+// console_write() in a single call.
+
+#define KPRINTF_BUFFER 256
+
+typedef struct out_buf {
+    char *buf;
+    size_t cap;     // Bytes buf can hold (0 for a pure length query)
+    size_t len;     // Bytes currently in buf
+    size_t total;   // Bytes produced overall
+    void (*flush)(struct out_buf *out);
+} out_buf_t;
 
-    while (value && pos < (int)(sizeof(buf))) {
-        buf[pos++] = digits[value % (unsigned)base];
-        value /= (unsigned)base;
+static void out_char(out_buf_t *out, char c) {
+    out->total++;
+    if (out->len == out->cap) {
+        if (!out->flush) return;
+        out->flush(out);
     }
+    out->buf[out->len++] = c;
+}
 
-    while (pos--) {
-        putc_fb(NULL, buf[pos]);
+static void out_chars(out_buf_t *out, const char *s, size_t n) {
+    out->total += n;
+    while (n) {
+        if (out->len == out->cap) {
+            if (!out->flush) return;
+            out->flush(out);
+        }
+        size_t room = out->cap - out->len;
+        size_t take = n < room ? n : room;
+        for (size_t i = 0; i < take; i++) out->buf[out->len + i] = s[i];
+        out->len += take;
+        s += take;
+        n -= take;
     }
 }
 
-static void print_signed(long long value) {
-    if (value < 0) {
-        putc_fb(NULL, '-');
-        print_unsigned((unsigned long long)(-value), 10, false);
+static void out_repeat(out_buf_t *out, char c, size_t n) {
+    while (n--) out_char(out, c);
+}
+
+static const char digit_pairs[200] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Digits are written backwards ending at end; returns the first one.
+// Two digits per step off a lookup table halves the divisions.
+static char *format_decimal(char *end, unsigned long long value) {
+    char *p = end;
+    while (value >= 100) {
+        unsigned idx = (unsigned)(value % 100) * 2;
+        value /= 100;
+        p -= 2;
+        p[0] = digit_pairs[idx];
+        p[1] = digit_pairs[idx + 1];
+    }
+    if (value >= 10) {
+        p -= 2;
+        p[0] = digit_pairs[value * 2];
+        p[1] = digit_pairs[value * 2 + 1];
     } else {
-        print_unsigned((unsigned long long)value, 10, false);
+        *--p = (char)('0' + value);
     }
+    return p;
 }
 
-void kvprintf(const char *fmt, va_list args) {
+static char *format_power2(char *end, unsigned long long value, unsigned shift, bool upper) {
+    const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    unsigned mask = (1u << shift) - 1;
+    char *p = end;
+    do {
+        *--p = digits[value & mask];
+        value >>= shift;
+    } while (value);
+    return p;
+}
+
+enum {
+    FLAG_LEFT  = 1 << 0,  // '-'
+    FLAG_ZERO  = 1 << 1,  // '0'
+    FLAG_PLUS  = 1 << 2,  // '+'
+    FLAG_SPACE = 1 << 3,  // ' '
+    FLAG_ALT   = 1 << 4,  // '#'
+};
+
+// Emit digits with sign/prefix, precision and field width applied
+static void out_number(out_buf_t *out, const char *digits, size_t ndigits,
+                       const char *prefix, int flags, int width, int precision) {
+    size_t nprefix = 0;
+    while (prefix[nprefix]) nprefix++;
+
+    // "%.0d" of zero prints nothing
+    if (precision == 0 && ndigits == 1 && digits[0] == '0') ndigits = 0;
+
+    size_t zeros = 0;
+    if (precision >= 0 && (size_t)precision > ndigits) {
+        zeros = (size_t)precision - ndigits;
+    } else if (precision < 0 && (flags & FLAG_ZERO) && !(flags & FLAG_LEFT) &&
+               width > 0 && (size_t)width > nprefix + ndigits) {
+        zeros = (size_t)width - nprefix - ndigits;
+    }
+
+    size_t body = nprefix + zeros + ndigits;
+    size_t pad = (width > 0 && (size_t)width > body) ? (size_t)width - body : 0;
+
+    if (!(flags & FLAG_LEFT)) out_repeat(out, ' ', pad);
+    out_chars(out, prefix, nprefix);
+    out_repeat(out, '0', zeros);
+    out_chars(out, digits, ndigits);
+    if (flags & FLAG_LEFT) out_repeat(out, ' ', pad);
+}
+
+static void out_string(out_buf_t *out, const char *s, int flags, int width, int precision) {
+    if (!s) s = "(null)";
+    size_t len = 0;
+    while (s[len] && (precision < 0 || len < (size_t)precision)) len++;
+
+    size_t pad = (width > 0 && (size_t)width > len) ? (size_t)width - len : 0;
+    if (!(flags & FLAG_LEFT)) out_repeat(out, ' ', pad);
+    out_chars(out, s, len);
+    if (flags & FLAG_LEFT) out_repeat(out, ' ', pad);
+}
+
+enum { LEN_INT, LEN_CHAR, LEN_SHORT, LEN_LONG, LEN_LLONG, LEN_SIZE, LEN_PTRDIFF, LEN_MAX };
+
+static unsigned long long arg_unsigned(va_list *args, int length) {
+    switch (length) {
+        case LEN_CHAR:    return (unsigned char)va_arg(*args, unsigned int);
+        case LEN_SHORT:   return (unsigned short)va_arg(*args, unsigned int);
+        case LEN_LONG:    return va_arg(*args, unsigned long);
+        case LEN_LLONG:   return va_arg(*args, unsigned long long);
+        case LEN_SIZE:    return va_arg(*args, size_t);
+        case LEN_PTRDIFF: return (unsigned long long)va_arg(*args, ptrdiff_t);
+        case LEN_MAX:     return va_arg(*args, uintmax_t);
+        default:          return va_arg(*args, unsigned int);
+    }
+}
+
+static long long arg_signed(va_list *args, int length) {
+    switch (length) {
+        case LEN_CHAR:    return (signed char)va_arg(*args, int);
+        case LEN_SHORT:   return (short)va_arg(*args, int);
+        case LEN_LONG:    return va_arg(*args, long);
+        case LEN_LLONG:   return va_arg(*args, long long);
+        case LEN_SIZE:    return (long long)va_arg(*args, size_t);
+        case LEN_PTRDIFF: return va_arg(*args, ptrdiff_t);
+        case LEN_MAX:     return va_arg(*args, intmax_t);
+        default:          return va_arg(*args, int);
+    }
+}
+
+static void format(out_buf_t *out, const char *fmt, va_list *args) {
     for (const char *p = fmt; *p; ++p) {
         if (*p != '%') {
-            putc_fb(NULL, *p);
+            // Copy the whole literal run at once
+            const char *run = p;
+            while (p[1] && p[1] != '%') p++;
+            out_chars(out, run, (size_t)(p - run) + 1);
             continue;
         }
+        const char *spec = p++;
 
-        ++p;
+        int flags = 0;
+        for (;; p++) {
+            if (*p == '-') flags |= FLAG_LEFT;
+            else if (*p == '0') flags |= FLAG_ZERO;
+            else if (*p == '+') flags |= FLAG_PLUS;
+            else if (*p == ' ') flags |= FLAG_SPACE;
+            else if (*p == '#') flags |= FLAG_ALT;
+            else break;
+        }
+
+        int width = 0;
+        if (*p == '*') {
+            width = va_arg(*args, int);
+            if (width < 0) {
+                flags |= FLAG_LEFT;
+                width = -width;
+            }
+            p++;
+        } else {
+            while (*p >= '0' && *p <= '9') width = width * 10 + (*p++ - '0');
+        }
+
+        int precision = -1;
+        if (*p == '.') {
+            p++;
+            precision = 0;
+            if (*p == '*') {
+                precision = va_arg(*args, int);
+                if (precision < 0) precision = -1;
+                p++;
+            } else {
+                while (*p >= '0' && *p <= '9') precision = precision * 10 + (*p++ - '0');
+            }
+        }
+
+        int length = LEN_INT;
         switch (*p) {
-            case 's': {
-                const char *s = va_arg(args, const char *);
-                if (s) print(NULL, s);
-                else print(NULL, "(null)");
+            case 'h':
+                length = (p[1] == 'h') ? LEN_CHAR : LEN_SHORT;
+                p += (p[1] == 'h') ? 2 : 1;
                 break;
-            }
-            case 'c': {
-                char c = (char)va_arg(args, int);
-                putc_fb(NULL, c);
+            case 'l':
+                length = (p[1] == 'l') ? LEN_LLONG : LEN_LONG;
+                p += (p[1] == 'l') ? 2 : 1;
                 break;
-            }
+            case 'z': length = LEN_SIZE; p++; break;
+            case 't': length = LEN_PTRDIFF; p++; break;
+            case 'j': length = LEN_MAX; p++; break;
+            default: break;
+        }
+
+        char digits[24];
+        char *end = digits + sizeof(digits);
+        char *first;
+        switch (*p) {
             case 'd':
             case 'i': {
-                int val = va_arg(args, int);
-                print_signed(val);
+                long long val = arg_signed(args, length);
+                unsigned long long mag = val < 0 ? 0ULL - (unsigned long long)val
+                                                 : (unsigned long long)val;
+                const char *sign = val < 0 ? "-" : (flags & FLAG_PLUS) ? "+"
+                                 : (flags & FLAG_SPACE) ? " " : "";
+                first = format_decimal(end, mag);
+                out_number(out, first, (size_t)(end - first), sign, flags, width, precision);
                 break;
             }
             case 'u': {
-                unsigned int val = va_arg(args, unsigned int);
-                print_unsigned(val, 10, false);
+                first = format_decimal(end, arg_unsigned(args, length));
+                out_number(out, first, (size_t)(end - first), "", flags, width, precision);
                 break;
             }
-            case 'x': {
-                unsigned int val = va_arg(args, unsigned int);
-                print_unsigned(val, 16, false);
+            case 'x':
+            case 'X': {
+                unsigned long long val = arg_unsigned(args, length);
+                const char *prefix = (flags & FLAG_ALT) && val ? (*p == 'x' ? "0x" : "0X") : "";
+                first = format_power2(end, val, 4, *p == 'X');
+                out_number(out, first, (size_t)(end - first), prefix, flags, width, precision);
                 break;
             }
-            case 'X': {
-        unsigned int val = va_arg(args, unsigned int);
-        print_unsigned(val, 16, true);
-        break;
-    }
-    case 'p': {
-        uint64_t val = (uint64_t)(uintptr_t)va_arg(args, void *);
-        print_hex(NULL, val);
-        break;
-    }
-            case '%': {
-                putc_fb(NULL, '%');
+            case 'o': {
+                unsigned long long val = arg_unsigned(args, length);
+                first = format_power2(end, val, 3, false);
+                out_number(out, first, (size_t)(end - first),
+                           (flags & FLAG_ALT) && val ? "0" : "", flags, width, precision);
+                break;
+            }
+            case 'p': {
+                // Same shape as print_hex(): 0x and 16 upper-case digits
+                uint64_t val = (uint64_t)(uintptr_t)va_arg(*args, void *);
+                first = format_power2(end, val, 4, true);
+                out_number(out, first, (size_t)(end - first), "0x", flags, width, 16);
                 break;
             }
+            case 's':
+                out_string(out, va_arg(*args, const char *), flags, width, precision);
+                break;
+            case 'c': {
+                char c = (char)va_arg(*args, int);
+                size_t pad = width > 1 ? (size_t)width - 1 : 0;
+                if (!(flags & FLAG_LEFT)) out_repeat(out, ' ', pad);
+                out_char(out, c);
+                if (flags & FLAG_LEFT) out_repeat(out, ' ', pad);
+                break;
+            }
+            case '%':
+                out_char(out, '%');
+                break;
+            case '\0':
+                // Trailing '%': print what we have and stop
+                out_chars(out, spec, (size_t)(p - spec));
+                return;
             default:
-                putc_fb(NULL, '%');
-                putc_fb(NULL, *p);
+                // Unknown conversion: print it verbatim
+                out_chars(out, spec, (size_t)(p - spec) + 1);
                 break;
         }
     }
 }
 
+int kvsnprintf(char *buf, size_t size, const char *fmt, va_list args) {
+    out_buf_t out = { .buf = buf, .cap = size ? size - 1 : 0 };
+    va_list ap;
+    va_copy(ap, args);
+    format(&out, fmt, &ap);
+    va_end(ap);
+    if (size) buf[out.len] = '\0';
+    return (int)out.total;
+}
+
+int ksnprintf(char *buf, size_t size, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = kvsnprintf(buf, size, fmt, args);
+    va_end(args);
+    return n;
+}
+
+static void flush_console(out_buf_t *out) {
+    console_write(out->buf, out->len);
+    out->len = 0;
+}
+
+void kvprintf(const char *fmt, va_list args) {
+    char buf[KPRINTF_BUFFER];
+    out_buf_t out = { .buf = buf, .cap = sizeof(buf), .flush = flush_console };
+    va_list ap;
+    va_copy(ap, args);
+    format(&out, fmt, &ap);
+    va_end(ap);
+    if (out.len) flush_console(&out);
+}
+
 void kprintf(const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
@@ -101,5 +332,5 @@ void kprintf(const char *fmt, ...) {
 
 void kputs(const char *s) {
     print(NULL, s);
-    putc_fb(NULL, '\n');
+    console_write("\n", 1);
 }
@@ -2,8 +2,16 @@
 #define LIBC_STDIO_H
 
 #include <stdarg.h>
+#include <stddef.h>
 
-void kprintf(const char *fmt, ...);
+// Format into buf like snprintf(): at most size - 1 characters plus a NUL,
+// returning the length the full output would have had. Supports flags
+// "-0+ #", width and precision (also as '*'), the length modifiers
+// hh/h/l/ll/z/t/j and the conversions d i u x X o p s c %.
+int ksnprintf(char *buf, size_t size, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+int kvsnprintf(char *buf, size_t size, const char *fmt, va_list args);
+
+void kprintf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 void kvprintf(const char *fmt, va_list args);
 void kputs(const char *s);
 
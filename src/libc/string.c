@@ -1,31 +1,189 @@
 #include "libc/string.h"
+#include "arch/x86/cpu.h"
+#include "arch/x86/fpu.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// The kernel is built with -mno-sse, so bulk copies are done either with x86
+// fast string instructions (rep movsb/stosb) or with 8-byte general purpose
+// register loops. string_init() picks between them once from CPUID. Without
+// ERMS, large copies use SSE2 inside a kernel_fpu_begin/end section.
+//
+// The word loops contain an empty asm barrier so the compiler can't turn them
+// back into calls to memcpy/memset.
+
+#define STRING_ERMS_THRESHOLD 256 // rep movsb startup cost without FSRM
+#define STRING_SSE_THRESHOLD  2048 // amortizes the TS and state save around SSE
+
+typedef uint64_t __attribute__((may_alias)) word_t;
+
+// Copies of at least this many bytes use rep movsb/stosb (SIZE_MAX = never)
+static size_t fast_string_threshold = SIZE_MAX;
+static const char* string_variant = "words";
+
+void string_init(void) {
+    fast_string_threshold = SIZE_MAX;
+    string_variant = "words";
+    if (cpuid_max_leaf(0) < 7) return;
+
+    uint32_t ebx, edx;
+    cpuid(7, 0, NULL, &ebx, NULL, &edx);
+    bool erms = (ebx & (1u << 9)) != 0;  // Enhanced rep movsb/stosb
+    bool fsrm = (edx & (1u << 4)) != 0;  // Fast short rep movsb
+
+    if (fsrm) {
+        fast_string_threshold = 0;
+        string_variant = "fsrm";
+    } else if (erms) {
+        fast_string_threshold = STRING_ERMS_THRESHOLD;
+        string_variant = "erms";
+    }
+}
+
+const char* string_variant_name(void) {
+    return string_variant;
+}
+
+bool string_has_erms(void) {
+    return fast_string_threshold != SIZE_MAX;
+}
+
+void *memcpy_erms(void *dst, const void *src, size_t n) {
+    void *d = dst;
+    asm volatile ("rep movsb" : "+D"(d), "+S"(src), "+c"(n) :: "memory");
+    return dst;
+}
+
+void *memcpy_sse2(void *dst, const void *src, size_t n) {
+    if (!kernel_fpu_available()) return memcpy_words(dst, src, n);
 
-void *memcpy(void *dst, const void *src, size_t n) {
     unsigned char *d = (unsigned char *)dst;
     const unsigned char *s = (const unsigned char *)src;
-    for (size_t i = 0; i < n; i++) d[i] = s[i];
+    while (n && ((uintptr_t)d & 15)) { *d++ = *s++; n--; }
+
+    // 64 bytes per iteration: unaligned loads, aligned stores
+    uint64_t flags = kernel_fpu_begin();
+    while (n >= 64) {
+        asm volatile (
+            "movdqu 0(%1), %%xmm0\n"
+            "movdqu 16(%1), %%xmm1\n"
+            "movdqu 32(%1), %%xmm2\n"
+            "movdqu 48(%1), %%xmm3\n"
+            "movdqa %%xmm0, 0(%0)\n"
+            "movdqa %%xmm1, 16(%0)\n"
+            "movdqa %%xmm2, 32(%0)\n"
+            "movdqa %%xmm3, 48(%0)\n"
+            :: "r"(d), "r"(s) : "memory"
+        );
+        d += 64; s += 64; n -= 64;
+    }
+    kernel_fpu_end(flags);
+
+    if (n) memcpy_words(d, s, n);
     return dst;
 }
 
-void *memmove(void *dst, const void *src, size_t n) {
+void *memcpy_words(void *dst, const void *src, size_t n) {
     unsigned char *d = (unsigned char *)dst;
     const unsigned char *s = (const unsigned char *)src;
-    if (d == s || n == 0) return dst;
-    if (d < s) {
-        for (size_t i = 0; i < n; i++) d[i] = s[i];
-    } else {
-        for (size_t i = n; i != 0; i--) d[i-1] = s[i-1];
+
+    // Head: align the destination to 8 bytes
+    while (n && ((uintptr_t)d & 7)) { *d++ = *s++; n--; }
+
+    // Body: four words per iteration, all loads before the stores so a
+    // forward overlapping copy (dst < src) stays correct
+    while (n >= 32) {
+        word_t w0 = ((const word_t *)s)[0];
+        word_t w1 = ((const word_t *)s)[1];
+        word_t w2 = ((const word_t *)s)[2];
+        word_t w3 = ((const word_t *)s)[3];
+        ((word_t *)d)[0] = w0;
+        ((word_t *)d)[1] = w1;
+        ((word_t *)d)[2] = w2;
+        ((word_t *)d)[3] = w3;
+        asm volatile ("" ::: "memory");
+        d += 32; s += 32; n -= 32;
+    }
+    while (n >= 8) {
+        *(word_t *)d = *(const word_t *)s;
+        asm volatile ("" ::: "memory");
+        d += 8; s += 8; n -= 8;
     }
+
+    // Tail
+    while (n) { *d++ = *s++; n--; }
     return dst;
 }
 
-void *memset(void *dst, int c, size_t n) {
+// Copy from the end towards the start, for overlapping moves with dst > src
+void *memmove_backward(void *dst, const void *src, size_t n) {
+    unsigned char *d = (unsigned char *)dst + n;
+    const unsigned char *s = (const unsigned char *)src + n;
+
+    // Odd bytes at the top first, then whole words with the direction flag set
+    size_t tail = n & 7;
+    while (tail--) { *--d = *--s; }
+
+    size_t words = n >> 3;
+    if (words) {
+        d -= 8;
+        s -= 8;
+        asm volatile ("std\n\trep movsq\n\tcld"
+                      : "+D"(d), "+S"(s), "+c"(words) :: "memory");
+    }
+    return dst;
+}
+
+void *memset_erms(void *dst, int c, size_t n) {
+    void *d = dst;
+    asm volatile ("rep stosb" : "+D"(d), "+c"(n) : "a"(c) : "memory");
+    return dst;
+}
+
+void *memset_words(void *dst, int c, size_t n) {
     unsigned char *d = (unsigned char *)dst;
     unsigned char v = (unsigned char)c;
-    for (size_t i = 0; i < n; i++) d[i] = v;
+    word_t pattern = 0x0101010101010101ULL * v;
+
+    while (n && ((uintptr_t)d & 7)) { *d++ = v; n--; }
+    while (n >= 32) {
+        ((word_t *)d)[0] = pattern;
+        ((word_t *)d)[1] = pattern;
+        ((word_t *)d)[2] = pattern;
+        ((word_t *)d)[3] = pattern;
+        asm volatile ("" ::: "memory");
+        d += 32; n -= 32;
+    }
+    while (n >= 8) {
+        *(word_t *)d = pattern;
+        asm volatile ("" ::: "memory");
+        d += 8; n -= 8;
+    }
+    while (n) { *d++ = v; n--; }
     return dst;
 }
 
+void *memcpy(void *dst, const void *src, size_t n) {
+    if (n >= fast_string_threshold) return memcpy_erms(dst, src, n);
+    if (n >= STRING_SSE_THRESHOLD && fast_string_threshold == SIZE_MAX) return memcpy_sse2(dst, src, n);
+    return memcpy_words(dst, src, n);
+}
+
+void *memmove(void *dst, const void *src, size_t n) {
+    unsigned char *d = (unsigned char *)dst;
+    const unsigned char *s = (const unsigned char *)src;
+    if (d == s || n == 0) return dst;
+
+    // Forward copies are safe unless the destination starts inside the source
+    if (d < s || d >= s + n) return memcpy(dst, src, n);
+    return memmove_backward(dst, src, n);
+}
+
+void *memset(void *dst, int c, size_t n) {
+    if (n >= fast_string_threshold) return memset_erms(dst, c, n);
+    return memset_words(dst, c, n);
+}
+
 int memcmp(const void *a, const void *b, size_t n) {
     const unsigned char *x = (const unsigned char *)a;
     const unsigned char *y = (const unsigned char *)b;
@@ -1,11 +1,25 @@
 #pragma once
 #include <stddef.h>
+#include <stdbool.h>
 
 void *memcpy(void *dst, const void *src, size_t n);
 void *memmove(void *dst, const void *src, size_t n);
 void *memset(void *dst, int c, size_t n);
 int   memcmp(const void *a, const void *b, size_t n);
 
+// Select the memcpy/memmove/memset variants for this CPU (once, at boot)
+void string_init(void);
+const char *string_variant_name(void);
+bool string_has_erms(void);
+
+// Individual variants, exposed for benchmarking
+void *memcpy_words(void *dst, const void *src, size_t n);
+void *memcpy_erms(void *dst, const void *src, size_t n);
+void *memcpy_sse2(void *dst, const void *src, size_t n);
+void *memmove_backward(void *dst, const void *src, size_t n);
+void *memset_words(void *dst, int c, size_t n);
+void *memset_erms(void *dst, int c, size_t n);
+
 size_t strlen(const char *s);
 int    strcmp(const char *a, const char *b);
 int    strncmp(const char *a, const char *b, size_t n);
@@ -0,0 +1,153 @@
+#include "memory/dma.h"
+#include "arch/x86/spinlock.h"
+#include "memory/pmm.h"
+#include "memory/hhdm.h"
+#include "libc/string.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// The DMA zone is a physically contiguous range that pmm_init keeps out of the
+// buddy allocator. It is managed with a plain bitmap (one bit per page, set =
+// used) and first-fit search, which is enough for the few long-lived rings and
+// buffers drivers set up.
+
+#define DMA_MAX_ZONE_PAGES 1024
+#define WORD_BITS 64
+
+static uint64_t zone_map[DMA_MAX_ZONE_PAGES / WORD_BITS];
+static uint64_t zone_base = 0;
+static size_t zone_pages = 0;
+static size_t zone_free = 0;
+static spinlock_t zone_lock;  // Guards zone_map and zone_free
+
+static inline bool page_used(size_t page) {
+    return (zone_map[page / WORD_BITS] >> (page % WORD_BITS)) & 1;
+}
+
+static void mark_pages(size_t first, size_t count, bool used) {
+    for (size_t page = first; page < first + count; page++) {
+        uint64_t bit = 1ULL << (page % WORD_BITS);
+        if (used) zone_map[page / WORD_BITS] |= bit;
+        else zone_map[page / WORD_BITS] &= ~bit;
+    }
+}
+
+static inline size_t next_pow2(size_t value) {
+    size_t result = 1;
+    while (result < value) result <<= 1;
+    return result;
+}
+
+void dma_init(void) {
+    uint64_t base;
+    size_t pages;
+
+    memset(zone_map, 0, sizeof(zone_map));
+    zone_base = 0;
+    zone_pages = 0;
+    zone_free = 0;
+    if (!pmm_get_dma_zone(&base, &pages)) return;
+
+    if (pages > DMA_MAX_ZONE_PAGES) pages = DMA_MAX_ZONE_PAGES;
+    zone_base = base;
+    zone_pages = pages;
+    zone_free = pages;
+}
+
+// First-fit search for a free, aligned run of pages in the zone
+static bool zone_alloc(size_t pages, size_t align, uint64_t max_phys, uint64_t* phys) {
+    if (pages > zone_free) return false;
+
+    // First page index whose address is aligned
+    size_t step = align / PAGE_SIZE;
+    uint64_t first_addr = (zone_base + align - 1) & ~(uint64_t)(align - 1);
+    size_t page = (size_t)((first_addr - zone_base) / PAGE_SIZE);
+
+    while (page + pages <= zone_pages) {
+        uint64_t addr = zone_base + (uint64_t)page * PAGE_SIZE;
+        if (addr + (uint64_t)pages * PAGE_SIZE - 1 > max_phys) return false;
+
+        // Look for a used page in the run; restart after it if there is one
+        size_t used = pages;
+        for (size_t i = 0; i < pages; i++) {
+            if (page_used(page + i)) {
+                used = i;
+                break;
+            }
+        }
+        if (used == pages) {
+            mark_pages(page, pages, true);
+            zone_free -= pages;
+            *phys = addr;
+            return true;
+        }
+
+        size_t skip_to = page + used + 1;
+        page += ((skip_to - page + step - 1) / step) * step;
+    }
+    return false;
+}
+
+// Fall back to the buddy allocator: a power-of-two block is aligned to its own
+// size, so ask for one at least as large as the alignment and trim the tail
+static bool pmm_fallback_alloc(size_t pages, size_t align, uint64_t max_phys, uint64_t* phys) {
+    size_t block = next_pow2(pages > align / PAGE_SIZE ? pages : align / PAGE_SIZE);
+    uint64_t addr = (uint64_t)pmm_alloc_pages(block);
+    if (!addr) return false;
+
+    if (addr + (uint64_t)pages * PAGE_SIZE - 1 > max_phys) {
+        pmm_free_pages((void*)addr, block);
+        return false;
+    }
+    if (block > pages) {
+        pmm_free_pages((void*)(addr + (uint64_t)pages * PAGE_SIZE), block - pages);
+    }
+    *phys = addr;
+    return true;
+}
+
+bool dma_alloc(size_t size, size_t align, uint64_t max_phys, dma_buffer_t* out) {
+    if (!out || size == 0) return false;
+    if (align < PAGE_SIZE) align = PAGE_SIZE;
+    if (align & (align - 1)) return false; // Must be a power of two
+
+    size_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t phys;
+    spin_lock(&zone_lock);
+    bool in_zone = zone_alloc(pages, align, max_phys, &phys);
+    spin_unlock(&zone_lock);
+    if (!in_zone && !pmm_fallback_alloc(pages, align, max_phys, &phys)) {
+        return false;
+    }
+
+    out->phys = phys;
+    out->virt = hhdm_phys_to_virt(phys);
+    out->size = pages * PAGE_SIZE;
+    memset(out->virt, 0, out->size);
+    return true;
+}
+
+void dma_free(dma_buffer_t* buf) {
+    if (!buf || buf->size == 0) return;
+
+    size_t pages = buf->size / PAGE_SIZE;
+    if (buf->phys >= zone_base && buf->phys < zone_base + (uint64_t)zone_pages * PAGE_SIZE) {
+        size_t first = (size_t)((buf->phys - zone_base) / PAGE_SIZE);
+        spin_lock(&zone_lock);
+        mark_pages(first, pages, false);
+        zone_free += pages;
+        spin_unlock(&zone_lock);
+    } else {
+        pmm_free_pages((void*)buf->phys, pages);
+    }
+
+    buf->phys = 0;
+    buf->virt = NULL;
+    buf->size = 0;
+}
+
+void dma_get_stats(size_t* total_pages, size_t* free_pages) {
+    if (total_pages) *total_pages = zone_pages;
+    if (free_pages) *free_pages = zone_free;
+}
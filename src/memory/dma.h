@@ -0,0 +1,35 @@
+#ifndef MEMORY_DMA_H
+#define MEMORY_DMA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Highest physical address reachable by devices with 32-bit DMA
+#define DMA_LIMIT_32BIT 0xFFFFFFFFULL
+// No limit on the physical address
+#define DMA_LIMIT_NONE  0xFFFFFFFFFFFFFFFFULL
+
+// A physically contiguous buffer for device DMA
+typedef struct {
+    uint64_t phys;  // Physical address to program into the device
+    void* virt;     // HHDM mapping of the same memory for the CPU
+    size_t size;    // Size in bytes, rounded up to whole pages
+} dma_buffer_t;
+
+// Take over the zone reserved by pmm_init
+void dma_init(void);
+
+// Allocate a zeroed, physically contiguous buffer
+// align is rounded up to at least a page and must be a power of two
+// The whole buffer lies at or below max_phys (e.g. DMA_LIMIT_32BIT)
+// Served from the DMA zone, or from the PMM if the zone can't fit it
+bool dma_alloc(size_t size, size_t align, uint64_t max_phys, dma_buffer_t* out);
+
+// Free a buffer from dma_alloc
+void dma_free(dma_buffer_t* buf);
+
+// Get DMA zone statistics in pages
+void dma_get_stats(size_t* total_pages, size_t* free_pages);
+
+#endif // MEMORY_DMA_H
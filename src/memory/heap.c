@@ -1,59 +1,119 @@
 #include "memory/heap.h"
+#include "arch/x86/spinlock.h"
 #include "memory/pmm.h"
 #include "memory/vmm.h"
+#include "memory/slab.h"
+#include "core/stats.h"
 #include "libc/string.h"
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
 
+// Large allocations are carved out of arenas: physically contiguous page runs
+// obtained from one pmm_alloc_pages() call. Blocks are only linked to blocks in
+// the same arena, so neighbours in a list are always adjacent in memory.
+
+// Arena header at the start of each page run
+typedef struct heap_arena {
+    struct heap_arena* next;  // Next arena in the heap
+    struct heap_arena* prev;  // Previous arena in the heap
+    size_t pages;             // Length of the page run
+    size_t reserved;          // Keeps the first block 16-byte aligned
+} heap_arena_t;
 
 // Block header for each allocation
 typedef struct heap_block {
     size_t size;              // Size of the block (not including header)
     bool is_free;             // Is this block free?
-    struct heap_block* next;  // Next block in the list
-    struct heap_block* prev;  // Previous block in the list
+    struct heap_block* next;  // Next block in the same arena
+    struct heap_block* prev;  // Previous block in the same arena
 } heap_block_t;
 
+#define ARENA_HEADER_SIZE sizeof(heap_arena_t)
 #define BLOCK_HEADER_SIZE sizeof(heap_block_t)
 #define MIN_ALLOC_SIZE 16  // Minimum allocation size
 #define HEAP_MAGIC 0xDEADBEEF  // For debugging
+#define HEAP_MIN_ARENA_PAGES 4  // Smallest page run requested from the PMM
+#define HEAP_RETAIN_BYTES (64 * 1024)  // Idle arena memory kept before reclaiming
 
-// Head of the free list
-static heap_block_t* heap_start = NULL;
+static heap_arena_t* arena_head = NULL;
+static heap_arena_t* arena_tail = NULL;
 static size_t total_heap_size = 0;
 static size_t total_allocated = 0;
 static size_t num_allocations = 0;
+static size_t idle_bytes = 0;  // Bytes in arenas that have no live blocks
+
+// Guards the arena lists and counters; slab objects are covered by their cache
+static spinlock_t heap_lock;
 
 // Align size to 16 bytes
 static inline size_t align_size(size_t size) {
     return (size + 15) & ~15;
 }
 
-// Expand the heap by allocating more pages
+static inline heap_block_t* arena_first_block(heap_arena_t* arena) {
+    return (heap_block_t*)((uint8_t*)arena + ARENA_HEADER_SIZE);
+}
+
+static inline size_t arena_bytes(const heap_arena_t* arena) {
+    return arena->pages * PAGE_SIZE;
+}
+
+// A free block with no neighbours spans its whole arena
+static inline bool block_spans_arena(const heap_block_t* block) {
+    return block->is_free && block->prev == NULL && block->next == NULL;
+}
+
+static inline heap_arena_t* block_arena(heap_block_t* block) {
+    return (heap_arena_t*)((uint8_t*)block - ARENA_HEADER_SIZE);
+}
+
+// Expand the heap by allocating a new arena
 static heap_block_t* expand_heap(size_t size) {
     // Calculate how many pages we need
-    size_t total_needed = size + BLOCK_HEADER_SIZE;
+    size_t total_needed = size + ARENA_HEADER_SIZE + BLOCK_HEADER_SIZE;
     size_t pages_needed = (total_needed + PAGE_SIZE - 1) / PAGE_SIZE;
-    
+    if (pages_needed < HEAP_MIN_ARENA_PAGES) pages_needed = HEAP_MIN_ARENA_PAGES;
+
     // Allocate pages
     void* new_mem = pmm_alloc_pages(pages_needed);
     if (!new_mem) return NULL;
-    
-    // Convert to virtual address
-    heap_block_t* block = (heap_block_t*)phys_to_virt((uint64_t)new_mem);
-    
+
+    // Convert to virtual address and link the arena at the tail
+    heap_arena_t* arena = (heap_arena_t*)phys_to_virt((uint64_t)new_mem);
+    arena->pages = pages_needed;
+    arena->reserved = 0;
+    arena->next = NULL;
+    arena->prev = arena_tail;
+    if (arena_tail) arena_tail->next = arena;
+    else arena_head = arena;
+    arena_tail = arena;
+
     // Initialize the block
-    block->size = (pages_needed * PAGE_SIZE) - BLOCK_HEADER_SIZE;
+    heap_block_t* block = arena_first_block(arena);
+    block->size = arena_bytes(arena) - ARENA_HEADER_SIZE - BLOCK_HEADER_SIZE;
     block->is_free = true;
     block->next = NULL;
     block->prev = NULL;
-    
-    total_heap_size += pages_needed * PAGE_SIZE;
-    
+
+    total_heap_size += arena_bytes(arena);
+    idle_bytes += arena_bytes(arena);
+
     return block;
 }
 
+// Return an idle arena to the PMM
+static void release_arena(heap_arena_t* arena) {
+    if (arena->prev) arena->prev->next = arena->next;
+    else arena_head = arena->next;
+    if (arena->next) arena->next->prev = arena->prev;
+    else arena_tail = arena->prev;
+
+    total_heap_size -= arena_bytes(arena);
+    idle_bytes -= arena_bytes(arena);
+    pmm_free_pages((void*)virt_to_phys(arena), arena->pages);
+}
+
 // Split a block if it's too large
 static void split_block(heap_block_t* block, size_t size) {
     // Only split if there's enough room for another block
@@ -64,7 +124,7 @@ static void split_block(heap_block_t* block, size_t size) {
         new_block->is_free = true;
         new_block->next = block->next;
         new_block->prev = block;
-        
+
         if (block->next) {
             block->next->prev = new_block;
         }
@@ -73,93 +133,131 @@ static void split_block(heap_block_t* block, size_t size) {
     }
 }
 
-// Merge adjacent free blocks
-static void merge_free_blocks(heap_block_t* block) {
+// Absorb the (free) next block into this one
+static void absorb_next(heap_block_t* block) {
+    heap_block_t* next = block->next;
+    block->size += BLOCK_HEADER_SIZE + next->size;
+    block->next = next->next;
+    if (block->next) {
+        block->next->prev = block;
+    }
+}
+
+// Merge adjacent free blocks, returning the block that now holds this one
+static heap_block_t* merge_free_blocks(heap_block_t* block) {
     // Merge with next block if it's free
     if (block->next && block->next->is_free) {
-        block->size += BLOCK_HEADER_SIZE + block->next->size;
-        block->next = block->next->next;
-        if (block->next) {
-            block->next->prev = block;
-        }
+        absorb_next(block);
     }
-    
+
     // Merge with previous block if it's free
     if (block->prev && block->prev->is_free) {
-        block->prev->size += BLOCK_HEADER_SIZE + block->size;
-        block->prev->next = block->next;
-        if (block->next) {
-            block->next->prev = block->prev;
-        }
+        block = block->prev;
+        absorb_next(block);
     }
+    return block;
+}
+
+// Mark a free block as used, taking its arena out of the idle count
+static void claim_block(heap_block_t* block, size_t size) {
+    if (block_spans_arena(block)) {
+        idle_bytes -= arena_bytes(block_arena(block));
+    }
+
+    split_block(block, size);
+    block->is_free = false;
+    total_allocated += block->size;
+    num_allocations++;
 }
 
 void heap_init(void) {
     // Start with 4 pages (16KB)
-    heap_start = expand_heap(PAGE_SIZE * 4);
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    if (!arena_head) {
+        expand_heap(PAGE_SIZE * 4);
+    }
+    spin_unlock_irqrestore(&heap_lock, flags);
 }
 
 void* kmalloc(size_t size) {
     if (size == 0) return NULL;
-    
+    KSTAT_INC(HEAP_KMALLOC);
+
+    // Small requests are served by the slab size classes
+    kmem_cache_t* cache = slab_size_class(size);
+    if (cache) {
+        void* obj = kmem_cache_alloc(cache);
+        if (obj) {
+            KSTAT_INC(HEAP_SLAB_HIT);
+            return obj;
+        }
+    }
+
     // Align size
     size = align_size(size);
-    
+
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+
     // Find a free block that's big enough
-    heap_block_t* current = heap_start;
-    while (current) {
-        if (current->is_free && current->size >= size) {
-            // Found a suitable block
-            split_block(current, size);
-            current->is_free = false;
-            total_allocated += current->size;
-            num_allocations++;
-            
-            // Return pointer to memory after the header
-            return (void*)((uint8_t*)current + BLOCK_HEADER_SIZE);
+    for (heap_arena_t* arena = arena_head; arena; arena = arena->next) {
+        for (heap_block_t* current = arena_first_block(arena); current; current = current->next) {
+            KSTAT_INC(HEAP_NODES_WALKED);
+            if (current->is_free && current->size >= size) {
+                // Found a suitable block
+                claim_block(current, size);
+                spin_unlock_irqrestore(&heap_lock, flags);
+
+                // Return pointer to memory after the header
+                return (void*)((uint8_t*)current + BLOCK_HEADER_SIZE);
+            }
         }
-        current = current->next;
     }
-    
-    // No suitable block found, expand heap
+
+    // No suitable block found, expand heap (the new arena becomes the tail)
     heap_block_t* new_block = expand_heap(size);
+    if (new_block) claim_block(new_block, size);
+    spin_unlock_irqrestore(&heap_lock, flags);
+
     if (!new_block) return NULL;
-    
-    // Add to end of list
-    if (heap_start == NULL) {
-        heap_start = new_block;
-    } else {
-        heap_block_t* last = heap_start;
-        while (last->next) last = last->next;
-        last->next = new_block;
-        new_block->prev = last;
-    }
-    
-    split_block(new_block, size);
-    new_block->is_free = false;
-    total_allocated += new_block->size;
-    num_allocations++;
-    
     return (void*)((uint8_t*)new_block + BLOCK_HEADER_SIZE);
 }
 
 void kfree(void* ptr) {
     if (!ptr) return;
-    
+
+    kmem_cache_t* cache = slab_cache_of(ptr);
+    if (cache) {
+        kmem_cache_free(cache, ptr);
+        return;
+    }
+
     // Get block header
     heap_block_t* block = (heap_block_t*)((uint8_t*)ptr - BLOCK_HEADER_SIZE);
-    
+
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
     if (block->is_free) {
         // Double free - ignore
+        spin_unlock_irqrestore(&heap_lock, flags);
         return;
     }
-    
+
     block->is_free = true;
     total_allocated -= block->size;
     num_allocations--;
-    
+
     // Merge with adjacent free blocks
-    merge_free_blocks(block);
+    block = merge_free_blocks(block);
+
+    // Whole arena free again: keep it around up to the watermark, then give
+    // the pages back to the PMM
+    if (block_spans_arena(block)) {
+        heap_arena_t* arena = block_arena(block);
+        idle_bytes += arena_bytes(arena);
+        if (idle_bytes > HEAP_RETAIN_BYTES) {
+            release_arena(arena);
+        }
+    }
+    spin_unlock_irqrestore(&heap_lock, flags);
 }
 
 void* kcalloc(size_t num, size_t size) {
@@ -181,31 +279,56 @@ void* krealloc(void* ptr, size_t new_size) {
         kfree(ptr);
         return NULL;
     }
-    
-    // Get old block
-    heap_block_t* block = (heap_block_t*)((uint8_t*)ptr - BLOCK_HEADER_SIZE);
-    size_t old_size = block->size;
-    
-    // If new size fits in current block, just return it
-    if (align_size(new_size) <= old_size) {
-        return ptr;
+
+    // Get old size from the slab cache or the block header
+    size_t old_size;
+    kmem_cache_t* cache = slab_cache_of(ptr);
+    if (cache) {
+        old_size = kmem_cache_object_size(cache);
+        if (new_size <= old_size) {
+            return ptr;
+        }
+    } else {
+        heap_block_t* block = (heap_block_t*)((uint8_t*)ptr - BLOCK_HEADER_SIZE);
+        old_size = block->size;
+
+        // If new size fits in current block, just return it
+        size_t wanted = align_size(new_size);
+        if (wanted <= old_size) {
+            return ptr;
+        }
+
+        // Grow in place by absorbing a free successor in the same arena
+        uint64_t flags = spin_lock_irqsave(&heap_lock);
+        heap_block_t* next = block->next;
+        if (next && next->is_free && old_size + BLOCK_HEADER_SIZE + next->size >= wanted) {
+            absorb_next(block);
+            split_block(block, wanted);
+            total_allocated += block->size - old_size;
+            spin_unlock_irqrestore(&heap_lock, flags);
+            return ptr;
+        }
+        spin_unlock_irqrestore(&heap_lock, flags);
     }
-    
+
     // Allocate new block
     void* new_ptr = kmalloc(new_size);
     if (!new_ptr) return NULL;
-    
+
     // Copy old data
     memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
-    
+
     // Free old block
     kfree(ptr);
-    
+
     return new_ptr;
 }
 
 void heap_get_stats(size_t* total_alloc, size_t* total_fr, size_t* num_alloc) {
-    if (total_alloc) *total_alloc = total_allocated;
-    if (total_fr) *total_fr = total_heap_size - total_allocated;
-    if (num_alloc) *num_alloc = num_allocations;
-}
\ No newline at end of file
+    size_t slab_pages, slab_bytes, slab_objects;
+    slab_get_stats(&slab_pages, &slab_bytes, &slab_objects);
+
+    if (total_alloc) *total_alloc = total_allocated + slab_bytes;
+    if (total_fr) *total_fr = (total_heap_size - total_allocated) + (slab_pages * PAGE_SIZE - slab_bytes);
+    if (num_alloc) *num_alloc = num_allocations + slab_objects;
+}
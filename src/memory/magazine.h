@@ -0,0 +1,38 @@
+#ifndef MEMORY_MAGAZINE_H
+#define MEMORY_MAGAZINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Per-CPU stack of free items (pages or objects) in front of a shared
+// allocator. Only its own CPU touches a magazine, with interrupts off, so
+// it needs no lock. An empty magazine is refilled and a full one spilled
+// MAGAZINE_BATCH items at a time under the shared allocator's lock.
+//
+// Sized so one magazine is exactly two cache lines.
+#define MAGAZINE_SIZE  15
+#define MAGAZINE_BATCH 8
+
+typedef struct {
+    uint64_t count;
+    uintptr_t items[MAGAZINE_SIZE];
+} __attribute__((aligned(64))) magazine_t;
+
+static inline bool magazine_empty(const magazine_t *mag) {
+    return mag->count == 0;
+}
+
+static inline bool magazine_full(const magazine_t *mag) {
+    return mag->count == MAGAZINE_SIZE;
+}
+
+static inline uintptr_t magazine_pop(magazine_t *mag) {
+    return mag->items[--mag->count];
+}
+
+static inline void magazine_push(magazine_t *mag, uintptr_t item) {
+    mag->items[mag->count++] = item;
+}
+
+#endif // MEMORY_MAGAZINE_H
@@ -1,114 +1,286 @@
-// malloc.h - Simple userspace malloc/free implementation
+// malloc.h - Userspace malloc/free implementation
 #ifndef MALLOC_H
 #define MALLOC_H
 
 #include "kiwilib.h"
 
-// Block header for allocated memory
-typedef struct malloc_block {
-    size_t size;                   // Size of usable memory (not including header)
-    int is_free;                   // 1 if free, 0 if allocated
-    struct malloc_block* next;     // Next block in list
-} malloc_block_t;
+// The heap is one contiguous run of memory below the program break. It is cut
+// into chunks that each start with a small header; the last chunk is the "top"
+// (wilderness) chunk, which is grown with brk() in large steps and trimmed back
+// when enough memory at the end is free.
+//
+// Free chunks sit in size-class bins and carry a boundary tag: the chunk after
+// a free chunk records its size in prev_size and has CHUNK_PREV_INUSE cleared,
+// so free() can find and merge both neighbours in constant time.
+//
+// malloc assumes it is the only user of brk().
 
-#define BLOCK_HEADER_SIZE sizeof(malloc_block_t)
+// Chunk header. next/prev overlap the user data and are only valid while the
+// chunk is free.
+typedef struct malloc_chunk {
+    size_t prev_size;              // Size of the previous chunk, valid only when it is free
+    size_t size;                   // Size of this chunk including header, low bits are flags
+    struct malloc_chunk* next;     // Next free chunk in the same bin
+    struct malloc_chunk* prev;     // Previous free chunk in the same bin
+} malloc_chunk_t;
+
+#define BLOCK_HEADER_SIZE (2 * sizeof(size_t))
 #define ALIGN_SIZE 16
+#define MIN_CHUNK_SIZE sizeof(malloc_chunk_t)
+
+#define CHUNK_INUSE      0x1  // This chunk is allocated
+#define CHUNK_PREV_INUSE 0x2  // The chunk before this one is allocated
+#define CHUNK_FLAGS      (CHUNK_INUSE | CHUNK_PREV_INUSE)
+
+// Chunks below 1 KiB get an exact bin per 16 bytes; larger chunks share one
+// bin per power of two.
+#define SMALL_BIN_COUNT 64
+#define SMALL_BIN_LIMIT (SMALL_BIN_COUNT * ALIGN_SIZE)
+#define LARGE_BIN_SHIFT 10    // log2(SMALL_BIN_LIMIT)
+#define LARGE_BIN_COUNT 32
+#define MALLOC_BIN_COUNT (SMALL_BIN_COUNT + LARGE_BIN_COUNT)
+#define BINMAP_WORDS ((MALLOC_BIN_COUNT + 63) / 64)
 
-static malloc_block_t* heap_head = 0;
+#define MALLOC_PAGE_SIZE 4096
+#define MALLOC_GROW_SIZE (64 * 1024)        // brk() is moved in steps of this size
+#define MALLOC_TOP_PAD (64 * 1024)          // Free memory kept at the top after a trim
+#define MALLOC_TRIM_THRESHOLD (256 * 1024)  // Top size that triggers a trim
+#define MALLOC_MAX_REQUEST (((size_t)-1) / 2)
+
+static malloc_chunk_t* bins[MALLOC_BIN_COUNT];
+static uint64_t binmap[BINMAP_WORDS];  // Bit set = bin is non-empty
+static malloc_chunk_t* top = 0;        // Last chunk of the heap, never in a bin
+static uint8_t* heap_end = 0;          // Program break as last set by malloc
 
 // Align size to 16 bytes
 static size_t align_up(size_t size) {
-    return (size + ALIGN_SIZE - 1) & ~(ALIGN_SIZE - 1);
+    return (size + ALIGN_SIZE - 1) & ~(size_t)(ALIGN_SIZE - 1);
+}
+
+static inline size_t chunk_size(const malloc_chunk_t* chunk) {
+    return chunk->size & ~(size_t)CHUNK_FLAGS;
+}
+
+static inline malloc_chunk_t* chunk_at(malloc_chunk_t* chunk, size_t offset) {
+    return (malloc_chunk_t*)((uint8_t*)chunk + offset);
+}
+
+static inline void* chunk_to_mem(malloc_chunk_t* chunk) {
+    return (uint8_t*)chunk + BLOCK_HEADER_SIZE;
+}
+
+static inline malloc_chunk_t* mem_to_chunk(void* ptr) {
+    return (malloc_chunk_t*)((uint8_t*)ptr - BLOCK_HEADER_SIZE);
+}
+
+// Chunk size needed to hold a request
+static inline size_t request_size(size_t size) {
+    size_t need = align_up(size + BLOCK_HEADER_SIZE);
+    return need < MIN_CHUNK_SIZE ? MIN_CHUNK_SIZE : need;
+}
+
+static int bin_index(size_t size) {
+    if (size < SMALL_BIN_LIMIT) return (int)(size / ALIGN_SIZE);
+
+    int index = SMALL_BIN_COUNT + (63 - __builtin_clzll(size)) - LARGE_BIN_SHIFT;
+    return index < MALLOC_BIN_COUNT ? index : MALLOC_BIN_COUNT - 1;
+}
+
+static void bin_insert(malloc_chunk_t* chunk) {
+    int index = bin_index(chunk_size(chunk));
+    chunk->prev = 0;
+    chunk->next = bins[index];
+    if (bins[index]) bins[index]->prev = chunk;
+    bins[index] = chunk;
+    binmap[index / 64] |= 1ULL << (index % 64);
 }
 
-// Find a free block that fits
-static malloc_block_t* find_free_block(size_t size) {
-    malloc_block_t* current = heap_head;
-    
-    while (current) {
-        if (current->is_free && current->size >= size) {
-            return current;
+static void bin_remove(malloc_chunk_t* chunk) {
+    int index = bin_index(chunk_size(chunk));
+    if (chunk->prev) chunk->prev->next = chunk->next;
+    else bins[index] = chunk->next;
+    if (chunk->next) chunk->next->prev = chunk->prev;
+    if (!bins[index]) binmap[index / 64] &= ~(1ULL << (index % 64));
+}
+
+// First non-empty bin at or after index, or -1
+static int next_bin(int index) {
+    for (int word = index / 64; word < BINMAP_WORDS; word++) {
+        uint64_t bits = binmap[word];
+        if (word == index / 64) bits &= ~0ULL << (index % 64);
+        if (bits) return word * 64 + __builtin_ctzll(bits);
+    }
+    return -1;
+}
+
+// Take a free chunk of at least need bytes out of the bins and mark it used
+static malloc_chunk_t* take_from_bins(size_t need) {
+    int index = bin_index(need);
+    malloc_chunk_t* chunk = 0;
+
+    // Chunks in a large bin vary in size, so the request's own bin has to be
+    // searched. Every chunk in a higher bin is big enough.
+    if (index >= SMALL_BIN_COUNT) {
+        for (chunk = bins[index]; chunk; chunk = chunk->next) {
+            if (chunk_size(chunk) >= need) break;
         }
-        current = current->next;
+        index++;
+    }
+
+    if (!chunk) {
+        index = index < MALLOC_BIN_COUNT ? next_bin(index) : -1;
+        if (index < 0) return 0;
+        chunk = bins[index];
     }
-    
-    return 0;  // No suitable block found
+
+    bin_remove(chunk);
+    chunk->size |= CHUNK_INUSE;
+    chunk_at(chunk, chunk_size(chunk))->size |= CHUNK_PREV_INUSE;
+    return chunk;
 }
 
-// Expand heap by allocating more memory
-static malloc_block_t* expand_heap(size_t size) {
-    // Request memory from kernel
-    void* current_brk = brk(0);
-    size_t total_size = BLOCK_HEADER_SIZE + size;
-    
-    void* new_brk = brk((void*)((uint64_t)current_brk + total_size));
-    if (new_brk == current_brk) {
+// Move the program break so the top chunk is at least top_needed bytes
+static int grow_heap(size_t top_needed) {
+    if (!top) {
+        // First call: start the heap at the current break
+        heap_end = (uint8_t*)align_up((size_t)(uint64_t)brk(0));
+        top = (malloc_chunk_t*)heap_end;
+    }
+
+    size_t have = (size_t)(heap_end - (uint8_t*)top);
+    if (have >= top_needed) return 1;
+
+    size_t grow = (top_needed - have + MALLOC_GROW_SIZE - 1) & ~(size_t)(MALLOC_GROW_SIZE - 1);
+    uint8_t* target = heap_end + grow;
+    uint8_t* new_brk = (uint8_t*)brk((void*)target);
+    if (new_brk < target) {
         return 0;  // Failed to expand
     }
-    
-    // Initialize new block
-    malloc_block_t* block = (malloc_block_t*)current_brk;
-    block->size = size;
-    block->is_free = 0;
-    block->next = 0;
-    
-    // Add to list
-    if (!heap_head) {
-        heap_head = block;
-    } else {
-        malloc_block_t* current = heap_head;
-        while (current->next) {
-            current = current->next;
-        }
-        current->next = block;
+
+    // The top chunk never has a free chunk before it, so PREV_INUSE is always set
+    heap_end = new_brk;
+    top->size = (size_t)(heap_end - (uint8_t*)top) | CHUNK_PREV_INUSE;
+    return 1;
+}
+
+// Give the unused end of the heap back to the kernel
+static void trim_top(void) {
+    if (chunk_size(top) < MALLOC_TRIM_THRESHOLD) return;
+
+    size_t keep = ((size_t)(uint64_t)top + MALLOC_TOP_PAD + MALLOC_PAGE_SIZE - 1)
+                  & ~(size_t)(MALLOC_PAGE_SIZE - 1);
+    uint8_t* new_brk = (uint8_t*)brk((void*)keep);
+    if (new_brk >= heap_end || new_brk < (uint8_t*)top + MIN_CHUNK_SIZE) {
+        return;  // Kernel didn't shrink the break
+    }
+
+    heap_end = new_brk;
+    top->size = (size_t)(heap_end - (uint8_t*)top) | CHUNK_PREV_INUSE;
+}
+
+// Free a chunk: merge it with free neighbours and bin it, or fold it into top
+static void release_chunk(malloc_chunk_t* chunk) {
+    size_t size = chunk_size(chunk);
+
+    // Merge with previous chunk if it's free
+    if (!(chunk->size & CHUNK_PREV_INUSE)) {
+        malloc_chunk_t* prev = (malloc_chunk_t*)((uint8_t*)chunk - chunk->prev_size);
+        bin_remove(prev);
+        size += chunk_size(prev);
+        chunk = prev;
+    }
+
+    // A chunk next to top becomes the new top
+    malloc_chunk_t* next = chunk_at(chunk, size);
+    if (next == top) {
+        top = chunk;
+        top->size = (size + chunk_size(next)) | CHUNK_PREV_INUSE;
+        trim_top();
+        return;
     }
-    
-    return block;
+
+    // Merge with next chunk if it's free
+    if (!(next->size & CHUNK_INUSE)) {
+        bin_remove(next);
+        size += chunk_size(next);
+        next = chunk_at(chunk, size);
+    }
+
+    // Free neighbours were merged, so the chunk before this one is in use
+    chunk->size = size | CHUNK_PREV_INUSE;
+    next->prev_size = size;
+    next->size &= ~(size_t)CHUNK_PREV_INUSE;
+    bin_insert(chunk);
+}
+
+// Shrink a used chunk to need bytes, freeing the rest
+static void split_chunk(malloc_chunk_t* chunk, size_t need) {
+    size_t size = chunk_size(chunk);
+    if (size - need < MIN_CHUNK_SIZE) return;
+
+    malloc_chunk_t* rest = chunk_at(chunk, need);
+    rest->size = (size - need) | CHUNK_INUSE | CHUNK_PREV_INUSE;
+    chunk->size = need | (chunk->size & CHUNK_FLAGS);
+    release_chunk(rest);
+}
+
+// Carve a used chunk of need bytes off the front of top
+static malloc_chunk_t* take_from_top(size_t need) {
+    if (!grow_heap(need + MIN_CHUNK_SIZE)) return 0;
+
+    malloc_chunk_t* chunk = top;
+    size_t top_size = chunk_size(top);
+    chunk->size = need | CHUNK_INUSE | (top->size & CHUNK_PREV_INUSE);
+
+    top = chunk_at(chunk, need);
+    top->size = (top_size - need) | CHUNK_PREV_INUSE;
+    return chunk;
 }
 
 // Allocate memory
 void* malloc(size_t size) {
-    if (size == 0) return 0;
-    
-    size = align_up(size);
-    
-    // Try to find existing free block
-    malloc_block_t* block = find_free_block(size);
-    
-    if (block) {
-        // Found a free block
-        block->is_free = 0;
-        return (void*)((uint8_t*)block + BLOCK_HEADER_SIZE);
-    }
-    
-    // Need to expand heap
-    block = expand_heap(size);
-    if (!block) return 0;
-    
-    return (void*)((uint8_t*)block + BLOCK_HEADER_SIZE);
+    if (size == 0 || size > MALLOC_MAX_REQUEST) return 0;
+
+    size_t need = request_size(size);
+
+    malloc_chunk_t* chunk = take_from_bins(need);
+    if (chunk) {
+        split_chunk(chunk, need);
+        return chunk_to_mem(chunk);
+    }
+
+    chunk = take_from_top(need);
+    if (!chunk) return 0;
+
+    return chunk_to_mem(chunk);
 }
 
 // Free memory
 void free(void* ptr) {
     if (!ptr) return;
-    
-    // Get block header
-    malloc_block_t* block = (malloc_block_t*)((uint8_t*)ptr - BLOCK_HEADER_SIZE);
-    block->is_free = 1;
-    
-    // TODO: Coalesce adjacent free blocks
-    // TODO: Return memory to kernel when possible
+
+    malloc_chunk_t* chunk = mem_to_chunk(ptr);
+    if (!(chunk->size & CHUNK_INUSE)) {
+        // Double free - ignore
+        return;
+    }
+
+    release_chunk(chunk);
 }
 
 // Allocate zeroed memory
 void* calloc(size_t num, size_t size) {
+    if (num != 0 && size > MALLOC_MAX_REQUEST / num) {
+        return 0;
+    }
+
     size_t total = num * size;
     void* ptr = malloc(total);
-    
+
     if (ptr) {
         memset(ptr, 0, total);
     }
-    
+
     return ptr;
 }
 
@@ -119,26 +291,48 @@ void* realloc(void* ptr, size_t new_size) {
         free(ptr);
         return 0;
     }
-    
-    // Get old block
-    malloc_block_t* block = (malloc_block_t*)((uint8_t*)ptr - BLOCK_HEADER_SIZE);
-    
-    // If new size fits, just return existing pointer
-    if (new_size <= block->size) {
+    if (new_size > MALLOC_MAX_REQUEST) return 0;
+
+    malloc_chunk_t* chunk = mem_to_chunk(ptr);
+    size_t size = chunk_size(chunk);
+    size_t need = request_size(new_size);
+
+    // Shrinking (or still fits): hand the tail back
+    if (need <= size) {
+        split_chunk(chunk, need);
+        return ptr;
+    }
+
+    // Grow in place into top or a free successor
+    malloc_chunk_t* next = chunk_at(chunk, size);
+    if (next == top) {
+        if (grow_heap(need - size + MIN_CHUNK_SIZE)) {
+            size_t top_size = chunk_size(top);
+            chunk->size = need | (chunk->size & CHUNK_FLAGS);
+            top = chunk_at(chunk, need);
+            top->size = (size + top_size - need) | CHUNK_PREV_INUSE;
+            return ptr;
+        }
+    } else if (!(next->size & CHUNK_INUSE) && size + chunk_size(next) >= need) {
+        bin_remove(next);
+        size += chunk_size(next);
+        chunk->size = size | (chunk->size & CHUNK_FLAGS);
+        chunk_at(chunk, size)->size |= CHUNK_PREV_INUSE;
+        split_chunk(chunk, need);
         return ptr;
     }
-    
+
     // Allocate new block
     void* new_ptr = malloc(new_size);
     if (!new_ptr) return 0;
-    
+
     // Copy old data
-    memcpy(new_ptr, ptr, block->size);
-    
+    memcpy(new_ptr, ptr, size - BLOCK_HEADER_SIZE);
+
     // Free old block
     free(ptr);
-    
+
     return new_ptr;
 }
 
-#endif
\ No newline at end of file
+#endif
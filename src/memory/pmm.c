@@ -1,159 +1,634 @@
 #include "memory/pmm.h"
 #include "limine.h"
+#include "arch/x86/smp.h"
+#include "arch/x86/spinlock.h"
+#include "core/stats.h"
 #include "libc/string.h"
 #include "memory/hhdm.h"
+#include "memory/magazine.h"
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
 
-// The bitmap - each bit represents one page
-static uint8_t* bitmap = NULL;
-static size_t bitmap_size = 0; // size in bytes
+// Buddy allocator: free memory is kept as power-of-two blocks of pages.
+// A block of order k spans (1 << k) pages and starts on a (1 << k) page boundary.
+//
+// Memory is split into regions, one per usable memmap range, so holes in the
+// physical address space cost nothing. Each region has, for every order, a
+// bitmap with one bit per block ("free block head") and a summary bitmap with
+// one bit per map word that is set when that word has no free block left.
+// Finding a free block is a ctz over the summary followed by a ctz over a word.
+
+#define PMM_MAX_REGIONS 64
+#define WORD_BITS 64
+
+typedef struct {
+    uint64_t* map;      // Bit set = block is a free block head
+    uint64_t* summary;  // Bit set = corresponding map word is fully used
+    size_t first_block; // Block number (pfn >> order) of bit 0
+    size_t words;       // Number of 64-bit words in map
+    size_t hint;        // No summary word below this has a free map word
+    size_t free_blocks; // Free blocks of this order in the region
+} order_map_t;
+
+typedef struct {
+    size_t start_pfn;   // First page managed by this region
+    size_t end_pfn;     // One past the last page
+    order_map_t orders[PMM_ORDER_COUNT];
+    uint16_t* shares;   // Per page: mappings beyond the first (copy-on-write)
+    uint8_t* free;      // Per page: 1 while free, in the buddy maps or any cache
+} pmm_region_t;
+
+// Page caches in front of the buddy allocator. Freed pages park on the dirty
+// stack; the idle loop zeroes them (or fresh buddy pages) into the zero pool.
+// Pages on either stack count as free in the statistics.
+//
+// A page's free byte is set by whoever frees it and cleared by whoever hands
+// it out, so a page parked in a magazine or on either stack still reads as
+// free and a second pmm_free() of it is ignored. Moving pages between the
+// caches and the buddy maps leaves the byte alone.
+#define PMM_DIRTY_MAX 128
+#define PMM_ZERO_POOL_TARGET 128
+#define PMM_SCRUB_BATCH 4 // Pages zeroed per idle call, keeps key latency low
+
+static size_t dirty_stack[PMM_DIRTY_MAX];
+static size_t dirty_count = 0;
+static size_t zero_pool[PMM_ZERO_POOL_TARGET];
+static size_t zero_count = 0;
+
+// Physically contiguous zone below 4GB kept out of the buddy allocator for DMA
+#define PMM_DMA_ZONE_PAGES 1024 // 4MB
+#define PMM_DMA_ZONE_LIMIT_PFN (0x100000000ULL / PAGE_SIZE)
+
+static size_t dma_zone_pfn = 0;
+static size_t dma_zone_pages = 0;
+
+static pmm_region_t regions[PMM_MAX_REGIONS];
+static size_t region_count = 0;
+static size_t dropped_ranges = 0;   // Usable ranges past PMM_MAX_REGIONS
+static size_t dropped_pages = 0;
+static size_t free_counts[PMM_ORDER_COUNT];
 static size_t total_pages = 0;
 static size_t used_pages = 0;
-static size_t search_cursor = 0; // Hint for next allocation
 
-// Highest physical address we know about
-static uint64_t highest_addr = 0;
+// Guards the buddy maps, both page caches and the counters. Held with
+// interrupts off and never across a page clear.
+static spinlock_t pmm_lock;
+
+// Per-CPU single-page magazines in front of all of the above. Pages in a
+// magazine are counted in used_pages; pmm_get_stats() takes them back out.
+static magazine_t page_mags[SMP_MAX_CPUS];
+
+static inline size_t summary_words(size_t words) {
+    return (words + WORD_BITS - 1) / WORD_BITS;
+}
 
-// Helper: Set a bit in the bitmap (mark page as used)
-static inline void bitmap_set(size_t index) {
-    bitmap[index / 8] |= (1 << (index % 8));
+static inline size_t order_pages(unsigned order) {
+    return (size_t)1 << order;
 }
 
-// Helper: Clear a bit in the bitmap (mark page as free)
-static inline void bitmap_clear(size_t index) {
-    bitmap[index / 8] &= ~(1 << (index % 8));
+// Smallest order whose block holds at least count pages
+static inline unsigned order_for_count(size_t count) {
+    unsigned order = 0;
+    while (order_pages(order) < count) order++;
+    return order;
 }
 
-// Helper: Test if a bit is set
-static inline bool bitmap_test(size_t index) {
-    return bitmap[index / 8] & (1 << (index % 8));
+// Does the whole block [pfn, pfn + (1 << order)) lie inside the region?
+static inline bool block_in_region(const pmm_region_t* region, size_t pfn, unsigned order) {
+    return pfn >= region->start_pfn && pfn + order_pages(order) <= region->end_pfn;
 }
 
-// Try to allocate a contiguous run of pages within [start, end)
-static void* allocate_run_from(size_t start, size_t end, size_t count) {
-    size_t idx = start;
-    while (idx + count <= end) {
-        size_t run_length = 0;
-        while (idx + run_length < end && run_length < count && !bitmap_test(idx + run_length)) {
-            run_length++;
+// Helper: Set a bit in an order bitmap (mark block as free)
+static inline void map_set(order_map_t* m, size_t pfn, unsigned order) {
+    size_t bit = (pfn >> order) - m->first_block;
+    size_t word = bit / WORD_BITS;
+    m->map[word] |= 1ULL << (bit % WORD_BITS);
+    m->summary[word / WORD_BITS] &= ~(1ULL << (word % WORD_BITS));
+    if (word / WORD_BITS < m->hint) m->hint = word / WORD_BITS;
+    m->free_blocks++;
+    free_counts[order]++;
+}
+
+// Helper: Clear a bit in an order bitmap (mark block as not free)
+static inline void map_clear(order_map_t* m, size_t pfn, unsigned order) {
+    size_t bit = (pfn >> order) - m->first_block;
+    size_t word = bit / WORD_BITS;
+    m->map[word] &= ~(1ULL << (bit % WORD_BITS));
+    if (m->map[word] == 0) {
+        m->summary[word / WORD_BITS] |= 1ULL << (word % WORD_BITS);
+    }
+    m->free_blocks--;
+    free_counts[order]--;
+}
+
+// Helper: Test if a block is a free block head at this order
+static inline bool map_test(const order_map_t* m, size_t pfn, unsigned order) {
+    size_t bit = (pfn >> order) - m->first_block;
+    return m->map[bit / WORD_BITS] & (1ULL << (bit % WORD_BITS));
+}
+
+// Set bits [first, first + count) of a bitmap, whole words at a time
+static void fill_bits(uint64_t* words, size_t first, size_t count) {
+    while (count > 0 && first % WORD_BITS != 0) {
+        words[first / WORD_BITS] |= 1ULL << (first % WORD_BITS);
+        first++;
+        count--;
+    }
+
+    size_t whole = count / WORD_BITS;
+    memset(&words[first / WORD_BITS], 0xFF, whole * sizeof(uint64_t));
+    first += whole * WORD_BITS;
+    count -= whole * WORD_BITS;
+
+    while (count > 0) {
+        words[first / WORD_BITS] |= 1ULL << (first % WORD_BITS);
+        first++;
+        count--;
+    }
+}
+
+// Clear bits [first, first + count) of a bitmap, whole words at a time
+static void clear_bits(uint64_t* words, size_t first, size_t count) {
+    while (count > 0 && first % WORD_BITS != 0) {
+        words[first / WORD_BITS] &= ~(1ULL << (first % WORD_BITS));
+        first++;
+        count--;
+    }
+
+    size_t whole = count / WORD_BITS;
+    memset(&words[first / WORD_BITS], 0, whole * sizeof(uint64_t));
+    first += whole * WORD_BITS;
+    count -= whole * WORD_BITS;
+
+    while (count > 0) {
+        words[first / WORD_BITS] &= ~(1ULL << (first % WORD_BITS));
+        first++;
+        count--;
+    }
+}
+
+// Find the region that manages a page (regions are sorted by address)
+static pmm_region_t* region_for_pfn(size_t pfn) {
+    size_t lo = 0;
+    size_t hi = region_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        pmm_region_t* region = &regions[mid];
+        if (pfn < region->start_pfn) {
+            hi = mid;
+        } else if (pfn >= region->end_pfn) {
+            lo = mid + 1;
+        } else {
+            return region;
         }
+    }
+    return NULL;
+}
+
+// Find any free block in an order map, returning its first page
+static bool map_find(order_map_t* m, unsigned order, size_t* out_pfn) {
+    size_t swords = summary_words(m->words);
+    for (size_t s = m->hint; s < swords; s++) {
+        uint64_t available = ~m->summary[s];
+        if (available == 0) continue;
+
+        KSTAT_ADD(PMM_SCAN_WORDS, s - m->hint + 1);
+        m->hint = s;
+        size_t word = s * WORD_BITS + (size_t)__builtin_ctzll(available);
+        size_t bit = word * WORD_BITS + (size_t)__builtin_ctzll(m->map[word]);
+        *out_pfn = (m->first_block + bit) << order;
+        return true;
+    }
+    KSTAT_ADD(PMM_SCAN_WORDS, swords - m->hint);
+    m->hint = swords;
+    return false;
+}
+
+// Return a block to the free maps, coalescing with its buddy as far as possible
+static void free_block(pmm_region_t* region, size_t pfn, unsigned order) {
+    while (order < PMM_MAX_ORDER) {
+        size_t buddy = pfn ^ order_pages(order);
+        if (!block_in_region(region, buddy, order)) break;
+        if (!map_test(&region->orders[order], buddy, order)) break;
+
+        map_clear(&region->orders[order], buddy, order);
+        pfn &= ~order_pages(order);
+        order++;
+    }
+    map_set(&region->orders[order], pfn, order);
+}
 
-        if (run_length == count) {
-            for (size_t j = 0; j < count; j++) {
-                bitmap_set(idx + j);
+// Largest order block that starts at pfn and fits in count pages
+static inline unsigned largest_fit(size_t pfn, size_t count) {
+    unsigned order = 0;
+    while (order < PMM_MAX_ORDER
+           && (pfn & (order_pages(order + 1) - 1)) == 0
+           && order_pages(order + 1) <= count) {
+        order++;
+    }
+    return order;
+}
+
+// Free [pfn, pfn + count) by splitting it into maximal aligned blocks
+static void free_range(pmm_region_t* region, size_t pfn, size_t count) {
+    while (count > 0) {
+        unsigned order = largest_fit(pfn, count);
+        free_block(region, pfn, order);
+        pfn += order_pages(order);
+        count -= order_pages(order);
+    }
+}
+
+// Take a block of exactly this order, splitting a larger one if needed
+static bool alloc_block(unsigned order, size_t* out_pfn) {
+    for (unsigned current = order; current <= PMM_MAX_ORDER; current++) {
+        if (free_counts[current] == 0) continue;
+
+        for (size_t r = 0; r < region_count; r++) {
+            pmm_region_t* region = &regions[r];
+            order_map_t* m = &region->orders[current];
+            if (m->free_blocks == 0) continue;
+
+            size_t pfn;
+            if (!map_find(m, current, &pfn)) continue;
+            map_clear(m, pfn, current);
+
+            // Hand the upper halves back until the block has the requested order
+            while (current > order) {
+                current--;
+                map_set(&region->orders[current], pfn + order_pages(current), current);
             }
-            used_pages += count;
-            search_cursor = (idx + count) % total_pages;
-            return (void*)(idx * PAGE_SIZE);
+
+            *out_pfn = pfn;
+            return true;
         }
+    }
+    return false;
+}
+
+static inline uint8_t* free_byte(pmm_region_t* region, size_t pfn) {
+    return &region->free[pfn - region->start_pfn];
+}
+
+// Mark a page free; returns false if it already was (a double free)
+static inline bool page_mark_free(pmm_region_t* region, size_t pfn) {
+    return __atomic_exchange_n(free_byte(region, pfn), 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+// Mark a page as handed out to a caller
+static inline void page_mark_used(size_t pfn) {
+    __atomic_store_n(free_byte(region_for_pfn(pfn), pfn), 0, __ATOMIC_RELEASE);
+}
 
-        // Skip past the used page that ended the run
-        idx += run_length + 1;
+// Bytes of bitmap storage a region needs for all orders
+static size_t region_metadata_size(size_t start_pfn, size_t end_pfn) {
+    size_t bytes = 0;
+    for (unsigned order = 0; order <= PMM_MAX_ORDER; order++) {
+        size_t blocks = ((end_pfn - 1) >> order) - (start_pfn >> order) + 1;
+        size_t words = (blocks + WORD_BITS - 1) / WORD_BITS;
+        bytes += (words + summary_words(words)) * sizeof(uint64_t);
     }
-    return NULL;
+    bytes += ((end_pfn - start_pfn) * sizeof(uint16_t) + 7) & ~(size_t)7;
+    bytes += ((end_pfn - start_pfn) + 7) & ~(size_t)7;
+    return bytes;
+}
+
+// Point a region's order maps at its metadata and mark everything used
+static uint64_t* region_setup_maps(pmm_region_t* region, uint64_t* storage) {
+    for (unsigned order = 0; order <= PMM_MAX_ORDER; order++) {
+        order_map_t* m = &region->orders[order];
+        m->first_block = region->start_pfn >> order;
+        m->words = (((region->end_pfn - 1) >> order) - m->first_block + WORD_BITS) / WORD_BITS;
+        m->map = storage;
+        storage += m->words;
+        m->summary = storage;
+        storage += summary_words(m->words);
+        m->hint = 0;
+        m->free_blocks = 0;
+
+        memset(m->map, 0, m->words * sizeof(uint64_t));
+        memset(m->summary, 0xFF, summary_words(m->words) * sizeof(uint64_t));
+    }
+
+    size_t pages = region->end_pfn - region->start_pfn;
+    region->shares = (uint16_t*)storage;
+    memset(region->shares, 0, pages * sizeof(uint16_t));
+    storage += (pages * sizeof(uint16_t) + 7) / 8;
+
+    // region_release_all() frees every page next
+    region->free = (uint8_t*)storage;
+    memset(region->free, 1, pages);
+    return storage + (pages + 7) / 8;
+}
+
+// Mark the whole region free: a run of max-order blocks in the middle, set
+// with word-wide fills, plus at most a few smaller blocks at each edge
+static void region_release_all(pmm_region_t* region) {
+    const size_t max_pages = order_pages(PMM_MAX_ORDER);
+    size_t start = region->start_pfn;
+    size_t end = region->end_pfn;
+
+    size_t big_start = (start + max_pages - 1) & ~(max_pages - 1);
+    size_t big_end = end & ~(max_pages - 1);
+
+    if (big_start >= big_end) {
+        free_range(region, start, end - start);
+        return;
+    }
+
+    free_range(region, start, big_start - start);
+    free_range(region, big_end, end - big_end);
+
+    order_map_t* m = &region->orders[PMM_MAX_ORDER];
+    size_t first_bit = (big_start >> PMM_MAX_ORDER) - m->first_block;
+    size_t count = (big_end - big_start) >> PMM_MAX_ORDER;
+    fill_bits(m->map, first_bit, count);
+    clear_bits(m->summary, first_bit / WORD_BITS,
+               (first_bit + count - 1) / WORD_BITS - first_bit / WORD_BITS + 1);
+    m->hint = 0;
+    m->free_blocks += count;
+    free_counts[PMM_MAX_ORDER] += count;
 }
 
 void pmm_init(struct limine_memmap_response* memmap) {
     if (memmap == NULL) {
         return;
     }
-    
-    // First pass: Find the highest memory address
+
+    // First pass: Build one region per usable range, merging adjacent entries
+    region_count = 0;
+    dropped_ranges = 0;
+    dropped_pages = 0;
     for (uint64_t i = 0; i < memmap->entry_count; i++) {
         struct limine_memmap_entry* entry = memmap->entries[i];
-        uint64_t top = entry->base + entry->length;
-        if (top > highest_addr) {
-            highest_addr = top;
+        if (entry->type != LIMINE_MEMMAP_USABLE) continue;
+
+        size_t first = (entry->base + PAGE_SIZE - 1) / PAGE_SIZE;
+        size_t end = (entry->base + entry->length) / PAGE_SIZE;
+        if (first >= end) continue;
+
+        if (region_count > 0 && regions[region_count - 1].end_pfn == first) {
+            regions[region_count - 1].end_pfn = end;
+            continue;
+        }
+        if (region_count == PMM_MAX_REGIONS) {
+            // No slot left: the range goes unused, but say so
+            dropped_ranges++;
+            dropped_pages += end - first;
+            continue;
         }
+
+        regions[region_count].start_pfn = first;
+        regions[region_count].end_pfn = end;
+        region_count++;
     }
-    
-    total_pages = highest_addr / PAGE_SIZE;
-    bitmap_size = (total_pages + 7) / 8;
-    
-    // Second pass: Find a place to put our bitmap
-    uint64_t bitmap_phys = 0;  // Physical address
-    for (uint64_t i = 0; i < memmap->entry_count; i++) {
-        struct limine_memmap_entry* entry = memmap->entries[i];
-        
-        if (entry->type == LIMINE_MEMMAP_USABLE && entry->length >= bitmap_size) {
-            bitmap_phys = entry->base;
-            bitmap = hhdm_phys_to_virt(bitmap_phys);  // Convert to virtual!
+
+    // Set aside the DMA zone before general allocations can fragment it. Take
+    // it from the front of the lowest region that fits it below 4GB.
+    dma_zone_pfn = 0;
+    dma_zone_pages = 0;
+    for (size_t r = 0; r < region_count; r++) {
+        pmm_region_t* region = &regions[r];
+        if (region->start_pfn + PMM_DMA_ZONE_PAGES > PMM_DMA_ZONE_LIMIT_PFN) break;
+        if (region->end_pfn - region->start_pfn > PMM_DMA_ZONE_PAGES) {
+            dma_zone_pfn = region->start_pfn;
+            dma_zone_pages = PMM_DMA_ZONE_PAGES;
+            region->start_pfn += PMM_DMA_ZONE_PAGES;
             break;
         }
     }
-    
-    if (bitmap == NULL) {
-        return;
+
+    // Second pass: Find a place to put the bitmaps of every region. Taking
+    // pages off the front of a region shrinks its own bitmaps, so size the
+    // metadata for the unshrunk regions and we always have enough space.
+    size_t metadata_size = 0;
+    for (size_t r = 0; r < region_count; r++) {
+        metadata_size += region_metadata_size(regions[r].start_pfn, regions[r].end_pfn);
     }
-    
-    // Initialize bitmap: mark everything as used first
-    memset(bitmap, 0xFF, bitmap_size);
-    used_pages = total_pages;
-    
-    // Third pass: Mark free regions
-    for (uint64_t i = 0; i < memmap->entry_count; i++) {
-        struct limine_memmap_entry* entry = memmap->entries[i];
-        
-        if (entry->type == LIMINE_MEMMAP_USABLE) {
-            uint64_t base = entry->base;
-            uint64_t length = entry->length;
-            
-            for (uint64_t addr = base; addr < base + length; addr += PAGE_SIZE) {
-                size_t page_index = addr / PAGE_SIZE;
-                if (page_index < total_pages && bitmap_test(page_index)) {
-                    bitmap_clear(page_index);
-                    used_pages--;
-                }
-            }
+    size_t metadata_pages = (metadata_size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    uint64_t* metadata = NULL;
+    for (size_t r = 0; r < region_count; r++) {
+        pmm_region_t* region = &regions[r];
+        if (region->end_pfn - region->start_pfn > metadata_pages) {
+            metadata = hhdm_phys_to_virt((uint64_t)region->start_pfn * PAGE_SIZE);  // Convert to virtual!
+            region->start_pfn += metadata_pages;
+            break;
         }
     }
-    
-    // Mark the bitmap itself as used
-    size_t bitmap_pages = (bitmap_size + PAGE_SIZE - 1) / PAGE_SIZE;
-    for (size_t i = 0; i < bitmap_pages; i++) {
-        size_t page_index = (bitmap_phys + i * PAGE_SIZE) / PAGE_SIZE;
-        if (page_index < total_pages && !bitmap_test(page_index)) {
-            bitmap_set(page_index);
-            used_pages++;
+
+    if (metadata == NULL) {
+        region_count = 0;
+        return;
+    }
+
+    // Third pass: Lay out each region's maps and release its pages
+    for (unsigned order = 0; order <= PMM_MAX_ORDER; order++) {
+        free_counts[order] = 0;
+    }
+    total_pages = 0;
+    for (size_t r = 0; r < region_count; r++) {
+        pmm_region_t* region = &regions[r];
+        metadata = region_setup_maps(region, metadata);
+        region_release_all(region);
+        total_pages += region->end_pfn - region->start_pfn;
+    }
+    used_pages = 0;
+}
+
+// Give every cached page back to the buddy allocator so it can coalesce.
+// Other CPUs' magazines are theirs alone, so only ours is emptied.
+static void drain_page_caches(void) {
+    magazine_t* mag = &page_mags[smp_cpu_id()];
+    while (!magazine_empty(mag)) {
+        size_t pfn = magazine_pop(mag) / PAGE_SIZE;
+        free_block(region_for_pfn(pfn), pfn, 0);
+        used_pages--;
+    }
+    while (dirty_count > 0) {
+        size_t pfn = dirty_stack[--dirty_count];
+        free_block(region_for_pfn(pfn), pfn, 0);
+    }
+    while (zero_count > 0) {
+        size_t pfn = zero_pool[--zero_count];
+        free_block(region_for_pfn(pfn), pfn, 0);
+    }
+}
+
+static inline void zero_page(size_t pfn) {
+    memset(hhdm_phys_to_virt((uint64_t)pfn * PAGE_SIZE), 0, PAGE_SIZE);
+}
+
+// One page from the caches or the buddy maps; caller holds pmm_lock
+static void* alloc_page(void) {
+    size_t pfn;
+    if (dirty_count > 0) {
+        // Most recently freed page first - it is probably still in cache
+        KSTAT_INC(PMM_ALLOC_CACHED);
+        pfn = dirty_stack[--dirty_count];
+    } else if (!alloc_block(0, &pfn)) {
+        if (zero_count == 0) {
+            // No free pages
+            return NULL;
         }
+        pfn = zero_pool[--zero_count];
     }
 
-    search_cursor = 0;
+    used_pages++;
+    return (void*)(pfn * PAGE_SIZE);
+}
+
+// Back to the dirty stack or the buddy maps; caller holds pmm_lock
+static void free_page(size_t pfn) {
+    if (dirty_count < PMM_DIRTY_MAX) {
+        dirty_stack[dirty_count++] = pfn;
+    } else {
+        free_block(region_for_pfn(pfn), pfn, 0);
+    }
+    used_pages--;
 }
 
 void* pmm_alloc(void) {
-    if (total_pages == 0) return NULL;
-
-    // Find next free page, starting from the cursor to avoid full rescans
-    for (size_t scanned = 0; scanned < total_pages; scanned++) {
-        size_t idx = (search_cursor + scanned) % total_pages;
-        if (!bitmap_test(idx)) {
-            bitmap_set(idx);
-            used_pages++;
-            search_cursor = (idx + 1) % total_pages;
-            return (void*)(idx * PAGE_SIZE);
+    KSTAT_INC(PMM_ALLOC);
+    uint64_t flags = irq_save();
+    magazine_t* mag = &page_mags[smp_cpu_id()];
+    if (!magazine_empty(mag)) {
+        KSTAT_INC(PMM_MAG_HIT);
+    } else {
+        KSTAT_INC(PMM_MAG_REFILL);
+        spin_lock(&pmm_lock);
+        for (int i = 0; i < MAGAZINE_BATCH; i++) {
+            void* page = alloc_page();
+            if (!page) break;
+            magazine_push(mag, (uintptr_t)page);
         }
+        spin_unlock(&pmm_lock);
     }
 
-    // No free pages
-    return NULL;
+    void* page = magazine_empty(mag) ? NULL : (void*)magazine_pop(mag);
+    irq_restore(flags);
+    if (page) page_mark_used((uint64_t)page / PAGE_SIZE);
+    return page;
+}
+
+void* pmm_alloc_zeroed(void) {
+    KSTAT_INC(PMM_ALLOC);
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    if (zero_count > 0) {
+        used_pages++;
+        void* page = (void*)(zero_pool[--zero_count] * PAGE_SIZE);
+        page_mark_used((uint64_t)page / PAGE_SIZE);
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        return page;
+    }
+
+    // Pool is empty - zero on the spot
+    void* page = alloc_page();
+    if (page) page_mark_used((uint64_t)page / PAGE_SIZE);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    if (page) zero_page((uint64_t)page / PAGE_SIZE);
+    return page;
 }
 
 void pmm_free(void* addr) {
     if (addr == NULL) return;
-    
+
     size_t page_index = (uint64_t)addr / PAGE_SIZE;
-    
-    if (page_index >= total_pages) return; // Invalid address
-    if (!bitmap_test(page_index)) return; // Already free
-    
-    bitmap_clear(page_index);
-    used_pages--;
-    if (page_index < search_cursor) {
-        search_cursor = page_index;
+
+    pmm_region_t* region = region_for_pfn(page_index);
+    if (!region) return; // Invalid address
+
+    if (!page_mark_free(region, page_index)) return; // Already free
+
+    uint64_t flags = irq_save();
+    magazine_t* mag = &page_mags[smp_cpu_id()];
+    if (magazine_full(mag)) {
+        KSTAT_INC(PMM_MAG_SPILL);
+        spin_lock(&pmm_lock);
+        for (int i = 0; i < MAGAZINE_BATCH; i++) {
+            free_page(magazine_pop(mag) / PAGE_SIZE);
+        }
+        spin_unlock(&pmm_lock);
+    }
+    magazine_push(mag, (uintptr_t)addr & ~(uintptr_t)(PAGE_SIZE - 1));
+    irq_restore(flags);
+}
+
+static uint16_t* shares_of(uint64_t addr) {
+    size_t pfn = addr / PAGE_SIZE;
+    pmm_region_t* region = region_for_pfn(pfn);
+    return region ? &region->shares[pfn - region->start_pfn] : NULL;
+}
+
+bool pmm_page_share(void* addr) {
+    uint16_t* shares = shares_of((uint64_t)addr);
+    if (!shares) return true;
+
+    uint16_t old = __atomic_load_n(shares, __ATOMIC_RELAXED);
+    do {
+        if (old == UINT16_MAX) return false;  // Wrapping would free a mapped page
+    } while (!__atomic_compare_exchange_n(shares, &old, (uint16_t)(old + 1), false,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return true;
+}
+
+bool pmm_page_unshare(void* addr) {
+    uint16_t* shares = shares_of((uint64_t)addr);
+    if (!shares) return false;
+
+    uint16_t old = __atomic_load_n(shares, __ATOMIC_ACQUIRE);
+    do {
+        if (old == 0) {
+            pmm_free(addr);
+            return true;
+        }
+    } while (!__atomic_compare_exchange_n(shares, &old, (uint16_t)(old - 1), false,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return false;
+}
+
+uint32_t pmm_page_shares(void* addr) {
+    uint16_t* shares = shares_of((uint64_t)addr);
+    return shares ? __atomic_load_n(shares, __ATOMIC_ACQUIRE) : 0;
+}
+
+bool pmm_idle_scrub(void) {
+    bool did_work = false;
+
+    for (int i = 0; i < PMM_SCRUB_BATCH; i++) {
+        // Take the page out under the lock, but clear it without holding it
+        uint64_t flags = spin_lock_irqsave(&pmm_lock);
+        size_t pfn = 0;
+        bool have_page = zero_count < PMM_ZERO_POOL_TARGET;
+        if (have_page) {
+            if (dirty_count > 0) {
+                pfn = dirty_stack[--dirty_count];
+            } else {
+                have_page = alloc_block(0, &pfn);
+            }
+        }
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        if (!have_page) break;
+
+        zero_page(pfn);
+
+        // Another CPU may have filled the pool meanwhile
+        flags = spin_lock_irqsave(&pmm_lock);
+        if (zero_count < PMM_ZERO_POOL_TARGET) {
+            zero_pool[zero_count++] = pfn;
+        } else {
+            free_block(region_for_pfn(pfn), pfn, 0);
+        }
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        did_work = true;
     }
+
+    return did_work;
+}
+
+size_t pmm_zeroed_pages(void) {
+    return zero_count;
 }
 
 void* pmm_alloc_pages(size_t count) {
@@ -161,38 +636,98 @@ void* pmm_alloc_pages(size_t count) {
     if (count > total_pages) return NULL;
     if (count == 1) return pmm_alloc();
 
-    // Try from cursor to the end, then wrap around
-    void* result = allocate_run_from(search_cursor, total_pages, count);
-    if (!result && search_cursor > 0) {
-        result = allocate_run_from(0, search_cursor, count);
+    unsigned order = order_for_count(count);
+    if (order > PMM_MAX_ORDER) return NULL;
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    KSTAT_INC(PMM_ALLOC);
+    size_t pfn;
+    if (!alloc_block(order, &pfn)) {
+        // Cached single pages may be holding buddies apart - release them and retry
+        drain_page_caches();
+        if (!alloc_block(order, &pfn)) {
+            // Couldn't find enough contiguous pages
+            spin_unlock_irqrestore(&pmm_lock, flags);
+            return NULL;
+        }
     }
-    if (result) return result;
 
-    // Couldn't find enough contiguous pages
-    return NULL;
+    // Give back the tail of the block that the caller didn't ask for
+    pmm_region_t* region = region_for_pfn(pfn);
+    size_t block_pages = order_pages(order);
+    if (block_pages > count) {
+        free_range(region, pfn + count, block_pages - count);
+    }
+
+    memset(free_byte(region, pfn), 0, count);
+    used_pages += count;
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return (void*)(pfn * PAGE_SIZE);
 }
 
 void pmm_free_pages(void* addr, size_t count) {
     if (addr == NULL || count == 0) return;
-    
+
     size_t start_page = (uint64_t)addr / PAGE_SIZE;
-    
+    pmm_region_t* region = region_for_pfn(start_page);
+    if (!region) return;
+    if (count > region->end_pfn - start_page) count = region->end_pfn - start_page;
+
+    // Free runs of allocated pages, skipping any page that is already free,
+    // whether in the buddy maps or parked in a cache
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    size_t run_start = start_page;
+    size_t run_length = 0;
     for (size_t i = 0; i < count; i++) {
         size_t page_index = start_page + i;
-        if (page_index >= total_pages) break;
-        
-        if (bitmap_test(page_index)) {
-            bitmap_clear(page_index);
-            used_pages--;
-            if (page_index < search_cursor) {
-                search_cursor = page_index;
+        if (!page_mark_free(region, page_index)) {
+            if (run_length) {
+                free_range(region, run_start, run_length);
+                used_pages -= run_length;
             }
+            run_length = 0;
+            continue;
         }
+        if (run_length == 0) run_start = page_index;
+        run_length++;
     }
+    if (run_length) {
+        free_range(region, run_start, run_length);
+        used_pages -= run_length;
+    }
+    spin_unlock_irqrestore(&pmm_lock, flags);
 }
 
 void pmm_get_stats(size_t* total, size_t* used, size_t* free) {
+    size_t cached = 0;
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) cached += page_mags[cpu].count;
+    // Not a snapshot: a spill between the two reads may leave cached ahead
+    size_t in_use = used_pages > cached ? used_pages - cached : 0;
+
     if (total) *total = total_pages;
-    if (used) *used = used_pages;
-    if (free) *free = total_pages - used_pages;
-}
\ No newline at end of file
+    if (used) *used = in_use;
+    if (free) *free = total_pages - in_use;
+}
+
+void pmm_get_order_stats(size_t* free_blocks) {
+    if (!free_blocks) return;
+    for (unsigned order = 0; order <= PMM_MAX_ORDER; order++) {
+        free_blocks[order] = free_counts[order];
+    }
+}
+
+bool pmm_get_dma_zone(uint64_t* base, size_t* pages) {
+    if (dma_zone_pages == 0) return false;
+    if (base) *base = (uint64_t)dma_zone_pfn * PAGE_SIZE;
+    if (pages) *pages = dma_zone_pages;
+    return true;
+}
+
+size_t pmm_region_count(void) {
+    return region_count;
+}
+
+size_t pmm_dropped_pages(size_t* ranges) {
+    if (ranges) *ranges = dropped_ranges;
+    return dropped_pages;
+}
@@ -10,6 +10,10 @@
 // Page size is 4KB (4096 bytes)
 #define PAGE_SIZE 4096
 
+// Buddy orders: an order k block spans (1 << k) pages (order 18 = 1GB)
+#define PMM_MAX_ORDER 18
+#define PMM_ORDER_COUNT (PMM_MAX_ORDER + 1)
+
 // Initialize the physical memory manager
 void pmm_init(struct limine_memmap_response* memmap);
 
@@ -17,18 +21,57 @@ void pmm_init(struct limine_memmap_response* memmap);
 // Returns physical address of the page, or 0 if no memory available
 void* pmm_alloc(void);
 
+// Allocate a single physical page filled with zeroes
+// Served from the pre-zeroed pool when possible
+void* pmm_alloc_zeroed(void);
+
 // Free a physical page
 // addr must be the address returned by pmm_alloc()
 void pmm_free(void* addr);
 
+// Copy-on-write sharing. A page starts with one owner; pmm_page_share()
+// records one more mapping and pmm_page_unshare() drops one, freeing the
+// page when it was the last (returns true then). Pages outside the PMM,
+// such as module memory, are never counted or freed. Up to 65536 mappings:
+// pmm_page_share() returns false and records nothing past that.
+bool pmm_page_share(void* addr);
+bool pmm_page_unshare(void* addr);
+
+// Mappings of the page beyond the first; 0 means its owner may write it
+uint32_t pmm_page_shares(void* addr);
+
 // Allocate multiple contiguous pages
 // Returns physical address of the first page, or 0 if can't find contiguous space
+// A power-of-two count is aligned to its own size (512 pages -> 2MB aligned)
 void* pmm_alloc_pages(size_t count);
 
 // Free multiple contiguous pages
 void pmm_free_pages(void* addr, size_t count);
 
+// Do a small amount of background page zeroing while the CPU is idle
+// Returns true if any work was done
+bool pmm_idle_scrub(void);
+
+// Number of pages currently in the pre-zeroed pool
+size_t pmm_zeroed_pages(void);
+
 // Get statistics about memory usage
 void pmm_get_stats(size_t* total_pages, size_t* used_pages, size_t* free_pages);
 
+// Get the number of free blocks of each order
+// free_blocks must have room for PMM_ORDER_COUNT entries
+void pmm_get_order_stats(size_t* free_blocks);
+
+// Number of physical memory regions managed (one per usable memmap range)
+size_t pmm_region_count(void);
+
+// Usable RAM pmm_init() had to leave out because the memory map had more
+// separate usable ranges than the PMM has region slots for (64). Returns
+// pages and sets ranges.
+size_t pmm_dropped_pages(size_t* ranges);
+
+// Physical range reserved for DMA buffers in pmm_init (managed by dma.c)
+// Returns false if no usable range below 4GB was large enough
+bool pmm_get_dma_zone(uint64_t* base, size_t* pages);
+
 #endif // MEMORY_PMM_H
@@ -0,0 +1,357 @@
+#include "memory/slab.h"
+#include "arch/x86/smp.h"
+#include "arch/x86/spinlock.h"
+#include "core/stats.h"
+#include "memory/magazine.h"
+#include "memory/pmm.h"
+#include "memory/vmm.h"
+#include "libc/string.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Each slab is one physical page reached through the HHDM. The slab header
+// sits at the start of the page and the objects follow it. Free objects are
+// linked through their first word, so an allocation is a pointer pop.
+//
+// In front of the slabs every cache keeps one magazine per CPU. Objects
+// parked in a magazine still count as in use by their slab; only the batched
+// refills and spills take the cache lock.
+
+#define SLAB_MAGIC 0x51AB51AB51AB51ABULL
+#define SLAB_MIN_ALIGN 16
+#define SLAB_MAX_EMPTY 1 // Empty slabs a cache keeps before returning pages
+
+typedef struct slab {
+    uint64_t magic;          // SLAB_MAGIC ^ address of the slab
+    kmem_cache_t* cache;     // Cache this slab belongs to
+    struct slab* next;
+    struct slab* prev;
+    void* free_list;         // First free object in this slab
+    uint32_t in_use;         // Objects handed out
+    uint32_t capacity;       // Objects that fit in the slab
+} slab_t;
+
+struct kmem_cache {
+    const char* name;
+    size_t object_size;      // Size of each object, rounded up to alignment
+    size_t align;
+    size_t first_offset;     // Offset of the first object within a slab
+    uint32_t capacity;       // Objects per slab (0 = layout not computed yet)
+    slab_t* partial;         // Slabs with free objects
+    slab_t* full;            // Slabs with no free objects
+    slab_t* empty;           // Slabs with no objects in use
+    size_t empty_count;
+    size_t slab_count;
+    size_t objects_in_use;
+    bool is_static;          // Built-in cache that can't be destroyed
+    spinlock_t lock;         // Guards the slab lists and counters above
+    magazine_t mags[SMP_MAX_CPUS];
+};
+
+#define SIZE_CLASS(sz) { .name = "kmalloc-" #sz, .object_size = sz, .align = SLAB_MIN_ALIGN, .is_static = true }
+
+// kmalloc size classes. The largest classes are picked so that three and two
+// objects still fit next to the slab header in one page.
+static kmem_cache_t size_classes[] = {
+    SIZE_CLASS(16),
+    SIZE_CLASS(32),
+    SIZE_CLASS(48),
+    SIZE_CLASS(64),
+    SIZE_CLASS(96),
+    SIZE_CLASS(128),
+    SIZE_CLASS(192),
+    SIZE_CLASS(256),
+    SIZE_CLASS(384),
+    SIZE_CLASS(512),
+    SIZE_CLASS(768),
+    SIZE_CLASS(1024),
+    SIZE_CLASS(1344),
+    SIZE_CLASS(2016),
+};
+
+#define SIZE_CLASS_COUNT (sizeof(size_classes) / sizeof(size_classes[0]))
+
+// Cache that kmem_cache_create() takes its descriptors from
+static kmem_cache_t cache_cache = {
+    .name = "kmem_cache",
+    .object_size = sizeof(kmem_cache_t),
+    .align = _Alignof(kmem_cache_t),
+    .is_static = true,
+};
+
+// Shared by every cache, whose locks don't cover it: updated atomically
+static size_t total_slab_pages = 0;
+
+// Objects handed out to callers, counted by the CPU that allocated or freed
+// them (so one CPU's count can go negative) and summed when read
+typedef struct {
+    int64_t objects;
+    int64_t bytes;
+} __attribute__((aligned(64))) slab_cpu_stats_t;
+
+static slab_cpu_stats_t cpu_stats[SMP_MAX_CPUS];
+
+static inline size_t align_up(size_t value, size_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+static inline uint64_t slab_magic(const slab_t* slab) {
+    return SLAB_MAGIC ^ (uint64_t)(uintptr_t)slab;
+}
+
+static void slab_list_push(slab_t** head, slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head) (*head)->prev = slab;
+    *head = slab;
+}
+
+static void slab_list_remove(slab_t** head, slab_t* slab) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else *head = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+// Work out how objects are laid out in a slab
+static bool cache_layout(kmem_cache_t* cache) {
+    cache->object_size = align_up(cache->object_size, cache->align);
+    cache->first_offset = align_up(sizeof(slab_t), cache->align);
+    if (cache->first_offset + cache->object_size > PAGE_SIZE) return false;
+
+    cache->capacity = (uint32_t)((PAGE_SIZE - cache->first_offset) / cache->object_size);
+    return true;
+}
+
+// Take a page from the PMM and carve it into free objects
+static slab_t* slab_create(kmem_cache_t* cache) {
+    if (cache->capacity == 0 && !cache_layout(cache)) return NULL;
+
+    void* page = pmm_alloc();
+    if (!page) return NULL;
+
+    slab_t* slab = (slab_t*)phys_to_virt((uint64_t)page);
+    slab->magic = slab_magic(slab);
+    slab->cache = cache;
+    slab->next = NULL;
+    slab->prev = NULL;
+    slab->in_use = 0;
+    slab->capacity = cache->capacity;
+
+    // Thread the free list through the objects in address order
+    uint8_t* obj = (uint8_t*)slab + cache->first_offset;
+    slab->free_list = obj;
+    for (uint32_t i = 0; i + 1 < cache->capacity; i++) {
+        *(void**)obj = obj + cache->object_size;
+        obj += cache->object_size;
+    }
+    *(void**)obj = NULL;
+
+    cache->slab_count++;
+    __atomic_fetch_add(&total_slab_pages, 1, __ATOMIC_RELAXED);
+    return slab;
+}
+
+// Return a slab page to the PMM
+static void slab_release(slab_t* slab) {
+    kmem_cache_t* cache = slab->cache;
+    cache->slab_count--;
+    __atomic_fetch_sub(&total_slab_pages, 1, __ATOMIC_RELAXED);
+
+    // Forget the magic so the page is never mistaken for a slab again
+    slab->magic = 0;
+    pmm_free((void*)virt_to_phys(slab));
+}
+
+static void slab_release_list(slab_t* head) {
+    while (head) {
+        slab_t* next = head->next;
+        slab_release(head);
+        head = next;
+    }
+}
+
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align) {
+    if (size == 0) return NULL;
+    if (align == 0) align = SLAB_MIN_ALIGN;
+    if (align & (align - 1)) return NULL; // Must be a power of two
+    if (size < sizeof(void*)) size = sizeof(void*);
+
+    kmem_cache_t* cache = (kmem_cache_t*)kmem_cache_alloc(&cache_cache);
+    if (!cache) return NULL;
+
+    memset(cache, 0, sizeof(kmem_cache_t));
+    cache->name = name;
+    cache->object_size = size;
+    cache->align = align;
+    if (!cache_layout(cache)) {
+        kmem_cache_free(&cache_cache, cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void kmem_cache_destroy(kmem_cache_t* cache) {
+    if (!cache || cache->is_static) return;
+
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+
+    // Whatever no magazine holds was never freed; stop counting it
+    int64_t live = (int64_t)cache->objects_in_use;
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        live -= (int64_t)cache->mags[cpu].count;
+        cache->mags[cpu].count = 0;
+    }
+    slab_cpu_stats_t* stats = &cpu_stats[smp_cpu_id()];
+    stats->objects -= live;
+    stats->bytes -= live * (int64_t)cache->object_size;
+
+    slab_release_list(cache->partial);
+    slab_release_list(cache->full);
+    slab_release_list(cache->empty);
+    spin_unlock_irqrestore(&cache->lock, flags);
+    kmem_cache_free(&cache_cache, cache);
+}
+
+// Take one object out of the slabs; caller holds the cache lock
+static void* slab_take(kmem_cache_t* cache) {
+    slab_t* slab = cache->partial;
+    if (!slab) {
+        slab = cache->empty;
+        if (slab) {
+            slab_list_remove(&cache->empty, slab);
+            cache->empty_count--;
+        } else {
+            slab = slab_create(cache);
+            if (!slab) return NULL;
+        }
+        slab_list_push(&cache->partial, slab);
+    }
+
+    void* obj = slab->free_list;
+    slab->free_list = *(void**)obj;
+    slab->in_use++;
+
+    if (slab->in_use == slab->capacity) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+    }
+
+    cache->objects_in_use++;
+    return obj;
+}
+
+// Put one object back into its slab; caller holds the cache lock
+static void slab_give(kmem_cache_t* cache, void* obj) {
+    slab_t* slab = (slab_t*)((uintptr_t)obj & ~(uintptr_t)(PAGE_SIZE - 1));
+    if (slab->in_use == slab->capacity) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+    }
+
+    *(void**)obj = slab->free_list;
+    slab->free_list = obj;
+    slab->in_use--;
+    cache->objects_in_use--;
+
+    if (slab->in_use == 0) {
+        slab_list_remove(&cache->partial, slab);
+        if (cache->empty_count < SLAB_MAX_EMPTY) {
+            slab_list_push(&cache->empty, slab);
+            cache->empty_count++;
+        } else {
+            slab_release(slab);
+        }
+    }
+}
+
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    if (!cache) return NULL;
+
+    uint64_t flags = irq_save();
+    uint32_t cpu = smp_cpu_id();
+    magazine_t* mag = &cache->mags[cpu];
+    if (!magazine_empty(mag)) {
+        KSTAT_INC(SLAB_MAG_HIT);
+    } else {
+        KSTAT_INC(SLAB_MAG_REFILL);
+        spin_lock(&cache->lock);
+        for (int i = 0; i < MAGAZINE_BATCH; i++) {
+            void* obj = slab_take(cache);
+            if (!obj) break;
+            magazine_push(mag, (uintptr_t)obj);
+        }
+        spin_unlock(&cache->lock);
+        if (magazine_empty(mag)) {
+            irq_restore(flags);
+            return NULL;
+        }
+    }
+
+    void* obj = (void*)magazine_pop(mag);
+    cpu_stats[cpu].objects++;
+    cpu_stats[cpu].bytes += (int64_t)cache->object_size;
+    irq_restore(flags);
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* obj) {
+    if (!cache || !obj) return;
+
+    slab_t* slab = (slab_t*)((uintptr_t)obj & ~(uintptr_t)(PAGE_SIZE - 1));
+    if (slab->magic != slab_magic(slab) || slab->cache != cache) {
+        // Not an object of this cache - ignore
+        return;
+    }
+
+    uint64_t flags = irq_save();
+    uint32_t cpu = smp_cpu_id();
+    magazine_t* mag = &cache->mags[cpu];
+    if (magazine_full(mag)) {
+        KSTAT_INC(SLAB_MAG_SPILL);
+        spin_lock(&cache->lock);
+        for (int i = 0; i < MAGAZINE_BATCH; i++) {
+            slab_give(cache, (void*)magazine_pop(mag));
+        }
+        spin_unlock(&cache->lock);
+    }
+    magazine_push(mag, (uintptr_t)obj);
+    cpu_stats[cpu].objects--;
+    cpu_stats[cpu].bytes -= (int64_t)cache->object_size;
+    irq_restore(flags);
+}
+
+size_t kmem_cache_object_size(const kmem_cache_t* cache) {
+    return cache ? cache->object_size : 0;
+}
+
+kmem_cache_t* slab_size_class(size_t size) {
+    if (size == 0 || size > SLAB_MAX_SIZE) return NULL;
+
+    for (size_t i = 0; i < SIZE_CLASS_COUNT; i++) {
+        if (size <= size_classes[i].object_size) return &size_classes[i];
+    }
+    return NULL;
+}
+
+kmem_cache_t* slab_cache_of(const void* ptr) {
+    if (!ptr) return NULL;
+
+    const slab_t* slab = (const slab_t*)((uintptr_t)ptr & ~(uintptr_t)(PAGE_SIZE - 1));
+    if (slab->magic != slab_magic(slab)) return NULL;
+    return slab->cache;
+}
+
+void slab_get_stats(size_t* slab_pages, size_t* bytes_in_use, size_t* objects_in_use) {
+    int64_t objects = 0, bytes = 0;
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        objects += cpu_stats[cpu].objects;
+        bytes += cpu_stats[cpu].bytes;
+    }
+
+    if (slab_pages) *slab_pages = total_slab_pages;
+    if (bytes_in_use) *bytes_in_use = bytes > 0 ? (size_t)bytes : 0;
+    if (objects_in_use) *objects_in_use = objects > 0 ? (size_t)objects : 0;
+}
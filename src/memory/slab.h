@@ -0,0 +1,39 @@
+#ifndef MEMORY_SLAB_H
+#define MEMORY_SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Object cache handing out fixed-size objects from page-sized slabs
+typedef struct kmem_cache kmem_cache_t;
+
+// Largest object size served by the kmalloc size classes
+#define SLAB_MAX_SIZE 2016
+
+// Create a cache for objects of the given size and alignment (0 = 16 bytes)
+// Returns NULL if the object is too large to fit a slab
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align);
+
+// Destroy a cache and return all of its slabs to the PMM
+void kmem_cache_destroy(kmem_cache_t* cache);
+
+// Allocate one object from a cache
+void* kmem_cache_alloc(kmem_cache_t* cache);
+
+// Return an object to the cache it came from
+void kmem_cache_free(kmem_cache_t* cache, void* obj);
+
+// Size of the objects in a cache
+size_t kmem_cache_object_size(const kmem_cache_t* cache);
+
+// Size-class cache that serves a kmalloc of this size (NULL if too large)
+kmem_cache_t* slab_size_class(size_t size);
+
+// Returns the cache owning ptr, or NULL if ptr is not a slab object
+kmem_cache_t* slab_cache_of(const void* ptr);
+
+// Get slab statistics: pages held by slabs and bytes handed out
+void slab_get_stats(size_t* slab_pages, size_t* bytes_in_use, size_t* objects_in_use);
+
+#endif // MEMORY_SLAB_H
@@ -0,0 +1,346 @@
+#include "memory/vma.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arch/x86/cpu.h"
+#include "arch/x86/smp.h"
+#include "arch/x86/spinlock.h"
+#include "core/stats.h"
+#include "libc/string.h"
+#include "memory/pmm.h"
+#include "memory/slab.h"
+
+static kmem_cache_t *vma_cache = NULL;
+static spinlock_t vma_cache_lock;
+
+static vma_t *vma_alloc(void) {
+    if (!vma_cache) {
+        uint64_t flags = spin_lock_irqsave(&vma_cache_lock);
+        if (!vma_cache) vma_cache = kmem_cache_create("vma", sizeof(vma_t), 0);
+        spin_unlock_irqrestore(&vma_cache_lock, flags);
+        if (!vma_cache) return NULL;
+    }
+    vma_t *vma = (vma_t *)kmem_cache_alloc(vma_cache);
+    if (vma) memset(vma, 0, sizeof(*vma));
+    return vma;
+}
+
+static vma_t *find_locked(page_table_t *pt, uint64_t addr) {
+    for (vma_t *vma = pt->vmas; vma && vma->start <= addr; vma = vma->next) {
+        if (addr < vma->end) return vma;
+    }
+    return NULL;
+}
+
+// Served straight from the backing file instead of a private copy?
+static bool page_is_direct(const vma_t *vma, uint64_t page) {
+    if (!vma->file || (vma->prot & VMA_WRITE)) return false;
+    uint64_t offset = page - vma->start;
+    if (offset + PAGE_SIZE > vma->file_size) return false;
+    return ((uintptr_t)(vma->file + offset) & (PAGE_SIZE - 1)) == 0;
+}
+
+static uint64_t pte_flags(uint32_t prot) {
+    uint64_t flags = PAGE_PRESENT;
+    if (prot & VMA_WRITE) flags |= PAGE_WRITE;
+    if (prot & VMA_USER) flags |= PAGE_USER;
+    if (!(prot & VMA_EXEC) && (rdmsr(MSR_EFER) & EFER_NXE)) flags |= PAGE_NX;
+    return flags;
+}
+
+// Private frames unmapped per TLB flush in release_pages()
+#define RELEASE_BATCH 64
+
+// Unmap the pages of [from, to) that no area covers any more and drop this
+// address space's hold on their private frames; each is freed once no clone
+// maps it any more. Works in chunks: the PTEs are cleared under vma_lock,
+// but the shootdown waits for CPUs that may be spinning on that lock with
+// interrupts off, so it and the frees only run once the lock is dropped.
+// Called without vma_lock; vma only tells which pages are the file's own.
+static void release_pages(page_table_t *pt, const vma_t *vma, uint64_t from, uint64_t to) {
+    uint64_t page = from;
+    while (page < to) {
+        vmm_tlb_batch_t batch;
+        vmm_tlb_batch_begin(&batch, pt);
+        uint64_t frames[RELEASE_BATCH];
+        size_t count = 0;
+
+        uint64_t flags = spin_lock_irqsave(&pt->vma_lock);
+        for (; page < to && count < RELEASE_BATCH; page += PAGE_SIZE) {
+            uint64_t *pte = vmm_get_pte(pt, page);
+            if (!pte || !(*pte & PAGE_PRESENT)) continue;
+            if (find_locked(pt, page)) continue;  // Area grown back meanwhile
+
+            uint64_t phys = *pte & PAGE_FRAME_MASK;
+            *pte = 0;
+            vmm_tlb_batch_add(&batch, page);
+            if (!page_is_direct(vma, page)) frames[count++] = phys;
+        }
+        spin_unlock_irqrestore(&pt->vma_lock, flags);
+
+        // No CPU may reach a frame through a stale entry once it is freed
+        vmm_tlb_batch_flush(&batch);
+        for (size_t i = 0; i < count; i++) pmm_page_unshare((void *)frames[i]);
+    }
+}
+
+bool vma_map(page_table_t *pt, uint64_t start, uint64_t size, uint32_t prot,
+             const void *file, uint64_t file_size) {
+    uint64_t end = PAGE_ALIGN_UP(start + size);
+    if (!pt || (start & (PAGE_SIZE - 1)) || end < start || end > VMM_USER_END) return false;
+
+    vma_t *vma = vma_alloc();
+    if (!vma) return false;
+    vma->start = start;
+    vma->end = end;
+    vma->prot = prot;
+    vma->file = (const uint8_t *)file;
+    vma->file_size = file ? file_size : 0;
+
+    uint64_t flags = spin_lock_irqsave(&pt->vma_lock);
+    vma_t *prev = NULL;
+    vma_t *next = pt->vmas;
+    while (next && next->start < start) {
+        prev = next;
+        next = next->next;
+    }
+    bool overlaps = (prev && prev->end > start) || (next && next->start < end);
+    if (!overlaps) {
+        vma->next = next;
+        if (prev) prev->next = vma;
+        else pt->vmas = vma;
+    }
+    spin_unlock_irqrestore(&pt->vma_lock, flags);
+
+    if (overlaps) kmem_cache_free(vma_cache, vma);
+    return !overlaps;
+}
+
+bool vma_set_end(page_table_t *pt, uint64_t start, uint64_t new_end) {
+    new_end = PAGE_ALIGN_UP(new_end);
+    if (!pt || new_end < start || new_end > VMM_USER_END) return false;
+
+    bool ok = false;
+    uint64_t old_end = new_end;
+    uint64_t flags = spin_lock_irqsave(&pt->vma_lock);
+    vma_t *vma = pt->vmas;
+    while (vma && vma->start != start) vma = vma->next;
+    if (vma && (!vma->next || new_end <= vma->next->start)) {
+        old_end = vma->end;
+        vma->end = new_end;
+        ok = true;
+    }
+    spin_unlock_irqrestore(&pt->vma_lock, flags);
+
+    // Shrunk: the cut-off pages can no longer fault in, so free them unlocked
+    if (old_end > new_end) release_pages(pt, vma, new_end, old_end);
+    return ok;
+}
+
+// Give dst a private copy of a page whose frame can't take another mapping
+static bool copy_page(page_table_t *dst, const vma_t *vma, uint64_t page, uint64_t phys) {
+    uint64_t copy = (uint64_t)pmm_alloc();
+    if (!copy) return false;
+    memcpy(hhdm_phys_to_virt(copy), hhdm_phys_to_virt(phys), PAGE_SIZE);
+    if (vmm_map_page(dst, page, copy, pte_flags(vma->prot))) return true;
+    pmm_free((void *)copy);
+    return false;
+}
+
+// Map every page src has faulted in for vma into dst as well. Writable
+// private pages turn read-only + PAGE_COW on both sides. A frame already
+// shared as often as the PMM can count is copied for dst instead.
+static bool share_pages(page_table_t *dst, page_table_t *src, const vma_t *vma, vmm_tlb_batch_t *batch) {
+    for (uint64_t page = vma->start; page < vma->end; page += PAGE_SIZE) {
+        uint64_t *pte = vmm_get_pte(src, page);
+        if (!pte || !(*pte & PAGE_PRESENT)) continue;
+
+        uint64_t phys = *pte & PAGE_FRAME_MASK;
+        bool direct = page_is_direct(vma, page);
+        if (!direct) {
+            if (!pmm_page_share((void *)phys)) {
+                if (!copy_page(dst, vma, page, phys)) return false;
+                continue;
+            }
+            if (*pte & PAGE_WRITE) {
+                *pte = (*pte & ~(uint64_t)PAGE_WRITE) | PAGE_COW;
+                vmm_tlb_batch_add(batch, page);
+            }
+        }
+        if (!vmm_map_page(dst, page, phys, *pte & ~PAGE_FRAME_MASK)) {
+            if (!direct) pmm_page_unshare((void *)phys);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool vma_clone(page_table_t *dst, page_table_t *src) {
+    bool ok = true;
+    uint64_t flags = spin_lock_irqsave(&src->vma_lock);
+    vmm_tlb_batch_t batch;
+    vmm_tlb_batch_begin(&batch, src);
+
+    vma_t **tail = &dst->vmas;
+    for (const vma_t *vma = src->vmas; vma && ok; vma = vma->next) {
+        vma_t *copy = vma_alloc();
+        if (!copy) {
+            ok = false;
+            break;
+        }
+        *copy = *vma;
+        copy->next = NULL;
+        *tail = copy;
+        tail = &copy->next;
+        ok = share_pages(dst, src, vma, &batch);
+    }
+    dst->brk_start = src->brk_start;
+    dst->brk = src->brk;
+
+    spin_unlock_irqrestore(&src->vma_lock, flags);
+
+    // The source may be running on this CPU: its old writable entries go.
+    // Not under vma_lock, which a CPU faulting in src may be spinning on
+    // with interrupts off; dst is not visible yet and src only lost rights.
+    vmm_tlb_batch_flush(&batch);
+    return ok;
+}
+
+static bool access_allowed(const vma_t *vma, uint64_t error_code) {
+    if ((error_code & PF_WRITE) && !(vma->prot & VMA_WRITE)) return false;
+    if ((error_code & PF_USER) && !(vma->prot & VMA_USER)) return false;
+    if ((error_code & PF_IFETCH) && !(vma->prot & VMA_EXEC)) return false;
+    return true;
+}
+
+// Back the page holding addr; pt->vma_lock is held
+static bool fault_in(page_table_t *pt, const vma_t *vma, uint64_t addr) {
+    uint64_t page = PAGE_ALIGN_DOWN(addr);
+    uint64_t offset = page - vma->start;
+    uint64_t phys;
+    if (page_is_direct(vma, page)) {
+        phys = hhdm_virt_to_phys(vma->file + offset);
+        KSTAT_INC(VMA_FAULT_DIRECT);
+        return vmm_map_page(pt, page, phys, pte_flags(vma->prot));
+    }
+
+    if (vma->file && offset < vma->file_size) {
+        phys = (uint64_t)pmm_alloc();
+        if (!phys) return false;
+        uint8_t *dst = hhdm_phys_to_virt(phys);
+        uint64_t copy = vma->file_size - offset;
+        if (copy > PAGE_SIZE) copy = PAGE_SIZE;
+        memcpy(dst, vma->file + offset, copy);
+        memset(dst + copy, 0, PAGE_SIZE - copy);
+        KSTAT_INC(VMA_FAULT_FILE);
+    } else {
+        phys = (uint64_t)pmm_alloc_zeroed();
+        if (!phys) return false;
+        KSTAT_INC(VMA_FAULT_ANON);
+    }
+    if (vmm_map_page(pt, page, phys, pte_flags(vma->prot))) return true;
+    pmm_free((void *)phys);
+    return false;
+}
+
+// Write to a PAGE_COW page: copy it, or take it back if no clone still
+// maps it; pt->vma_lock is held, so only this CPU's TLB is invalidated.
+// Other CPUs may keep a read-only entry for the page: in the reuse case
+// that just costs them a spurious fault. When the page moved to a copy,
+// *stale is set to the old frame and the caller must shoot the page down
+// everywhere once the lock is dropped, then unshare the old frame.
+static bool break_cow(page_table_t *pt, const vma_t *vma, uint64_t addr, uint64_t *stale) {
+    uint64_t page = PAGE_ALIGN_DOWN(addr);
+    uint64_t *pte = vmm_get_pte(pt, page);
+    if (!pte || !(*pte & PAGE_PRESENT)) return false;
+    // Another CPU broke it first and ours still had the read-only entry,
+    // which the fault itself dropped
+    if (*pte & PAGE_WRITE) return true;
+    if (!(*pte & PAGE_COW)) return false;
+
+    uint64_t shared = *pte & PAGE_FRAME_MASK;
+    if (pmm_page_shares((void *)shared) == 0) {
+        KSTAT_INC(VMA_COW_REUSE);
+        *pte = shared | pte_flags(vma->prot);
+    } else {
+        uint64_t phys = (uint64_t)pmm_alloc();
+        if (!phys) return false;
+        memcpy(hhdm_phys_to_virt(phys), hhdm_phys_to_virt(shared), PAGE_SIZE);
+        *pte = phys | pte_flags(vma->prot);
+        *stale = shared;
+        KSTAT_INC(VMA_COW_COPY);
+    }
+    asm volatile ("invlpg (%0)" :: "r"(page) : "memory");
+    return true;
+}
+
+bool vma_handle_fault(uint64_t addr, uint64_t error_code) {
+    if (addr >= VMM_USER_END) return false;
+    page_table_t *pt = this_cpu()->page_table;
+    if (!pt || pt == vmm_get_kernel_page_table()) return false;
+
+    uint64_t flags = spin_lock_irqsave(&pt->vma_lock);
+    const vma_t *vma = find_locked(pt, addr);
+    bool ok = false;
+    uint64_t stale = 0;
+    if (vma && access_allowed(vma, error_code)) {
+        // Present pages that refuse the access are real protection faults,
+        // unless it is a write to a copy-on-write page
+        if (!(error_code & PF_PRESENT)) ok = fault_in(pt, vma, addr);
+        else if (error_code & PF_WRITE) ok = break_cow(pt, vma, addr, &stale);
+    }
+    spin_unlock_irqrestore(&pt->vma_lock, flags);
+
+    // The shootdown waits for CPUs that may spin on vma_lock, so only now
+    if (stale) {
+        vmm_tlb_batch_t batch;
+        vmm_tlb_batch_begin(&batch, pt);
+        vmm_tlb_batch_add(&batch, PAGE_ALIGN_DOWN(addr));
+        vmm_tlb_batch_flush(&batch);
+        pmm_page_unshare((void *)stale);
+    }
+    return ok;
+}
+
+bool vma_copy_from_user(page_table_t *pt, void *dst, uint64_t addr, uint64_t len) {
+    if (len == 0) return true;
+    if (addr >= VMM_USER_END || len > VMM_USER_END - addr) return false;
+
+    // Read through the direct map while holding vma_lock, so no page can be
+    // unmapped or replaced under us and the kernel never faults on user memory
+    uint64_t flags = spin_lock_irqsave(&pt->vma_lock);
+    uint8_t *out = (uint8_t *)dst;
+    bool ok = true;
+    while (ok && len > 0) {
+        uint64_t page = PAGE_ALIGN_DOWN(addr);
+        const vma_t *vma = find_locked(pt, page);
+        if (!vma || !access_allowed(vma, PF_USER)) {
+            ok = false;
+        } else if (!vmm_get_page_size(pt, page) && !fault_in(pt, vma, page)) {
+            ok = false;
+        } else {
+            uint64_t chunk = PAGE_SIZE - (addr - page);
+            if (chunk > len) chunk = len;
+            memcpy(out, hhdm_phys_to_virt(vmm_get_physical(pt, page) + (addr - page)), chunk);
+            out += chunk;
+            addr += chunk;
+            len -= chunk;
+        }
+    }
+    spin_unlock_irqrestore(&pt->vma_lock, flags);
+    return ok;
+}
+
+void vma_destroy_all(page_table_t *pt) {
+    uint64_t flags = spin_lock_irqsave(&pt->vma_lock);
+    vma_t *vma = pt->vmas;
+    pt->vmas = NULL;
+    spin_unlock_irqrestore(&pt->vma_lock, flags);
+
+    while (vma) {
+        vma_t *next = vma->next;
+        release_pages(pt, vma, vma->start, vma->end);
+        kmem_cache_free(vma_cache, vma);
+        vma = next;
+    }
+}
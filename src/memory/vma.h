@@ -0,0 +1,63 @@
+#ifndef MEMORY_VMA_H
+#define MEMORY_VMA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "memory/vmm.h"
+
+// Virtual memory areas: the user half of an address space is a sorted list
+// of page-aligned ranges, and pages are only allocated when first touched.
+// A file-backed area reads its first file_size bytes from memory that
+// stays valid for the area's lifetime (an initramfs module); read-only
+// pages that lie wholly inside the file and start on a page boundary are
+// mapped straight from it, the rest is copied or zero-filled on fault.
+
+#define VMA_READ  (1u << 0)
+#define VMA_WRITE (1u << 1)
+#define VMA_EXEC  (1u << 2)
+#define VMA_USER  (1u << 3)
+
+typedef struct vma {
+    struct vma *next;
+    uint64_t start;          // Page aligned
+    uint64_t end;            // Page aligned, exclusive; may equal start
+    uint32_t prot;           // VMA_* bits
+    const uint8_t *file;     // Contents of start.., NULL for anonymous memory
+    uint64_t file_size;      // Bytes of file behind start; the rest is zero
+} vma_t;
+
+// Page-fault error code bits
+#define PF_PRESENT (1u << 0)
+#define PF_WRITE   (1u << 1)
+#define PF_USER    (1u << 2)
+#define PF_IFETCH  (1u << 4)
+
+// Describe [start, start + size) in pt's user half. Fails if the range is
+// unaligned, outside the user half, overlaps another area or no memory.
+bool vma_map(page_table_t *pt, uint64_t start, uint64_t size, uint32_t prot,
+             const void *file, uint64_t file_size);
+
+// Move the end of the area starting at start (the heap, for brk). Pages
+// dropped by shrinking are unmapped and freed.
+bool vma_set_end(page_table_t *pt, uint64_t start, uint64_t new_end);
+
+// Copy src's areas and program break into the empty address space dst and
+// share every page faulted in so far: private pages copy-on-write (with a
+// PMM share count), pages mapped straight from a file as they are
+bool vma_clone(page_table_t *dst, page_table_t *src);
+
+// Resolve a fault at addr in the address space loaded on this CPU: fill in
+// a missing page, or break copy-on-write sharing on a write. Returns false
+// if no area allows the access, so the caller must treat it as fatal.
+bool vma_handle_fault(uint64_t addr, uint64_t error_code);
+
+// Copy len bytes at user address addr into dst, faulting pages in as
+// needed. False if any page lies outside a readable user area; dst may
+// then be partly written. The kernel never touches user memory directly.
+bool vma_copy_from_user(page_table_t *pt, void *dst, uint64_t addr, uint64_t len);
+
+// Free every area of pt and the pages faulted in for them (not the tables)
+void vma_destroy_all(page_table_t *pt);
+
+#endif // MEMORY_VMA_H
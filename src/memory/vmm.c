@@ -1,7 +1,12 @@
 #include "memory/vmm.h"
 #include "memory/pmm.h"
-#include "memory/heap.h"
+#include "memory/slab.h"
+#include "memory/vma.h"
 #include "libc/string.h"
+#include "arch/x86/apic.h"
+#include "arch/x86/cpu.h"
+#include "arch/x86/smp.h"
+#include "core/stats.h"
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -14,60 +19,142 @@
 // Extract physical address from page table entry
 #define PTE_GET_ADDR(entry) ((entry) & 0x000FFFFFFFFFF000ULL)
 #define PTE_GET_FLAGS(entry) ((entry) & 0xFFF)
+#define PTE_GET_ADDR_2M(entry) ((entry) & 0x000FFFFFFFE00000ULL)
+#define PTE_GET_ADDR_1G(entry) ((entry) & 0x000FFFFFC0000000ULL)
+
+// Low flag bits plus NX; large leaves keep their PAT bit at bit 12
+#define PTE_FLAGS_MASK (0xFFFULL | (1ULL << 63))
+#define PTE_LARGE_PAT  (1ULL << 12)
+
+// PAT memory type encodings
+#define PAT_UC       0x00ULL
+#define PAT_WC       0x01ULL
+#define PAT_WT       0x04ULL
+#define PAT_WP       0x05ULL
+#define PAT_WB       0x06ULL
+#define PAT_UC_MINUS 0x07ULL
+#define PAT_ENTRY(i, type) ((type) << ((i) * 8))
+
+// Power-on layout for PAT0-3 and WP/WC in PAT4/5, the same table Limine
+// programs, so entries it created keep their meaning
+#define PAT_LAYOUT (PAT_ENTRY(0, PAT_WB) | PAT_ENTRY(1, PAT_WT) | \
+                    PAT_ENTRY(2, PAT_UC_MINUS) | PAT_ENTRY(3, PAT_UC) | \
+                    PAT_ENTRY(4, PAT_WP) | PAT_ENTRY(5, PAT_WC) | \
+                    PAT_ENTRY(6, PAT_UC_MINUS) | PAT_ENTRY(7, PAT_UC))
+
+#define CR4_PGE   (1ULL << 7)
+#define CR4_PCIDE (1ULL << 17)
+
+// CR3 bit 63 on a write: keep the TLB entries tagged with the new PCID
+#define CR3_NOFLUSH (1ULL << 63)
+
+// PCIDs handed to user address spaces; 0 stays with the kernel table.
+// When they run out a new generation starts, and every CPU flushes all of
+// its PCIDs before it runs an address space from the new generation.
+#define PCID_MAX 4095
 
 // Current kernel page table (set by Limine)
 static page_table_t* kernel_page_table = NULL;
 
+static bool pcid_enabled = false;
+static spinlock_t pcid_lock;
+static uint16_t pcid_next = 1;
+static uint32_t pcid_generation = 1;
+
+// Dedicated cache for page_table_t descriptors
+static kmem_cache_t* page_table_cache = NULL;
+
+static page_table_t* alloc_page_table_struct(void) {
+    if (!page_table_cache) {
+        page_table_cache = kmem_cache_create("page_table", sizeof(page_table_t), 0);
+        if (!page_table_cache) return NULL;
+    }
+
+    page_table_t* pt = (page_table_t*)kmem_cache_alloc(page_table_cache);
+    if (pt) memset(pt, 0, sizeof(page_table_t));
+    return pt;
+}
+
+// Recycled page-table pages. Every page in the pool is already zeroed:
+// teardown clears the entries it visits, so reuse needs no memset.
+// Address spaces are built and torn down on any CPU, hence the lock.
+#define TABLE_POOL_MAX 256
+static uint64_t table_pool[TABLE_POOL_MAX];
+static size_t table_pool_count = 0;
+static spinlock_t table_pool_lock;
+
+// Get a zeroed page for a page table, from the pool or the PMM's zeroed pages
+static uint64_t table_alloc(void) {
+    uint64_t flags = spin_lock_irqsave(&table_pool_lock);
+    if (table_pool_count > 0) {
+        uint64_t phys = table_pool[--table_pool_count];
+        spin_unlock_irqrestore(&table_pool_lock, flags);
+        return phys;
+    }
+    spin_unlock_irqrestore(&table_pool_lock, flags);
+
+    return (uint64_t)pmm_alloc_zeroed();
+}
+
+// Give back a table page; it must already be all zeroes
+static void table_free(uint64_t phys) {
+    uint64_t flags = spin_lock_irqsave(&table_pool_lock);
+    if (table_pool_count < TABLE_POOL_MAX) {
+        table_pool[table_pool_count++] = phys;
+        spin_unlock_irqrestore(&table_pool_lock, flags);
+        return;
+    }
+    spin_unlock_irqrestore(&table_pool_lock, flags);
+    pmm_free((void*)phys);
+}
+
 void vmm_init(void) {
     // Limine already set up paging for us
     // We just need to get the current CR3 value (PML4 address)
     uint64_t cr3;
     asm volatile ("mov %%cr3, %0" : "=r"(cr3));
 
-    // Create kernel page table structure in the heap and zero it out
-    kernel_page_table = (page_table_t*)kcalloc(1, sizeof(page_table_t));
+    // Create kernel page table structure from its cache and zero it out
+    kernel_page_table = alloc_page_table_struct();
     if (!kernel_page_table) return;
 
     kernel_page_table->pml4_phys = (uint64_t*)(cr3 & ~0xFFFULL);
     kernel_page_table->pml4_virt = phys_to_virt((uint64_t)kernel_page_table->pml4_phys);
     if (!kernel_page_table->pml4_virt) {
-        kfree(kernel_page_table);
+        kmem_cache_free(page_table_cache, kernel_page_table);
         kernel_page_table = NULL;
+        return;
     }
+
+    // The APs read this when they come up; all CPUs are assumed alike
+    pcid_enabled = cpu_has_pcid();
+    vmm_init_cpu();
 }
 
 page_table_t* vmm_get_kernel_page_table(void) {
     return kernel_page_table;
 }
 
-void vmm_switch_page_table(page_table_t* pt) {
-    if (!pt) return;
-    asm volatile ("mov %0, %%cr3" : : "r"(pt->pml4_phys) : "memory");
-}
-
 page_table_t* vmm_create_page_table(void) {
     // Allocate structure
-    page_table_t* pt = (page_table_t*)kcalloc(1, sizeof(page_table_t));
+    page_table_t* pt = alloc_page_table_struct();
     if (!pt) return NULL;
 
-    // Allocate PML4
-    uint64_t pml4_phys = (uint64_t)pmm_alloc();
+    // Allocate PML4 (comes back zeroed)
+    uint64_t pml4_phys = table_alloc();
     if (!pml4_phys) {
-        kfree(pt);
+        kmem_cache_free(page_table_cache, pt);
         return NULL;
     }
     
     pt->pml4_phys = (uint64_t*)pml4_phys;
     pt->pml4_virt = phys_to_virt(pml4_phys);
     if (!pt->pml4_virt) {
-        pmm_free((void*)pml4_phys);
-        kfree(pt);
+        table_free(pml4_phys);
+        kmem_cache_free(page_table_cache, pt);
         return NULL;
     }
     
-    // Clear the PML4
-    memset(pt->pml4_virt, 0, PAGE_SIZE);
-    
     // Copy kernel mappings (higher half) from current page table
     if (kernel_page_table) {
         // Copy upper half entries (256-511) for kernel space
@@ -79,10 +166,219 @@ page_table_t* vmm_create_page_table(void) {
     return pt;
 }
 
+page_table_t* vmm_clone_address_space(page_table_t* src) {
+    if (!src || src == kernel_page_table) return NULL;
+
+    page_table_t* pt = vmm_create_page_table();
+    if (!pt) return NULL;
+    if (!vma_clone(pt, src)) {
+        vma_destroy_all(pt);
+        vmm_destroy_page_table(pt);
+        return NULL;
+    }
+    return pt;
+}
+
+// Defined below with the other table helpers
+static void free_table_tree(uint64_t table_phys, int level);
+
+void vmm_destroy_page_table(page_table_t* pt) {
+    if (!pt || pt == kernel_page_table) return;
+
+    // Never pull the tables out from under the CPU
+    uint64_t cr3;
+    asm volatile ("mov %%cr3, %0" : "=r"(cr3));
+    if ((cr3 & ~0xFFFULL) == (uint64_t)pt->pml4_phys) {
+        vmm_switch_page_table(kernel_page_table);
+    }
+
+    // Free every user-half PDPT/PD/PT; the kernel half is shared, just drop it
+    for (int i = 0; i < 512; i++) {
+        uint64_t entry = pt->pml4_virt[i];
+        if (entry == 0) continue;
+        if (i < 256 && (entry & PAGE_PRESENT)) {
+            free_table_tree(PTE_GET_ADDR(entry), 3);
+        }
+        pt->pml4_virt[i] = 0;
+    }
+
+    table_free((uint64_t)pt->pml4_phys);
+    kmem_cache_free(page_table_cache, pt);
+}
+
+// Flush the TLB entry covering a single address
+static inline void flush_page(uint64_t virt) {
+    KSTAT_INC(VMM_INVLPG);
+    asm volatile ("invlpg (%0)" : : "r"(virt) : "memory");
+}
+
+// Flush every non-global TLB entry by reloading CR3
+static inline void flush_all(void) {
+    KSTAT_INC(VMM_CR3_RELOAD);
+    uint64_t cr3;
+    asm volatile ("mov %%cr3, %0" : "=r"(cr3));
+    asm volatile ("mov %0, %%cr3" : : "r"(cr3) : "memory");
+}
+
+// Flush every TLB entry of every PCID, global ones included, by toggling CR4.PGE
+static inline void flush_everything(void) {
+    KSTAT_INC(VMM_FLUSH_EVERYTHING);
+    uint64_t flags = irq_save();
+    uint64_t cr4;
+    asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+    asm volatile ("mov %0, %%cr4" : : "r"(cr4 ^ CR4_PGE) : "memory");
+    asm volatile ("mov %0, %%cr4" : : "r"(cr4) : "memory");
+    irq_restore(flags);
+}
+
+void vmm_init_cpu(void) {
+    if (!kernel_page_table) return;
+    cpu_t* cpu = this_cpu();
+
+    // PCIDE may only be set while the PCID field of CR3 is zero
+    asm volatile ("mov %0, %%cr3" : : "r"(kernel_page_table->pml4_phys) : "memory");
+    cpu->page_table = kernel_page_table;
+    __atomic_fetch_or(&kernel_page_table->active_cpus, 1ULL << cpu->id, __ATOMIC_SEQ_CST);
+
+    if (pcid_enabled) {
+        uint64_t cr4;
+        asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+        asm volatile ("mov %0, %%cr4" : : "r"(cr4 | CR4_PCIDE) : "memory");
+    }
+
+    // Nothing maps with PAT4-7 before this runs, so no line can change type
+    // under us. The flush drops translations cached with the old table and
+    // any kernel-half change this CPU missed while it wasn't online yet.
+    if (cpu_has_pat() && rdmsr(MSR_PAT) != PAT_LAYOUT) wrmsr(MSR_PAT, PAT_LAYOUT);
+    flush_everything();
+}
+
+// Make sure pt owns a PCID of the current generation and return it
+static uint16_t pcid_assign(page_table_t* pt) {
+    uint32_t gen = __atomic_load_n(&pcid_generation, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&pt->pcid_gen, __ATOMIC_ACQUIRE) == gen) return pt->pcid;
+
+    uint64_t flags = spin_lock_irqsave(&pcid_lock);
+    if (pt->pcid_gen != pcid_generation) {
+        if (pcid_next > PCID_MAX) {
+            KSTAT_INC(VMM_PCID_ROLLOVER);
+            pcid_next = 1;
+            __atomic_store_n(&pcid_generation, pcid_generation + 1, __ATOMIC_RELEASE);
+        }
+        pt->pcid = pcid_next++;
+        __atomic_store_n(&pt->pcid_gen, pcid_generation, __ATOMIC_RELEASE);
+    }
+    uint16_t pcid = pt->pcid;
+    spin_unlock_irqrestore(&pcid_lock, flags);
+    return pcid;
+}
+
+void vmm_switch_page_table(page_table_t* pt) {
+    if (!pt) return;
+    cpu_t* cpu = this_cpu();
+    uint64_t bit = 1ULL << cpu->id;
+
+    // Publish the switch before reading tlb_gen: a flusher that misses this
+    // CPU in active_cpus has bumped tlb_gen where this CPU will see it
+    page_table_t* old = cpu->page_table;
+    if (old != pt) {
+        if (old) __atomic_fetch_and(&old->active_cpus, ~bit, __ATOMIC_SEQ_CST);
+        __atomic_fetch_or(&pt->active_cpus, bit, __ATOMIC_SEQ_CST);
+    }
+
+    uint64_t cr3 = (uint64_t)pt->pml4_phys;
+    if (pcid_enabled) {
+        if (pt != kernel_page_table) {
+            cr3 |= pcid_assign(pt);
+            if (cpu->pcid_gen != pt->pcid_gen) {
+                // PCIDs were handed out again since this CPU last dropped them
+                flush_everything();
+                cpu->pcid_gen = pt->pcid_gen;
+            }
+        }
+
+        // Entries left from the last time here are still good unless the
+        // address space was invalidated in the meantime
+        uint64_t gen = __atomic_load_n(&pt->tlb_gen, __ATOMIC_SEQ_CST);
+        if (pt->cpu_tlb_gen[cpu->id] == gen) {
+            KSTAT_INC(VMM_PCID_KEPT);
+            cr3 |= CR3_NOFLUSH;
+        }
+        pt->cpu_tlb_gen[cpu->id] = gen;
+    }
+
+    asm volatile ("mov %0, %%cr3" : : "r"(cr3) : "memory");
+    cpu->page_table = pt;
+}
+
+// Memory-type bits given as for a 4KB leaf, moved to where a large leaf keeps them
+static inline uint64_t large_leaf_type(uint64_t flags) {
+    if (flags & PAGE_PAT) flags = (flags & ~(uint64_t)PAGE_PAT) | PTE_LARGE_PAT;
+    return flags;
+}
+
+// Flags of a large leaf with the address bits removed
+static inline uint64_t large_leaf_flags(uint64_t entry) {
+    return entry & (PTE_FLAGS_MASK | PTE_LARGE_PAT);
+}
+
+// Turn a large leaf (level 3 = 1GB, level 2 = 2MB) into a table of
+// next-level leaves that map the same memory with the same flags
+static bool split_large_entry(uint64_t* entry, int level) {
+    uint64_t old = *entry;
+
+    uint64_t table_phys = table_alloc();
+    if (!table_phys) return false;
+    uint64_t* table = phys_to_virt(table_phys);
+
+    uint64_t flags = large_leaf_flags(old);
+    if (level == 3) {
+        // 1GB -> 512 x 2MB leaves, which keep the PS and large PAT bits
+        uint64_t base = PTE_GET_ADDR_1G(old);
+        for (int i = 0; i < 512; i++) {
+            table[i] = (base + (uint64_t)i * PAGE_SIZE_2M) | flags;
+        }
+    } else {
+        // 2MB -> 512 x 4KB leaves; PAT moves from bit 12 to bit 7
+        uint64_t base = PTE_GET_ADDR_2M(old);
+        uint64_t small_flags = flags & ~(PAGE_HUGE | PTE_LARGE_PAT);
+        if (flags & PTE_LARGE_PAT) small_flags |= PAGE_PAT;
+        for (int i = 0; i < 512; i++) {
+            table[i] = (base + (uint64_t)i * PAGE_SIZE) | small_flags;
+        }
+    }
+
+    // The table entry stays permissive; the leaves carry the real protection
+    *entry = table_phys | PAGE_PRESENT | PAGE_WRITE | (old & PAGE_USER);
+    return true;
+}
+
+// Free a page table page and every table below it (not the mapped pages).
+// Entries are cleared as they are visited so the page can be pooled as-is.
+static void free_table_tree(uint64_t table_phys, int level) {
+    uint64_t* table = phys_to_virt(table_phys);
+    for (int i = 0; i < 512; i++) {
+        uint64_t entry = table[i];
+        if (entry == 0) continue;
+        if (level > 1 && (entry & PAGE_PRESENT) && !(entry & PAGE_HUGE)) {
+            free_table_tree(PTE_GET_ADDR(entry), level - 1);
+        }
+        table[i] = 0;
+    }
+    table_free(table_phys);
+}
+
 // Helper: Get or create a page table at the given entry
-static uint64_t* get_or_create_table(uint64_t* table, size_t index, bool user_accessible) {
+// level is the level of table itself (4 = PML4, 3 = PDPT, 2 = PD)
+static uint64_t* get_or_create_table(uint64_t* table, size_t index, int level, bool user_accessible) {
     uint64_t entry = table[index];
 
+    if ((entry & PAGE_PRESENT) && (entry & PAGE_HUGE) && level < 4) {
+        // A large page covers this range - break it up first
+        if (!split_large_entry(&table[index], level)) return NULL;
+        entry = table[index];
+    }
+
     if (entry & PAGE_PRESENT) {
         // Table already exists - upgrade permissions if needed
         if (user_accessible && !(entry & PAGE_USER)) {
@@ -91,12 +387,12 @@ static uint64_t* get_or_create_table(uint64_t* table, size_t index, bool user_ac
         return (uint64_t*)phys_to_virt(PTE_GET_ADDR(entry));
     }
 
-    // Need to create a new table
-    uint64_t new_table_phys = (uint64_t)pmm_alloc();
+    // Need to create a new table (comes back zeroed)
+    uint64_t new_table_phys = table_alloc();
     if (!new_table_phys) return NULL;
+    KSTAT_INC(VMM_TABLES_CREATED);
 
     uint64_t* new_table_virt = phys_to_virt(new_table_phys);
-    memset(new_table_virt, 0, PAGE_SIZE);
 
     // Set the entry to point to the new table
     uint64_t flags = PAGE_PRESENT | PAGE_WRITE;
@@ -108,70 +404,422 @@ static uint64_t* get_or_create_table(uint64_t* table, size_t index, bool user_ac
     return new_table_virt;
 }
 
-bool vmm_map_page(page_table_t* pt, uint64_t virt, uint64_t phys, uint64_t flags) {
+// Walk the tables without creating anything. Returns the entry that maps
+// virt and its level (1 = 4KB PTE, 2 = 2MB PDE, 3 = 1GB PDPTE), or NULL.
+static uint64_t* walk_leaf(page_table_t* pt, uint64_t virt, int* level) {
+    uint64_t pml4_entry = pt->pml4_virt[PML4_INDEX(virt)];
+    if (!(pml4_entry & PAGE_PRESENT)) return NULL;
+
+    uint64_t* pdpt = phys_to_virt(PTE_GET_ADDR(pml4_entry));
+    uint64_t* pdpt_entry = &pdpt[PDPT_INDEX(virt)];
+    if (!(*pdpt_entry & PAGE_PRESENT)) return NULL;
+    if (*pdpt_entry & PAGE_HUGE) {
+        *level = 3;
+        return pdpt_entry;
+    }
+
+    uint64_t* pd = phys_to_virt(PTE_GET_ADDR(*pdpt_entry));
+    uint64_t* pd_entry = &pd[PD_INDEX(virt)];
+    if (!(*pd_entry & PAGE_PRESENT)) return NULL;
+    if (*pd_entry & PAGE_HUGE) {
+        *level = 2;
+        return pd_entry;
+    }
+
+    uint64_t* page_table = phys_to_virt(PTE_GET_ADDR(*pd_entry));
+    uint64_t* pt_entry = &page_table[PT_INDEX(virt)];
+    if (!(*pt_entry & PAGE_PRESENT)) return NULL;
+    *level = 1;
+    return pt_entry;
+}
+
+// The shootdown in flight; one at a time, serialised by shootdown_lock
+static spinlock_t shootdown_lock;
+static struct {
+    page_table_t* pt;          // NULL for shared kernel-half mappings
+    const uint64_t* addrs;
+    size_t count;
+    bool flush_all;
+    volatile uint64_t pending; // CPUs that still have to flush
+} shootdown;
+
+// Carry out an invalidation on this CPU
+static void flush_local(page_table_t* pt, const uint64_t* addrs, size_t count, bool all) {
+    if (!pt) {
+        // invlpg and CR3 reloads only reach the current PCID's copies
+        if (pcid_enabled) {
+            flush_everything();
+            return;
+        }
+    } else if (this_cpu()->page_table != pt) {
+        // Not loaded here: the lower half has nothing in the TLB, or catches
+        // up through tlb_gen at the next switch
+        return;
+    }
+
+    if (all) {
+        flush_all();
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            flush_page(addrs[i]);
+        }
+    }
+}
+
+// Answer the shootdown in flight, if it includes this CPU
+static void shootdown_service(void) {
+    uint64_t bit = 1ULL << smp_cpu_id();
+    if (!(__atomic_load_n(&shootdown.pending, __ATOMIC_ACQUIRE) & bit)) return;
+
+    flush_local(shootdown.pt, shootdown.addrs, shootdown.count, shootdown.flush_all);
+    __atomic_fetch_and(&shootdown.pending, ~bit, __ATOMIC_RELEASE);
+}
+
+void vmm_tlb_shootdown_ipi(void) {
+    shootdown_service();
+}
+
+// Invalidate on this CPU and on every other CPU that may hold the entries
+static void tlb_shootdown(page_table_t* pt, const uint64_t* addrs, size_t count, bool all) {
+    // Bump the generation before looking at active_cpus: a CPU switching in
+    // concurrently then either shows up there or sees the new generation
+    if (pt) __atomic_fetch_add(&pt->tlb_gen, 1, __ATOMIC_SEQ_CST);
+
+    uint64_t flags = irq_save();
+    uint32_t self = smp_cpu_id();
+
+    uint64_t targets = 0;
+    if (apic_enabled() && smp_cpu_count() > 1) {
+        if (pt) {
+            targets = __atomic_load_n(&pt->active_cpus, __ATOMIC_SEQ_CST);
+        } else {
+            for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+                cpu_t* cpu = smp_cpu(i);
+                if (cpu && cpu->online) targets |= 1ULL << i;
+            }
+        }
+        targets &= ~(1ULL << self);
+    }
+
+    if (targets == 0) {
+        flush_local(pt, addrs, count, all);
+        irq_restore(flags);
+        return;
+    }
+
+    // Interrupts stay off while waiting for the lock, so answer any
+    // shootdown aimed at this CPU in the meantime
+    while (!spin_trylock(&shootdown_lock)) {
+        shootdown_service();
+        asm volatile ("pause");
+    }
+
+    KSTAT_INC(VMM_SHOOTDOWN);
+    shootdown.pt = pt;
+    shootdown.addrs = addrs;
+    shootdown.count = count;
+    shootdown.flush_all = all;
+    __atomic_store_n(&shootdown.pending, targets, __ATOMIC_RELEASE);
+
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++) {
+        if (!(targets & (1ULL << i))) continue;
+        KSTAT_INC(VMM_SHOOTDOWN_IPI);
+        apic_send_ipi(smp_cpu(i)->lapic_id, IPI_TLB_SHOOTDOWN_VECTOR);
+    }
+
+    flush_local(pt, addrs, count, all);
+    while (__atomic_load_n(&shootdown.pending, __ATOMIC_ACQUIRE) != 0) {
+        asm volatile ("pause");
+    }
+
+    spin_unlock(&shootdown_lock);
+    irq_restore(flags);
+}
+
+// Invalidate the one page at virt, or all of pt's entries if whole is set
+static void flush_one(page_table_t* pt, uint64_t virt, bool whole) {
+    tlb_shootdown(virt >= VMM_KERNEL_HALF ? NULL : pt, &virt, 1, whole);
+}
+
+void vmm_tlb_batch_begin(vmm_tlb_batch_t* batch, page_table_t* pt) {
+    batch->pt = pt;
+    batch->count = 0;
+    batch->flush_all = false;
+    batch->kernel_half = false;
+}
+
+void vmm_tlb_batch_add(vmm_tlb_batch_t* batch, uint64_t virt) {
+    if (virt >= VMM_KERNEL_HALF) batch->kernel_half = true;
+    if (batch->flush_all) return;
+
+    if (batch->count == VMM_TLB_BATCH_MAX) {
+        // Too many single invalidations; one CR3 reload is cheaper
+        batch->flush_all = true;
+        return;
+    }
+    batch->addrs[batch->count++] = virt;
+}
+
+void vmm_tlb_batch_flush(vmm_tlb_batch_t* batch) {
+    if (batch->count == 0 && !batch->flush_all) return;
+
+    // The upper half is shared by every address space, so it goes to every CPU
+    page_table_t* pt = batch->kernel_half ? NULL : batch->pt;
+    tlb_shootdown(pt, batch->addrs, batch->count, batch->flush_all);
+
+    batch->count = 0;
+    batch->flush_all = false;
+    batch->kernel_half = false;
+}
+
+// Find (or create) the 4KB leaf table covering virt
+static uint64_t* get_leaf_table(page_table_t* pt, uint64_t virt, bool user_accessible) {
+    uint64_t* pdpt = get_or_create_table(pt->pml4_virt, PML4_INDEX(virt), 4, user_accessible);
+    if (!pdpt) return NULL;
+
+    uint64_t* pd = get_or_create_table(pdpt, PDPT_INDEX(virt), 3, user_accessible);
+    if (!pd) return NULL;
+
+    return get_or_create_table(pd, PD_INDEX(virt), 2, user_accessible);
+}
+
+bool vmm_map_range(page_table_t* pt, uint64_t virt, uint64_t phys, size_t pages, uint64_t flags) {
     if (!pt) return false;
-    
+
     // Align addresses
     virt = PAGE_ALIGN_DOWN(virt);
     phys = PAGE_ALIGN_DOWN(phys);
-    
-    // Get indices
-    size_t pml4_idx = PML4_INDEX(virt);
-    size_t pdpt_idx = PDPT_INDEX(virt);
-    size_t pd_idx = PD_INDEX(virt);
-    size_t pt_idx = PT_INDEX(virt);
-    
-    // Walk/create page tables
+
+    bool user_accessible = (flags & PAGE_USER) != 0;
+    bool ok = true;
+
+    vmm_tlb_batch_t batch;
+    vmm_tlb_batch_begin(&batch, pt);
+
+    while (pages > 0) {
+        // Walk/create page tables once per leaf table
+        uint64_t* page_table = get_leaf_table(pt, virt, user_accessible);
+        if (!page_table) {
+            ok = false;
+            break;
+        }
+
+        // Fill consecutive entries up to the end of this table
+        size_t pt_idx = PT_INDEX(virt);
+        size_t run = 512 - pt_idx;
+        if (run > pages) run = pages;
+
+        for (size_t i = 0; i < run; i++) {
+            uint64_t old = page_table[pt_idx + i];
+            page_table[pt_idx + i] = (phys + i * PAGE_SIZE) | flags | PAGE_PRESENT;
+
+            // Only a previously present entry can be cached in the TLB
+            if (old & PAGE_PRESENT) {
+                vmm_tlb_batch_add(&batch, virt + i * PAGE_SIZE);
+            }
+        }
+
+        virt += run * PAGE_SIZE;
+        phys += run * PAGE_SIZE;
+        pages -= run;
+    }
+
+    vmm_tlb_batch_flush(&batch);
+    return ok;
+}
+
+bool vmm_map_page(page_table_t* pt, uint64_t virt, uint64_t phys, uint64_t flags) {
+    return vmm_map_range(pt, virt, phys, 1, flags);
+}
+
+bool vmm_map_page_2m(page_table_t* pt, uint64_t virt, uint64_t phys, uint64_t flags) {
+    if (!pt) return false;
+    if ((virt | phys) & (PAGE_SIZE_2M - 1)) return false;
+
     bool user_accessible = (flags & PAGE_USER) != 0;
 
-    uint64_t* pdpt = get_or_create_table(pt->pml4_virt, pml4_idx, user_accessible);
+    uint64_t* pdpt = get_or_create_table(pt->pml4_virt, PML4_INDEX(virt), 4, user_accessible);
     if (!pdpt) return false;
 
-    uint64_t* pd = get_or_create_table(pdpt, pdpt_idx, user_accessible);
+    uint64_t* pd = get_or_create_table(pdpt, PDPT_INDEX(virt), 3, user_accessible);
     if (!pd) return false;
 
-    uint64_t* page_table = get_or_create_table(pd, pd_idx, user_accessible);
-    if (!page_table) return false;
-    
-    // Set the final page table entry
-    page_table[pt_idx] = phys | flags | PAGE_PRESENT;
-    
-    // Flush TLB for this address
-    asm volatile ("invlpg (%0)" : : "r"(virt) : "memory");
-    
+    // Replace whatever was there; a 4KB table underneath is no longer reachable
+    uint64_t old = pd[PD_INDEX(virt)];
+    pd[PD_INDEX(virt)] = phys | large_leaf_type(flags) | PAGE_PRESENT | PAGE_HUGE;
+
+    if ((old & PAGE_PRESENT) && !(old & PAGE_HUGE)) {
+        free_table_tree(PTE_GET_ADDR(old), 1);
+        flush_one(pt, virt, true);
+    } else {
+        flush_one(pt, virt, false);
+    }
     return true;
 }
 
+bool vmm_map_page_1g(page_table_t* pt, uint64_t virt, uint64_t phys, uint64_t flags) {
+    if (!pt) return false;
+    if ((virt | phys) & (PAGE_SIZE_1G - 1)) return false;
+    if (!cpu_has_1g_pages()) return false;
+
+    bool user_accessible = (flags & PAGE_USER) != 0;
+
+    uint64_t* pdpt = get_or_create_table(pt->pml4_virt, PML4_INDEX(virt), 4, user_accessible);
+    if (!pdpt) return false;
+
+    // Replace whatever was there; a PD (and its PTs) underneath is no longer reachable
+    uint64_t old = pdpt[PDPT_INDEX(virt)];
+    pdpt[PDPT_INDEX(virt)] = phys | large_leaf_type(flags) | PAGE_PRESENT | PAGE_HUGE;
+
+    if ((old & PAGE_PRESENT) && !(old & PAGE_HUGE)) {
+        free_table_tree(PTE_GET_ADDR(old), 2);
+        flush_one(pt, virt, true);
+    } else {
+        flush_one(pt, virt, false);
+    }
+    return true;
+}
+
+// Walk down to the entry that maps virt, splitting large pages on the way
+// when the range [virt, end) doesn't cover them entirely.
+// Returns NULL if nothing maps virt; *skip is set to the bytes to move on.
+static uint64_t* range_walk(page_table_t* pt, uint64_t virt, uint64_t end, int* level, uint64_t* skip) {
+    uint64_t pml4_entry = pt->pml4_virt[PML4_INDEX(virt)];
+    if (!(pml4_entry & PAGE_PRESENT)) {
+        *skip = (1ULL << 39) - (virt & ((1ULL << 39) - 1));
+        return NULL;
+    }
+
+    uint64_t* table = phys_to_virt(PTE_GET_ADDR(pml4_entry));
+    for (*level = 3; *level >= 1; (*level)--) {
+        int shift = 12 + 9 * (*level - 1);
+        uint64_t span = 1ULL << shift;
+        uint64_t* entry = &table[(virt >> shift) & 0x1FF];
+
+        if (!(*entry & PAGE_PRESENT)) {
+            *skip = span - (virt & (span - 1));
+            return NULL;
+        }
+
+        if (*level == 1) {
+            *skip = PAGE_SIZE;
+            return entry;
+        }
+
+        if (*entry & PAGE_HUGE) {
+            // Whole large page inside the range: unmap it as one leaf
+            if ((virt & (span - 1)) == 0 && end - virt >= span) {
+                *skip = span;
+                return entry;
+            }
+            if (!split_large_entry(entry, *level)) {
+                *skip = span - (virt & (span - 1));
+                return NULL;
+            }
+        }
+
+        table = phys_to_virt(PTE_GET_ADDR(*entry));
+    }
+    return NULL;
+}
+
+void vmm_unmap_range(page_table_t* pt, uint64_t virt, size_t pages) {
+    if (!pt || pages == 0) return;
+
+    virt = PAGE_ALIGN_DOWN(virt);
+    uint64_t end = virt + (uint64_t)pages * PAGE_SIZE;
+
+    vmm_tlb_batch_t batch;
+    vmm_tlb_batch_begin(&batch, pt);
+
+    while (virt < end) {
+        int level;
+        uint64_t skip;
+        uint64_t* entry = range_walk(pt, virt, end, &level, &skip);
+
+        if (entry && level == 1) {
+            // Clear consecutive entries of this leaf table in one go
+            size_t run = 512 - PT_INDEX(virt);
+            if (run > (end - virt) / PAGE_SIZE) run = (end - virt) / PAGE_SIZE;
+            for (size_t i = 0; i < run; i++) {
+                if (entry[i] & PAGE_PRESENT) {
+                    entry[i] = 0;
+                    vmm_tlb_batch_add(&batch, virt + i * PAGE_SIZE);
+                }
+            }
+            skip = run * PAGE_SIZE;
+        } else if (entry) {
+            *entry = 0;
+            vmm_tlb_batch_add(&batch, virt);
+        }
+
+        if (skip > end - virt) break;
+        virt += skip;
+    }
+
+    vmm_tlb_batch_flush(&batch);
+}
+
+bool vmm_set_memory_type(page_table_t* pt, uint64_t virt, size_t size, uint64_t type) {
+    if (!pt || size == 0) return false;
+    if (!cpu_has_pat()) return false;
+
+    type &= PAGE_CACHE_MASK;
+    uint64_t end = PAGE_ALIGN_UP(virt + size);
+    virt = PAGE_ALIGN_DOWN(virt);
+
+    vmm_tlb_batch_t batch;
+    vmm_tlb_batch_begin(&batch, pt);
+
+    bool ok = true;
+    while (virt < end) {
+        int level;
+        uint64_t skip;
+        uint64_t* entry = range_walk(pt, virt, end, &level, &skip);
+
+        if (entry && level == 1) {
+            if (*entry & PAGE_PRESENT) {
+                *entry = (*entry & ~(uint64_t)PAGE_CACHE_MASK) | type;
+                vmm_tlb_batch_add(&batch, virt);
+            }
+        } else if (entry) {
+            uint64_t large_mask = PTE_LARGE_PAT | PAGE_CACHE_DISABLE | PAGE_WRITE_THROUGH;
+            *entry = (*entry & ~large_mask) | large_leaf_type(type);
+            vmm_tlb_batch_add(&batch, virt);
+        } else if (vmm_get_page_size(pt, virt)) {
+            // A large page needed splitting and there was no memory for it
+            ok = false;
+        }
+
+        if (skip > end - virt) break;
+        virt += skip;
+    }
+
+    vmm_tlb_batch_flush(&batch);
+    return ok;
+}
+
 void vmm_unmap_page(page_table_t* pt, uint64_t virt) {
+    vmm_unmap_range(pt, virt, 1);
+}
+
+void vmm_unmap_huge_page(page_table_t* pt, uint64_t virt) {
     if (!pt) return;
-    
-    virt = PAGE_ALIGN_DOWN(virt);
-    
-    // Get indices
-    size_t pml4_idx = PML4_INDEX(virt);
-    size_t pdpt_idx = PDPT_INDEX(virt);
-    size_t pd_idx = PD_INDEX(virt);
-    size_t pt_idx = PT_INDEX(virt);
-    
-    // Walk page tables (don't create if they don't exist)
-    uint64_t pml4_entry = pt->pml4_virt[pml4_idx];
-    if (!(pml4_entry & PAGE_PRESENT)) return;
-    
-    uint64_t* pdpt = phys_to_virt(PTE_GET_ADDR(pml4_entry));
-    uint64_t pdpt_entry = pdpt[pdpt_idx];
-    if (!(pdpt_entry & PAGE_PRESENT)) return;
-    
-    uint64_t* pd = phys_to_virt(PTE_GET_ADDR(pdpt_entry));
-    uint64_t pd_entry = pd[pd_idx];
-    if (!(pd_entry & PAGE_PRESENT)) return;
-    
-    uint64_t* page_table = phys_to_virt(PTE_GET_ADDR(pd_entry));
-    
-    // Clear the entry
-    page_table[pt_idx] = 0;
-    
-    // Flush TLB
-    asm volatile ("invlpg (%0)" : : "r"(virt) : "memory");
+
+    int level;
+    uint64_t* entry = walk_leaf(pt, PAGE_ALIGN_DOWN(virt), &level);
+    if (!entry) return;
+
+    *entry = 0;
+    flush_one(pt, PAGE_ALIGN_DOWN(virt), false);
+}
+
+uint64_t* vmm_get_pte(page_table_t* pt, uint64_t virt) {
+    if (!pt) return NULL;
+
+    int level;
+    uint64_t* entry = walk_leaf(pt, PAGE_ALIGN_DOWN(virt), &level);
+    return entry && level == 1 ? entry : NULL;
 }
 
 uint64_t vmm_get_physical(page_table_t* pt, uint64_t virt) {
@@ -179,27 +827,40 @@ uint64_t vmm_get_physical(page_table_t* pt, uint64_t virt) {
     
     virt = PAGE_ALIGN_DOWN(virt);
     
-    // Get indices
-    size_t pml4_idx = PML4_INDEX(virt);
-    size_t pdpt_idx = PDPT_INDEX(virt);
-    size_t pd_idx = PD_INDEX(virt);
-    size_t pt_idx = PT_INDEX(virt);
-    
-    // Walk page tables
-    uint64_t pml4_entry = pt->pml4_virt[pml4_idx];
-    if (!(pml4_entry & PAGE_PRESENT)) return 0;
-    
-    uint64_t* pdpt = phys_to_virt(PTE_GET_ADDR(pml4_entry));
-    uint64_t pdpt_entry = pdpt[pdpt_idx];
-    if (!(pdpt_entry & PAGE_PRESENT)) return 0;
-    
-    uint64_t* pd = phys_to_virt(PTE_GET_ADDR(pdpt_entry));
-    uint64_t pd_entry = pd[pd_idx];
-    if (!(pd_entry & PAGE_PRESENT)) return 0;
-    
-    uint64_t* page_table = phys_to_virt(PTE_GET_ADDR(pd_entry));
-    uint64_t pt_entry = page_table[pt_idx];
-    if (!(pt_entry & PAGE_PRESENT)) return 0;
-    
-    return PTE_GET_ADDR(pt_entry);
-}
\ No newline at end of file
+    int level;
+    uint64_t* entry = walk_leaf(pt, virt, &level);
+    if (!entry) return 0;
+
+    switch (level) {
+        case 3:  return PTE_GET_ADDR_1G(*entry) + (virt & (PAGE_SIZE_1G - 1));
+        case 2:  return PTE_GET_ADDR_2M(*entry) + (virt & (PAGE_SIZE_2M - 1));
+        default: return PTE_GET_ADDR(*entry);
+    }
+}
+
+uint64_t vmm_get_page_size(page_table_t* pt, uint64_t virt) {
+    if (!pt) return 0;
+
+    int level;
+    uint64_t* entry = walk_leaf(pt, PAGE_ALIGN_DOWN(virt), &level);
+    if (!entry) return 0;
+
+    switch (level) {
+        case 3:  return PAGE_SIZE_1G;
+        case 2:  return PAGE_SIZE_2M;
+        default: return PAGE_SIZE;
+    }
+}
+
+void* vmm_map_phys(uint64_t phys, size_t size, uint64_t flags) {
+    if (size == 0) return NULL;
+    uint64_t start = PAGE_ALIGN_DOWN(phys);
+    uint64_t end = PAGE_ALIGN_UP(phys + size);
+
+    for (uint64_t page = start; page < end; page += PAGE_SIZE) {
+        uint64_t virt = (uint64_t)hhdm_phys_to_virt(page);
+        if (vmm_get_page_size(kernel_page_table, virt)) continue;
+        if (!vmm_map_page(kernel_page_table, virt, page, flags | PAGE_WRITE)) return NULL;
+    }
+    return hhdm_phys_to_virt(phys);
+}
@@ -4,6 +4,8 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include "arch/x86/smp.h"
+#include "arch/x86/spinlock.h"
 #include "memory/hhdm.h"
 
 // Page size is 4KB
@@ -13,38 +15,154 @@
 #define PAGE_PRESENT (1 << 0)
 #define PAGE_WRITE (1 << 1)
 #define PAGE_USER (1 << 2)
+#define PAGE_WRITE_THROUGH (1 << 3)
+#define PAGE_CACHE_DISABLE (1 << 4)
+#define PAGE_MMIO (PAGE_WRITE_THROUGH | PAGE_CACHE_DISABLE)  // Uncached, for device registers
+#define PAGE_HUGE (1 << 7)   // PS bit: 2MB leaf in a PD, 1GB leaf in a PDPT
+#define PAGE_PAT (1 << 7)    // PAT bit of a 4KB leaf; large leaves keep it at bit 12
+
+// Memory types, as PAT/PCD/PWT selecting the entries vmm_init_cpu() programs.
+// The first four match the power-on PAT, so plain PWT/PCD mean what they always did.
+#define PAGE_CACHE_MASK (PAGE_PAT | PAGE_CACHE_DISABLE | PAGE_WRITE_THROUGH)
+#define PAGE_WRITE_BACK 0
+#define PAGE_WRITE_COMBINING (PAGE_PAT | PAGE_WRITE_THROUGH)  // PAT5, for framebuffers
+#define PAGE_FRAME_MASK 0x000FFFFFFFFFF000ULL  // Physical address bits of a 4KB PTE
+#define PAGE_COW (1ULL << 9)  // Software bit: shared read-only until written
+#define PAGE_NX (1ULL << 63)  // No execute; only valid with EFER.NXE set
+
+// Large page sizes
+#define PAGE_SIZE_2M 0x200000ULL
+#define PAGE_SIZE_1G 0x40000000ULL
 
 // Virtual address manipulation
 #define PAGE_ALIGN_DOWN(addr) ((addr) & ~0xFFFULL)
 #define PAGE_ALIGN_UP(addr) (((addr) + 0xFFF) & ~0xFFFULL)
 
-// Page table structure
-typedef struct {
+// Start of the kernel half, shared by every address space
+#define VMM_KERNEL_HALF 0xFFFF800000000000ULL
+
+// End of the user half. The last page below the canonical hole is never
+// mapped, so SYSRET can't be handed a non-canonical return address.
+#define VMM_USER_END 0x00007FFFFFFFF000ULL
+
+struct vma;
+
+// Page table structure, doubling as the address space: user mappings are
+// described by the VMA list (see memory/vma.h) and filled in on fault
+typedef struct page_table {
     uint64_t* pml4_phys;
     uint64_t* pml4_virt;
+    struct vma* vmas;      // Sorted by address, guarded by vma_lock
+    spinlock_t vma_lock;
+    uint64_t brk_start;    // Program break: heap VMA start and current end
+    uint64_t brk;
+
+    // TLB tagging (see vmm_switch_page_table). The kernel table keeps PCID 0.
+    uint16_t pcid;
+    uint32_t pcid_gen;                        // PCID generation pcid belongs to
+    volatile uint64_t active_cpus;            // CPUs with this table in CR3
+    volatile uint64_t tlb_gen;                // Bumped by every invalidation
+    uint64_t cpu_tlb_gen[SMP_MAX_CPUS];       // tlb_gen each CPU last synced to
 } page_table_t;
 
+// Above this many pages a full CR3 reload is cheaper than invlpg per page
+#define VMM_TLB_BATCH_MAX 32
+
+// Pending TLB invalidations for one address space
+typedef struct {
+    page_table_t* pt;
+    uint64_t addrs[VMM_TLB_BATCH_MAX];
+    size_t count;
+    bool flush_all;    // Batch overflowed - reload CR3 instead
+    bool kernel_half;  // Batch touches shared kernel mappings
+} vmm_tlb_batch_t;
+
 // Initialize VMM
 void vmm_init(void);
 
+// Per-CPU paging setup: load the kernel table, enable PCIDs if the CPU has
+// them and program the PAT with the layout the PAGE_* memory types assume.
+// vmm_init() does it for the BSP; each AP must before it runs kernel code.
+void vmm_init_cpu(void);
+
+// IPI_TLB_SHOOTDOWN_VECTOR handler
+void vmm_tlb_shootdown_ipi(void);
+
 // Create a new page table
 page_table_t* vmm_create_page_table(void);
 
-// Switch to a different page table
+// New address space with the same VMAs as src, sharing every private page
+// copy-on-write: both sides lose write access and the first write fault
+// copies the page. Costs a PTE per mapped page, no page copies.
+page_table_t* vmm_clone_address_space(page_table_t* src);
+
+// Destroy a page table created by vmm_create_page_table()
+// Frees every user-half paging structure (not the mapped pages) and pt itself
+void vmm_destroy_page_table(page_table_t* pt);
+
+// Switch to a different page table (recorded in this_cpu()->page_table).
+// With PCIDs the switch keeps the TLB entries tagged for pt unless pt was
+// invalidated since this CPU last ran it. Interrupts must be off.
 void vmm_switch_page_table(page_table_t* pt);
 
 // Map a virtual address to a physical address
 bool vmm_map_page(page_table_t* pt, uint64_t virt, uint64_t phys, uint64_t flags);
 
-// Unmap a virtual address
+// Map pages consecutive physical pages starting at virt -> phys
+// Walks the tables once per leaf table and flushes the TLB once at the end.
+// Pages mapped before a failure stay mapped.
+bool vmm_map_range(page_table_t* pt, uint64_t virt, uint64_t phys, size_t pages, uint64_t flags);
+
+// Unmap pages consecutive 4KB pages starting at virt
+void vmm_unmap_range(page_table_t* pt, uint64_t virt, size_t pages);
+
+// Collect invalidations and flush them together with per-page invlpg or a
+// CR3 reload, whichever is cheaper for the batch size. Other CPUs running
+// the address space (every CPU, for kernel-half addresses) get one
+// shootdown IPI for the whole batch; the rest catch up through tlb_gen when
+// they next switch to it. The flush waits for those CPUs, so it must not
+// hold a lock they could be spinning on with interrupts off.
+void vmm_tlb_batch_begin(vmm_tlb_batch_t* batch, page_table_t* pt);
+void vmm_tlb_batch_add(vmm_tlb_batch_t* batch, uint64_t virt);
+void vmm_tlb_batch_flush(vmm_tlb_batch_t* batch);
+
+// Map a 2MB page; virt and phys must both be 2MB aligned
+// Use pmm_alloc_pages(512) to get suitably aligned physical memory.
+// Memory-type bits are given as for 4KB pages, for this and vmm_map_page_1g.
+bool vmm_map_page_2m(page_table_t* pt, uint64_t virt, uint64_t phys, uint64_t flags);
+
+// Map a 1GB page; virt and phys must both be 1GB aligned
+// Fails if the CPU has no 1GB page support
+bool vmm_map_page_1g(page_table_t* pt, uint64_t virt, uint64_t phys, uint64_t flags);
+
+// Change the memory type (PAGE_CACHE_MASK bits) of every page mapped in
+// [virt, virt + size), splitting large pages the range only partly covers.
+// Fails without PAT support or if a split runs out of memory.
+bool vmm_set_memory_type(page_table_t* pt, uint64_t virt, size_t size, uint64_t type);
+
+// Unmap a 4KB virtual page (splits a large page that covers it)
 void vmm_unmap_page(page_table_t* pt, uint64_t virt);
 
-// Get the physical address for a virtual address
+// Unmap the whole page (4KB, 2MB or 1GB) that covers virt
+void vmm_unmap_huge_page(page_table_t* pt, uint64_t virt);
+
+// The 4KB PTE mapping virt, or NULL if virt is unmapped or in a large page
+uint64_t* vmm_get_pte(page_table_t* pt, uint64_t virt);
+
+// Get the physical address for a virtual address (4KB granular)
 uint64_t vmm_get_physical(page_table_t* pt, uint64_t virt);
 
+// Get the size of the page mapping virt (4KB, 2MB or 1GB), or 0 if unmapped
+uint64_t vmm_get_page_size(page_table_t* pt, uint64_t virt);
+
 // Get the kernel page table
 page_table_t* vmm_get_kernel_page_table(void);
 
+// Make [phys, phys + size) reachable at its HHDM address, mapping the pages
+// Limine left out (device registers, some firmware tables) with flags.
+// Pages already mapped keep their mapping. Returns the HHDM address or NULL.
+void* vmm_map_phys(uint64_t phys, size_t size, uint64_t flags);
+
 // Helper: Convert physical to virtual address
 static inline void* phys_to_virt(uint64_t phys) {
     return hhdm_phys_to_virt(phys);